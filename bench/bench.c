@@ -0,0 +1,189 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "data.h"
+#include "bench.h"
+
+typedef struct
+{
+    const char *name;
+    const char *description;
+    void (*run)(int argc, char **argv);
+}
+Suite;
+
+static const Suite suites[] =
+{
+    {"contention",  "message handlers on the sharded user store, 1 to 32 of them", bench_contention},
+    {"engines",     "the same operations on every storage engine, whose users must match [USERS]", bench_engines},
+    {"footprint",   "memory taken by users and problems, compared to a cJSON tree [USERS]...", bench_footprint},
+    {"replication", "writes streamed to a standby and its lag, per persistence policy [POLICY]...", bench_replication},
+    {"startup",     "start from a generated users.json and from its snapshot [USERS]...", bench_startup},
+    {"workers",     "messages handled by 0 to 8 worker processes [MESSAGES]", bench_workers},
+    {"writes",      "appends through write_file and through plain writes [SIZE]...", bench_writes}
+};
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))
+    {
+        printf("Usage: bench [SUITE [ARGUMENT]...]\n"
+               "Runs the hok-daemon benchmarks in " DIR_DATA ", all of them if no SUITE is given.\n\n"
+               "Suites:\n");
+
+        for (size_t i = 0; i < sizeof suites / sizeof *suites; ++i)
+            printf("  %-12s%s\n",
+                   suites[i].name,
+                   suites[i].description);
+
+        return EXIT_SUCCESS;
+    }
+
+    for (size_t i = 0; i < sizeof suites / sizeof *suites; ++i)
+    {
+        if (argc > 1 && strcmp(argv[1], suites[i].name))
+            continue;
+
+        printf("== %s: %s (%ld CPUs)\n",
+               suites[i].name,
+               suites[i].description,
+               get_cpus_count());
+
+        suites[i].run(argc > 1 ? argc - 2 : 0, argv + (argc > 1 ? 2 : argc));
+        putchar('\n');
+
+        if (argc > 1)
+            return EXIT_SUCCESS;
+    }
+
+    if (argc > 1)
+    {
+        fprintf(stderr,
+                "Unknown suite '%s'\n"
+                "Try 'bench -h' for more information.\n",
+                argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void reset_data_dir(void)
+{
+    if (system("rm -rf " DIR_DATA) || mkdir(DIR_DATA, 0700))
+        die("%s: %s: failed to empty %s",
+            __BASE_FILE__,
+            __func__,
+            DIR_DATA);
+
+    FILE *users_file = fopen(FILE_USERS, "w");
+
+    if (!users_file || fputs("{}", users_file) == EOF || fclose(users_file))
+        die("%s: %s: failed to create %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+}
+
+double run_case(double (*run)(void *argument), void *argument)
+{
+    double *result = mmap(NULL, sizeof *result, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (result == MAP_FAILED)
+        die("%s: %s: failed to map result",
+            __BASE_FILE__,
+            __func__);
+
+    fflush(stdout);
+
+    const pid_t case_pid = fork();
+
+    if (case_pid < 0)
+        die("%s: %s: failed to fork",
+            __BASE_FILE__,
+            __func__);
+
+    if (!case_pid)
+    {
+        *result = run(argument);
+
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+
+    if (waitpid(case_pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr,
+                "Case failed, see %s\n",
+                FILE_ERRORLOG);
+        exit(EXIT_FAILURE);
+    }
+
+    const double case_result = *result;
+
+    munmap(result, sizeof *result);
+    return case_result;
+}
+
+uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+long get_cpus_count(void)
+{
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+size_t get_resident_size(void)
+{
+    FILE *statm_file = fopen("/proc/self/statm", "r");
+    size_t resident_pages = 0;
+
+    if (!statm_file || fscanf(statm_file, "%*s %zu", &resident_pages) != 1)
+        die("%s: %s: failed to read /proc/self/statm",
+            __BASE_FILE__,
+            __func__);
+
+    fclose(statm_file);
+    return resident_pages * sysconf(_SC_PAGESIZE);
+}
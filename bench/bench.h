@@ -0,0 +1,73 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef BENCH_H
+    #define BENCH_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+
+    /*
+     * The benchmarks are built with the DIR_DATA and the logs in a dir of their own,
+     * see the bench target of the Makefile, so they never touch the data of the hok-daemon.
+     */
+
+    /*
+     * Empties the DIR_DATA and puts an empty FILE_USERS there, like make install does.
+     */
+    void reset_data_dir(void);
+
+    /*
+     * Runs a case in a child process, since the data module is initialized once per process,
+     * and returns the number the case has returned. Dies if the child fails.
+     */
+    double run_case(double (*run)(void *argument), void *argument);
+
+    /*
+     * Returns the next number of a xorshift generator, so threads don't share a rand state.
+     */
+    uint64_t next_random(uint64_t *state);
+
+    /*
+     * Returns the number of the available CPUs, which the scaling depends on.
+     */
+    long get_cpus_count(void);
+
+    /*
+     * Returns the resident set size of the process in bytes.
+     */
+    size_t get_resident_size(void);
+
+    void bench_contention(int argc, char **argv);
+    void bench_engines(int argc, char **argv);
+    void bench_footprint(int argc, char **argv);
+    void bench_replication(int argc, char **argv);
+    void bench_startup(int argc, char **argv);
+    void bench_workers(int argc, char **argv);
+    void bench_writes(int argc, char **argv);
+
+#endif
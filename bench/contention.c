@@ -0,0 +1,122 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "bench.h"
+
+#define CONTENTION_USERS_COUNT      100000
+#define CONTENTION_OPERATIONS_COUNT 2000000 // Split between the handlers.
+#define CONTENTION_WRITES_SHARE     10      // Percent of the operations.
+#define MAX_CONTENTION_HANDLERS     32
+
+static double run_handlers(void *handlers_count);
+static void *handle_messages(void *operations_count);
+
+/*
+ * Every handler does the same mix of lookups and state changes on random chats,
+ * like the message threads do, and the throughput is compared to the one of a single handler.
+ */
+void bench_contention(int argc, char **argv)
+{
+    (void) argc;
+    (void) argv;
+
+    double single_handler_throughput = 0;
+
+    for (long handlers_count = 1; handlers_count <= MAX_CONTENTION_HANDLERS; handlers_count *= 2)
+    {
+        reset_data_dir();
+
+        const double throughput = run_case(run_handlers, &handlers_count);
+
+        if (handlers_count == 1)
+            single_handler_throughput = throughput;
+
+        printf("%2ld handlers: %10.0f operations/s, %.2fx of 1 handler\n",
+               handlers_count,
+               throughput,
+               throughput / single_handler_throughput);
+    }
+}
+
+static double run_handlers(void *handlers_count)
+{
+    const long count = *(long *) handlers_count;
+
+    init_data_module();
+
+    for (int_fast64_t chat_id = 0; chat_id < CONTENTION_USERS_COUNT; ++chat_id)
+        create_user(chat_id);
+
+    pthread_t handlers[MAX_CONTENTION_HANDLERS];
+    long operations_count = CONTENTION_OPERATIONS_COUNT / count;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < count; ++i)
+        if (pthread_create(&handlers[i],
+                           NULL,
+                           handle_messages,
+                           &operations_count))
+            die("%s: %s: failed to create handler",
+                __BASE_FILE__,
+                __func__);
+
+    for (long i = 0; i < count; ++i)
+        pthread_join(handlers[i], NULL);
+
+    return operations_count * count / get_elapsed_milliseconds(&start) * 1000;
+}
+
+static void *handle_messages(void *operations_count)
+{
+    uint64_t random_state = (uintptr_t) &random_state | 1;
+
+    for (long i = 0; i < *(long *) operations_count; ++i)
+    {
+        const uint64_t random = next_random(&random_state);
+        const int_fast64_t chat_id = random % CONTENTION_USERS_COUNT;
+
+        if (random / CONTENTION_USERS_COUNT % 100 < CONTENTION_WRITES_SHARE)
+            set_state(chat_id, ACCOUNT_BAN_STATE, random & 1);
+        else
+        {
+            UserRecord user_record;
+            get_user_record(chat_id, &user_record);
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,360 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "bench.h"
+
+#define ENGINES_OPERATIONS_PER_USER 10
+#define ENGINES_DUMP_BATCH_SIZE     64
+
+#define FILE_ENGINES_DUMP_FORMAT DIR_DATA "%s%s.dump"
+
+typedef struct
+{
+    long users_count;
+    const char *dump_file;
+}
+EnginesCase;
+
+static double run_operations(void *engines_case);
+static double reload_users(void *engines_case);
+static void dump_users(const EnginesCase *engines_case);
+static int files_match(const char *first_file_name, const char *second_file_name);
+static char **read_sorted_lines(const char *file_name, size_t *lines_count);
+static int compare_lines(const void *first_line, const void *second_line);
+
+static const char *const engines[] = {"memory", "btree"};
+
+/*
+ * The same random operations are run on every storage engine, then all users, the problem lists
+ * and the approved problems are dumped, and dumped again after a restart. Every dump
+ * must match the first one, else the engines don't behave the same and the suite fails.
+ * Problems created within the same second may be listed in any order, so the dumps are compared sorted.
+ */
+void bench_engines(int argc, char **argv)
+{
+    const long users_count = argc ? atol(argv[0]) : 10000;
+
+    if (users_count <= 0)
+        die("%s: %s: invalid users count '%s'",
+            __BASE_FILE__,
+            __func__,
+            argv[0]);
+
+    const size_t engines_count = sizeof engines / sizeof *engines;
+    char dump_files[engines_count * 2][sizeof FILE_ENGINES_DUMP_FORMAT + 32];
+
+    reset_data_dir();
+
+    for (size_t i = 0; i < engines_count; ++i)
+    {
+        if (set_storage_engine(engines[i]))
+            die("%s: %s: unknown storage engine '%s'",
+                __BASE_FILE__,
+                __func__,
+                engines[i]);
+
+        snprintf(dump_files[i * 2], sizeof *dump_files, FILE_ENGINES_DUMP_FORMAT, engines[i], "");
+        snprintf(dump_files[i * 2 + 1], sizeof *dump_files, FILE_ENGINES_DUMP_FORMAT, engines[i], ".reload");
+
+        EnginesCase engines_case = {users_count, dump_files[i * 2]};
+        const double operations_time = run_case(run_operations, &engines_case);
+
+        // Every engine imports the FILE_USERS and retires it, so the next one has to get it back.
+        if (rename(FILE_USERS_IMPORTED, FILE_USERS))
+            die("%s: %s: failed to restore %s",
+                __BASE_FILE__,
+                __func__,
+                FILE_USERS);
+
+        engines_case.dump_file = dump_files[i * 2 + 1];
+        const double reload_time = run_case(reload_users, &engines_case);
+
+        printf("%-8s%8.1f ms for %ld operations on %ld users, %8.1f ms to restart and read them all\n",
+               engines[i],
+               operations_time,
+               users_count * ENGINES_OPERATIONS_PER_USER,
+               users_count,
+               reload_time);
+    }
+
+    for (size_t i = 1; i < engines_count * 2; ++i)
+        if (!files_match(dump_files[0], dump_files[i]))
+        {
+            fprintf(stderr,
+                    "%s doesn't match %s\n",
+                    dump_files[i],
+                    dump_files[0]);
+            exit(EXIT_FAILURE);
+        }
+
+    printf("All the dumps match\n");
+}
+
+/*
+ * Returns the time of the operations, without the dump.
+ */
+static double run_operations(void *engines_case)
+{
+    const long users_count = ((EnginesCase *) engines_case)->users_count;
+    const long operations_count = users_count * ENGINES_OPERATIONS_PER_USER;
+
+    init_data_module();
+
+    uint64_t random_state = 88172645463325252;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (long i = 0; i < operations_count; ++i)
+    {
+        const uint64_t random = next_random(&random_state);
+        const int_fast64_t chat_id = random % users_count;
+
+        char username[MAX_USERNAME_SIZE + 1];
+        char text[MAX_PROBLEM_SIZE + 1];
+
+        snprintf(username, sizeof username, random >> 32 & 1 ? "user%ld" : "", (long) chat_id);
+        snprintf(text, sizeof text, "problem %lu", (unsigned long) i);
+
+        UserRecord user_record;
+
+        if (!get_user_record(chat_id, &user_record))
+        {
+            create_user(chat_id);
+            continue;
+        }
+
+        switch (random >> 40 & 7)
+        {
+            case 0:
+                set_state(chat_id, ACCOUNT_BAN_STATE, !(user_record.states & ACCOUNT_BAN_STATE));
+                break;
+
+            case 1:
+                set_state(chat_id, PROBLEM_PENDING_STATE, !(user_record.states & PROBLEM_PENDING_STATE));
+                break;
+
+            case 2:
+            case 3:
+                if (!user_record.has_problem)
+                    create_problem(chat_id, username, text, 0);
+                break;
+
+            case 4:
+                if (user_record.has_problem)
+                    delete_problem(chat_id, CLOSED_PROBLEM);
+                break;
+
+            case 5:
+                set_problem_username(chat_id, username);
+                break;
+
+            case 6:
+                // Like a problem sent by the user, see bot.c.
+                if (!user_record.has_problem)
+                {
+                    begin_transaction(chat_id);
+
+                    create_problem(chat_id, username, text, 0);
+                    set_state(chat_id, PROBLEM_PENDING_STATE, 0);
+
+                    commit_transaction();
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    const double operations_time = get_elapsed_milliseconds(&start_time);
+
+    dump_users(engines_case);
+    flush_data_module();
+
+    return operations_time;
+}
+
+/*
+ * Returns the time of the start and the dump.
+ */
+static double reload_users(void *engines_case)
+{
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    init_data_module();
+    dump_users(engines_case);
+
+    return get_elapsed_milliseconds(&start_time);
+}
+
+static void dump_users(const EnginesCase *engines_case)
+{
+    FILE *dump_file = fopen(engines_case->dump_file, "w");
+
+    if (!dump_file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            engines_case->dump_file);
+
+    for (int_fast64_t chat_id = 0; chat_id < engines_case->users_count; ++chat_id)
+    {
+        UserRecord user_record;
+
+        if (get_user_record(chat_id, &user_record))
+            fprintf(dump_file,
+                    "user %ld %u %d\n",
+                    (long) chat_id,
+                    user_record.states & ~SESSION_STATES,
+                    user_record.has_problem);
+    }
+
+    static ProblemView problems[ENGINES_DUMP_BATCH_SIZE];
+
+    for (int list = 0; list < 4; ++list)
+    {
+        ProblemsCursor cursor;
+        size_t problems_count;
+
+        open_problems_cursor(&cursor, 1, list & 1, list >> 1);
+
+        while ((problems_count = read_problems(&cursor, problems, ENGINES_DUMP_BATCH_SIZE)))
+            for (size_t i = 0; i < problems_count; ++i)
+                fprintf(dump_file,
+                        "list %d %s %s\n",
+                        list,
+                        problems[i].username,
+                        problems[i].problem);
+    }
+
+    const ApprovedProblems *approved_problems = acquire_approved_problems();
+
+    for (size_t i = 0; i < approved_problems->problems_count; ++i)
+        fprintf(dump_file,
+                "approved %s\n",
+                approved_problems->problems_with_chat_ids[i]);
+
+    release_approved_problems(approved_problems);
+
+    if (fclose(dump_file))
+        die("%s: %s: failed to write %s",
+            __BASE_FILE__,
+            __func__,
+            engines_case->dump_file);
+}
+
+static int files_match(const char *first_file_name, const char *second_file_name)
+{
+    size_t first_lines_count;
+    size_t second_lines_count;
+
+    char **first_lines = read_sorted_lines(first_file_name, &first_lines_count);
+    char **second_lines = read_sorted_lines(second_file_name, &second_lines_count);
+
+    int match = first_lines_count == second_lines_count;
+
+    for (size_t i = 0; match && i < first_lines_count; ++i)
+        match = !strcmp(first_lines[i], second_lines[i]);
+
+    // Frees the contents, which the lines point into.
+    free(first_lines[first_lines_count]);
+    free(second_lines[second_lines_count]);
+    free(first_lines);
+    free(second_lines);
+
+    return match;
+}
+
+/*
+ * Returns the lines of the file sorted, followed by the contents of the file, which they point into.
+ */
+static char **read_sorted_lines(const char *file_name, size_t *lines_count)
+{
+    FILE *file = fopen(file_name, "r");
+
+    if (!file || fseek(file, 0, SEEK_END))
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            file_name);
+
+    const long file_size = ftell(file);
+    char *contents = malloc(file_size + 1);
+
+    rewind(file);
+
+    if (!contents || fread(contents, 1, file_size, file) != (size_t) file_size)
+        die("%s: %s: failed to read %s",
+            __BASE_FILE__,
+            __func__,
+            file_name);
+
+    fclose(file);
+    contents[file_size] = 0;
+
+    *lines_count = 0;
+
+    for (long i = 0; i < file_size; ++i)
+        *lines_count += contents[i] == '\n';
+
+    char **lines = malloc((*lines_count + 1) * sizeof *lines);
+
+    if (!lines)
+        die("%s: %s: failed to allocate memory for lines",
+            __BASE_FILE__,
+            __func__);
+
+    char *line = contents;
+
+    for (size_t i = 0; i < *lines_count; ++i)
+    {
+        lines[i] = line;
+        line = strchr(line, '\n');
+        *line++ = 0;
+    }
+
+    lines[*lines_count] = contents;
+
+    qsort(lines, *lines_count, sizeof *lines, compare_lines);
+    return lines;
+}
+
+static int compare_lines(const void *first_line, const void *second_line)
+{
+    return strcmp(*(char *const *) first_line, *(char *const *) second_line);
+}
@@ -0,0 +1,192 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "bench.h"
+
+#define FOOTPRINT_PROBLEMS_SHARE 10 // Percent of the users with a problem.
+
+#define FILE_FOOTPRINT_USERS     DIR_DATA "footprint.json"
+#define FILE_FOOTPRINT_USERS_TMP DIR_DATA "footprint.json.tmp"
+
+typedef struct
+{
+    long users_count;
+    int with_problems;
+}
+FootprintCase;
+
+static double fill_store(void *footprint_case);
+static double parse_users(void *_);
+
+/*
+ * The growth of the resident size is measured for the users alone and then for the users
+ * with problems, whose difference is what the problems take. The same users are parsed
+ * into a cJSON tree, the way they were kept before the slabs, for comparison.
+ */
+void bench_footprint(int argc, char **argv)
+{
+    static char *default_argv[] = {"100000", "1000000"};
+
+    if (!argc)
+    {
+        argc = sizeof default_argv / sizeof *default_argv;
+        argv = default_argv;
+    }
+
+    for (int i = 0; i < argc; ++i)
+    {
+        FootprintCase footprint_case = {atol(argv[i]), 0};
+
+        if (footprint_case.users_count <= 0)
+            die("%s: %s: invalid users count '%s'",
+                __BASE_FILE__,
+                __func__,
+                argv[i]);
+
+        reset_data_dir();
+
+        const double users_size = run_case(fill_store, &footprint_case);
+        const double users_tree_size = run_case(parse_users, NULL);
+
+        footprint_case.with_problems = 1;
+        reset_data_dir();
+
+        const double problems_size = run_case(fill_store, &footprint_case) - users_size;
+        const double problems_tree_size = run_case(parse_users, NULL) - users_tree_size;
+        const long problems_count = footprint_case.users_count * FOOTPRINT_PROBLEMS_SHARE / 100;
+
+        printf("%8ld users: %6.1f bytes per user (cJSON tree: %6.1f), "
+               "%6.1f bytes per problem (cJSON tree: %6.1f)\n",
+               footprint_case.users_count,
+               users_size / footprint_case.users_count,
+               users_tree_size / footprint_case.users_count,
+               problems_size / problems_count,
+               problems_tree_size / problems_count);
+    }
+}
+
+/*
+ * Returns how much the resident size has grown while the users were created,
+ * and saves them to the FILE_FOOTPRINT_USERS for parse_users.
+ */
+static double fill_store(void *footprint_case)
+{
+    const FootprintCase *fill = footprint_case;
+
+    set_eviction_age("0");
+    init_data_module();
+
+    const size_t start_size = get_resident_size();
+    uint64_t random_state = 88172645463325252;
+
+    for (int_fast64_t chat_id = 0; chat_id < fill->users_count; ++chat_id)
+    {
+        create_user(chat_id);
+
+        if (!fill->with_problems || chat_id % (100 / FOOTPRINT_PROBLEMS_SHARE))
+            continue;
+
+        char username[MAX_USERNAME_SIZE + 1];
+        snprintf(username, sizeof username, "user%" PRIdFAST64, chat_id);
+
+        char text[MAX_PROBLEM_SIZE + 1];
+        const size_t text_size = 20 + next_random(&random_state) % 380;
+
+        for (size_t i = 0; i < text_size; ++i)
+            text[i] = 'a' + next_random(&random_state) % 26;
+
+        text[text_size] = 0;
+
+        create_problem(chat_id, chat_id % 5 ? username : "", text, 1);
+    }
+
+    flush_data_module();
+
+    const double users_size = get_resident_size() - start_size;
+
+    // Nothing else changes the users here, so they need no lock.
+    if (write_users(FILE_FOOTPRINT_USERS, FILE_FOOTPRINT_USERS_TMP, DIR_DATA) < 0)
+        die("%s: %s: failed to save %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_FOOTPRINT_USERS);
+
+    return users_size;
+}
+
+static double parse_users(void *_)
+{
+    (void) _;
+
+    FILE *users_file = fopen(FILE_FOOTPRINT_USERS, "r");
+
+    if (!users_file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_FOOTPRINT_USERS);
+
+    fseek(users_file, 0, SEEK_END);
+    const size_t users_file_size = ftell(users_file);
+    rewind(users_file);
+
+    char *users_string = malloc(users_file_size + 1);
+
+    if (!users_string || fread(users_string, 1, users_file_size, users_file) != users_file_size)
+        die("%s: %s: failed to read %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_FOOTPRINT_USERS);
+
+    users_string[users_file_size] = 0;
+    fclose(users_file);
+
+    const size_t start_size = get_resident_size();
+    cJSON *users = cJSON_Parse(users_string);
+
+    if (!users)
+        die("%s: %s: failed to parse %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_FOOTPRINT_USERS);
+
+    const double users_size = get_resident_size() - start_size;
+
+    cJSON_Delete(users);
+    free(users_string);
+
+    return users_size;
+}
@@ -0,0 +1,237 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "replication.h"
+#include "bench.h"
+
+#define FILE_REPLICATION_SOCKET DIR_DATA "replication.sock"
+
+#define REPLICATION_USERS_COUNT      10000
+#define REPLICATION_OPERATIONS_COUNT 100000
+#define REPLICATION_MARKERS_COUNT    100 // Users created among the operations to time the lag.
+#define REPLICATION_POLL_TIME        100 // 100 microseconds.
+
+/*
+ * Shared by the primary and the standby. The primary creates the markers, users after
+ * the REPLICATION_USERS_COUNT ones, and the standby notes when each of them shows up,
+ * both in milliseconds since start.
+ */
+typedef struct
+{
+    struct timespec start;
+    atomic_int standby_following;
+    double created_times[REPLICATION_MARKERS_COUNT];
+    double replicated_times[REPLICATION_MARKERS_COUNT];
+}
+ReplicationTimes;
+
+static double run_primary(void *with_standby);
+static void follow(void);
+static void print_lag(void);
+
+static ReplicationTimes *times;
+
+/*
+ * Every persistence policy is timed with the same state changes on random users, once alone
+ * and once streaming them to a standby over a Unix socket. The lag is how long a change takes
+ * from its call on the primary to its appearance on the standby.
+ */
+void bench_replication(int argc, char **argv)
+{
+    static char *default_argv[] = {DEFAULT_JOURNAL_POLICY, "interval:10", "sync"};
+
+    if (!argc)
+    {
+        argc = sizeof default_argv / sizeof *default_argv;
+        argv = default_argv;
+    }
+
+    times = mmap(NULL, sizeof *times, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (times == MAP_FAILED)
+        die("%s: %s: failed to map times",
+            __BASE_FILE__,
+            __func__);
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (set_persistence_policy(argv[i]))
+            die("%s: %s: invalid persistence policy '%s'",
+                __BASE_FILE__,
+                __func__,
+                argv[i]);
+
+        int with_standby = 0;
+
+        reset_data_dir();
+        const double alone_throughput = run_case(run_primary, &with_standby);
+
+        with_standby = 1;
+
+        reset_data_dir();
+        const double standby_throughput = run_case(run_primary, &with_standby);
+
+        printf("%-14s %8.0f writes/s alone, %8.0f with a standby (%.2fx), ",
+               argv[i],
+               alone_throughput,
+               standby_throughput,
+               standby_throughput / alone_throughput);
+
+        print_lag();
+    }
+
+    munmap(times, sizeof *times);
+}
+
+static double run_primary(void *with_standby)
+{
+    pid_t standby_pid = -1;
+
+    atomic_store(&times->standby_following, 0);
+
+    // The standby is forked before the data module starts any thread.
+    if (*(int *) with_standby)
+    {
+        if (set_replication_address(FILE_REPLICATION_SOCKET))
+            die("%s: %s: invalid replication address",
+                __BASE_FILE__,
+                __func__);
+
+        if ((standby_pid = fork()) < 0)
+            die("%s: %s: failed to fork standby",
+                __BASE_FILE__,
+                __func__);
+
+        if (!standby_pid)
+            follow();
+    }
+
+    init_data_module();
+
+    for (int_fast64_t chat_id = 0; chat_id < REPLICATION_USERS_COUNT; ++chat_id)
+        create_user(chat_id);
+
+    if (standby_pid > 0)
+    {
+        start_replication();
+
+        while (!atomic_load(&times->standby_following))
+            usleep(REPLICATION_POLL_TIME);
+    }
+
+    uint64_t random_state = 88172645463325252;
+
+    clock_gettime(CLOCK_MONOTONIC, &times->start);
+
+    for (long i = 0; i < REPLICATION_OPERATIONS_COUNT; ++i)
+    {
+        const uint64_t random = next_random(&random_state);
+
+        set_state(random % REPLICATION_USERS_COUNT, ACCOUNT_BAN_STATE, random >> 32 & 1);
+
+        if (!((i + 1) % (REPLICATION_OPERATIONS_COUNT / REPLICATION_MARKERS_COUNT)))
+        {
+            const long marker = (i + 1) / (REPLICATION_OPERATIONS_COUNT / REPLICATION_MARKERS_COUNT) - 1;
+
+            times->created_times[marker] = get_elapsed_milliseconds(&times->start);
+            create_user(REPLICATION_USERS_COUNT + marker);
+        }
+    }
+
+    const double throughput = REPLICATION_OPERATIONS_COUNT / get_elapsed_milliseconds(&times->start) * 1000;
+
+    if (standby_pid > 0)
+    {
+        int status;
+
+        if (waitpid(standby_pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            die("%s: %s: standby failed",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    flush_data_module();
+    return throughput;
+}
+
+/*
+ * Runs in the standby process until every marker has been replicated.
+ */
+static void follow(void)
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    while (follow_primary())
+        usleep(REPLICATION_POLL_TIME);
+
+    atomic_store(&times->standby_following, 1);
+
+    for (long marker = 0; marker < REPLICATION_MARKERS_COUNT; ++marker)
+    {
+        UserRecord user_record;
+
+        while (!get_user_record(REPLICATION_USERS_COUNT + marker, &user_record))
+            usleep(REPLICATION_POLL_TIME);
+
+        times->replicated_times[marker] = get_elapsed_milliseconds(&times->start);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+static void print_lag(void)
+{
+    double lag = 0;
+    double max_lag = 0;
+
+    for (long marker = 0; marker < REPLICATION_MARKERS_COUNT; ++marker)
+    {
+        const double marker_lag = times->replicated_times[marker] - times->created_times[marker];
+
+        lag += marker_lag;
+
+        if (marker_lag > max_lag)
+            max_lag = marker_lag;
+    }
+
+    printf("%.2f ms lag on average (max %.2f ms)\n",
+           lag / REPLICATION_MARKERS_COUNT,
+           max_lag);
+}
@@ -0,0 +1,184 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "bench.h"
+
+#define STARTUP_PROBLEMS_SHARE 10 // Percent of the users with a problem.
+
+static long generate_users(const long users_count);
+static double start(void *_);
+static double parse_users(void *_);
+
+/*
+ * A users.json is generated and loaded three times: parsed into a single cJSON tree,
+ * the way the users were loaded before the parallel loader, then imported by the daemon,
+ * which also saves the first snapshot, and then started from that snapshot.
+ */
+void bench_startup(int argc, char **argv)
+{
+    static char *default_argv[] = {"100000", "1000000"};
+
+    if (!argc)
+    {
+        argc = sizeof default_argv / sizeof *default_argv;
+        argv = default_argv;
+    }
+
+    for (int i = 0; i < argc; ++i)
+    {
+        const long users_count = atol(argv[i]);
+
+        if (users_count <= 0)
+            die("%s: %s: invalid users count '%s'",
+                __BASE_FILE__,
+                __func__,
+                argv[i]);
+
+        reset_data_dir();
+
+        const long users_file_size = generate_users(users_count);
+        const double parse_time = run_case(parse_users, NULL);
+        const double import_time = run_case(start, NULL);
+        const double snapshot_time = run_case(start, NULL);
+
+        printf("%8ld users (%5.1f MiB): %8.1f ms from users.json (cJSON_Parse alone: %8.1f ms), "
+               "%7.1f ms from the snapshot\n",
+               users_count,
+               users_file_size / 1048576.0,
+               import_time,
+               parse_time,
+               snapshot_time);
+    }
+}
+
+/*
+ * Writes the FILE_USERS with users_count users and returns its size.
+ */
+static long generate_users(const long users_count)
+{
+    FILE *users_file = fopen(FILE_USERS, "w");
+
+    if (!users_file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    uint64_t random_state = 88172645463325252;
+    const time_t current_time = time(NULL);
+
+    fputc('{', users_file);
+
+    for (long chat_id = 0; chat_id < users_count; ++chat_id)
+    {
+        const uint64_t random = next_random(&random_state);
+        Problem problem = {0};
+
+        char username[MAX_USERNAME_SIZE + 1];
+        char text[MAX_PROBLEM_SIZE + 1];
+
+        if (!(chat_id % (100 / STARTUP_PROBLEMS_SHARE)))
+        {
+            snprintf(username, sizeof username, "user%ld", chat_id);
+
+            const size_t text_size = 20 + random % 380;
+
+            for (size_t j = 0; j < text_size; ++j)
+                text[j] = 'a' + next_random(&random_state) % 26;
+
+            text[text_size] = 0;
+
+            problem.time = current_time;
+            problem.created = current_time;
+            problem.approved_at = random & 1 ? current_time : 0;
+            problem.username = username;
+            problem.text = text;
+        }
+
+        if (chat_id)
+            fputc(',', users_file);
+
+        export_user(users_file, chat_id, random >> 32 & PROBLEM_PENDING_STATE, &problem);
+    }
+
+    fputc('}', users_file);
+
+    const long users_file_size = ftell(users_file);
+
+    if (fclose(users_file))
+        die("%s: %s: failed to write %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    return users_file_size;
+}
+
+static double start(void *_)
+{
+    (void) _;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    init_data_module();
+
+    return get_elapsed_milliseconds(&start_time);
+}
+
+static double parse_users(void *_)
+{
+    (void) _;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    char *users_string = read_users_json();
+    cJSON *users = cJSON_Parse(users_string);
+
+    if (!users)
+        die("%s: %s: failed to parse %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    const double parse_time = get_elapsed_milliseconds(&start_time);
+
+    cJSON_Delete(users);
+    free(users_string);
+
+    return parse_time;
+}
@@ -0,0 +1,196 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "workers.h"
+#include "bench.h"
+
+#define WORKERS_USERS_COUNT    10000
+#define WORKERS_MESSAGES_COUNT 20000
+#define MAX_BENCH_WORKERS      8
+#define OUTSTANDING_RETRY_TIME 100 // 100 microseconds.
+
+static double run_workers(void *workers_count);
+static void run_worker(void);
+static void *handle_message(void *cjson_message);
+
+static long messages_count = WORKERS_MESSAGES_COUNT;
+static atomic_long *handled_messages_count; // Shared by the supervisor and the workers.
+
+/*
+ * The supervisor dispatches messages of random chats to the workers, which handle them
+ * like the bot does: a lookup, then a transaction, which creates or deletes the problem of the chat.
+ * No more messages are outstanding than the queues of the workers take, so none is dropped,
+ * and the throughput is compared to the one of the messages handled in the daemon itself.
+ */
+void bench_workers(int argc, char **argv)
+{
+    if (argc)
+        messages_count = atol(argv[0]);
+
+    if (messages_count <= 0)
+        die("%s: %s: invalid messages count",
+            __BASE_FILE__,
+            __func__);
+
+    double no_workers_throughput = 0;
+
+    for (long workers_count = 0; workers_count <= MAX_BENCH_WORKERS; workers_count = workers_count ? workers_count * 2 : 1)
+    {
+        reset_data_dir();
+
+        const double throughput = run_case(run_workers, &workers_count);
+
+        if (!workers_count)
+            no_workers_throughput = throughput;
+
+        printf("%ld workers: %8.0f messages/s, %.2fx of no workers\n",
+               workers_count,
+               throughput,
+               throughput / no_workers_throughput);
+    }
+}
+
+static double run_workers(void *workers_count)
+{
+    const long count = *(long *) workers_count;
+
+    handled_messages_count = mmap(NULL, sizeof *handled_messages_count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (handled_messages_count == MAP_FAILED)
+        die("%s: %s: failed to map handled_messages_count",
+            __BASE_FILE__,
+            __func__);
+
+    char count_string[16];
+    snprintf(count_string, sizeof count_string, "%ld", count);
+
+    set_workers_count(count_string);
+    start_workers(run_worker);
+
+    init_data_module();
+    serve_workers();
+
+    const long max_outstanding_count = WORKER_QUEUE_SIZE * (count ? count : 1);
+    uint64_t random_state = (uintptr_t) &random_state | 1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < messages_count; ++i)
+    {
+        while (i - atomic_load(handled_messages_count) >= max_outstanding_count)
+            usleep(OUTSTANDING_RETRY_TIME);
+
+        const int_fast64_t chat_id = next_random(&random_state) % WORKERS_USERS_COUNT;
+
+        cJSON *message = cJSON_CreateObject();
+        cJSON *chat = cJSON_CreateObject();
+        cJSON_AddNumberToObject(chat, "id", chat_id);
+        cJSON_AddItemToObject(message, "chat", chat);
+        cJSON_AddStringToObject(message, "text", "Hello");
+
+        if (count)
+        {
+            dispatch_message(chat_id, message);
+            cJSON_Delete(message);
+            continue;
+        }
+
+        pthread_t handle_message_thread;
+
+        if (pthread_create(&handle_message_thread,
+                           NULL,
+                           handle_message,
+                           message))
+            die("%s: %s: failed to create handle_message_thread",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_detach(handle_message_thread);
+    }
+
+    while (atomic_load(handled_messages_count) < messages_count)
+        usleep(OUTSTANDING_RETRY_TIME);
+
+    return messages_count / get_elapsed_milliseconds(&start) * 1000;
+}
+
+static void run_worker(void)
+{
+    attach_data_module();
+
+    for (;;)
+    {
+        pthread_t handle_message_thread;
+
+        if (pthread_create(&handle_message_thread,
+                           NULL,
+                           handle_message,
+                           receive_message()))
+            die("%s: %s: failed to create handle_message_thread",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_detach(handle_message_thread);
+    }
+}
+
+static void *handle_message(void *cjson_message)
+{
+    cJSON *message = cjson_message;
+    const int_fast64_t chat_id = cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(message, "chat"), "id"));
+
+    UserRecord user_record;
+
+    if (!get_user_record(chat_id, &user_record))
+        create_user(chat_id);
+    else if (user_record.has_problem)
+        delete_problem(chat_id, CLOSED_PROBLEM);
+    else
+    {
+        begin_transaction(chat_id);
+        set_state(chat_id, PROBLEM_DESCRIPTION_STATE, 0);
+        create_problem(chat_id, "", cJSON_GetStringValue(cJSON_GetObjectItem(message, "text")), 0);
+        commit_transaction();
+    }
+
+    cJSON_Delete(message);
+    atomic_fetch_add(handled_messages_count, 1);
+
+    return NULL;
+}
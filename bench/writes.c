@@ -0,0 +1,168 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "uring.h"
+#include "bench.h"
+
+#define FILE_WRITES DIR_DATA "writes"
+
+#define WRITES_COUNT        16384
+#define SYNCED_WRITES_COUNT 256
+#define MAX_WRITES_SIZE     67108864 // 64 MiB, written by a single case at most.
+#define MIN_WRITES_COUNT    16
+
+typedef int (*WriteFunction)(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync);
+
+static void compare_writes(const size_t data_size, const int sync);
+static double measure_writes(WriteFunction write_function, const void *data, const size_t data_size, const int sync, const long writes_count);
+static int write_plain(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync);
+
+/*
+ * Appends of every size are timed with and without a data sync, once through write_file
+ * and once with plain write and fdatasync calls, the way write_file falls back without io_uring.
+ */
+void bench_writes(int argc, char **argv)
+{
+    static char *default_argv[] = {"64", "4096", "65536", "1048576"};
+
+    if (!argc)
+    {
+        argc = sizeof default_argv / sizeof *default_argv;
+        argv = default_argv;
+    }
+
+    reset_data_dir();
+
+    printf("write_file %s io_uring\n",
+           is_uring_available() ? "syncs through" : "falls back from");
+
+    for (int i = 0; i < argc; ++i)
+    {
+        const long data_size = atol(argv[i]);
+
+        if (data_size <= 0)
+            die("%s: %s: invalid write size '%s'",
+                __BASE_FILE__,
+                __func__,
+                argv[i]);
+
+        compare_writes(data_size, 0);
+        compare_writes(data_size, 1);
+    }
+}
+
+static void compare_writes(const size_t data_size, const int sync)
+{
+    long writes_count = sync ? SYNCED_WRITES_COUNT : WRITES_COUNT;
+
+    if ((size_t) writes_count * data_size > MAX_WRITES_SIZE)
+        writes_count = MAX_WRITES_SIZE / data_size;
+
+    if (writes_count < MIN_WRITES_COUNT)
+        writes_count = MIN_WRITES_COUNT;
+
+    char *data = malloc(data_size);
+
+    if (!data)
+        die("%s: %s: failed to allocate memory for data",
+            __BASE_FILE__,
+            __func__);
+
+    memset(data, 'w', data_size);
+
+    const double uring_time = measure_writes(write_file, data, data_size, sync, writes_count);
+    const double plain_time = measure_writes(write_plain, data, data_size, sync, writes_count);
+
+    free(data);
+
+    printf("%8zu B %-7s write_file: %9.1f us %9.1f MiB/s, plain: %9.1f us %9.1f MiB/s\n",
+           data_size,
+           sync ? "synced" : "",
+           uring_time * 1000 / writes_count,
+           writes_count * data_size / 1048576.0 / (uring_time / 1000),
+           plain_time * 1000 / writes_count,
+           writes_count * data_size / 1048576.0 / (plain_time / 1000));
+}
+
+/*
+ * Appends writes_count copies of data to an empty FILE_WRITES and returns the time taken.
+ */
+static double measure_writes(WriteFunction write_function, const void *data, const size_t data_size, const int sync, const long writes_count)
+{
+    const int fd = open(FILE_WRITES, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_WRITES);
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (long i = 0; i < writes_count; ++i)
+        if (write_function(fd, data, data_size, -1, sync))
+            die("%s: %s: failed to write to %s",
+                __BASE_FILE__,
+                __func__,
+                FILE_WRITES);
+
+    const double writes_time = get_elapsed_milliseconds(&start_time);
+
+    close(fd);
+    return writes_time;
+}
+
+static int write_plain(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync)
+{
+    (void) offset;
+
+    const unsigned char *bytes = data;
+
+    for (size_t written_size = 0; written_size < data_size;)
+    {
+        const ssize_t size = write(fd, bytes + written_size, data_size - written_size);
+
+        if (size < 0)
+            return -1;
+
+        written_size += size;
+    }
+
+    return sync ? fdatasync(fd) : 0;
+}
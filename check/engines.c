@@ -0,0 +1,525 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "data.h"
+#include "workers.h"
+
+#define CHECK_USERS_COUNT         2000
+#define CHECK_OPERATIONS_PER_USER 10
+#define CHECK_DUMP_BATCH_SIZE     64
+#define CHECK_WORKER_POLL_TIME    1000 // 1 millisecond.
+
+#define FILE_CHECK_OPERATIONS DIR_DATA "check.operations"
+#define FILE_CHECK_DUMP       DIR_DATA "check.dump"
+#define FILE_CHECK_RELOAD     DIR_DATA "check.reload"
+
+typedef struct
+{
+    char *contents; // The lines point into it.
+    char **lines;
+    size_t lines_count;
+}
+CheckFile;
+
+typedef struct
+{
+    const char *name;
+    const char *storage_engine;
+    int with_worker;      // The operations are run by a worker process, see workers.h.
+    CheckFile operations; // The user after every operation.
+    CheckFile dump;       // All users, the problem lists and the approved problems, sorted.
+    CheckFile reload;     // The same after a restart.
+}
+EngineCheck;
+
+static void reset_data_dir(void);
+static void run_child(void (*run)(const EngineCheck *engine_check), const EngineCheck *engine_check);
+static void run_operations(const EngineCheck *engine_check);
+static void run_worker_operations(void);
+static void run_worker(void);
+static void reload_users(const EngineCheck *engine_check);
+static void write_operations(void);
+static void dump_users(FILE *dump_file);
+static void dump_approved_problems(FILE *dump_file);
+static FILE *open_file(const char *file_name, const char *mode);
+static void close_file(FILE *file, const char *file_name);
+static void read_check_file(const char *file_name, CheckFile *check_file, const int sorted);
+static int check_files_match(const EngineCheck *first_engine_check, const CheckFile *first_file,
+                             const EngineCheck *second_engine_check, const CheckFile *second_file,
+                             const char *what);
+static int compare_lines(const void *first_line, const void *second_line);
+static uint64_t next_random(uint64_t *state);
+
+static EngineCheck engine_checks[] =
+{
+    {.name = "memory", .storage_engine = "memory"},
+    {.name = "btree",  .storage_engine = "btree"},
+    {.name = "worker", .storage_engine = "memory", .with_worker = 1}
+};
+
+static atomic_int *worker_done; // Shared by the supervisor and the worker.
+
+/*
+ * Runs the same random operations on every storage engine, each from an empty data dir,
+ * and once more on the memory engine from a worker process,
+ * recording the user after each of them, then dumps all users, the problem lists
+ * and the approved problems, and dumps them again after a restart. Every engine must record
+ * the same as the first one and every dump must match the first one, else the first line
+ * which differs is printed and the check fails. Problems created within the same second
+ * may be listed in any order, so the dumps are compared sorted.
+ */
+int main(void)
+{
+    const size_t engines_count = sizeof engine_checks / sizeof *engine_checks;
+
+    for (size_t i = 0; i < engines_count; ++i)
+    {
+        EngineCheck *engine_check = &engine_checks[i];
+
+        reset_data_dir();
+
+        if (set_storage_engine(engine_check->storage_engine))
+            die("%s: %s: unknown storage engine '%s'",
+                __BASE_FILE__,
+                __func__,
+                engine_check->storage_engine);
+
+        run_child(run_operations, engine_check);
+        run_child(reload_users, engine_check);
+
+        read_check_file(FILE_CHECK_OPERATIONS, &engine_check->operations, 0);
+        read_check_file(FILE_CHECK_DUMP, &engine_check->dump, 1);
+        read_check_file(FILE_CHECK_RELOAD, &engine_check->reload, 1);
+    }
+
+    const EngineCheck *first_engine_check = &engine_checks[0];
+
+    for (size_t i = 0; i < engines_count; ++i)
+    {
+        const EngineCheck *engine_check = &engine_checks[i];
+
+        if (!check_files_match(first_engine_check, &first_engine_check->operations, engine_check, &engine_check->operations, "operations") ||
+            !check_files_match(first_engine_check, &first_engine_check->dump, engine_check, &engine_check->dump, "dump") ||
+            !check_files_match(first_engine_check, &first_engine_check->dump, engine_check, &engine_check->reload, "dump after a restart"))
+            return EXIT_FAILURE;
+
+        printf("%-8s%zu operations and %zu dumped lines match\n",
+               engine_check->name,
+               engine_check->operations.lines_count,
+               engine_check->dump.lines_count);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void reset_data_dir(void)
+{
+    if (system("rm -rf " DIR_DATA) || mkdir(DIR_DATA, 0700))
+        die("%s: %s: failed to empty %s",
+            __BASE_FILE__,
+            __func__,
+            DIR_DATA);
+
+    FILE *users_file = open_file(FILE_USERS, "w");
+
+    fputs("{}", users_file);
+    close_file(users_file, FILE_USERS);
+}
+
+/*
+ * Runs in a child process, so every engine starts and stops the way the daemon does.
+ */
+static void run_child(void (*run)(const EngineCheck *engine_check), const EngineCheck *engine_check)
+{
+    fflush(stdout);
+
+    const pid_t child_pid = fork();
+
+    if (child_pid < 0)
+        die("%s: %s: failed to fork",
+            __BASE_FILE__,
+            __func__);
+
+    if (!child_pid)
+    {
+        run(engine_check);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+
+    if (waitpid(child_pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr,
+                "The %s check failed, see %s\n",
+                engine_check->name,
+                FILE_ERRORLOG);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void run_operations(const EngineCheck *engine_check)
+{
+    if (engine_check->with_worker)
+    {
+        run_worker_operations();
+        return;
+    }
+
+    init_data_module();
+    write_operations();
+
+    FILE *dump_file = open_file(FILE_CHECK_DUMP, "w");
+
+    dump_users(dump_file);
+    dump_approved_problems(dump_file);
+    close_file(dump_file, FILE_CHECK_DUMP);
+
+    flush_data_module();
+}
+
+/*
+ * Runs in the supervisor, which serves the calls of the worker until it is done.
+ */
+static void run_worker_operations(void)
+{
+    worker_done = mmap(NULL, sizeof *worker_done, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (worker_done == MAP_FAILED)
+        die("%s: %s: failed to map worker_done",
+            __BASE_FILE__,
+            __func__);
+
+    set_workers_count("1");
+    start_workers(run_worker);
+
+    init_data_module();
+    serve_workers();
+
+    while (!atomic_load(worker_done))
+        usleep(CHECK_WORKER_POLL_TIME);
+
+    // Only the supervisor publishes the approved problems.
+    FILE *dump_file = open_file(FILE_CHECK_DUMP, "a");
+
+    dump_approved_problems(dump_file);
+    close_file(dump_file, FILE_CHECK_DUMP);
+
+    flush_data_module();
+}
+
+static void run_worker(void)
+{
+    attach_data_module();
+    write_operations();
+
+    FILE *dump_file = open_file(FILE_CHECK_DUMP, "w");
+
+    dump_users(dump_file);
+    close_file(dump_file, FILE_CHECK_DUMP);
+
+    atomic_store(worker_done, 1);
+
+    // The worker is killed with the supervisor.
+    for (;;)
+        pause();
+}
+
+static void reload_users(const EngineCheck *engine_check)
+{
+    (void) engine_check;
+
+    init_data_module();
+
+    FILE *dump_file = open_file(FILE_CHECK_RELOAD, "w");
+
+    dump_users(dump_file);
+    dump_approved_problems(dump_file);
+    close_file(dump_file, FILE_CHECK_RELOAD);
+}
+
+/*
+ * Runs the operations and writes the user after each of them to the FILE_CHECK_OPERATIONS.
+ */
+static void write_operations(void)
+{
+    const long operations_count = (long) CHECK_USERS_COUNT * CHECK_OPERATIONS_PER_USER;
+
+    FILE *operations_file = open_file(FILE_CHECK_OPERATIONS, "w");
+    uint64_t random_state = 88172645463325252;
+
+    for (long i = 0; i < operations_count; ++i)
+    {
+        const uint64_t random = next_random(&random_state);
+        const int_fast64_t chat_id = random % CHECK_USERS_COUNT;
+
+        char username[MAX_USERNAME_SIZE + 1];
+        char text[MAX_PROBLEM_SIZE + 1];
+
+        snprintf(username, sizeof username, random >> 32 & 1 ? "user%ld" : "", (long) chat_id);
+        snprintf(text, sizeof text, "problem %ld", i);
+
+        UserRecord user_record;
+
+        if (!get_user_record(chat_id, &user_record))
+            create_user(chat_id);
+        else
+            switch (random >> 40 & 7)
+            {
+                case 0:
+                    set_state(chat_id, ACCOUNT_BAN_STATE, !(user_record.states & ACCOUNT_BAN_STATE));
+                    break;
+
+                case 1:
+                    set_state(chat_id, PROBLEM_PENDING_STATE, !(user_record.states & PROBLEM_PENDING_STATE));
+                    break;
+
+                case 2:
+                case 3:
+                    if (!user_record.has_problem)
+                        create_problem(chat_id, username, text, 0);
+                    break;
+
+                case 4:
+                    if (user_record.has_problem)
+                        delete_problem(chat_id, CLOSED_PROBLEM);
+                    break;
+
+                case 5:
+                    set_problem_username(chat_id, username);
+                    break;
+
+                case 6:
+                    // Like a problem sent by the user, see bot.c.
+                    if (!user_record.has_problem)
+                    {
+                        begin_transaction(chat_id);
+
+                        create_problem(chat_id, username, text, 0);
+                        set_state(chat_id, PROBLEM_PENDING_STATE, 0);
+
+                        commit_transaction();
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+
+        const int user_exists = get_user_record(chat_id, &user_record);
+
+        fprintf(operations_file,
+                "%ld: user %ld %d %u %d\n",
+                i,
+                (long) chat_id,
+                user_exists,
+                user_exists ? user_record.states : 0,
+                user_exists && user_record.has_problem);
+    }
+
+    close_file(operations_file, FILE_CHECK_OPERATIONS);
+}
+
+static void dump_users(FILE *dump_file)
+{
+    for (int_fast64_t chat_id = 0; chat_id < CHECK_USERS_COUNT; ++chat_id)
+    {
+        UserRecord user_record;
+
+        if (get_user_record(chat_id, &user_record))
+            fprintf(dump_file,
+                    "user %ld %u %d\n",
+                    (long) chat_id,
+                    user_record.states & ~SESSION_STATES,
+                    user_record.has_problem);
+    }
+
+    static ProblemView problems[CHECK_DUMP_BATCH_SIZE];
+
+    for (int list = 0; list < 4; ++list)
+    {
+        ProblemsCursor cursor;
+        size_t problems_count;
+
+        open_problems_cursor(&cursor, 1, list & 1, list >> 1);
+
+        while ((problems_count = read_problems(&cursor, problems, CHECK_DUMP_BATCH_SIZE)))
+            for (size_t i = 0; i < problems_count; ++i)
+                fprintf(dump_file,
+                        "list %d %s %s\n",
+                        list,
+                        problems[i].username,
+                        problems[i].problem);
+    }
+}
+
+static void dump_approved_problems(FILE *dump_file)
+{
+    const ApprovedProblems *approved_problems = acquire_approved_problems();
+
+    for (size_t i = 0; i < approved_problems->problems_count; ++i)
+        fprintf(dump_file,
+                "approved %s\n",
+                approved_problems->problems_with_chat_ids[i]);
+
+    release_approved_problems(approved_problems);
+}
+
+static FILE *open_file(const char *file_name, const char *mode)
+{
+    FILE *file = fopen(file_name, mode);
+
+    if (!file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            file_name);
+
+    return file;
+}
+
+static void close_file(FILE *file, const char *file_name)
+{
+    if (fclose(file))
+        die("%s: %s: failed to write %s",
+            __BASE_FILE__,
+            __func__,
+            file_name);
+}
+
+static void read_check_file(const char *file_name, CheckFile *check_file, const int sorted)
+{
+    FILE *file = open_file(file_name, "r");
+
+    if (fseek(file, 0, SEEK_END))
+        die("%s: %s: failed to seek %s",
+            __BASE_FILE__,
+            __func__,
+            file_name);
+
+    const long file_size = ftell(file);
+    char *contents = malloc(file_size + 1);
+
+    rewind(file);
+
+    if (!contents || fread(contents, 1, file_size, file) != (size_t) file_size)
+        die("%s: %s: failed to read %s",
+            __BASE_FILE__,
+            __func__,
+            file_name);
+
+    fclose(file);
+    contents[file_size] = 0;
+
+    size_t lines_count = 0;
+
+    for (long i = 0; i < file_size; ++i)
+        lines_count += contents[i] == '\n';
+
+    char **lines = malloc((lines_count + 1) * sizeof *lines);
+
+    if (!lines)
+        die("%s: %s: failed to allocate memory for lines",
+            __BASE_FILE__,
+            __func__);
+
+    char *line = contents;
+
+    for (size_t i = 0; i < lines_count; ++i)
+    {
+        lines[i] = line;
+        line = strchr(line, '\n');
+        *line++ = 0;
+    }
+
+    if (sorted)
+        qsort(lines, lines_count, sizeof *lines, compare_lines);
+
+    check_file->contents = contents;
+    check_file->lines = lines;
+    check_file->lines_count = lines_count;
+}
+
+/*
+ * Prints the first line, which differs, to the stderr.
+ */
+static int check_files_match(const EngineCheck *first_engine_check, const CheckFile *first_file,
+                             const EngineCheck *second_engine_check, const CheckFile *second_file,
+                             const char *what)
+{
+    size_t i = 0;
+
+    while (i < first_file->lines_count &&
+           i < second_file->lines_count &&
+           !strcmp(first_file->lines[i], second_file->lines[i]))
+        ++i;
+
+    if (i == first_file->lines_count && i == second_file->lines_count)
+        return 1;
+
+    fprintf(stderr,
+            "The %s %s doesn't match the %s one:\n"
+            "  %-8s%s\n"
+            "  %-8s%s\n",
+            second_engine_check->name,
+            what,
+            first_engine_check->name,
+            first_engine_check->name,
+            i < first_file->lines_count ? first_file->lines[i] : "(no more lines)",
+            second_engine_check->name,
+            i < second_file->lines_count ? second_file->lines[i] : "(no more lines)");
+
+    return 0;
+}
+
+static int compare_lines(const void *first_line, const void *second_line)
+{
+    return strcmp(*(char *const *) first_line, *(char *const *) second_line);
+}
+
+/*
+ * The xorshift64 of the benchmarks, so the check runs the same operations every time.
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
@@ -0,0 +1,96 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef ARCHIVE_H
+    #define ARCHIVE_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <time.h>
+
+    #define ARCHIVE_BLOCK_SIZE       65536   // 64 KiB of entries compressed together.
+    #define MAX_ARCHIVE_SEGMENT_SIZE 8388608 // 8 MiB of compressed blocks.
+    #define ARCHIVE_FILTER_SIZE      256     // Bytes of the chat_id filter of a block.
+
+    /*
+     * A problem, which has been closed and is kept only in the archive.
+     */
+    typedef struct
+    {
+        int_fast64_t chat_id;
+        unsigned int closure; // CLOSED_PROBLEM, DECLINED_PROBLEM and so on, see data.h.
+        time_t created;
+        time_t approved_at;   // 0 if the problem hasn't been approved.
+        time_t closed;
+        const char *username; // Without the '@', empty for problems saved without one.
+        const char *text;
+    }
+    ArchivedProblem;
+
+    /*
+     * Selects archived problems of a user, or of all users, closed within a time range.
+     */
+    typedef struct
+    {
+        int all_chat_ids;
+        int_fast64_t chat_id;
+        time_t from;
+        time_t to;
+    }
+    ArchiveQuery;
+
+    /*
+     * Opens the archive in the DIR_ARCHIVE, recovers it after a crash and starts
+     * the archive thread, which appends problems to it.
+     */
+    void init_archive(void);
+
+    /*
+     * Queues a problem for the archive. The problem strings are copied.
+     */
+    void archive_problem(const ArchivedProblem *problem);
+
+    /*
+     * Writes all queued problems to the disk right away.
+     */
+    void flush_archive(void);
+
+    /*
+     * Parses a query of the form 'CHAT_ID' or 'all', optionally followed by ':FROM[:TO]',
+     * the range of closing times in seconds since the Epoch.
+     * Returns 0 on success or -1 if the query is invalid.
+     */
+    int parse_archive_query(const char *query, ArchiveQuery *archive_query);
+
+    /*
+     * Prints the archived problems matching a query to the stdout as JSON lines in the closing order.
+     * Reads only the blocks, which the segment indexes don't rule out, so it can run
+     * beside a working hok-daemon. Returns the number of printed problems.
+     */
+    size_t query_archive(const ArchiveQuery *archive_query);
+
+#endif
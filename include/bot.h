@@ -53,25 +53,39 @@
     #define MAX_COMMAND_BAN_SIZE     4
     #define MAX_COMMAND_UNBAN_SIZE   6
 
-    #define MAX_DELETE_EXPIRED_PROBLEMS_INTERVAL   300 // 5 minutes.
     #define MAX_UPDATE_PROBLEMS_USERNAMES_INTERVAL 600 // 10 minutes.
 
+    #define PROBLEMS_PAGE_SIZE 16 // Problems read at once by the listings.
+
+    #define MAX_FEED_STATS_INTERVAL 3600 // 1 hour.
+
     #define NOKEYBOARD "{\"remove_keyboard\":true}"
 
-    #define get_current_keyboard(chat_id) (has_problem(chat_id) ? \
-                                           "{\"keyboard\":" \
-                                           "[[{\"text\":\"" COMMAND_CLOSEPROBLEM "\"}," \
-                                           "{\"text\":\"" COMMAND_HELPSOMEONE "\"}]]," \
-                                           "\"resize_keyboard\":true}" : \
-                                           (get_state(chat_id, "problem_description_state") ? \
-                                            "{\"keyboard\":" \
-                                            "[[{\"text\":\"" COMMAND_CANCEL "\"}]]," \
-                                            "\"resize_keyboard\":true}" : \
-                                            "{\"keyboard\":" \
-                                            "[[{\"text\":\"" COMMAND_HELPME "\"}," \
-                                            "{\"text\":\"" COMMAND_HELPSOMEONE "\"}]]," \
-                                            "\"resize_keyboard\":true}"))
+    #define KEYBOARD_PROBLEM "{\"keyboard\":" \
+                             "[[{\"text\":\"" COMMAND_CLOSEPROBLEM "\"}," \
+                             "{\"text\":\"" COMMAND_HELPSOMEONE "\"}]]," \
+                             "\"resize_keyboard\":true}"
+
+    #define KEYBOARD_DESCRIPTION "{\"keyboard\":" \
+                                 "[[{\"text\":\"" COMMAND_CANCEL "\"}]]," \
+                                 "\"resize_keyboard\":true}"
+
+    #define KEYBOARD_DEFAULT "{\"keyboard\":" \
+                             "[[{\"text\":\"" COMMAND_HELPME "\"}," \
+                             "{\"text\":\"" COMMAND_HELPSOMEONE "\"}]]," \
+                             "\"resize_keyboard\":true}"
+
+    #define get_keyboard(user_record) ((user_record)->has_problem ? \
+                                       KEYBOARD_PROBLEM : \
+                                       ((user_record)->states & PROBLEM_DESCRIPTION_STATE ? \
+                                        KEYBOARD_DESCRIPTION : \
+                                        KEYBOARD_DEFAULT))
 
     void start_bot(const int maintenance_mode);
 
+    /*
+     * Handles the messages dispatched to the current worker process, see start_workers.
+     */
+    void start_bot_worker(void);
+
 #endif
@@ -0,0 +1,158 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef BTREE_H
+    #define BTREE_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+
+    #define BTREE_PAGE_SIZE 8192
+
+    #define MAX_BTREE_KEY_SIZE   32
+    #define MAX_BTREE_VALUE_SIZE 1984 // Keeps at least 4 cells in a page, so a split always fits.
+    #define MAX_BTREE_DEPTH      16
+
+    /*
+     * A page of the B-tree file cached in memory.
+     */
+    typedef struct
+    {
+        uint32_t page_number;
+        int dirty;      // 1 if changed since the last checkpoint, 2 if only written by a running one,
+                        // such a page is never evicted.
+        int referenced; // Set on every access and cleared by the eviction clock.
+        unsigned char data[BTREE_PAGE_SIZE];
+    }
+    BTreeFrame;
+
+    /*
+     * A B-tree of byte string keys and values kept in a file of BTREE_PAGE_SIZE pages,
+     * of which at most max_cached_pages clean pages are cached in memory.
+     * Changes stay in the cache until checkpoint_btree writes them, so the file always holds
+     * the state of the last checkpoint. A B-tree isn't thread-safe, see open_btree.
+     */
+    typedef struct
+    {
+        int fd;
+        int checkpoint_fd;
+        const char *file;
+
+        uint32_t root;
+        uint32_t pages_count;
+        uint32_t free_page; // Head of the list of freed pages, 0 if there is none.
+
+        BTreeFrame **frames; // Indexed by the page number, NULL for pages not in the cache.
+        size_t frames_capacity;
+        size_t cached_pages_count;
+        size_t dirty_pages_count;
+        size_t max_cached_pages;
+        uint32_t clock_hand;
+
+        uint64_t page_hits;
+        uint64_t page_reads;
+    }
+    BTree;
+
+    /*
+     * The pages of a checkpoint copied from the cache, see prepare_btree_checkpoint.
+     */
+    typedef struct
+    {
+        uint32_t pages_count;
+        uint32_t *page_numbers; // The header page 0 first.
+        unsigned char *pages;   // pages_count pages in the order of page_numbers.
+    }
+    BTreeCheckpoint;
+
+    /*
+     * A position in a B-tree, see seek_btree_cursor. Its fields are private to the btree module.
+     */
+    typedef struct
+    {
+        uint32_t pages[MAX_BTREE_DEPTH];
+        uint16_t indexes[MAX_BTREE_DEPTH];
+        int depth; // 0 after the last value.
+    }
+    BTreeCursor;
+
+    /*
+     * Opens a B-tree file, creating it if it doesn't exist. A checkpoint interrupted by a crash
+     * is completed from the checkpoint_file first.
+     * Returns 1 if the tree is new and empty, else 0.
+     */
+    int open_btree(BTree *tree, const char *file, const char *checkpoint_file, const size_t max_cached_pages);
+
+    /*
+     * Copies the value of a key into value, which must fit MAX_BTREE_VALUE_SIZE bytes.
+     * Returns 1 if the key exists, else 0.
+     */
+    int get_btree_value(BTree *tree, const void *key, const size_t key_size, void *value, size_t *value_size);
+
+    /*
+     * Inserts a key or replaces its value.
+     * key_size must not exceed MAX_BTREE_KEY_SIZE and value_size must not exceed MAX_BTREE_VALUE_SIZE.
+     */
+    void put_btree_value(BTree *tree, const void *key, const size_t key_size, const void *value, const size_t value_size);
+
+    /*
+     * Removes a key. Pages left empty are freed, but pages aren't merged.
+     * Returns 1 if the key existed, else 0.
+     */
+    int delete_btree_value(BTree *tree, const void *key, const size_t key_size);
+
+    /*
+     * Starts a cursor before the first key not less than key.
+     */
+    void seek_btree_cursor(BTree *tree, BTreeCursor *cursor, const void *key, const size_t key_size);
+
+    /*
+     * Copies the key and the value following the cursor position and moves the cursor past them.
+     * key must fit MAX_BTREE_KEY_SIZE bytes and value must fit MAX_BTREE_VALUE_SIZE bytes.
+     * The tree must not change between the calls.
+     * Returns 1 on success or 0 after the last key.
+     */
+    int next_btree_value(BTree *tree, BTreeCursor *cursor, void *key, size_t *key_size, void *value, size_t *value_size);
+
+    /*
+     * Writes all changed pages to the file. The pages are written to the checkpoint file
+     * and synced before they overwrite their places in the file, so a crash in the middle
+     * can't leave the file with a part of them.
+     */
+    void checkpoint_btree(BTree *tree);
+
+    /*
+     * checkpoint_btree in three steps, so the tree is only needed at the ends:
+     * prepare_btree_checkpoint copies the changed pages, write_btree_checkpoint writes them
+     * and may run concurrently with any other B-tree function but another checkpoint, and
+     * finish_btree_checkpoint marks the pages not changed meanwhile as clean.
+     */
+    void prepare_btree_checkpoint(BTree *tree, BTreeCheckpoint *checkpoint);
+    void write_btree_checkpoint(const BTree *tree, const BTreeCheckpoint *checkpoint);
+    void finish_btree_checkpoint(BTree *tree, BTreeCheckpoint *checkpoint);
+
+#endif
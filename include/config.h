@@ -0,0 +1,5 @@
+#ifndef CONFIG_H
+    #define CONFIG_H
+    #define BOT_TOKEN    "123:abc"
+    #define ROOT_CHAT_ID 1000
+#endif
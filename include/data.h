@@ -28,72 +28,327 @@
 #ifndef DATA_H
     #define DATA_H
 
+    #include <stdio.h>
+    #include <stddef.h>
     #include <stdint.h>
+    #include <stdatomic.h>
+    #include <time.h>
 
     #include <cjson/cJSON.h>
 
-    #define FILE_USERS "/var/lib/hok-daemon/users.json"
+    #include "journal.h"
+
+    #ifndef DIR_DATA // The benchmarks keep their data elsewhere.
+        #define DIR_DATA "/var/lib/hok-daemon/"
+    #endif
+
+    #define FILE_USERS                 DIR_DATA "users.json"
+    #define FILE_USERS_IMPORTED        DIR_DATA "users.json.imported"
+    #define FILE_USERS_TMP             DIR_DATA "users.json.tmp"
+    #define FILE_SNAPSHOT              DIR_DATA "users.snapshot"
+    #define FILE_SNAPSHOT_TMP          DIR_DATA "users.snapshot.tmp"
+    #define FILE_JOURNAL               DIR_DATA "users.journal"
+    #define FILE_JOURNAL_OLD           DIR_DATA "users.journal.old"
+    #define FILE_BTREE                 DIR_DATA "users.btree"
+    #define FILE_BTREE_JOURNAL         DIR_DATA "users.btree.journal"
+    #define FILE_BTREE_CHECKPOINT      DIR_DATA "users.btree.checkpoint"
+    #define FILE_COLD_USERS            DIR_DATA "users.cold"
+    #define FILE_COLD_USERS_CHECKPOINT DIR_DATA "users.cold.checkpoint"
+    #define DIR_BACKUPS                DIR_DATA "backups/"
+    #define DIR_ARCHIVE                DIR_DATA "archive/"
+    #define FILE_ARCHIVE_PENDING       DIR_ARCHIVE "pending"
 
     #define MAX_USERNAME_SIZE 32
     #define MAX_CHAT_ID_SIZE  20
     #define MAX_PROBLEM_SIZE  1024
 
+    #define MAX_SHOWN_PROBLEM_SIZE (MAX_CHAT_ID_SIZE + MAX_USERNAME_SIZE + MAX_PROBLEM_SIZE + 6) // "(chat_id) @username: text".
+
     #define MAX_PROBLEM_LIFETIME 1814400 // 21 days.
 
+    #define USERS_SHARDS_BITS  4
+    #define USERS_SHARDS_COUNT (1 << USERS_SHARDS_BITS)
+
+    #define MIN_JOURNAL_COMPACTION_SIZE 1048576 // 1 MiB.
+
+    #define DEFAULT_STORAGE_ENGINE     "memory"
+    #define DEFAULT_PERSISTENCE_POLICY DEFAULT_JOURNAL_POLICY
+    #define DEFAULT_BACKUP_INTERVAL    86400 // 1 day.
+    #define DEFAULT_BACKUPS_COUNT      7
+    #define DEFAULT_EVICTION_AGE       2592000 // 30 days.
+
+    #define ACCOUNT_BAN_STATE         0x1
+    #define PROBLEM_PENDING_STATE     0x2
+    #define PROBLEM_DESCRIPTION_STATE 0x4
+
+    #define SESSION_STATES PROBLEM_DESCRIPTION_STATE // Kept out of the storage, see set_state.
+
+    #define CLOSED_PROBLEM   1 // Closed by the user.
+    #define DECLINED_PROBLEM 2 // Declined by the admin.
+    #define EXPIRED_PROBLEM  3
+    #define ORPHANED_PROBLEM 4 // Closed after the user removed the username.
+    #define UNBANNED_PROBLEM 5 // Dropped when the user was unbanned.
+
+    #define PROBLEM_CLOSURES_COUNT 5
+
+    /*
+     * A copy of a user, which stays consistent after the users table changes.
+     */
+    typedef struct
+    {
+        int_fast64_t chat_id;
+        unsigned int states; // ACCOUNT_BAN_STATE, PROBLEM_PENDING_STATE and PROBLEM_DESCRIPTION_STATE flags.
+        int has_problem;
+    }
+    UserRecord;
+
+    /*
+     * An immutable version of the approved problems of not banned users in the creation order.
+     */
+    typedef struct
+    {
+        atomic_size_t references;
+        uint_fast64_t generation; // Of the approved problems list, see get_problems_generation.
+        size_t problems_count;
+        int_fast64_t *chat_ids;
+        time_t *created_times;               // Which order the problems with the chat_ids.
+        const char **problems;               // "@username: text".
+        const char **problems_with_chat_ids; // The same problems prefixed with "(chat_id) ".
+        const char **usernames;              // Without the '@', empty for problems saved without one.
+    }
+    ApprovedProblems;
+
+    /*
+     * A position in one of the problem lists, which survives changes of the lists
+     * between reads, see open_problems_cursor. Its fields are private to the data module.
+     */
+    typedef struct
+    {
+        int include_chat_ids;
+        int pending_problems;
+        int banned_accounts;
+        int has_position;    // 0 until the first problem is read.
+        time_t created;      // Sort key of the last read problem.
+        int_fast64_t chat_id;
+        uint32_t next_user_ids[USERS_SHARDS_COUNT]; // Where every shard list is expected to go on.
+    }
+    ProblemsCursor;
+
+    /*
+     * A copy of a problem read through a ProblemsCursor.
+     */
+    typedef struct
+    {
+        int_fast64_t chat_id;
+        char username[MAX_USERNAME_SIZE + 1];
+        char problem[MAX_SHOWN_PROBLEM_SIZE + 1]; // "@username: text", prefixed with "(chat_id) " if requested.
+    }
+    ProblemView;
+
+    /*
+     * Chooses where users are kept: "memory" keeps all of them in memory with the FILE_SNAPSHOT
+     * and the FILE_JOURNAL on the disk, "btree" keeps them in the FILE_BTREE on the disk
+     * with a page cache in memory. Must be called before init_data_module and convert_users.
+     * Returns 0 on success or -1 if the engine is unknown.
+     */
+    int set_storage_engine(const char *name);
+
+    /*
+     * Returns the file, where the chosen storage engine keeps users.
+     */
+    const char *get_storage_file(void);
+
+    /*
+     * Sets how changes are written to the disk, see set_journal_policy.
+     * Must be called before init_data_module.
+     * Returns 0 on success or -1 if the policy is invalid.
+     */
+    int set_persistence_policy(const char *policy);
+
+    /*
+     * Sets how often, in seconds, a backup of users is taken. 0 disables scheduled backups.
+     * Must be called before init_data_module.
+     * Returns 0 on success or -1 if the interval is invalid.
+     */
+    int set_backup_interval(const char *interval);
+
+    /*
+     * Sets how many of the newest backups are kept, older ones are deleted after every backup.
+     * 0 keeps all the backups.
+     * Must be called before init_data_module.
+     * Returns 0 on success or -1 if the count is invalid.
+     */
+    int set_backups_count(const char *count);
+
+    /*
+     * Sets after how many seconds without activity a user without a problem is evicted
+     * from memory to the FILE_COLD_USERS, from which it's loaded back on the next access.
+     * 0 disables the eviction. Only the "memory" storage engine evicts users.
+     * Must be called before init_data_module.
+     * Returns 0 on success or -1 if the age is invalid.
+     */
+    int set_eviction_age(const char *age);
+
+    /*
+     * Returns the name of a storage engine whose files have changed after the users, which would be
+     * loaded, if any, else NULL. Loaded are the files of the chosen storage engine or, if it has none yet
+     * or if importing is set (see convert_users), the FILE_USERS. Users of such an engine would be lost,
+     * so they must be moved with export_users_json and convert_users first.
+     */
+    const char *find_newer_storage_engine(const int importing);
+
+    /*
+     * Converts the FILE_USERS to the files of the storage engine (the FILE_SNAPSHOT or the FILE_BTREE),
+     * replacing the ones it has, from which users are loaded then. Used instead of init_data_module.
+     */
+    void convert_users(void);
+
+    /*
+     * Writes the users of the storage engine to the FILE_USERS, from which another engine
+     * can import them with convert_users. Used instead of init_data_module.
+     * Returns 0 on success or -1 on failure.
+     */
+    int export_users_json(void);
+
     void init_data_module(void);
 
     /*
-     * Returns 1 if a user exists, else 0.
+     * Returns 1 if the storage engine can be replicated to a standby, see replication.h, else 0.
      */
-    int has_user(const int_fast64_t chat_id);
+    int is_replicable(void);
 
     /*
-     * Creates a user with
-     * 'account_ban_state' = 0, 'problem_pending_state' = 1 and 'problem_description_state' = 0 by default.
+     * Writes all users in the FILE_USERS format and calls attach_replica while they can't change,
+     * so a replica, which starts from them, misses no change journaled afterwards.
+     * Returns the version of the journal records, see init_replica.
      */
-    void create_user(const int_fast64_t chat_id);
+    uint32_t export_replica(FILE *users_file, void (*attach_replica)(void));
+
+    /*
+     * Loads the users of a replica from a string written by export_replica on the primary,
+     * whose records are of records_version. Used instead of init_data_module until promote_replica.
+     */
+    void init_replica(char *users_string, const uint32_t records_version);
+
+    /*
+     * Applies the records journaled by the primary after the users of the replica were exported.
+     */
+    void apply_replica_records(const void *records, const size_t records_size);
 
     /*
-     * Returns a user state, which must be 0 or 1.
-     * state_name must be 'account_ban_state', 'problem_pending_state' or 'problem_description_state'.
+     * Drops the users of a replica, whose primary has dropped it, so init_replica
+     * or init_data_module can load them again.
      */
-    int get_state(const int_fast64_t chat_id, const char *state_name);
+    void drop_replica(void);
+
+    /*
+     * Takes over the files of the stopped primary with the users of the replica
+     * and finishes the init like init_data_module.
+     */
+    void promote_replica(void);
+
+    /*
+     * Makes a worker process use the users of the supervisor, see start_workers.
+     * Used instead of init_data_module. Only the user operations and the problems generations
+     * are available then, the approved problems, expiry and backups stay in the supervisor.
+     */
+    void attach_data_module(void);
+
+    /*
+     * Writes all changes that aren't on the disk yet.
+     */
+    void flush_data_module(void);
+
+    /*
+     * Asks the data module to take a backup of users to the DIR_BACKUPS as soon as possible.
+     * Safe to call from a signal handler.
+     */
+    void request_backup(void);
+
+    /*
+     * Copies a user into user_record with a single lookup.
+     * Returns 1 if the user exists, else 0 and user_record has no states and no problem.
+     */
+    int get_user_record(const int_fast64_t chat_id, UserRecord *user_record);
+
+    /*
+     * Starts a transaction on a user: the mutations of that user that follow in this thread,
+     * until commit_transaction, are applied under a single write lock and persisted together,
+     * all or nothing. Nothing else can read or change the user meanwhile, so only mutations
+     * may be called inside a transaction and they must fit into a single journal record.
+     */
+    void begin_transaction(const int_fast64_t chat_id);
+
+    /*
+     * Persists the current transaction according to the persistence policy and ends it.
+     */
+    void commit_transaction(void);
+
+    /*
+     * Creates a user with only the PROBLEM_PENDING_STATE set by default.
+     */
+    void create_user(const int_fast64_t chat_id);
 
     /*
      * Sets a user state.
-     * state_name must be 'account_ban_state', 'problem_pending_state' or 'problem_description_state'.
+     * state must be ACCOUNT_BAN_STATE, PROBLEM_PENDING_STATE or PROBLEM_DESCRIPTION_STATE.
      * state_value must be 0 or 1.
+     * SESSION_STATES are set in the user session (see sessions.h) without touching the disk,
+     * so they're lost on restart and after SESSION_TTL seconds of inactivity.
+     */
+    void set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value);
+
+    /*
+     * Creates a user problem. username is stored without the '@' and must fit MAX_USERNAME_SIZE.
      */
-    void set_state(const int_fast64_t chat_id, const char *state_name, const int state_value);
+    void create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit);
 
     /*
-     * Returns 1 if a user has a problem, else 0.
+     * Changes the username shown with a user problem, if the user has one.
      */
-    int has_problem(const int_fast64_t chat_id);
+    void set_problem_username(const int_fast64_t chat_id, const char *username);
 
     /*
-     * Creates a user problem.
+     * Deletes a user problem and appends it to the archive (see archive.h) with the closure,
+     * which must be CLOSED_PROBLEM, DECLINED_PROBLEM, EXPIRED_PROBLEM, ORPHANED_PROBLEM or UNBANNED_PROBLEM.
      */
-    void create_problem(const int_fast64_t chat_id, const char *problem_text, const int use_time_limit);
+    void delete_problem(const int_fast64_t chat_id, const unsigned int closure);
 
     /*
-     * Modifies a user problem.
+     * Starts a cursor before the first problem of the list chosen by pending_problems and banned_accounts.
      */
-    void modify_problem(const int_fast64_t chat_id, const char *problem_text);
+    void open_problems_cursor(ProblemsCursor *cursor, const int include_chat_ids, const int pending_problems, const int banned_accounts);
 
     /*
-     * Deletes a user problem.
+     * Copies up to max_problems_count problems following the cursor position into problems
+     * in the creation order and moves the cursor past them. Problems created or removed
+     * in the meantime are seen or skipped according to their place in the order.
+     * Returns the number of copied problems, 0 at the end of the list.
      */
-    void delete_problem(const int_fast64_t chat_id);
+    size_t read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count);
 
     /*
-     * Returns all users problems with a specified parameters.
+     * Returns the generation of the list chosen by pending_problems and banned_accounts,
+     * which changes whenever a problem is added to it, removed from it or changes its username.
      */
-    cJSON *get_problems(const int include_chat_ids, const int pending_problems, const int banned_accounts);
+    uint_fast64_t get_problems_generation(const int pending_problems, const int banned_accounts);
+
+    /*
+     * Returns the current version of the approved problems without taking any lock.
+     * The version doesn't change and stays valid until release_approved_problems.
+     */
+    const ApprovedProblems *acquire_approved_problems(void);
+
+    void release_approved_problems(const ApprovedProblems *problems);
 
     /*
      * Returns all expired users problems chat ids.
      */
     cJSON *get_expired_problems_chat_ids(void);
 
+    /*
+     * Blocks until at least one user problem has expired.
+     */
+    void wait_problems_expiry(void);
+
 #endif
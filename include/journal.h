@@ -0,0 +1,135 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef JOURNAL_H
+    #define JOURNAL_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+
+    #define MAX_JOURNAL_RECORD_SIZE 4096
+
+    #define DEFAULT_JOURNAL_POLICY "interval:100"
+
+    #define MAX_JOURNAL_COMMIT_DELAY   1000 // 1 second, used by the 'mutations' policy.
+    #define MAX_JOURNAL_STATS_INTERVAL 3600 // 1 hour.
+
+    /*
+     * Sets how the journal commits records to the disk:
+     * 'interval:N' commits everything appended within N milliseconds at once;
+     * 'mutations:N' commits once N records are appended (or MAX_JOURNAL_COMMIT_DELAY passes);
+     * 'sync' commits as soon as possible and makes wait_journal_record block until then.
+     * Must be called before open_journal.
+     * Returns 0 on success or -1 if the policy is invalid.
+     */
+    int set_journal_policy(const char *policy);
+
+    /*
+     * Opens a journal file, creating it if it doesn't exist, and passes every
+     * record to apply_record in the order they were appended.
+     * records_version is the version of the records layout, a journal of an older
+     * layout is replayed with its own version passed to apply_record, a newer one is refused.
+     * A torn or corrupted tail left by a crash in the middle of an append is cut off.
+     * Then starts the journal thread, which commits records and calls compact after every commit.
+     * Returns the records version of the replayed journal, new records are appended with
+     * records_version only after reset_journal if it differs.
+     * If apply_record is NULL, the records of the file are discarded instead of being replayed,
+     * so their effects must be saved somewhere else already.
+     */
+    uint32_t open_journal(const char *file,
+                          const uint32_t records_version,
+                          void (*apply_record)(const uint32_t records_version,
+                                               const unsigned char *record,
+                                               const size_t record_size),
+                          void (*compact)(void));
+
+    /*
+     * Queues a checksummed record for the journal and returns its sequence number.
+     * record_size must not exceed MAX_JOURNAL_RECORD_SIZE.
+     */
+    uint_fast64_t append_journal_record(const void *record, const size_t record_size);
+
+    /*
+     * Waits until a record is on the disk if the 'sync' policy is used, else returns immediately.
+     */
+    void wait_journal_record(const uint_fast64_t sequence);
+
+    /*
+     * Commits all queued records right away.
+     */
+    void flush_journal(void);
+
+    /*
+     * Returns the journal size in bytes, including queued records.
+     */
+    size_t get_journal_size(void);
+
+    /*
+     * Passes every record of a journal file, which isn't open, to apply_record like open_journal.
+     * Returns the records version of the file.
+     */
+    uint32_t replay_journal(const char *file,
+                            const uint32_t records_version,
+                            void (*apply_record)(const uint32_t records_version,
+                                                 const unsigned char *record,
+                                                 const size_t record_size));
+
+    /*
+     * Renames the journal file to old_file in the dir and goes on in a new one, so the records
+     * appended afterwards are kept apart from the ones, whose effects the caller is saving.
+     * Queued records go to the new file, so replaying them again must be harmless.
+     */
+    void rotate_journal(const char *old_file, const char *dir);
+
+    /*
+     * Discards all records in the journal, including queued ones.
+     * Must be called only after their effects have been saved somewhere else.
+     */
+    void reset_journal(void);
+
+    /*
+     * Passes the records appended after the call to replicate, batch by batch, right before
+     * they are written to the disk or discarded by reset_journal, with the sequence number
+     * of the last one. replicate must not append records. Replaces the previous replicate.
+     * Returns the sequence number of the last record appended before the call.
+     */
+    uint_fast64_t replicate_journal(void (*replicate)(const void *records,
+                                                      const size_t records_size,
+                                                      const uint_fast64_t sequence));
+
+    /*
+     * Passes every record of records, as passed to replicate, to apply_record.
+     * Returns 0 on success or -1 if the records are damaged.
+     */
+    int apply_journal_records(const void *records,
+                              const size_t records_size,
+                              const uint32_t records_version,
+                              void (*apply_record)(const uint32_t records_version,
+                                                   const unsigned char *record,
+                                                   const size_t record_size));
+
+#endif
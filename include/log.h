@@ -28,8 +28,12 @@
 #ifndef LOG_H
     #define LOG_H
 
-    #define FILE_INFOLOG  "/var/log/hok-daemon/info_log"
-    #define FILE_ERRORLOG "/var/log/hok-daemon/error_log"
+    #ifndef DIR_LOG // The benchmarks keep their logs elsewhere.
+        #define DIR_LOG "/var/log/hok-daemon/"
+    #endif
+
+    #define FILE_INFOLOG  DIR_LOG "info_log"
+    #define FILE_ERRORLOG DIR_LOG "error_log"
 
     #define MAX_TIMESTAMP_SIZE 21
 
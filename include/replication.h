@@ -0,0 +1,70 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef REPLICATION_H
+    #define REPLICATION_H
+
+    #define REPLICATION_SEND_TIMEOUT        1000 // 1 second, a standby, which takes longer to receive, is dropped.
+    #define REPLICATION_CONNECT_INTERVAL    1    // 1 second.
+    #define MAX_REPLICATION_TAKEOVER_DELAY  5    // 5 seconds, see wait_primary.
+    #define MAX_REPLICATION_STATS_INTERVAL  3600 // 1 hour.
+
+    /*
+     * Sets where the primary accepts a standby: a Unix socket path, which starts with a '/',
+     * or 'HOST:PORT' of a TCP socket. Since a standby isn't authenticated, the HOST must be
+     * a loopback one and only a standby of the same user is accepted at a Unix socket.
+     * Returns 0 on success or -1 if the address is invalid.
+     */
+    int set_replication_address(const char *address);
+
+    /*
+     * Returns 1 if set_replication_address was called, else 0.
+     */
+    int is_replication_enabled(void);
+
+    /*
+     * Starts accepting a standby at the replication address, one at a time. The standby gets
+     * all users first, then every batch of journal records before the batch is written
+     * to the disk, so it has everything the disk has. Its acknowledgements give the lag,
+     * which is reported regularly. Must be called after init_data_module or promote_replica.
+     */
+    void start_replication(void);
+
+    /*
+     * Connects to the primary at the replication address, loads its users with init_replica
+     * and applies its records in the background.
+     * Returns 0 on success or -1 if the primary doesn't accept a standby (yet).
+     */
+    int follow_primary(void);
+
+    /*
+     * Blocks until the stream from the primary ends, which happens when the primary stops
+     * or drops the standby, and all of it is applied.
+     */
+    void wait_primary(void);
+
+#endif
@@ -44,6 +44,19 @@
 
     #define MAX_REQUEST_RETRIES 3
 
+    #define MAX_CONNECTIONS 16 // Idle connections kept in the shared pool.
+
+    #define MAX_REQUESTS_STATS_INTERVAL 3600 // 1 hour.
+
+    /*
+     * Initializes curl and the cache of DNS lookups, TLS sessions and connections,
+     * which is shared by the curl handles of all threads.
+     * Every thread makes its requests with its own handle, set up on its first request
+     * and cleaned up when the thread exits, while the connections stay in the shared cache,
+     * so a thread that handles a single message still reuses a connection of another one.
+     * The numbers of requests, new connections and TLS handshakes are reported every
+     * MAX_REQUESTS_STATS_INTERVAL.
+     */
     void init_requests_module(void);
 
     /*
@@ -66,4 +79,15 @@
      */
     void send_message_with_keyboard(const int_fast64_t chat_id, const char *message, const char *keyboard);
 
+    /*
+     * Returns a message URL-encoded for send_escaped_message_with_keyboard.
+     * The returned string must be freed.
+     */
+    char *escape_message(const char *message);
+
+    /*
+     * Sends a message escaped by escape_message with a keyboard to a chat via the Telegram Bot API.
+     */
+    void send_escaped_message_with_keyboard(const int_fast64_t chat_id, const char *escaped_message, const char *keyboard);
+
 #endif
@@ -0,0 +1,49 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef SESSIONS_H
+    #define SESSIONS_H
+
+    #include <stdint.h>
+
+    #define SESSION_TTL 3600 // 1 hour.
+
+    /*
+     * Sets a session state of a user. Session states are transient conversational states,
+     * which are kept only in memory: they never reach the disk, are forgotten on restart and
+     * after SESSION_TTL seconds without access to the session.
+     * state_value must be 0 or 1.
+     */
+    void set_session_state(const int_fast64_t chat_id, const unsigned int state, const int state_value);
+
+    /*
+     * Returns the session states of a user, 0 if the user has no session,
+     * and renews the session.
+     */
+    unsigned int get_session_states(const int_fast64_t chat_id);
+
+#endif
@@ -0,0 +1,78 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef SLAB_H
+    #define SLAB_H
+
+    #include <stddef.h>
+
+    #define SLAB_SIZE 16384 // 16 KiB.
+
+    #define MIN_SLAB_CHUNK_SIZE 16
+    #define MAX_SLAB_CHUNK_SIZE 4096
+    #define SLAB_CLASSES_COUNT  24 // See slab_chunk_sizes.
+
+    /*
+     * An allocator of small blocks, which carves slabs of SLAB_SIZE bytes into chunks
+     * of one size class each and reuses freed chunks of the same class.
+     * Blocks bigger than MAX_SLAB_CHUNK_SIZE are allocated on their own.
+     * A slab allocator isn't thread-safe, it must be zero-initialized before use.
+     */
+    typedef struct
+    {
+        void *free_chunks[SLAB_CLASSES_COUNT];
+
+        char *slab;
+        size_t slab_used_size;
+
+        size_t reserved_size; // Bytes taken from the system for slabs and big blocks.
+        size_t chunks_size;   // Bytes handed out, including the rounding up to a size class.
+        size_t blocks_size;   // Bytes requested.
+    }
+    SlabAllocator;
+
+    /*
+     * Returns a block of at least size bytes.
+     */
+    void *allocate_slab_block(SlabAllocator *allocator, const size_t size);
+
+    /*
+     * Returns a block to the allocator. size must be the size it was allocated with.
+     */
+    void free_slab_block(SlabAllocator *allocator, void *block, const size_t size);
+
+    /*
+     * Returns a copy of a string allocated with allocate_slab_block.
+     */
+    char *copy_slab_string(SlabAllocator *allocator, const char *string);
+
+    /*
+     * Frees a string returned by copy_slab_string.
+     */
+    void free_slab_string(SlabAllocator *allocator, char *string);
+
+#endif
@@ -0,0 +1,293 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef STORAGE_H
+    #define STORAGE_H
+
+    #include <stdio.h>
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <time.h>
+
+    #include <cjson/cJSON.h>
+
+    #include "data.h"
+
+    #define STATES_COUNT 3 // State flags are 1 << index, see state_names.
+
+    #define PROBLEM_LISTS_COUNT 4 // Indexed by (pending ? 1 : 0) | (banned ? 2 : 0).
+
+    typedef struct
+    {
+        time_t time;        // Start of the problem lifetime, 0 if the problem never expires.
+        time_t created;
+        time_t approved_at; // 0 if the problem hasn't been approved.
+        char *username;     // Without the '@', empty for problems saved without one.
+        char *text;         // NULL if the user has no problem.
+    }
+    Problem;
+
+    /*
+     * A top-level entry of the FILE_USERS, found before the users are parsed.
+     */
+    typedef struct
+    {
+        int_fast64_t chat_id;
+        const char *chat_id_string;
+        const char *user_string; // The user object, not terminated.
+        size_t user_string_size;
+    }
+    UsersEntry;
+
+    /*
+     * An open-addressing table (linear probing) keyed by chat ids, of slots_mask + 1 slots,
+     * a power of two, of slot_size bytes each. A slot of zero bytes is empty.
+     * get_chat_id returns the chat id of a used slot.
+     */
+    typedef struct
+    {
+        void *slots;
+        size_t slot_size;
+        size_t slots_mask;
+        int_fast64_t (*get_chat_id)(const void *context, const void *slot);
+        const void *context;
+    }
+    ChatSlots;
+
+    /*
+     * A storage engine keeps the users and implements the operations of the data module
+     * of the same names, see data.h. The data module shares the approved problems, the
+     * expiry notifications and the backups between the engines, which call back into it
+     * with the functions below.
+     */
+    typedef struct
+    {
+        const char *name;
+        const char *file;         // Where the users are kept, see convert_users.
+        const char *journal_file; // Changed on every write, unlike the file, see find_newer_storage_engine.
+
+        /*
+         * Loads the users and opens the engine journal.
+         */
+        void (*init)(void);
+
+        /*
+         * Replaces the files of the engine with the users of the FILE_USERS,
+         * which is retired then, see retire_users_json.
+         */
+        void (*convert_users)(void);
+
+        void (*flush)(void);
+
+        /*
+         * Locks all users for reading, so scan_problems and export_users see them consistent.
+         */
+        void (*lock_users)(void);
+        void (*unlock_users)(void);
+
+        int (*get_user_record)(const int_fast64_t chat_id, UserRecord *user_record);
+        void (*begin_transaction)(const int_fast64_t chat_id);
+        void (*commit_transaction)(void);
+        void (*create_user)(const int_fast64_t chat_id);
+        void (*set_state)(const int_fast64_t chat_id, const unsigned int state, const int state_value);
+        void (*create_problem)(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit);
+        void (*set_problem_username)(const int_fast64_t chat_id, const char *username);
+        void (*delete_problem)(const int_fast64_t chat_id);
+        size_t (*read_problems)(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count);
+
+        /*
+         * Passes the problems of a list to visit in the creation order.
+         * The users must be locked with lock_users.
+         */
+        void (*scan_problems)(const int pending_problems,
+                              const int banned_accounts,
+                              void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                              void *context);
+
+        /*
+         * Passes the problem of a user to visit, if it is in the list of scan_problems,
+         * with the user locked, so the users needn't be locked with lock_users.
+         */
+        void (*find_problem)(const int_fast64_t chat_id,
+                             const int pending_problems,
+                             const int banned_accounts,
+                             void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                             void *context);
+
+        cJSON *(*get_expired_problems_chat_ids)(void);
+
+        /*
+         * Returns the time when the earliest problem expires or 0 if no problem can expire.
+         */
+        time_t (*get_expiry_deadline)(void);
+
+        /*
+         * Writes all users in the FILE_USERS format with export_user.
+         * The users must be locked with lock_users or be a copy of the process.
+         */
+        void (*export_users)(FILE *users_file);
+
+        /*
+         * Saves the users to a file with write_users and returns how long writers
+         * were paused in milliseconds, or -1 on failure.
+         */
+        double (*save_backup)(const char *file, const char *tmp_file);
+
+        void (*report_footprint)(void);
+
+        /*
+         * Replication, see replication.h, NULL if the engine can't be replicated.
+         * init_replica loads the users from a FILE_USERS string instead of the files of the engine.
+         * apply_replica_record applies a record journaled by the primary, of the records_version
+         * of the engine, without journaling it again. drop_replica leaves the engine as it was
+         * before init_replica. promote_replica saves the users to the files of the engine,
+         * which it takes over from the primary, and finishes the init.
+         */
+        void (*init_replica)(char *users_string);
+        void (*apply_replica_record)(const uint32_t records_version, const unsigned char *record, const size_t record_size);
+        void (*drop_replica)(void);
+        void (*promote_replica)(void);
+        uint32_t records_version;
+    }
+    StorageEngine;
+
+    extern const StorageEngine memory_storage_engine; // All users in memory, a snapshot and a journal on the disk.
+    extern const StorageEngine btree_storage_engine;  // Users in a B-tree on the disk, a page cache in memory.
+    extern const StorageEngine worker_storage_engine; // Calls the engine of the supervisor from a worker process, see workers.h.
+
+    extern const char *state_names[STATES_COUNT];
+
+    extern long eviction_age; // Seconds, see set_eviction_age.
+
+    /*
+     * Marks a problem list as changed by the problem of a user, see get_problems_generation.
+     * Must be called with the changed user locked for writing.
+     */
+    void touch_problem_list(const int_fast64_t chat_id, const int pending_problems, const int banned_accounts);
+
+    /*
+     * Updates the approved problems of the users touched since the last publication.
+     * Must be called without holding any user lock.
+     */
+    void publish_approved_problems(void);
+
+    /*
+     * Wakes up wait_problems_expiry after the earliest expiry has changed.
+     */
+    void notify_expiry(void);
+
+    /*
+     * Returns the closure passed to the delete_problem being called by this thread.
+     */
+    unsigned int get_deletion_closure(void);
+
+    /*
+     * Passes a problem, which delete_problem is about to discard, to the archive.
+     * Must be called with the user locked for writing. Replayed deletions are ignored,
+     * as their problems were archived before.
+     */
+    void archive_deleted_problem(const int_fast64_t chat_id, const Problem *problem);
+
+    /*
+     * Formats a problem the way it is shown, "@username: text", prefixed with "(chat_id) "
+     * if include_chat_id is set. Returns the formatted size like snprintf.
+     */
+    int format_problem(char *buffer,
+                       const size_t buffer_size,
+                       const int_fast64_t chat_id,
+                       const Problem *problem,
+                       const int include_chat_id);
+
+    /*
+     * Splits a problem text saved before usernames were kept apart, "@username: text".
+     * username must fit MAX_USERNAME_SIZE + 1 bytes and is left empty if the text has no username.
+     */
+    void split_problem_text(const char *problem_text, char *username, const char **text);
+
+    /*
+     * Returns the whole FILE_USERS as a string, which must be freed.
+     */
+    char *read_users_json(void);
+
+    /*
+     * Renames the FILE_USERS to the FILE_USERS_IMPORTED once the storage engine has saved
+     * its users to the engine files, so the outdated FILE_USERS can't be imported again.
+     */
+    void retire_users_json(void);
+
+    /*
+     * Splits the FILE_USERS into its top-level entries without parsing the users,
+     * so they can be parsed in parallel. Keys are terminated in place.
+     * Returns the number of entries and dies if the file isn't a JSON object.
+     */
+    size_t find_users_entries(char *users_string, UsersEntry **entries);
+
+    /*
+     * Parses a user of the FILE_USERS. The problem strings point into the returned cJSON
+     * or into split_username, which must fit MAX_USERNAME_SIZE + 1 bytes, so they are valid
+     * until the cJSON is deleted. Dies if the user is invalid.
+     */
+    cJSON *parse_user(const UsersEntry *entry, unsigned int *states, Problem *problem, char *split_username);
+
+    /*
+     * Writes a user as a member of the FILE_USERS object, without a separator.
+     */
+    void export_user(FILE *users_file, const int_fast64_t chat_id, const unsigned int states, const Problem *problem);
+
+    /*
+     * Writes all users with the export_users of the storage engine to a file and returns
+     * its size, or -1 on failure. The data is streamed to a temporary file in the same dir
+     * first, then synced and renamed, so a crash can't leave the file truncated.
+     */
+    long write_users(const char *file, const char *tmp_file, const char *dir);
+
+    /*
+     * Makes a completed rename in a dir durable.
+     * Returns 0 on success or -1 on failure.
+     */
+    int sync_dir(const char *dir);
+
+    double get_elapsed_milliseconds(const struct timespec *start);
+
+    /*
+     * Mixes the chat_id bits (splitmix64 finalizer), since chat ids are sequential-ish,
+     * but linear probing needs well-spread low bits and the archive filters all 64 bits.
+     */
+    uint64_t hash_chat_id(const int_fast64_t chat_id);
+
+    /*
+     * Returns the slot a chat id is inserted into, the first empty slot of its probe sequence.
+     */
+    size_t find_empty_chat_slot(const ChatSlots *table, const int_fast64_t chat_id);
+
+    /*
+     * Empties a used slot. Following slots of the probe sequence are shifted back,
+     * so no lookup stops at the freed slot.
+     */
+    void clear_chat_slot(const ChatSlots *table, size_t slot);
+
+#endif
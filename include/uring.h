@@ -0,0 +1,55 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef URING_H
+    #define URING_H
+
+    #include <sys/types.h>
+    #include <stddef.h>
+
+    #define URING_ENTRIES 8
+
+    /*
+     * Writes data_size bytes to a file at offset, or at the file position if offset is -1,
+     * and then syncs the file data if sync is set. The write and the sync go to the kernel
+     * as a single linked io_uring submission, so the caller makes one system call for both.
+     * A write without a sync is a plain write, which io_uring would only slow down.
+     * Plain write and fdatasync calls are used as well if the kernel has no io_uring
+     * or refuses the submission, or the process is a child forked after the io_uring was set up.
+     * The call waits for its own submission, nothing is batched across calls,
+     * so callers batch their writes themselves: a group commit of the journal
+     * is a single call for all its records.
+     * Returns 0 on success or -1 on failure with errno set.
+     */
+    int write_file(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync);
+
+    /*
+     * Returns 1 if write_file syncs writes through io_uring, else 0.
+     */
+    int is_uring_available(void);
+
+#endif
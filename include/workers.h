@@ -0,0 +1,100 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#ifndef WORKERS_H
+    #define WORKERS_H
+
+    #include <stdint.h>
+    #include <stdatomic.h>
+
+    #include <cjson/cJSON.h>
+
+    #define MAX_WORKERS_COUNT 16
+
+    #define WORKER_QUEUE_SIZE       64    // Messages waiting for a worker.
+    #define MAX_WORKER_BACKLOG_SIZE 1024  // Messages waiting in the supervisor for room in the queue of a worker.
+    #define MAX_WORKER_MESSAGE_SIZE 65536 // Of a message as JSON, bigger ones are dropped.
+    #define WORKER_CALLERS_COUNT    16    // Threads of a worker calling the store at once.
+    #define MAX_CALL_PROBLEMS       16    // Problems read by a single call of a worker.
+    #define MAX_TRANSACTION_CALLS   8     // Mutations of a transaction of a worker.
+
+    #define WORKER_RESTART_DELAY         1  // 1 second.
+    #define WORKER_DROPS_REPORT_INTERVAL 60 // 1 minute.
+
+    /*
+     * Sets how many worker processes handle messages. 0 handles them in the daemon itself.
+     * Returns 0 on success or -1 if the count is invalid.
+     */
+    int set_workers_count(const char *count);
+
+    /*
+     * Splits the daemon into the supervisor, which keeps the users and polls the updates,
+     * and the worker processes, which handle messages and call the supervisor store through
+     * shared memory. A keeper process runs run_worker in every worker and restarts a worker,
+     * which has crashed, without disturbing the supervisor. Returns only in the supervisor.
+     * Every store call of a worker is still carried out by the supervisor, which is also
+     * the only process polling the updates, so it bounds the throughput the workers reach.
+     * Does nothing if the workers count is 0. Must be called before any thread is created.
+     */
+    void start_workers(void (*run_worker)(void));
+
+    /*
+     * Starts the threads, which carry out the calls of the workers.
+     * Must be called in the supervisor after init_data_module.
+     */
+    void serve_workers(void);
+
+    /*
+     * Returns the number of worker processes, 0 until start_workers or if there are none.
+     */
+    int get_workers_count(void);
+
+    int is_worker_process(void);
+
+    /*
+     * Returns the problem lists generations (see get_problems_generation), which are shared
+     * by the supervisor and the workers.
+     */
+    atomic_uint_fast64_t *get_shared_problem_lists_generations(void);
+
+    /*
+     * Queues a message for the worker of its chat, so messages of a chat are always handled
+     * by the same worker. Never blocks: while the queue of the worker is full, the message
+     * waits in a backlog of MAX_WORKER_BACKLOG_SIZE messages, and is dropped if that is full too.
+     * The dropped messages are counted and reported at most every WORKER_DROPS_REPORT_INTERVAL
+     * and once the backlog is empty again.
+     * Must be called only by the supervisor thread polling the updates.
+     */
+    void dispatch_message(const int_fast64_t chat_id, const cJSON *message);
+
+    /*
+     * Blocks until a message is queued for the current worker and returns it.
+     * The returned cJSON must be deleted.
+     */
+    cJSON *receive_message(void);
+
+#endif
@@ -0,0 +1,1041 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <zlib.h>
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "checksum.h"
+#include "uring.h"
+#include "data.h"
+#include "storage.h"
+#include "archive.h"
+
+#define ARCHIVE_BLOCK_MAGIC 0x424B4F48 // "HOKB".
+#define ARCHIVE_INDEX_MAGIC 0x494B4F48 // "HOKI".
+#define ARCHIVE_INDEX_VERSION 1
+
+#define ARCHIVE_FILTER_HASHES 3
+
+#define MAX_ARCHIVE_FILE_SIZE (sizeof DIR_ARCHIVE + 16) // "NNNNNNNN.segment".
+
+/*
+ * The archive is a sequence of segments, each of which is a DIR_ARCHIVE "NNNNNNNN.segment" file
+ * of zlib-compressed blocks of entries and a DIR_ARCHIVE "NNNNNNNN.index" file of an
+ * IndexHeader followed by an IndexEntry per block. An entry is an EntryHeader followed by
+ * the username and the text, both not terminated, and its checksum covers all of that.
+ * Entries are numbered in the archiving order, so those of the FILE_ARCHIVE_PENDING,
+ * which collects the entries of the next block uncompressed, are told apart from those
+ * of blocks already written, even after a crash between the two.
+ */
+typedef struct
+{
+    uint64_t sequence;
+    int64_t chat_id;
+    int64_t created;
+    int64_t approved_at;
+    int64_t closed;
+    uint16_t text_size;
+    uint8_t username_size;
+    uint8_t closure;
+    uint32_t checksum;
+}
+EntryHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t compressed_size;
+    uint32_t raw_size;
+    uint32_t entries_count;
+    uint64_t first_sequence;
+}
+BlockHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+}
+IndexHeader;
+
+/*
+ * Describes a block well enough to skip it: the chat_id filter is a Bloom filter,
+ * which has the ARCHIVE_FILTER_HASHES bits of every chat_id of the block set.
+ * The checksum covers everything before itself.
+ */
+typedef struct
+{
+    uint64_t offset; // Of the BlockHeader in the segment.
+    uint64_t first_sequence;
+    int64_t min_chat_id;
+    int64_t max_chat_id;
+    int64_t min_closed;
+    int64_t max_closed;
+    uint32_t compressed_size;
+    uint32_t raw_size;
+    uint32_t entries_count;
+    uint8_t chat_ids_filter[ARCHIVE_FILTER_SIZE];
+    uint32_t checksum;
+}
+IndexEntry;
+
+/*
+ * Encoded entries, see EntryHeader.
+ */
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t entries_count;
+}
+Entries;
+
+static void *persist_archive(void *_);
+static void commit_entries(void);
+static void seal_block(void);
+static void open_segment(const uint32_t number, const int is_new);
+static void recover_pending_entries(const uint_fast64_t sealed_sequence);
+static void add_entries(Entries *entries, const void *data, const size_t data_size);
+static size_t read_entry(const unsigned char *data, const size_t data_size, EntryHeader *entry_header);
+static int is_matching_entry(const EntryHeader *entry_header, const ArchiveQuery *archive_query);
+static void print_entry(const EntryHeader *entry_header, const unsigned char *entry_data);
+static size_t query_entries(const unsigned char *data,
+                            const size_t data_size,
+                            const uint_fast64_t min_sequence,
+                            const ArchiveQuery *archive_query);
+static int is_matching_block(const IndexEntry *index_entry, const ArchiveQuery *archive_query);
+static void add_to_filter(uint8_t *filter, const int_fast64_t chat_id);
+static int is_in_filter(const uint8_t *filter, const int_fast64_t chat_id);
+static uint32_t get_entry_checksum(const EntryHeader *entry_header, const void *strings);
+static size_t read_index(const uint32_t number, IndexEntry **index_entries, int *is_damaged);
+static size_t find_segments(uint32_t **numbers);
+static int compare_numbers(const void *number, const void *other_number);
+static void get_segment_file(char *file, const uint32_t number, const char *extension);
+static unsigned char *read_file(const char *file, size_t *file_size);
+
+static const char *closure_names[PROBLEM_CLOSURES_COUNT] =
+{
+    "closed",
+    "declined",
+    "expired",
+    "orphaned",
+    "unbanned"
+};
+
+/*
+ * Appenders only touch the pending_entries under the archive_mutex.
+ * The archive thread swaps them with the writing_entries and writes the latter,
+ * as well as the blocks, under the archive_io_mutex, which flush_archive takes as well.
+ * Lock order: archive_io_mutex, then archive_mutex.
+ */
+static Entries pending_entries;
+static Entries writing_entries;
+static Entries block_entries; // Those in the FILE_ARCHIVE_PENDING.
+
+static uint_fast64_t appended_sequence;
+
+static pthread_mutex_t archive_mutex    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t archive_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appended_cond     = PTHREAD_COND_INITIALIZER;
+
+static int pending_fd = -1;
+static int segment_fd = -1;
+static int index_fd = -1;
+static uint32_t segment_number;
+static uint64_t segment_size;
+
+void init_archive(void)
+{
+    if (mkdir(DIR_ARCHIVE, 0700) && errno != EEXIST)
+        die("%s: %s: failed to create %s",
+            __BASE_FILE__,
+            __func__,
+            DIR_ARCHIVE);
+
+    uint32_t *numbers;
+    const size_t segments_count = find_segments(&numbers);
+
+    uint_fast64_t sealed_sequence = 0;
+
+    // The last segment may be empty, if a crash came right after it was started.
+    for (size_t i = segments_count; i-- && !sealed_sequence;)
+    {
+        IndexEntry *index_entries;
+        int is_damaged;
+        const size_t index_entries_count = read_index(numbers[i], &index_entries, &is_damaged);
+
+        if (index_entries_count)
+        {
+            const IndexEntry *last_entry = &index_entries[index_entries_count - 1];
+            sealed_sequence = last_entry->first_sequence + last_entry->entries_count - 1;
+        }
+
+        if (i == segments_count - 1)
+        {
+            segment_size = index_entries_count ?
+                           index_entries[index_entries_count - 1].offset +
+                           sizeof(BlockHeader) +
+                           index_entries[index_entries_count - 1].compressed_size :
+                           0;
+
+            open_segment(numbers[i], 0);
+
+            // Entries, which were written after the last good one, are cut off with their blocks.
+            if (is_damaged &&
+                ftruncate(index_fd, sizeof(IndexHeader) + index_entries_count * sizeof(IndexEntry)))
+                die("%s: %s: failed to truncate segment %" PRIu32 " index",
+                    __BASE_FILE__,
+                    __func__,
+                    numbers[i]);
+        }
+
+        free(index_entries);
+    }
+
+    free(numbers);
+
+    recover_pending_entries(sealed_sequence);
+
+    if (block_entries.size >= ARCHIVE_BLOCK_SIZE)
+        seal_block();
+
+    pthread_t persist_archive_thread;
+
+    if (pthread_create(&persist_archive_thread,
+                       NULL,
+                       persist_archive,
+                       NULL))
+        die("%s: %s: failed to create persist_archive_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(persist_archive_thread);
+}
+
+void archive_problem(const ArchivedProblem *problem)
+{
+    const size_t username_size = strlen(problem->username);
+    const size_t text_size = strlen(problem->text);
+
+    if (username_size > MAX_USERNAME_SIZE || text_size > UINT16_MAX)
+        die("%s: %s: problem is too big",
+            __BASE_FILE__,
+            __func__);
+
+    EntryHeader entry_header = {0};
+    entry_header.chat_id = problem->chat_id;
+    entry_header.created = problem->created;
+    entry_header.approved_at = problem->approved_at;
+    entry_header.closed = problem->closed;
+    entry_header.text_size = text_size;
+    entry_header.username_size = username_size;
+    entry_header.closure = problem->closure;
+
+    pthread_mutex_lock(&archive_mutex);
+
+    entry_header.sequence = ++appended_sequence;
+    entry_header.checksum = update_crc32(update_crc32(update_crc32(0, &entry_header, offsetof(EntryHeader, checksum)),
+                                                      problem->username,
+                                                      username_size),
+                                         problem->text,
+                                         text_size);
+
+    add_entries(&pending_entries, &entry_header, sizeof entry_header);
+    add_entries(&pending_entries, problem->username, username_size);
+    add_entries(&pending_entries, problem->text, text_size);
+    ++pending_entries.entries_count;
+
+    pthread_cond_signal(&appended_cond);
+    pthread_mutex_unlock(&archive_mutex);
+}
+
+void flush_archive(void)
+{
+    commit_entries();
+}
+
+int parse_archive_query(const char *query, ArchiveQuery *archive_query)
+{
+    memset(archive_query, 0, sizeof *archive_query);
+    archive_query->to = (time_t) INT64_MAX;
+
+    char *end;
+
+    if (!strncmp(query, "all", 3))
+    {
+        archive_query->all_chat_ids = 1;
+        end = (char *) query + 3;
+    }
+    else
+    {
+        archive_query->chat_id = strtoll(query, &end, 10);
+
+        if (end == query)
+            return -1;
+    }
+
+    if (!*end)
+        return 0;
+
+    if (*end != ':')
+        return -1;
+
+    const char *from = end + 1;
+    archive_query->from = strtoll(from, &end, 10);
+
+    if (end == from || archive_query->from < 0)
+        return -1;
+
+    if (!*end)
+        return 0;
+
+    if (*end != ':')
+        return -1;
+
+    const char *to = end + 1;
+    archive_query->to = strtoll(to, &end, 10);
+
+    if (*end || end == to || archive_query->to < archive_query->from)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * The FILE_ARCHIVE_PENDING is read first, so its entries, which get into a block
+ * in the meantime, are found in the block and skipped in the file by their sequence numbers.
+ */
+size_t query_archive(const ArchiveQuery *archive_query)
+{
+    size_t pending_size;
+    unsigned char *pending = read_file(FILE_ARCHIVE_PENDING, &pending_size);
+
+    if (!pending)
+        die("%s: %s: failed to read %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_ARCHIVE_PENDING);
+
+    size_t problems_count = 0;
+    uint_fast64_t sealed_sequence = 0;
+
+    uint32_t *numbers;
+    const size_t segments_count = find_segments(&numbers);
+
+    for (size_t i = 0; i < segments_count; ++i)
+    {
+        IndexEntry *index_entries;
+        int is_damaged;
+        const size_t index_entries_count = read_index(numbers[i], &index_entries, &is_damaged);
+
+        int segment_fd = -1;
+
+        for (size_t j = 0; j < index_entries_count; ++j)
+        {
+            const IndexEntry *index_entry = &index_entries[j];
+            sealed_sequence = index_entry->first_sequence + index_entry->entries_count - 1;
+
+            if (!is_matching_block(index_entry, archive_query))
+                continue;
+
+            // The segment is opened only once one of its blocks can match.
+            if (segment_fd < 0)
+            {
+                char segment_file[MAX_ARCHIVE_FILE_SIZE];
+                get_segment_file(segment_file, numbers[i], "segment");
+
+                if ((segment_fd = open(segment_file, O_RDONLY | O_CLOEXEC)) < 0)
+                    die("%s: %s: failed to open %s",
+                        __BASE_FILE__,
+                        __func__,
+                        segment_file);
+            }
+
+            unsigned char *block = malloc(sizeof(BlockHeader) + index_entry->compressed_size);
+            unsigned char *raw_block = malloc(index_entry->raw_size + 1);
+
+            if (!block || !raw_block)
+                die("%s: %s: failed to allocate memory for block",
+                    __BASE_FILE__,
+                    __func__);
+
+            const size_t block_size = sizeof(BlockHeader) + index_entry->compressed_size;
+
+            BlockHeader block_header;
+            uLongf raw_size = index_entry->raw_size;
+
+            if (pread(segment_fd, block, block_size, index_entry->offset) != (ssize_t) block_size ||
+                (memcpy(&block_header, block, sizeof block_header),
+                 block_header.magic != ARCHIVE_BLOCK_MAGIC) ||
+                block_header.compressed_size != index_entry->compressed_size ||
+                uncompress(raw_block, &raw_size, block + sizeof block_header, block_header.compressed_size) != Z_OK ||
+                raw_size != index_entry->raw_size)
+                die("%s: %s: segment %" PRIu32 " block at %" PRIu64 " is damaged",
+                    __BASE_FILE__,
+                    __func__,
+                    numbers[i],
+                    index_entry->offset);
+
+            problems_count += query_entries(raw_block, raw_size, 0, archive_query);
+
+            free(block);
+            free(raw_block);
+        }
+
+        if (segment_fd >= 0)
+            close(segment_fd);
+
+        free(index_entries);
+    }
+
+    free(numbers);
+
+    // The entries of the next block aren't indexed yet.
+    problems_count += query_entries(pending, pending_size, sealed_sequence + 1, archive_query);
+    free(pending);
+
+    return problems_count;
+}
+
+/*
+ * Writes the archived problems as soon as they are queued.
+ */
+static void *persist_archive(void *_)
+{
+    (void) _;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&archive_mutex);
+
+        while (!pending_entries.size)
+            pthread_cond_wait(&appended_cond, &archive_mutex);
+
+        pthread_mutex_unlock(&archive_mutex);
+
+        commit_entries();
+    }
+
+    return NULL;
+}
+
+/*
+ * Appends the queued entries to the FILE_ARCHIVE_PENDING and compresses them
+ * into a block once there are enough of them.
+ */
+static void commit_entries(void)
+{
+    pthread_mutex_lock(&archive_io_mutex);
+    pthread_mutex_lock(&archive_mutex);
+
+    Entries entries = pending_entries;
+    pending_entries = writing_entries;
+    writing_entries = entries;
+
+    pthread_mutex_unlock(&archive_mutex);
+
+    if (writing_entries.size)
+    {
+        if (write_file(pending_fd, writing_entries.data, writing_entries.size, -1, 1))
+            die("%s: %s: failed to write to %s",
+                __BASE_FILE__,
+                __func__,
+                FILE_ARCHIVE_PENDING);
+
+        add_entries(&block_entries, writing_entries.data, writing_entries.size);
+        block_entries.entries_count += writing_entries.entries_count;
+
+        writing_entries.size = 0;
+        writing_entries.entries_count = 0;
+
+        if (block_entries.size >= ARCHIVE_BLOCK_SIZE)
+            seal_block();
+    }
+
+    pthread_mutex_unlock(&archive_io_mutex);
+}
+
+/*
+ * Compresses the block_entries into a block at the end of the current segment,
+ * or of a new one if it's full, indexes the block and empties the FILE_ARCHIVE_PENDING.
+ * Every step is synced before the next one, so a crash leaves either a block,
+ * which isn't indexed yet and is cut off by init_archive, or pending entries,
+ * which are already in a block and are skipped by their sequence numbers.
+ */
+static void seal_block(void)
+{
+    IndexEntry index_entry = {0};
+    index_entry.min_chat_id = INT64_MAX;
+    index_entry.max_chat_id = INT64_MIN;
+    index_entry.min_closed = INT64_MAX;
+    index_entry.max_closed = INT64_MIN;
+    index_entry.raw_size = block_entries.size;
+    index_entry.entries_count = block_entries.entries_count;
+
+    EntryHeader entry_header;
+
+    for (size_t offset = 0, entry_size; (entry_size = read_entry(block_entries.data + offset, block_entries.size - offset, &entry_header)); offset += entry_size)
+    {
+        if (!offset)
+            index_entry.first_sequence = entry_header.sequence;
+
+        if (entry_header.chat_id < index_entry.min_chat_id)
+            index_entry.min_chat_id = entry_header.chat_id;
+
+        if (entry_header.chat_id > index_entry.max_chat_id)
+            index_entry.max_chat_id = entry_header.chat_id;
+
+        if (entry_header.closed < index_entry.min_closed)
+            index_entry.min_closed = entry_header.closed;
+
+        if (entry_header.closed > index_entry.max_closed)
+            index_entry.max_closed = entry_header.closed;
+
+        add_to_filter(index_entry.chat_ids_filter, entry_header.chat_id);
+    }
+
+    uLongf compressed_size = compressBound(block_entries.size);
+    unsigned char *block = malloc(sizeof(BlockHeader) + compressed_size);
+
+    if (!block)
+        die("%s: %s: failed to allocate memory for block",
+            __BASE_FILE__,
+            __func__);
+
+    if (compress2(block + sizeof(BlockHeader), &compressed_size, block_entries.data, block_entries.size, Z_BEST_COMPRESSION) != Z_OK)
+        die("%s: %s: failed to compress block",
+            __BASE_FILE__,
+            __func__);
+
+    const BlockHeader block_header =
+    {
+        .magic = ARCHIVE_BLOCK_MAGIC,
+        .compressed_size = compressed_size,
+        .raw_size = block_entries.size,
+        .entries_count = block_entries.entries_count,
+        .first_sequence = index_entry.first_sequence
+    };
+
+    memcpy(block, &block_header, sizeof block_header);
+
+    if (segment_fd < 0 || (segment_size && segment_size + sizeof block_header + compressed_size > MAX_ARCHIVE_SEGMENT_SIZE))
+        open_segment(segment_number + 1, 1);
+
+    if (write_file(segment_fd, block, sizeof block_header + compressed_size, segment_size, 1))
+        die("%s: %s: failed to write segment %" PRIu32,
+            __BASE_FILE__,
+            __func__,
+            segment_number);
+
+    free(block);
+
+    index_entry.offset = segment_size;
+    index_entry.compressed_size = compressed_size;
+    index_entry.checksum = update_crc32(0, &index_entry, offsetof(IndexEntry, checksum));
+
+    if (write_file(index_fd, &index_entry, sizeof index_entry, -1, 1))
+        die("%s: %s: failed to write segment %" PRIu32 " index",
+            __BASE_FILE__,
+            __func__,
+            segment_number);
+
+    segment_size += sizeof block_header + compressed_size;
+
+    if (ftruncate(pending_fd, 0))
+        die("%s: %s: failed to truncate %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_ARCHIVE_PENDING);
+
+    report("Archived %zu problems into segment %" PRIu32 " (%zu bytes compressed to %zu)",
+           block_entries.entries_count,
+           segment_number,
+           block_entries.size,
+           (size_t) compressed_size);
+
+    block_entries.size = 0;
+    block_entries.entries_count = 0;
+}
+
+/*
+ * Opens the files of a segment, which become the current ones. A new segment
+ * gets its index header right away, an existing one is cut to its indexed blocks.
+ */
+static void open_segment(const uint32_t number, const int is_new)
+{
+    char segment_file[MAX_ARCHIVE_FILE_SIZE];
+    char index_file[MAX_ARCHIVE_FILE_SIZE];
+
+    get_segment_file(segment_file, number, "segment");
+    get_segment_file(index_file, number, "index");
+
+    if (segment_fd >= 0)
+    {
+        close(segment_fd);
+        close(index_fd);
+    }
+
+    const int flags = is_new ? O_TRUNC : 0;
+
+    if ((segment_fd = open(segment_file, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            segment_file);
+
+    if ((index_fd = open(index_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            index_file);
+
+    if (is_new)
+    {
+        const IndexHeader index_header =
+        {
+            .magic = ARCHIVE_INDEX_MAGIC,
+            .version = ARCHIVE_INDEX_VERSION
+        };
+
+        if (write_file(index_fd, &index_header, sizeof index_header, -1, 1) || sync_dir(DIR_ARCHIVE))
+            die("%s: %s: failed to write %s",
+                __BASE_FILE__,
+                __func__,
+                index_file);
+
+        segment_size = 0;
+    }
+    else
+    {
+        struct stat segment_stat;
+
+        if (fstat(segment_fd, &segment_stat))
+            die("%s: %s: failed to get %s size",
+                __BASE_FILE__,
+                __func__,
+                segment_file);
+
+        if ((uint64_t) segment_stat.st_size > segment_size)
+        {
+            if (ftruncate(segment_fd, segment_size))
+                die("%s: %s: failed to truncate %s",
+                    __BASE_FILE__,
+                    __func__,
+                    segment_file);
+
+            report("Archive segment %" PRIu32 " tail of %zu bytes isn't indexed and was discarded",
+                   number,
+                   (size_t) segment_stat.st_size - (size_t) segment_size);
+        }
+    }
+
+    segment_number = number;
+}
+
+/*
+ * Loads the entries of the FILE_ARCHIVE_PENDING, which aren't in a block yet, into
+ * the block_entries and rewrites the file if it also has sealed or damaged entries.
+ */
+static void recover_pending_entries(const uint_fast64_t sealed_sequence)
+{
+    if ((pending_fd = open(FILE_ARCHIVE_PENDING, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_ARCHIVE_PENDING);
+
+    appended_sequence = sealed_sequence;
+
+    size_t pending_size;
+    unsigned char *pending = read_file(FILE_ARCHIVE_PENDING, &pending_size);
+
+    if (!pending)
+        die("%s: %s: failed to read %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_ARCHIVE_PENDING);
+
+    size_t offset = 0;
+    EntryHeader entry_header;
+
+    for (size_t entry_size; (entry_size = read_entry(pending + offset, pending_size - offset, &entry_header)); offset += entry_size)
+    {
+        if (entry_header.sequence <= sealed_sequence)
+            continue;
+
+        add_entries(&block_entries, pending + offset, entry_size);
+        ++block_entries.entries_count;
+
+        appended_sequence = entry_header.sequence;
+    }
+
+    if (block_entries.size != pending_size)
+    {
+        if (ftruncate(pending_fd, 0) ||
+            (block_entries.size && write_file(pending_fd, block_entries.data, block_entries.size, -1, 1)))
+            die("%s: %s: failed to rewrite %s",
+                __BASE_FILE__,
+                __func__,
+                FILE_ARCHIVE_PENDING);
+
+        if (offset != pending_size)
+            report("Archive pending tail of %zu bytes is damaged and was discarded",
+                   pending_size - offset);
+    }
+
+    free(pending);
+}
+
+static void add_entries(Entries *entries, const void *data, const size_t data_size)
+{
+    const size_t new_size = entries->size + data_size;
+
+    if (new_size > entries->capacity)
+    {
+        size_t new_capacity = entries->capacity ? entries->capacity : ARCHIVE_BLOCK_SIZE;
+
+        while (new_capacity < new_size)
+            new_capacity *= 2;
+
+        if (!(entries->data = realloc(entries->data, new_capacity)))
+            die("%s: %s: failed to reallocate memory for entries->data",
+                __BASE_FILE__,
+                __func__);
+
+        entries->capacity = new_capacity;
+    }
+
+    memcpy(entries->data + entries->size, data, data_size);
+    entries->size = new_size;
+}
+
+/*
+ * Copies the header of the entry at the start of data into entry_header.
+ * Returns the entry size, or 0 if data doesn't start with a whole valid entry.
+ */
+static size_t read_entry(const unsigned char *data, const size_t data_size, EntryHeader *entry_header)
+{
+    if (data_size < sizeof *entry_header)
+        return 0;
+
+    memcpy(entry_header, data, sizeof *entry_header);
+
+    const size_t entry_size = sizeof *entry_header + entry_header->username_size + entry_header->text_size;
+
+    if (entry_size > data_size ||
+        entry_header->username_size > MAX_USERNAME_SIZE ||
+        get_entry_checksum(entry_header, data + sizeof *entry_header) != entry_header->checksum)
+        return 0;
+
+    return entry_size;
+}
+
+static int is_matching_entry(const EntryHeader *entry_header, const ArchiveQuery *archive_query)
+{
+    return (archive_query->all_chat_ids || entry_header->chat_id == archive_query->chat_id) &&
+           entry_header->closed >= archive_query->from &&
+           entry_header->closed <= archive_query->to;
+}
+
+static void print_entry(const EntryHeader *entry_header, const unsigned char *entry_data)
+{
+    char chat_id[MAX_CHAT_ID_SIZE + 1];
+    snprintf(chat_id, sizeof chat_id, "%" PRId64, entry_header->chat_id);
+
+    char username[MAX_USERNAME_SIZE + 1];
+    memcpy(username, entry_data + sizeof *entry_header, entry_header->username_size);
+    username[entry_header->username_size] = 0;
+
+    char *text = malloc(entry_header->text_size + 1);
+
+    if (!text)
+        die("%s: %s: failed to allocate memory for text",
+            __BASE_FILE__,
+            __func__);
+
+    memcpy(text, entry_data + sizeof *entry_header + entry_header->username_size, entry_header->text_size);
+    text[entry_header->text_size] = 0;
+
+    const char *closure = entry_header->closure >= 1 && entry_header->closure <= PROBLEM_CLOSURES_COUNT ?
+                          closure_names[entry_header->closure - 1] :
+                          "unknown";
+
+    cJSON *problem = cJSON_CreateObject();
+
+    cJSON_AddStringToObject(problem, "chat_id", chat_id);
+    cJSON_AddStringToObject(problem, "username", username);
+    cJSON_AddStringToObject(problem, "text", text);
+    cJSON_AddStringToObject(problem, "closure", closure);
+    cJSON_AddNumberToObject(problem, "created", entry_header->created);
+    cJSON_AddNumberToObject(problem, "approved_at", entry_header->approved_at);
+    cJSON_AddNumberToObject(problem, "closed", entry_header->closed);
+
+    char *problem_string = cJSON_PrintUnformatted(problem);
+
+    if (!problem_string)
+        die("%s: %s: failed to print problem",
+            __BASE_FILE__,
+            __func__);
+
+    puts(problem_string);
+
+    cJSON_free(problem_string);
+    cJSON_Delete(problem);
+    free(text);
+}
+
+/*
+ * Prints the matching entries of data with sequence numbers from min_sequence on
+ * and returns their number. Stops at the first damaged entry.
+ */
+static size_t query_entries(const unsigned char *data,
+                            const size_t data_size,
+                            const uint_fast64_t min_sequence,
+                            const ArchiveQuery *archive_query)
+{
+    size_t problems_count = 0;
+    EntryHeader entry_header;
+
+    for (size_t offset = 0, entry_size; (entry_size = read_entry(data + offset, data_size - offset, &entry_header)); offset += entry_size)
+    {
+        if (entry_header.sequence < min_sequence || !is_matching_entry(&entry_header, archive_query))
+            continue;
+
+        print_entry(&entry_header, data + offset);
+        ++problems_count;
+    }
+
+    return problems_count;
+}
+
+static int is_matching_block(const IndexEntry *index_entry, const ArchiveQuery *archive_query)
+{
+    if (index_entry->max_closed < archive_query->from || index_entry->min_closed > archive_query->to)
+        return 0;
+
+    if (archive_query->all_chat_ids)
+        return 1;
+
+    return archive_query->chat_id >= index_entry->min_chat_id &&
+           archive_query->chat_id <= index_entry->max_chat_id &&
+           is_in_filter(index_entry->chat_ids_filter, archive_query->chat_id);
+}
+
+static void add_to_filter(uint8_t *filter, const int_fast64_t chat_id)
+{
+    uint64_t hash = hash_chat_id(chat_id);
+
+    for (int i = 0; i < ARCHIVE_FILTER_HASHES; ++i, hash >>= 16)
+    {
+        const size_t bit = hash % (ARCHIVE_FILTER_SIZE * 8);
+        filter[bit / 8] |= 1 << bit % 8;
+    }
+}
+
+static int is_in_filter(const uint8_t *filter, const int_fast64_t chat_id)
+{
+    uint64_t hash = hash_chat_id(chat_id);
+
+    for (int i = 0; i < ARCHIVE_FILTER_HASHES; ++i, hash >>= 16)
+    {
+        const size_t bit = hash % (ARCHIVE_FILTER_SIZE * 8);
+
+        if (!(filter[bit / 8] & 1 << bit % 8))
+            return 0;
+    }
+
+    return 1;
+}
+
+static uint32_t get_entry_checksum(const EntryHeader *entry_header, const void *strings)
+{
+    return update_crc32(update_crc32(0, entry_header, offsetof(EntryHeader, checksum)),
+                        strings,
+                        entry_header->username_size + entry_header->text_size);
+}
+
+/*
+ * Reads the valid entries of a segment index into index_entries, which must be freed.
+ * is_damaged is set if the index continues with something else after them.
+ * Returns the number of the valid entries, dies if the index has an unknown format.
+ */
+static size_t read_index(const uint32_t number, IndexEntry **index_entries, int *is_damaged)
+{
+    char index_file[MAX_ARCHIVE_FILE_SIZE];
+    get_segment_file(index_file, number, "index");
+
+    size_t index_size;
+    unsigned char *index = read_file(index_file, &index_size);
+
+    if (!index)
+        die("%s: %s: failed to read %s",
+            __BASE_FILE__,
+            __func__,
+            index_file);
+
+    IndexHeader index_header;
+
+    if (index_size < sizeof index_header ||
+        (memcpy(&index_header, index, sizeof index_header),
+         index_header.magic != ARCHIVE_INDEX_MAGIC || index_header.version != ARCHIVE_INDEX_VERSION))
+        die("%s: %s: %s has unknown format",
+            __BASE_FILE__,
+            __func__,
+            index_file);
+
+    const size_t max_entries_count = (index_size - sizeof index_header) / sizeof **index_entries;
+
+    if (!(*index_entries = malloc(max_entries_count * sizeof **index_entries + 1)))
+        die("%s: %s: failed to allocate memory for index_entries",
+            __BASE_FILE__,
+            __func__);
+
+    memcpy(*index_entries, index + sizeof index_header, max_entries_count * sizeof **index_entries);
+    free(index);
+
+    size_t entries_count = 0;
+    uint64_t offset = 0;
+
+    // Blocks follow each other, so an entry pointing elsewhere is as damaged as a torn one.
+    while (entries_count < max_entries_count)
+    {
+        const IndexEntry *index_entry = &(*index_entries)[entries_count];
+
+        if (index_entry->checksum != update_crc32(0, index_entry, offsetof(IndexEntry, checksum)) ||
+            index_entry->offset != offset)
+            break;
+
+        offset += sizeof(BlockHeader) + index_entry->compressed_size;
+        ++entries_count;
+    }
+
+    *is_damaged = index_size != sizeof index_header + entries_count * sizeof **index_entries;
+    return entries_count;
+}
+
+/*
+ * Finds the numbers of the segments, which have an index, into numbers, which must be freed.
+ * Returns the number of the segments, the numbers are in the ascending order.
+ */
+static size_t find_segments(uint32_t **numbers)
+{
+    DIR *archive_dir = opendir(DIR_ARCHIVE);
+
+    if (!archive_dir)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            DIR_ARCHIVE);
+
+    size_t segments_count = 0;
+    size_t capacity = 16;
+
+    if (!(*numbers = malloc(capacity * sizeof **numbers)))
+        die("%s: %s: failed to allocate memory for numbers",
+            __BASE_FILE__,
+            __func__);
+
+    for (const struct dirent *entry; (entry = readdir(archive_dir));)
+    {
+        uint32_t number;
+        int name_size = 0;
+
+        if (sscanf(entry->d_name, "%8" SCNu32 ".index%n", &number, &name_size) != 1 ||
+            name_size != 14 ||
+            entry->d_name[name_size])
+            continue;
+
+        if (segments_count == capacity &&
+            !(*numbers = realloc(*numbers, (capacity *= 2) * sizeof **numbers)))
+            die("%s: %s: failed to reallocate memory for numbers",
+                __BASE_FILE__,
+                __func__);
+
+        (*numbers)[segments_count++] = number;
+    }
+
+    closedir(archive_dir);
+
+    qsort(*numbers, segments_count, sizeof **numbers, compare_numbers);
+    return segments_count;
+}
+
+static int compare_numbers(const void *number, const void *other_number)
+{
+    const uint32_t a = *(const uint32_t *) number;
+    const uint32_t b = *(const uint32_t *) other_number;
+
+    return (a > b) - (a < b);
+}
+
+static void get_segment_file(char *file, const uint32_t number, const char *extension)
+{
+    snprintf(file, MAX_ARCHIVE_FILE_SIZE, DIR_ARCHIVE "%08" PRIu32 ".%s", number, extension);
+}
+
+/*
+ * Returns the whole file, which must be freed, or NULL on failure.
+ * A file, which doesn't exist, is read as empty.
+ */
+static unsigned char *read_file(const char *file, size_t *file_size)
+{
+    *file_size = 0;
+
+    const int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return errno == ENOENT ? malloc(1) : NULL;
+
+    struct stat file_stat;
+    unsigned char *data = NULL;
+
+    if (!fstat(fd, &file_stat) && (data = malloc(file_stat.st_size + 1)))
+    {
+        ssize_t read_size;
+
+        while (*file_size < (size_t) file_stat.st_size &&
+               (read_size = pread(fd, data + *file_size, file_stat.st_size - *file_size, *file_size)) > 0)
+            *file_size += read_size;
+    }
+
+    close(fd);
+    return data;
+}
@@ -26,10 +26,12 @@
  ******************************************************************************/
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cjson/cJSON.h>
@@ -38,37 +40,95 @@
 #include "log.h"
 #include "requests.h"
 #include "data.h"
+#include "workers.h"
 #include "bot.h"
 
+/*
+ * Problem listings sent by the commands.
+ */
+typedef enum
+{
+    FEED_APPROVED,               // /helpsomeone.
+    FEED_APPROVED_WITH_CHAT_IDS, // /helpsomeone of the root.
+    FEED_PENDING,                // /pendinglist.
+    FEED_BANNED,                 // /banlist.
+    FEEDS_COUNT
+}
+Feed;
+
+/*
+ * A feed rendered for sending, with every problem escaped by escape_message.
+ */
+typedef struct
+{
+    atomic_size_t references;
+    uint_fast64_t generation; // Of the problem list, see get_problems_generation.
+    size_t messages_count;
+    char **messages;
+}
+RenderedFeed;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    RenderedFeed *rendered_feed; // NULL until the feed is sent for the first time.
+}
+FeedCache;
+
 static void *delete_expired_problems(void *_);
 static void *update_problems_usernames(void *_);
 static void handle_updates(cJSON *updates, const int maintenance_mode);
 static void *handle_message_in_maintenance_mode(void *cjson_message);
 static void *handle_message_in_default_mode(void *cjson_message);
-static void handle_problem(const int_fast64_t chat_id,
+static void handle_problem(UserRecord *user_record,
                            const int root_access,
                            const char *username,
                            const char *problem);
-static void handle_command(const int_fast64_t chat_id,
+static void handle_command(UserRecord *user_record,
                            const int root_access,
                            const char *username,
                            const char *command);
-static void handle_helpsomeone_command(const int_fast64_t chat_id, const int root_access);
-static void handle_helpme_command(const int_fast64_t chat_id, const char *username);
-static void handle_closeproblem_command(const int_fast64_t chat_id);
-static void handle_start_command(const int_fast64_t chat_id, const int root_access, const char *username);
-static void handle_pendinglist_command(const int_fast64_t chat_id, const int root_access);
+static void handle_helpsomeone_command(const UserRecord *user_record, const int root_access);
+static void handle_helpme_command(UserRecord *user_record, const char *username);
+static void handle_closeproblem_command(UserRecord *user_record);
+static void handle_start_command(const UserRecord *user_record, const int root_access, const char *username);
+static void handle_pendinglist_command(const UserRecord *user_record, const int root_access);
 static void handle_confirm_command(const int_fast64_t chat_id, const int root_access, const char *arg);
 static void handle_decline_command(const int_fast64_t chat_id, const int root_access, const char *arg);
-static void handle_banlist_command(const int_fast64_t chat_id, const int root_access);
+static void handle_banlist_command(const UserRecord *user_record, const int root_access);
 static void handle_ban_command(const int_fast64_t chat_id, const int root_access, const char *arg);
 static void handle_unban_command(const int_fast64_t chat_id, const int root_access, const char *arg);
+static void send_feed(const int_fast64_t chat_id, const Feed feed, const char *keyboard, const char *no_problems_message);
+static RenderedFeed *acquire_feed(const Feed feed);
+static void release_feed(RenderedFeed *rendered_feed);
+static RenderedFeed *render_approved_problems(const ApprovedProblems *approved_problems, const int include_chat_ids);
+static RenderedFeed *render_problems(const int pending_problems, const int banned_accounts, const int include_chat_ids);
+static void add_rendered_problem(RenderedFeed *rendered_feed, size_t *messages_capacity, const char *problem);
+static void report_feed_stats(void);
+static const char *get_current_keyboard(const int_fast64_t chat_id);
 
 static volatile int delete_expired_problems_thread_running = 0;
 static volatile int update_problems_usernames_thread_running = 0;
 
 static int_fast32_t last_update_id = 0;
 
+/*
+ * Every feed keeps its last rendering, which is sent again as long as the generation
+ * of its problem list stays the same. A replaced rendering is freed by its last sender.
+ */
+static FeedCache feed_caches[FEEDS_COUNT] =
+{
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL }
+};
+
+static pthread_mutex_t feed_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t feed_stats_hits;
+static size_t feed_stats_misses;
+static time_t feed_stats_start_time;
+
 void start_bot(const int maintenance_mode)
 {
     for (;;)
@@ -122,35 +182,57 @@ void start_bot(const int maintenance_mode)
     }
 }
 
+void start_bot_worker(void)
+{
+    for (;;)
+    {
+        pthread_t handle_message_thread;
+
+        if (pthread_create(&handle_message_thread,
+                           NULL,
+                           handle_message_in_default_mode,
+                           receive_message()))
+            die("%s: %s: failed to create handle_message_thread",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_detach(handle_message_thread);
+    }
+}
+
 static void *delete_expired_problems(void *_)
 {
     (void) _;
 
-    cJSON *chat_ids = get_expired_problems_chat_ids();
-    const int chat_ids_size = cJSON_GetArraySize(chat_ids);
-
-    for (int i = 0; i < chat_ids_size; ++i)
+    for (;;)
     {
-        const int_fast64_t chat_id = strtoll(cJSON_GetStringValue(cJSON_GetArrayItem(chat_ids, i)), NULL, 10);
+        wait_problems_expiry();
 
-        delete_problem(chat_id);
-        set_state(chat_id, "problem_pending_state", 1);
+        cJSON *chat_ids = get_expired_problems_chat_ids();
+        const int chat_ids_size = cJSON_GetArraySize(chat_ids);
 
-        report("User %" PRIdFAST64
-               " problem expired and was closed",
-               chat_id);
+        for (int i = 0; i < chat_ids_size; ++i)
+        {
+            const int_fast64_t chat_id = strtoll(cJSON_GetStringValue(cJSON_GetArrayItem(chat_ids, i)), NULL, 10);
 
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_ATTENTION " Время вашей проблемы истекло\n\n"
-                                   "Если вам всё ещё нужна помощь, пожалуйста, опишите вашу проблему ещё раз!",
-                                   get_current_keyboard(chat_id));
-    }
+            begin_transaction(chat_id);
+            delete_problem(chat_id, EXPIRED_PROBLEM);
+            set_state(chat_id, PROBLEM_PENDING_STATE, 1);
+            commit_transaction();
+
+            report("User %" PRIdFAST64
+                   " problem expired and was closed",
+                   chat_id);
 
-    cJSON_Delete(chat_ids);
+            send_message_with_keyboard(chat_id,
+                                       EMOJI_ATTENTION " Время вашей проблемы истекло\n\n"
+                                       "Если вам всё ещё нужна помощь, пожалуйста, опишите вашу проблему ещё раз!",
+                                       get_current_keyboard(chat_id));
+        }
 
-    sleep(MAX_DELETE_EXPIRED_PROBLEMS_INTERVAL);
+        cJSON_Delete(chat_ids);
+    }
 
-    delete_expired_problems_thread_running = 0;
     return NULL;
 }
 
@@ -158,24 +240,12 @@ static void *update_problems_usernames(void *_)
 {
     (void) _;
 
-    cJSON *problems = get_problems(1, 0, 0);
-    const int problems_size = cJSON_GetArraySize(problems);
+    const ApprovedProblems *problems = acquire_approved_problems();
 
-    for (int i = 0; i < problems_size; ++i)
+    for (size_t i = 0; i < problems->problems_count; ++i)
     {
-        int_fast64_t chat_id;
-        char username[MAX_USERNAME_SIZE + 1];
-        char problem[MAX_PROBLEM_SIZE + 1];
-
-        if (sscanf(cJSON_GetStringValue(cJSON_GetArrayItem(problems, i)),
-                   "(%" SCNdFAST64
-                   ") @%[^:]: %[^\\0]",
-                   &chat_id,
-                   username,
-                   problem) != 3)
-            die("%s: %s: failed to parse problem",
-                __BASE_FILE__,
-                __func__);
+        const int_fast64_t chat_id = problems->chat_ids[i];
+        const char *username = problems->usernames[i];
 
         cJSON *chat = get_chat(chat_id);
 
@@ -186,8 +256,10 @@ static void *update_problems_usernames(void *_)
 
         if (!current_username)
         {
-            delete_problem(chat_id);
-            set_state(chat_id, "problem_pending_state", 1);
+            begin_transaction(chat_id);
+            delete_problem(chat_id, ORPHANED_PROBLEM);
+            set_state(chat_id, PROBLEM_PENDING_STATE, 1);
+            commit_transaction();
 
             report("User %" PRIdFAST64
                    " removed username '%s' and problem was closed",
@@ -200,14 +272,7 @@ static void *update_problems_usernames(void *_)
         }
         else if (strcmp(username, current_username))
         {
-            char username_with_problem[MAX_USERNAME_SIZE + MAX_PROBLEM_SIZE + 4];
-            snprintf(username_with_problem,
-                     sizeof username_with_problem,
-                     "@%s: %s",
-                     current_username,
-                     problem);
-
-            modify_problem(chat_id, username_with_problem);
+            set_problem_username(chat_id, current_username);
 
             report("User %" PRIdFAST64
                    " changed username from '%s'"
@@ -220,7 +285,7 @@ static void *update_problems_usernames(void *_)
         cJSON_Delete(chat);
     }
 
-    cJSON_Delete(problems);
+    release_approved_problems(problems);
 
     sleep(MAX_UPDATE_PROBLEMS_USERNAMES_INTERVAL);
 
@@ -240,7 +305,9 @@ static void handle_updates(cJSON *updates, const int maintenance_mode)
 
         const cJSON *message = cJSON_GetObjectItem(update, "message");
 
-        if (message)
+        if (message && !maintenance_mode && get_workers_count())
+            dispatch_message(cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(message, "chat"), "id")), message);
+        else if (message)
         {
             pthread_t handle_message_thread;
 
@@ -288,17 +355,24 @@ static void *handle_message_in_default_mode(void *cjson_message)
 
     const int root_access = (chat_id == ROOT_CHAT_ID);
 
-    if (!has_user(chat_id))
+    UserRecord user_record;
+
+    if (!get_user_record(chat_id, &user_record))
     {
         create_user(chat_id);
+        user_record.states = PROBLEM_PENDING_STATE;
+
         report("New user %" PRIdFAST64
                " appeared",
                chat_id);
     }
-    else if (get_state(chat_id, "account_ban_state"))
+    else if (user_record.states & ACCOUNT_BAN_STATE)
     {
         if (root_access)
-            set_state(ROOT_CHAT_ID, "account_ban_state", 0);
+        {
+            set_state(ROOT_CHAT_ID, ACCOUNT_BAN_STATE, 0);
+            user_record.states &= ~ACCOUNT_BAN_STATE;
+        }
         else
         {
             send_message_with_keyboard(chat_id,
@@ -311,13 +385,13 @@ static void *handle_message_in_default_mode(void *cjson_message)
     const cJSON *username = cJSON_GetObjectItem(chat, "username");
     const cJSON *text = cJSON_GetObjectItem(message, "text");
 
-    if (get_state(chat_id, "problem_description_state"))
-        handle_problem(chat_id,
+    if (user_record.states & PROBLEM_DESCRIPTION_STATE)
+        handle_problem(&user_record,
                        root_access,
                        username ? username->valuestring : NULL,
                        text ? text->valuestring : NULL);
     else
-        handle_command(chat_id,
+        handle_command(&user_record,
                        root_access,
                        username ? username->valuestring : NULL,
                        text ? text->valuestring : NULL);
@@ -327,11 +401,13 @@ exit:
     return NULL;
 }
 
-static void handle_problem(const int_fast64_t chat_id,
+static void handle_problem(UserRecord *user_record,
                            const int root_access,
                            const char *username,
                            const char *problem)
 {
+    const int_fast64_t chat_id = user_record->chat_id;
+
     if (!problem)
     {
         send_message_with_keyboard(chat_id,
@@ -342,20 +418,24 @@ static void handle_problem(const int_fast64_t chat_id,
 
     if (!strcmp(problem, COMMAND_CANCEL))
     {
-        set_state(chat_id, "problem_description_state", 0);
+        set_state(chat_id, PROBLEM_DESCRIPTION_STATE, 0);
+        user_record->states &= ~PROBLEM_DESCRIPTION_STATE;
+
         send_message_with_keyboard(chat_id,
                                    EMOJI_OK " Описание проблемы отменено",
-                                   get_current_keyboard(chat_id));
+                                   get_keyboard(user_record));
         return;
     }
 
     if (!username)
     {
-        set_state(chat_id, "problem_description_state", 0);
+        set_state(chat_id, PROBLEM_DESCRIPTION_STATE, 0);
+        user_record->states &= ~PROBLEM_DESCRIPTION_STATE;
+
         send_message_with_keyboard(chat_id,
                                    EMOJI_FAILED " Извините, для этой функции вам нужно "
                                    "создать имя пользователя в настройках Telegram",
-                                   get_current_keyboard(chat_id));
+                                   get_keyboard(user_record));
         return;
     }
 
@@ -367,15 +447,22 @@ static void handle_problem(const int_fast64_t chat_id,
         return;
     }
 
-    char username_with_problem[MAX_USERNAME_SIZE + MAX_PROBLEM_SIZE + 4];
-    snprintf(username_with_problem,
-             sizeof username_with_problem,
-             "@%s: %s",
-             username,
-             problem);
+    begin_transaction(chat_id);
+
+    create_problem(chat_id, username, problem, !root_access);
+    set_state(chat_id, PROBLEM_DESCRIPTION_STATE, 0);
+
+    // Problems of the root are published without a check.
+    if (root_access)
+        set_state(ROOT_CHAT_ID, PROBLEM_PENDING_STATE, 0);
+
+    commit_transaction();
 
-    create_problem(chat_id, username_with_problem, !root_access);
-    set_state(chat_id, "problem_description_state", 0);
+    user_record->has_problem = 1;
+    user_record->states &= ~PROBLEM_DESCRIPTION_STATE;
+
+    if (root_access)
+        user_record->states &= ~PROBLEM_PENDING_STATE;
 
     report("User %" PRIdFAST64
            " with username '%s'"
@@ -385,30 +472,29 @@ static void handle_problem(const int_fast64_t chat_id,
            problem);
 
     if (root_access)
-    {
-        set_state(ROOT_CHAT_ID, "problem_pending_state", 0);
         send_message_with_keyboard(ROOT_CHAT_ID,
                                    EMOJI_OK " Ваша проблема сохранена\n\n"
                                    "Надеюсь вам помогут как можно быстрее!",
-                                   get_current_keyboard(ROOT_CHAT_ID));
-    }
+                                   get_keyboard(user_record));
     else
     {
         send_message_with_keyboard(chat_id,
                                    EMOJI_INFO " Перед публикацией ваша проблема должна пройти проверку\n\n"
                                    "Пожалуйста, ожидайте!",
-                                   get_current_keyboard(chat_id));
+                                   get_keyboard(user_record));
         send_message_with_keyboard(ROOT_CHAT_ID,
                                    EMOJI_INFO " Появилась новая проблема для проверки",
                                    "");
     }
 }
 
-static void handle_command(const int_fast64_t chat_id,
+static void handle_command(UserRecord *user_record,
                            const int root_access,
                            const char *username,
                            const char *command)
 {
+    const int_fast64_t chat_id = user_record->chat_id;
+
     if (!command)
     {
         send_message_with_keyboard(chat_id,
@@ -418,15 +504,15 @@ static void handle_command(const int_fast64_t chat_id,
     }
 
     if (!strcmp(command, COMMAND_HELPSOMEONE))
-        handle_helpsomeone_command(chat_id, root_access);
+        handle_helpsomeone_command(user_record, root_access);
     else if (!strcmp(command, COMMAND_HELPME))
-        handle_helpme_command(chat_id, username);
+        handle_helpme_command(user_record, username);
     else if (!strcmp(command, COMMAND_CLOSEPROBLEM))
-        handle_closeproblem_command(chat_id);
+        handle_closeproblem_command(user_record);
     else if (!strcmp(command, COMMAND_START))
-        handle_start_command(chat_id, root_access, username);
+        handle_start_command(user_record, root_access, username);
     else if (!strcmp(command, COMMAND_PENDINGLIST))
-        handle_pendinglist_command(chat_id, root_access);
+        handle_pendinglist_command(user_record, root_access);
     else if (!strncmp(command, COMMAND_CONFIRM, MAX_COMMAND_CONFIRM_SIZE))
         handle_confirm_command(chat_id,
                                root_access,
@@ -436,7 +522,7 @@ static void handle_command(const int_fast64_t chat_id,
                                root_access,
                                command + MAX_COMMAND_DECLINE_SIZE);
     else if (!strcmp(command, COMMAND_BANLIST))
-        handle_banlist_command(chat_id, root_access);
+        handle_banlist_command(user_record, root_access);
     else if (!strncmp(command, COMMAND_BAN, MAX_COMMAND_BAN_SIZE))
         handle_ban_command(chat_id,
                            root_access,
@@ -451,27 +537,19 @@ static void handle_command(const int_fast64_t chat_id,
                                    "");
 }
 
-static void handle_helpsomeone_command(const int_fast64_t chat_id, const int root_access)
+static void handle_helpsomeone_command(const UserRecord *user_record, const int root_access)
 {
-    cJSON *problems = get_problems(root_access, 0, 0);
-    const int problems_size = cJSON_GetArraySize(problems);
-
-    if (!problems_size)
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_OK " Пока что никто не нуждается в помощи",
-                                   "");
-    else
-        for (int i = 0; i < problems_size; ++i)
-            send_message_with_keyboard(chat_id,
-                                       cJSON_GetStringValue(cJSON_GetArrayItem(problems, i)),
-                                       i + 1 != problems_size ? NOKEYBOARD : get_current_keyboard(chat_id));
-
-    cJSON_Delete(problems);
+    send_feed(user_record->chat_id,
+              root_access ? FEED_APPROVED_WITH_CHAT_IDS : FEED_APPROVED,
+              get_keyboard(user_record),
+              EMOJI_OK " Пока что никто не нуждается в помощи");
 }
 
-static void handle_helpme_command(const int_fast64_t chat_id, const char *username)
+static void handle_helpme_command(UserRecord *user_record, const char *username)
 {
-    if (has_problem(chat_id))
+    const int_fast64_t chat_id = user_record->chat_id;
+
+    if (user_record->has_problem)
         send_message_with_keyboard(chat_id,
                                    EMOJI_FAILED " Извините, вы уже описали вашу проблему",
                                    "");
@@ -484,30 +562,39 @@ static void handle_helpme_command(const int_fast64_t chat_id, const char *userna
                                        "");
         else
         {
-            set_state(chat_id, "problem_description_state", 1);
+            set_state(chat_id, PROBLEM_DESCRIPTION_STATE, 1);
+            user_record->states |= PROBLEM_DESCRIPTION_STATE;
+
             send_message_with_keyboard(chat_id,
                                        EMOJI_WRITE " Опишите вашу проблему",
-                                       get_current_keyboard(chat_id));
+                                       get_keyboard(user_record));
         }
     }
 }
 
-static void handle_closeproblem_command(const int_fast64_t chat_id)
+static void handle_closeproblem_command(UserRecord *user_record)
 {
-    if (!has_problem(chat_id))
+    const int_fast64_t chat_id = user_record->chat_id;
+
+    if (!user_record->has_problem)
         send_message_with_keyboard(chat_id,
                                    EMOJI_FAILED " Извините, у вас нет проблемы для закрытия",
                                    "");
     else
     {
-        if (get_state(chat_id, "problem_pending_state"))
+        if (user_record->states & PROBLEM_PENDING_STATE)
             send_message_with_keyboard(chat_id,
                                        EMOJI_FAILED " Извините, вы не можете закрыть проблему, которая находится на проверке",
                                        "");
         else
         {
-            delete_problem(chat_id);
-            set_state(chat_id, "problem_pending_state", 1);
+            begin_transaction(chat_id);
+            delete_problem(chat_id, CLOSED_PROBLEM);
+            set_state(chat_id, PROBLEM_PENDING_STATE, 1);
+            commit_transaction();
+
+            user_record->has_problem = 0;
+            user_record->states |= PROBLEM_PENDING_STATE;
 
             report("User %" PRIdFAST64
                    " closed problem",
@@ -516,13 +603,15 @@ static void handle_closeproblem_command(const int_fast64_t chat_id)
             send_message_with_keyboard(chat_id,
                                        EMOJI_OK " Ваша проблема закрыта\n\n"
                                        "Я очень рад, что ваша проблема решена!",
-                                       get_current_keyboard(chat_id));
+                                       get_keyboard(user_record));
         }
     }
 }
 
-static void handle_start_command(const int_fast64_t chat_id, const int root_access, const char *username)
+static void handle_start_command(const UserRecord *user_record, const int root_access, const char *username)
 {
+    const int_fast64_t chat_id = user_record->chat_id;
+
     const char *user_greeting = EMOJI_GREETING " Добро пожаловать";
     const char *bot_description = "Оказывайте поддержку и помощь другим, а также получайте решения собственных проблем!";
 
@@ -544,7 +633,7 @@ static void handle_start_command(const int_fast64_t chat_id, const int root_acce
 
     send_message_with_keyboard(chat_id,
                                start_message,
-                               get_current_keyboard(chat_id));
+                               get_keyboard(user_record));
 
     if (root_access)
         send_message_with_keyboard(ROOT_CHAT_ID,
@@ -566,28 +655,18 @@ static void handle_start_command(const int_fast64_t chat_id, const int root_acce
                                    "");
 }
 
-static void handle_pendinglist_command(const int_fast64_t chat_id, const int root_access)
+static void handle_pendinglist_command(const UserRecord *user_record, const int root_access)
 {
     if (!root_access)
-        send_message_with_keyboard(chat_id,
+        send_message_with_keyboard(user_record->chat_id,
                                    EMOJI_FAILED " Извините, у вас недостаточно прав",
                                    "");
     else
     {
-        cJSON *problems = get_problems(1, 1, 0);
-        const int problems_size = cJSON_GetArraySize(problems);
-
-        if (!problems_size)
-            send_message_with_keyboard(ROOT_CHAT_ID,
-                                       EMOJI_OK " Проблем для проверки не найдено",
-                                       "");
-        else
-            for (int i = 0; i < problems_size; ++i)
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           cJSON_GetStringValue(cJSON_GetArrayItem(problems, i)),
-                                           i + 1 != problems_size ? NOKEYBOARD : get_current_keyboard(ROOT_CHAT_ID));
-
-        cJSON_Delete(problems);
+        send_feed(ROOT_CHAT_ID,
+                  FEED_PENDING,
+                  get_keyboard(user_record),
+                  EMOJI_OK " Проблем для проверки не найдено");
     }
 }
 
@@ -610,26 +689,27 @@ static void handle_confirm_command(const int_fast64_t chat_id, const int root_ac
         {
             char *end;
             const int_fast64_t target_chat_id = strtoll(arg, &end, 10);
+            UserRecord target_user_record;
 
             if (*end || end == arg)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, вы указали некорректный идентификатор чата для одобрения проблемы",
                                            "");
-            else if (!has_user(target_chat_id))
+            else if (!get_user_record(target_chat_id, &target_user_record))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, такого пользователя не существует",
                                            "");
-            else if (!has_problem(target_chat_id))
+            else if (!target_user_record.has_problem)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, для одобрения проблемы у пользователя должна быть проблема",
                                            "");
-            else if (!get_state(target_chat_id, "problem_pending_state"))
+            else if (!(target_user_record.states & PROBLEM_PENDING_STATE))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, уже одобренная проблема не может быть одобрена",
                                            "");
             else
             {
-                set_state(target_chat_id, "problem_pending_state", 0);
+                set_state(target_chat_id, PROBLEM_PENDING_STATE, 0);
 
                 report("User %" PRIdFAST64
                        " confirmed user %" PRIdFAST64
@@ -668,26 +748,27 @@ static void handle_decline_command(const int_fast64_t chat_id, const int root_ac
         {
             char *end;
             const int_fast64_t target_chat_id = strtoll(arg, &end, 10);
+            UserRecord target_user_record;
 
             if (*end || end == arg)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, вы указали некорректный идентификатор чата для отклонения проблемы",
                                            "");
-            else if (!has_user(target_chat_id))
+            else if (!get_user_record(target_chat_id, &target_user_record))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, такого пользователя не существует",
                                            "");
-            else if (!has_problem(target_chat_id))
+            else if (!target_user_record.has_problem)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, для отклонения проблемы у пользователя должна быть проблема",
                                            "");
-            else if (!get_state(target_chat_id, "problem_pending_state"))
+            else if (!(target_user_record.states & PROBLEM_PENDING_STATE))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, уже одобренная проблема не может быть отклонена",
                                            "");
             else
             {
-                delete_problem(target_chat_id);
+                delete_problem(target_chat_id, DECLINED_PROBLEM);
 
                 report("User %" PRIdFAST64
                        " declined user %" PRIdFAST64
@@ -707,28 +788,18 @@ static void handle_decline_command(const int_fast64_t chat_id, const int root_ac
     }
 }
 
-static void handle_banlist_command(const int_fast64_t chat_id, const int root_access)
+static void handle_banlist_command(const UserRecord *user_record, const int root_access)
 {
     if (!root_access)
-        send_message_with_keyboard(chat_id,
+        send_message_with_keyboard(user_record->chat_id,
                                    EMOJI_FAILED " Извините, у вас недостаточно прав",
                                    "");
     else
     {
-        cJSON *problems = get_problems(1, 0, 1);
-        const int problems_size = cJSON_GetArraySize(problems);
-
-        if (!problems_size)
-            send_message_with_keyboard(ROOT_CHAT_ID,
-                                       EMOJI_OK " Проблем заблокированных пользователей не найдено",
-                                       "");
-        else
-            for (int i = 0; i < problems_size; ++i)
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           cJSON_GetStringValue(cJSON_GetArrayItem(problems, i)),
-                                           i + 1 != problems_size ? NOKEYBOARD : get_current_keyboard(ROOT_CHAT_ID));
-
-        cJSON_Delete(problems);
+        send_feed(ROOT_CHAT_ID,
+                  FEED_BANNED,
+                  get_keyboard(user_record),
+                  EMOJI_OK " Проблем заблокированных пользователей не найдено");
     }
 }
 
@@ -751,6 +822,7 @@ static void handle_ban_command(const int_fast64_t chat_id, const int root_access
         {
             char *end;
             const int_fast64_t target_chat_id = strtoll(arg, &end, 10);
+            UserRecord target_user_record;
 
             if (*end || end == arg)
                 send_message_with_keyboard(ROOT_CHAT_ID,
@@ -760,24 +832,27 @@ static void handle_ban_command(const int_fast64_t chat_id, const int root_access
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, вы не можете заблокировать сами себя",
                                            "");
-            else if (!has_user(target_chat_id))
+            else if (!get_user_record(target_chat_id, &target_user_record))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, такого пользователя не существует",
                                            "");
-            else if (get_state(target_chat_id, "account_ban_state"))
+            else if (target_user_record.states & ACCOUNT_BAN_STATE)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, пользователь уже заблокирован",
                                            "");
-            else if (!has_problem(target_chat_id))
+            else if (!target_user_record.has_problem)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, для блокировки пользователя у него должна быть проблема",
                                            "");
             else
             {
-                set_state(target_chat_id, "account_ban_state", 1);
+                begin_transaction(target_chat_id);
+                set_state(target_chat_id, ACCOUNT_BAN_STATE, 1);
 
-                if (get_state(target_chat_id, "problem_pending_state"))
-                    set_state(target_chat_id, "problem_pending_state", 0);
+                if (target_user_record.states & PROBLEM_PENDING_STATE)
+                    set_state(target_chat_id, PROBLEM_PENDING_STATE, 0);
+
+                commit_transaction();
 
                 report("User %" PRIdFAST64
                        " banned user %" PRIdFAST64,
@@ -814,25 +889,27 @@ static void handle_unban_command(const int_fast64_t chat_id, const int root_acce
         {
             char *end;
             const int_fast64_t target_chat_id = strtoll(arg, &end, 10);
+            UserRecord target_user_record;
 
             if (*end || end == arg)
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, вы указали некорректный идентификатор чата для разблокировки пользователя",
                                            "");
-            else if (!has_user(target_chat_id))
+            else if (!get_user_record(target_chat_id, &target_user_record))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, такого пользователя не существует",
                                            "");
-            else if (!get_state(target_chat_id, "account_ban_state"))
+            else if (!(target_user_record.states & ACCOUNT_BAN_STATE))
                 send_message_with_keyboard(ROOT_CHAT_ID,
                                            EMOJI_FAILED " Извините, пользователь не заблокирован",
                                            "");
             else
             {
-                delete_problem(target_chat_id);
-
-                set_state(target_chat_id, "problem_pending_state", 1);
-                set_state(target_chat_id, "account_ban_state", 0);
+                begin_transaction(target_chat_id);
+                delete_problem(target_chat_id, UNBANNED_PROBLEM);
+                set_state(target_chat_id, PROBLEM_PENDING_STATE, 1);
+                set_state(target_chat_id, ACCOUNT_BAN_STATE, 0);
+                commit_transaction();
 
                 report("User %" PRIdFAST64
                        " unbanned user %" PRIdFAST64,
@@ -849,3 +926,192 @@ static void handle_unban_command(const int_fast64_t chat_id, const int root_acce
         }
     }
 }
+
+/*
+ * Sends a feed to a chat, with the keyboard on the last problem.
+ */
+static void send_feed(const int_fast64_t chat_id, const Feed feed, const char *keyboard, const char *no_problems_message)
+{
+    RenderedFeed *rendered_feed = acquire_feed(feed);
+
+    if (!rendered_feed->messages_count)
+        send_message_with_keyboard(chat_id,
+                                   no_problems_message,
+                                   "");
+    else
+        for (size_t i = 0; i < rendered_feed->messages_count; ++i)
+            send_escaped_message_with_keyboard(chat_id,
+                                               rendered_feed->messages[i],
+                                               i + 1 != rendered_feed->messages_count ? NOKEYBOARD : keyboard);
+
+    release_feed(rendered_feed);
+}
+
+/*
+ * Returns a rendering of a feed, which is at least as new as its problem list
+ * at the moment of the call, and takes a reference to it.
+ */
+static RenderedFeed *acquire_feed(const Feed feed)
+{
+    FeedCache *cache = &feed_caches[feed];
+
+    const ApprovedProblems *approved_problems = NULL;
+    uint_fast64_t generation;
+
+    // The approved problems are rendered from their published version, which may lag behind the list.
+    // Worker processes have no published version and render them from the list like the others.
+    if ((feed == FEED_APPROVED || feed == FEED_APPROVED_WITH_CHAT_IDS) && !is_worker_process())
+    {
+        approved_problems = acquire_approved_problems();
+        generation = approved_problems->generation;
+    }
+    else
+        generation = get_problems_generation(feed == FEED_PENDING, feed == FEED_BANNED);
+
+    pthread_mutex_lock(&cache->mutex);
+
+    // A concurrent sender may have rendered a newer generation already, which is as good.
+    const int hit = cache->rendered_feed && cache->rendered_feed->generation >= generation;
+
+    if (!hit)
+    {
+        RenderedFeed *rendered_feed = approved_problems ?
+                                      render_approved_problems(approved_problems, feed == FEED_APPROVED_WITH_CHAT_IDS) :
+                                      render_problems(feed == FEED_PENDING, feed == FEED_BANNED, feed != FEED_APPROVED);
+
+        // The generation was taken before the rendering, so later changes only make it stale sooner.
+        rendered_feed->generation = generation;
+
+        if (cache->rendered_feed)
+            release_feed(cache->rendered_feed);
+
+        cache->rendered_feed = rendered_feed;
+    }
+
+    RenderedFeed *rendered_feed = cache->rendered_feed;
+    atomic_fetch_add(&rendered_feed->references, 1);
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (approved_problems)
+        release_approved_problems(approved_problems);
+
+    pthread_mutex_lock(&feed_stats_mutex);
+
+    if (hit)
+        ++feed_stats_hits;
+    else
+        ++feed_stats_misses;
+
+    if (!feed_stats_start_time)
+        feed_stats_start_time = time(NULL);
+    else if (difftime(time(NULL), feed_stats_start_time) >= MAX_FEED_STATS_INTERVAL)
+        report_feed_stats();
+
+    pthread_mutex_unlock(&feed_stats_mutex);
+
+    return rendered_feed;
+}
+
+static void release_feed(RenderedFeed *rendered_feed)
+{
+    if (atomic_fetch_sub(&rendered_feed->references, 1) != 1)
+        return;
+
+    for (size_t i = 0; i < rendered_feed->messages_count; ++i)
+        free(rendered_feed->messages[i]);
+
+    free(rendered_feed->messages);
+    free(rendered_feed);
+}
+
+static RenderedFeed *render_approved_problems(const ApprovedProblems *approved_problems, const int include_chat_ids)
+{
+    RenderedFeed *rendered_feed = calloc(1, sizeof *rendered_feed);
+
+    if (!rendered_feed)
+        die("%s: %s: failed to allocate memory for rendered_feed",
+            __BASE_FILE__,
+            __func__);
+
+    atomic_init(&rendered_feed->references, 1);
+
+    size_t messages_capacity = 0;
+    const char **problems = include_chat_ids ? approved_problems->problems_with_chat_ids : approved_problems->problems;
+
+    for (size_t i = 0; i < approved_problems->problems_count; ++i)
+        add_rendered_problem(rendered_feed, &messages_capacity, problems[i]);
+
+    return rendered_feed;
+}
+
+static RenderedFeed *render_problems(const int pending_problems, const int banned_accounts, const int include_chat_ids)
+{
+    RenderedFeed *rendered_feed = calloc(1, sizeof *rendered_feed);
+
+    if (!rendered_feed)
+        die("%s: %s: failed to allocate memory for rendered_feed",
+            __BASE_FILE__,
+            __func__);
+
+    atomic_init(&rendered_feed->references, 1);
+
+    size_t messages_capacity = 0;
+
+    ProblemsCursor cursor;
+    open_problems_cursor(&cursor, include_chat_ids, pending_problems, banned_accounts);
+
+    ProblemView problems[PROBLEMS_PAGE_SIZE];
+    size_t problems_count;
+
+    while ((problems_count = read_problems(&cursor, problems, PROBLEMS_PAGE_SIZE)))
+        for (size_t i = 0; i < problems_count; ++i)
+            add_rendered_problem(rendered_feed, &messages_capacity, problems[i].problem);
+
+    return rendered_feed;
+}
+
+static void add_rendered_problem(RenderedFeed *rendered_feed, size_t *messages_capacity, const char *problem)
+{
+    if (rendered_feed->messages_count == *messages_capacity)
+    {
+        *messages_capacity = *messages_capacity ? *messages_capacity * 2 : PROBLEMS_PAGE_SIZE;
+        rendered_feed->messages = realloc(rendered_feed->messages, *messages_capacity * sizeof *rendered_feed->messages);
+
+        if (!rendered_feed->messages)
+            die("%s: %s: failed to reallocate memory for rendered_feed->messages",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    rendered_feed->messages[rendered_feed->messages_count++] = escape_message(problem);
+}
+
+/*
+ * Must be called with the feed_stats_mutex held.
+ */
+static void report_feed_stats(void)
+{
+    if (feed_stats_hits + feed_stats_misses)
+        report("Feeds were sent %zu times: %zu from the cache, %zu rendered again (%.1f%% hit rate)",
+               feed_stats_hits + feed_stats_misses,
+               feed_stats_hits,
+               feed_stats_misses,
+               100.0 * feed_stats_hits / (feed_stats_hits + feed_stats_misses));
+
+    feed_stats_hits = 0;
+    feed_stats_misses = 0;
+    feed_stats_start_time = time(NULL);
+}
+
+/*
+ * Returns the keyboard for the current user states.
+ * Prefer get_keyboard on a user record, which is already at hand.
+ */
+static const char *get_current_keyboard(const int_fast64_t chat_id)
+{
+    UserRecord user_record;
+    get_user_record(chat_id, &user_record);
+
+    return get_keyboard(&user_record);
+}
@@ -0,0 +1,1110 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "checksum.h"
+#include "btree.h"
+
+#define BTREE_MAGIC   0x54424F48 // "HOBT".
+#define BTREE_VERSION 1
+
+#define CHECKPOINT_MAGIC 0x50434F48 // "HOCP".
+
+#define MIN_FRAMES_CAPACITY 1024
+
+#define LEAF_CELL_HEADER_SIZE   3 // uint8_t key size and uint16_t value size.
+#define BRANCH_CELL_HEADER_SIZE 5 // uint8_t key size and uint32_t child.
+
+typedef enum
+{
+    LEAF_NODE = 1,
+    BRANCH_NODE,
+    FREE_PAGE
+}
+PageType;
+
+/*
+ * Page 0 of the file. The checksum covers the header up to itself.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t root;
+    uint32_t pages_count;
+    uint32_t free_page;
+    uint32_t checksum;
+}
+BTreeHeader;
+
+/*
+ * Every other page is a node: a NodeHeader, the uint16_t offsets of its cells in the key order,
+ * then free space and the cells themselves, which are packed at the end of the page.
+ * A leaf cell is the key size, the value size, the key and the value.
+ * A branch cell is the key size, a child and the key, the child holding the keys less than
+ * the cell key and not less than the previous one, the right_child holds the rest.
+ * A free page keeps the next free page in its right_child.
+ */
+typedef struct
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t cells_count;
+    uint16_t cells_start;
+    uint16_t reserved_2;
+    uint32_t right_child;
+}
+NodeHeader;
+
+/*
+ * The checkpoint file is a CheckpointHeader followed by pages_count uint32_t page numbers
+ * and then by the pages themselves. The data checksum covers everything after the header,
+ * the header checksum covers the header up to itself.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t pages_count;
+    uint32_t data_checksum;
+    uint32_t header_checksum;
+}
+CheckpointHeader;
+
+/*
+ * A cell of a node being split.
+ */
+typedef struct
+{
+    const unsigned char *data;
+    size_t size;
+}
+Cell;
+
+static BTreeFrame *get_frame(BTree *tree, const uint32_t page_number);
+static unsigned char *read_page(BTree *tree, const uint32_t page_number);
+static unsigned char *write_page(BTree *tree, const uint32_t page_number);
+static BTreeFrame *add_frame(BTree *tree, const uint32_t page_number);
+static uint32_t allocate_page(BTree *tree, const PageType type);
+static void free_page(BTree *tree, const uint32_t page_number);
+static void trim_cache(BTree *tree);
+static void init_node(unsigned char *page, const PageType type, const uint32_t right_child);
+static uint16_t *get_slots(unsigned char *page);
+static unsigned char *get_cell(unsigned char *page, const size_t index);
+static size_t get_cell_size(const unsigned char *cell, const int leaf);
+static uint32_t get_child(unsigned char *page, const size_t index);
+static void set_child(unsigned char *page, const size_t index, const uint32_t child);
+static int compare_keys(const void *key, const size_t key_size, const void *other_key, const size_t other_key_size);
+static size_t find_cell(unsigned char *page, const void *key, const size_t key_size, const int upper);
+static int is_cell_key(unsigned char *page, const size_t index, const void *key, const size_t key_size);
+static int insert_cell(unsigned char *page, const size_t index, const unsigned char *cell, const size_t cell_size);
+static void remove_cell(unsigned char *page, const size_t index);
+static void fill_node(unsigned char *page, const PageType type, const Cell *cells, const size_t cells_count, const uint32_t right_child);
+static uint32_t split_node(BTree *tree,
+                           const uint32_t page_number,
+                           const size_t index,
+                           const unsigned char *cell,
+                           const size_t cell_size,
+                           unsigned char *separator,
+                           size_t *separator_size);
+static void apply_checkpoint(BTree *tree);
+static void write_header_page(const BTree *tree, unsigned char *page);
+static void read_all(const int fd, void *data, const size_t data_size, const off_t offset, const char *file);
+static void write_all(const int fd, const void *data, const size_t data_size, const off_t offset, const char *file);
+
+int open_btree(BTree *tree, const char *file, const char *checkpoint_file, const size_t max_cached_pages)
+{
+    memset(tree, 0, sizeof *tree);
+
+    tree->file = file;
+    tree->max_cached_pages = max_cached_pages;
+
+    if ((tree->fd = open(file, O_RDWR | O_CREAT, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            file);
+
+    if ((tree->checkpoint_fd = open(checkpoint_file, O_RDWR | O_CREAT, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            checkpoint_file);
+
+    apply_checkpoint(tree);
+
+    struct stat file_stat;
+
+    if (fstat(tree->fd, &file_stat))
+        die("%s: %s: failed to get %s size",
+            __BASE_FILE__,
+            __func__,
+            file);
+
+    if (!file_stat.st_size)
+    {
+        // Nothing is written until the first checkpoint, so an interrupted start leaves the file empty.
+        tree->pages_count = 1;
+        tree->root = allocate_page(tree, LEAF_NODE);
+        return 1;
+    }
+
+    BTreeHeader header;
+    read_all(tree->fd, &header, sizeof header, 0, file);
+
+    if (header.magic != BTREE_MAGIC ||
+        header.version != BTREE_VERSION ||
+        header.page_size != BTREE_PAGE_SIZE ||
+        header.checksum != update_crc32(0, &header, offsetof(BTreeHeader, checksum)) ||
+        !header.root ||
+        header.root >= header.pages_count ||
+        header.free_page >= header.pages_count)
+        die("%s: %s: %s is corrupted",
+            __BASE_FILE__,
+            __func__,
+            file);
+
+    tree->root = header.root;
+    tree->pages_count = header.pages_count;
+    tree->free_page = header.free_page;
+
+    return 0;
+}
+
+int get_btree_value(BTree *tree, const void *key, const size_t key_size, void *value, size_t *value_size)
+{
+    trim_cache(tree);
+
+    uint32_t page_number = tree->root;
+    unsigned char *page;
+
+    while (((NodeHeader *) (page = read_page(tree, page_number)))->type == BRANCH_NODE)
+        page_number = get_child(page, find_cell(page, key, key_size, 1));
+
+    const size_t index = find_cell(page, key, key_size, 0);
+
+    if (!is_cell_key(page, index, key, key_size))
+        return 0;
+
+    const unsigned char *cell = get_cell(page, index);
+    uint16_t cell_value_size;
+    memcpy(&cell_value_size, cell + 1, sizeof cell_value_size);
+
+    memcpy(value, cell + LEAF_CELL_HEADER_SIZE + cell[0], cell_value_size);
+    *value_size = cell_value_size;
+
+    return 1;
+}
+
+/*
+ * A full node is split in two halves by size, the lower half stays in its page.
+ * The parent gets the separator with a pointer to the lower half and its pointer
+ * to the node moves to the upper half, so a split can climb up to a new root.
+ */
+void put_btree_value(BTree *tree, const void *key, const size_t key_size, const void *value, const size_t value_size)
+{
+    if (!key_size || key_size > MAX_BTREE_KEY_SIZE || value_size > MAX_BTREE_VALUE_SIZE)
+        die("%s: %s: key or value is too big",
+            __BASE_FILE__,
+            __func__);
+
+    trim_cache(tree);
+
+    uint32_t pages[MAX_BTREE_DEPTH];
+    size_t indexes[MAX_BTREE_DEPTH];
+    int depth = 0;
+
+    uint32_t page_number = tree->root;
+    unsigned char *page;
+
+    while (((NodeHeader *) (page = read_page(tree, page_number)))->type == BRANCH_NODE)
+    {
+        if (depth == MAX_BTREE_DEPTH)
+            die("%s: %s: %s is too deep",
+                __BASE_FILE__,
+                __func__,
+                tree->file);
+
+        pages[depth] = page_number;
+        indexes[depth] = find_cell(page, key, key_size, 1);
+        page_number = get_child(page, indexes[depth++]);
+    }
+
+    page = write_page(tree, page_number);
+
+    size_t index = find_cell(page, key, key_size, 0);
+
+    if (is_cell_key(page, index, key, key_size))
+        remove_cell(page, index);
+
+    unsigned char cell[LEAF_CELL_HEADER_SIZE + MAX_BTREE_KEY_SIZE + MAX_BTREE_VALUE_SIZE];
+    const uint16_t cell_value_size = value_size;
+
+    cell[0] = key_size;
+    memcpy(cell + 1, &cell_value_size, sizeof cell_value_size);
+    memcpy(cell + LEAF_CELL_HEADER_SIZE, key, key_size);
+    memcpy(cell + LEAF_CELL_HEADER_SIZE + key_size, value, value_size);
+
+    if (insert_cell(page, index, cell, LEAF_CELL_HEADER_SIZE + key_size + value_size))
+        return;
+
+    unsigned char separator[MAX_BTREE_KEY_SIZE];
+    size_t separator_size;
+
+    uint32_t right_page_number = split_node(tree,
+                                            page_number,
+                                            index,
+                                            cell,
+                                            LEAF_CELL_HEADER_SIZE + key_size + value_size,
+                                            separator,
+                                            &separator_size);
+
+    unsigned char branch_cell[BRANCH_CELL_HEADER_SIZE + MAX_BTREE_KEY_SIZE];
+
+    while (depth)
+    {
+        const uint32_t parent_page_number = pages[--depth];
+        index = indexes[depth];
+
+        unsigned char *parent_page = write_page(tree, parent_page_number);
+        set_child(parent_page, index, right_page_number);
+
+        branch_cell[0] = separator_size;
+        memcpy(branch_cell + 1, &page_number, sizeof page_number);
+        memcpy(branch_cell + BRANCH_CELL_HEADER_SIZE, separator, separator_size);
+
+        if (insert_cell(parent_page, index, branch_cell, BRANCH_CELL_HEADER_SIZE + separator_size))
+            return;
+
+        right_page_number = split_node(tree,
+                                       parent_page_number,
+                                       index,
+                                       branch_cell,
+                                       BRANCH_CELL_HEADER_SIZE + separator_size,
+                                       separator,
+                                       &separator_size);
+        page_number = parent_page_number;
+    }
+
+    const uint32_t root = allocate_page(tree, BRANCH_NODE);
+    unsigned char *root_page = write_page(tree, root);
+
+    branch_cell[0] = separator_size;
+    memcpy(branch_cell + 1, &page_number, sizeof page_number);
+    memcpy(branch_cell + BRANCH_CELL_HEADER_SIZE, separator, separator_size);
+
+    insert_cell(root_page, 0, branch_cell, BRANCH_CELL_HEADER_SIZE + separator_size);
+    ((NodeHeader *) root_page)->right_child = right_page_number;
+
+    tree->root = root;
+}
+
+/*
+ * An emptied leaf is removed from its parent and a branch left with
+ * only its right_child is replaced by it, so no node is ever empty.
+ */
+int delete_btree_value(BTree *tree, const void *key, const size_t key_size)
+{
+    trim_cache(tree);
+
+    uint32_t pages[MAX_BTREE_DEPTH];
+    size_t indexes[MAX_BTREE_DEPTH];
+    int depth = 0;
+
+    uint32_t page_number = tree->root;
+    unsigned char *page;
+
+    while (((NodeHeader *) (page = read_page(tree, page_number)))->type == BRANCH_NODE)
+    {
+        if (depth == MAX_BTREE_DEPTH)
+            die("%s: %s: %s is too deep",
+                __BASE_FILE__,
+                __func__,
+                tree->file);
+
+        pages[depth] = page_number;
+        indexes[depth] = find_cell(page, key, key_size, 1);
+        page_number = get_child(page, indexes[depth++]);
+    }
+
+    const size_t index = find_cell(page, key, key_size, 0);
+
+    if (!is_cell_key(page, index, key, key_size))
+        return 0;
+
+    page = write_page(tree, page_number);
+    remove_cell(page, index);
+
+    if (((NodeHeader *) page)->cells_count || !depth)
+        return 1;
+
+    free_page(tree, page_number);
+
+    const uint32_t parent_page_number = pages[--depth];
+    unsigned char *parent_page = write_page(tree, parent_page_number);
+    NodeHeader *parent_node = (NodeHeader *) parent_page;
+
+    if (indexes[depth] < parent_node->cells_count)
+        remove_cell(parent_page, indexes[depth]);
+    else
+    {
+        parent_node->right_child = get_child(parent_page, parent_node->cells_count - 1);
+        remove_cell(parent_page, parent_node->cells_count - 1);
+    }
+
+    if (parent_node->cells_count)
+        return 1;
+
+    if (!depth)
+        tree->root = parent_node->right_child;
+    else
+        set_child(write_page(tree, pages[depth - 1]), indexes[depth - 1], parent_node->right_child);
+
+    free_page(tree, parent_page_number);
+    return 1;
+}
+
+void seek_btree_cursor(BTree *tree, BTreeCursor *cursor, const void *key, const size_t key_size)
+{
+    trim_cache(tree);
+
+    cursor->depth = 0;
+
+    uint32_t page_number = tree->root;
+
+    for (;;)
+    {
+        unsigned char *page = read_page(tree, page_number);
+        const int leaf = ((NodeHeader *) page)->type == LEAF_NODE;
+
+        if (cursor->depth == MAX_BTREE_DEPTH)
+            die("%s: %s: %s is too deep",
+                __BASE_FILE__,
+                __func__,
+                tree->file);
+
+        cursor->pages[cursor->depth] = page_number;
+        cursor->indexes[cursor->depth] = find_cell(page, key, key_size, !leaf);
+
+        if (leaf)
+            break;
+
+        page_number = get_child(page, cursor->indexes[cursor->depth++]);
+    }
+
+    ++cursor->depth;
+}
+
+/*
+ * The cursor keeps the path from the root to the current leaf, where every branch index
+ * points to the child being walked, since leaves aren't linked to each other.
+ */
+int next_btree_value(BTree *tree, BTreeCursor *cursor, void *key, size_t *key_size, void *value, size_t *value_size)
+{
+    trim_cache(tree);
+
+    while (cursor->depth)
+    {
+        const int level = cursor->depth - 1;
+        unsigned char *page = read_page(tree, cursor->pages[level]);
+        const NodeHeader *node = (const NodeHeader *) page;
+
+        if (node->type == LEAF_NODE && cursor->indexes[level] < node->cells_count)
+        {
+            const unsigned char *cell = get_cell(page, cursor->indexes[level]++);
+            uint16_t cell_value_size;
+            memcpy(&cell_value_size, cell + 1, sizeof cell_value_size);
+
+            memcpy(key, cell + LEAF_CELL_HEADER_SIZE, cell[0]);
+            memcpy(value, cell + LEAF_CELL_HEADER_SIZE + cell[0], cell_value_size);
+            *key_size = cell[0];
+            *value_size = cell_value_size;
+
+            return 1;
+        }
+
+        if (node->type == LEAF_NODE || cursor->indexes[level] > node->cells_count)
+        {
+            // The node is done, its parent goes on with the next child.
+            if (--cursor->depth)
+                ++cursor->indexes[cursor->depth - 1];
+
+            continue;
+        }
+
+        if (cursor->depth == MAX_BTREE_DEPTH)
+            die("%s: %s: %s is too deep",
+                __BASE_FILE__,
+                __func__,
+                tree->file);
+
+        cursor->pages[cursor->depth] = get_child(page, cursor->indexes[level]);
+        cursor->indexes[cursor->depth++] = 0;
+    }
+
+    return 0;
+}
+
+void checkpoint_btree(BTree *tree)
+{
+    BTreeCheckpoint checkpoint;
+
+    prepare_btree_checkpoint(tree, &checkpoint);
+    write_btree_checkpoint(tree, &checkpoint);
+    finish_btree_checkpoint(tree, &checkpoint);
+}
+
+void prepare_btree_checkpoint(BTree *tree, BTreeCheckpoint *checkpoint)
+{
+    // The header page is always written, every checkpoint changes at least one page.
+    checkpoint->pages_count = tree->dirty_pages_count + 1;
+    checkpoint->page_numbers = malloc(checkpoint->pages_count * sizeof *checkpoint->page_numbers);
+    checkpoint->pages = malloc((size_t) checkpoint->pages_count * BTREE_PAGE_SIZE);
+
+    if (!checkpoint->page_numbers || !checkpoint->pages)
+        die("%s: %s: failed to allocate memory for checkpoint",
+            __BASE_FILE__,
+            __func__);
+
+    checkpoint->page_numbers[0] = 0;
+    write_header_page(tree, checkpoint->pages);
+
+    for (size_t i = 0, j = 1; i < tree->frames_capacity; ++i)
+        if (tree->frames[i] && tree->frames[i]->dirty)
+        {
+            // A page changed again before finish_btree_checkpoint is marked 1 by write_page.
+            tree->frames[i]->dirty = 2;
+
+            checkpoint->page_numbers[j] = i;
+            memcpy(checkpoint->pages + j++ * BTREE_PAGE_SIZE, tree->frames[i]->data, BTREE_PAGE_SIZE);
+        }
+}
+
+void write_btree_checkpoint(const BTree *tree, const BTreeCheckpoint *checkpoint)
+{
+    const uint32_t pages_count = checkpoint->pages_count;
+
+    CheckpointHeader header =
+    {
+        .magic = CHECKPOINT_MAGIC,
+        .pages_count = pages_count,
+        .data_checksum = update_crc32(0, checkpoint->page_numbers, pages_count * sizeof *checkpoint->page_numbers)
+    };
+
+    off_t offset = sizeof header;
+
+    write_all(tree->checkpoint_fd, checkpoint->page_numbers, pages_count * sizeof *checkpoint->page_numbers, offset, "checkpoint file");
+    offset += pages_count * sizeof *checkpoint->page_numbers;
+
+    header.data_checksum = update_crc32(header.data_checksum, checkpoint->pages, (size_t) pages_count * BTREE_PAGE_SIZE);
+    write_all(tree->checkpoint_fd, checkpoint->pages, (size_t) pages_count * BTREE_PAGE_SIZE, offset, "checkpoint file");
+
+    header.header_checksum = update_crc32(0, &header, offsetof(CheckpointHeader, header_checksum));
+    write_all(tree->checkpoint_fd, &header, sizeof header, 0, "checkpoint file");
+
+    if (fsync(tree->checkpoint_fd))
+        die("%s: %s: failed to sync checkpoint file",
+            __BASE_FILE__,
+            __func__);
+
+    // The pages stay cached until finish_btree_checkpoint, so no reader meets one half written.
+    for (uint32_t i = 0; i < pages_count; ++i)
+        write_all(tree->fd,
+                  checkpoint->pages + (size_t) i * BTREE_PAGE_SIZE,
+                  BTREE_PAGE_SIZE,
+                  (off_t) checkpoint->page_numbers[i] * BTREE_PAGE_SIZE,
+                  tree->file);
+
+    if (fsync(tree->fd))
+        die("%s: %s: failed to sync %s",
+            __BASE_FILE__,
+            __func__,
+            tree->file);
+
+    // A checkpoint file left by a crash after this point is applied again, which changes nothing.
+    if (ftruncate(tree->checkpoint_fd, 0))
+        die("%s: %s: failed to truncate checkpoint file",
+            __BASE_FILE__,
+            __func__);
+}
+
+void finish_btree_checkpoint(BTree *tree, BTreeCheckpoint *checkpoint)
+{
+    for (uint32_t i = 1; i < checkpoint->pages_count; ++i)
+    {
+        BTreeFrame *frame = tree->frames[checkpoint->page_numbers[i]];
+
+        if (frame->dirty == 2)
+        {
+            frame->dirty = 0;
+            --tree->dirty_pages_count;
+        }
+    }
+
+    free(checkpoint->page_numbers);
+    free(checkpoint->pages);
+}
+
+static BTreeFrame *get_frame(BTree *tree, const uint32_t page_number)
+{
+    if (!page_number || page_number >= tree->pages_count)
+        die("%s: %s: %s is corrupted",
+            __BASE_FILE__,
+            __func__,
+            tree->file);
+
+    BTreeFrame *frame = page_number < tree->frames_capacity ? tree->frames[page_number] : NULL;
+
+    if (frame)
+        ++tree->page_hits;
+    else
+    {
+        frame = add_frame(tree, page_number);
+        read_all(tree->fd, frame->data, BTREE_PAGE_SIZE, (off_t) page_number * BTREE_PAGE_SIZE, tree->file);
+
+        ++tree->page_reads;
+    }
+
+    frame->referenced = 1;
+    return frame;
+}
+
+static unsigned char *read_page(BTree *tree, const uint32_t page_number)
+{
+    return get_frame(tree, page_number)->data;
+}
+
+static unsigned char *write_page(BTree *tree, const uint32_t page_number)
+{
+    BTreeFrame *frame = get_frame(tree, page_number);
+
+    if (!frame->dirty)
+        ++tree->dirty_pages_count;
+
+    frame->dirty = 1;
+
+    return frame->data;
+}
+
+/*
+ * Frames are allocated one by one, so their pages stay in place while the frames table grows.
+ */
+static BTreeFrame *add_frame(BTree *tree, const uint32_t page_number)
+{
+    if (page_number >= tree->frames_capacity)
+    {
+        size_t frames_capacity = tree->frames_capacity ? tree->frames_capacity : MIN_FRAMES_CAPACITY;
+
+        while (frames_capacity <= page_number)
+            frames_capacity *= 2;
+
+        tree->frames = realloc(tree->frames, frames_capacity * sizeof *tree->frames);
+
+        if (!tree->frames)
+            die("%s: %s: failed to reallocate memory for frames",
+                __BASE_FILE__,
+                __func__);
+
+        memset(tree->frames + tree->frames_capacity,
+               0,
+               (frames_capacity - tree->frames_capacity) * sizeof *tree->frames);
+
+        tree->frames_capacity = frames_capacity;
+    }
+
+    BTreeFrame *frame = malloc(sizeof *frame);
+
+    if (!frame)
+        die("%s: %s: failed to allocate memory for frame",
+            __BASE_FILE__,
+            __func__);
+
+    frame->page_number = page_number;
+    frame->dirty = 0;
+    frame->referenced = 1;
+
+    tree->frames[page_number] = frame;
+    ++tree->cached_pages_count;
+
+    return frame;
+}
+
+/*
+ * Takes a page from the list of freed pages or appends a new one.
+ */
+static uint32_t allocate_page(BTree *tree, const PageType type)
+{
+    uint32_t page_number = tree->free_page;
+    unsigned char *page;
+
+    if (page_number)
+    {
+        page = write_page(tree, page_number);
+        tree->free_page = ((NodeHeader *) page)->right_child;
+    }
+    else
+    {
+        page_number = tree->pages_count++;
+
+        BTreeFrame *frame = add_frame(tree, page_number);
+        frame->dirty = 1;
+        ++tree->dirty_pages_count;
+
+        page = frame->data;
+        memset(page, 0, BTREE_PAGE_SIZE);
+    }
+
+    init_node(page, type, 0);
+    return page_number;
+}
+
+static void free_page(BTree *tree, const uint32_t page_number)
+{
+    init_node(write_page(tree, page_number), FREE_PAGE, tree->free_page);
+    tree->free_page = page_number;
+}
+
+/*
+ * Evicts clean pages with the clock policy until at most max_cached_pages are cached.
+ * Called at the start of every operation, so no page an operation holds is evicted.
+ */
+static void trim_cache(BTree *tree)
+{
+    for (size_t steps = 0; tree->cached_pages_count > tree->max_cached_pages && steps < 2 * tree->frames_capacity; ++steps)
+    {
+        if (tree->clock_hand >= tree->frames_capacity)
+            tree->clock_hand = 0;
+
+        BTreeFrame *frame = tree->frames[tree->clock_hand];
+
+        if (frame && !frame->dirty)
+        {
+            if (frame->referenced)
+                frame->referenced = 0;
+            else
+            {
+                free(frame);
+                tree->frames[tree->clock_hand] = NULL;
+                --tree->cached_pages_count;
+            }
+        }
+
+        ++tree->clock_hand;
+    }
+}
+
+static void init_node(unsigned char *page, const PageType type, const uint32_t right_child)
+{
+    NodeHeader *node = (NodeHeader *) page;
+
+    memset(node, 0, sizeof *node);
+    node->type = type;
+    node->cells_start = BTREE_PAGE_SIZE;
+    node->right_child = right_child;
+}
+
+static uint16_t *get_slots(unsigned char *page)
+{
+    return (uint16_t *) (page + sizeof(NodeHeader));
+}
+
+static unsigned char *get_cell(unsigned char *page, const size_t index)
+{
+    return page + get_slots(page)[index];
+}
+
+static size_t get_cell_size(const unsigned char *cell, const int leaf)
+{
+    if (!leaf)
+        return BRANCH_CELL_HEADER_SIZE + cell[0];
+
+    uint16_t value_size;
+    memcpy(&value_size, cell + 1, sizeof value_size);
+
+    return LEAF_CELL_HEADER_SIZE + cell[0] + value_size;
+}
+
+/*
+ * Returns the child at a branch index, where the index past the last cell is the right_child.
+ */
+static uint32_t get_child(unsigned char *page, const size_t index)
+{
+    const NodeHeader *node = (const NodeHeader *) page;
+    uint32_t child = node->right_child;
+
+    if (index < node->cells_count)
+        memcpy(&child, get_cell(page, index) + 1, sizeof child);
+
+    return child;
+}
+
+static void set_child(unsigned char *page, const size_t index, const uint32_t child)
+{
+    NodeHeader *node = (NodeHeader *) page;
+
+    if (index < node->cells_count)
+        memcpy(get_cell(page, index) + 1, &child, sizeof child);
+    else
+        node->right_child = child;
+}
+
+/*
+ * Orders keys bytewise, a prefix goes first.
+ */
+static int compare_keys(const void *key, const size_t key_size, const void *other_key, const size_t other_key_size)
+{
+    const int result = memcmp(key, other_key, key_size < other_key_size ? key_size : other_key_size);
+
+    if (result || key_size == other_key_size)
+        return result;
+
+    return key_size < other_key_size ? -1 : 1;
+}
+
+/*
+ * Returns the index of the first cell with a key greater than key if upper is set,
+ * else of the first one with a key not less than key.
+ */
+static size_t find_cell(unsigned char *page, const void *key, const size_t key_size, const int upper)
+{
+    const int leaf = ((NodeHeader *) page)->type == LEAF_NODE;
+    size_t low = 0;
+    size_t high = ((NodeHeader *) page)->cells_count;
+
+    while (low < high)
+    {
+        const size_t middle = (low + high) / 2;
+        const unsigned char *cell = get_cell(page, middle);
+        const int result = compare_keys(cell + (leaf ? LEAF_CELL_HEADER_SIZE : BRANCH_CELL_HEADER_SIZE),
+                                        cell[0],
+                                        key,
+                                        key_size);
+
+        if (result < 0 || (upper && !result))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+static int is_cell_key(unsigned char *page, const size_t index, const void *key, const size_t key_size)
+{
+    if (index >= ((NodeHeader *) page)->cells_count)
+        return 0;
+
+    const unsigned char *cell = get_cell(page, index);
+
+    return !compare_keys(cell + LEAF_CELL_HEADER_SIZE, cell[0], key, key_size);
+}
+
+/*
+ * Returns 1 if the cell fits into the page, else 0 and the page doesn't change.
+ * Space left by removed cells is reclaimed by packing the cells again.
+ */
+static int insert_cell(unsigned char *page, const size_t index, const unsigned char *cell, const size_t cell_size)
+{
+    NodeHeader *node = (NodeHeader *) page;
+    uint16_t *slots = get_slots(page);
+    const size_t slots_end = sizeof *node + (node->cells_count + 1) * sizeof *slots;
+
+    if (node->cells_start < slots_end + cell_size)
+    {
+        const int leaf = node->type == LEAF_NODE;
+        size_t cells_size = cell_size;
+
+        for (size_t i = 0; i < node->cells_count; ++i)
+            cells_size += get_cell_size(get_cell(page, i), leaf);
+
+        if (slots_end + cells_size > BTREE_PAGE_SIZE)
+            return 0;
+
+        unsigned char packed_page[BTREE_PAGE_SIZE];
+        memcpy(packed_page, page, BTREE_PAGE_SIZE);
+
+        Cell cells[node->cells_count + 1];
+
+        for (size_t i = 0; i < node->cells_count; ++i)
+        {
+            cells[i].data = get_cell(packed_page, i);
+            cells[i].size = get_cell_size(cells[i].data, leaf);
+        }
+
+        fill_node(page, node->type, cells, node->cells_count, node->right_child);
+    }
+
+    node->cells_start -= cell_size;
+    memcpy(page + node->cells_start, cell, cell_size);
+
+    memmove(slots + index + 1, slots + index, (node->cells_count - index) * sizeof *slots);
+    slots[index] = node->cells_start;
+
+    ++node->cells_count;
+    return 1;
+}
+
+static void remove_cell(unsigned char *page, const size_t index)
+{
+    NodeHeader *node = (NodeHeader *) page;
+    uint16_t *slots = get_slots(page);
+
+    memmove(slots + index, slots + index + 1, (node->cells_count - index - 1) * sizeof *slots);
+    --node->cells_count;
+}
+
+/*
+ * Rewrites a node with cells, which must not point into the page.
+ */
+static void fill_node(unsigned char *page, const PageType type, const Cell *cells, const size_t cells_count, const uint32_t right_child)
+{
+    init_node(page, type, right_child);
+
+    NodeHeader *node = (NodeHeader *) page;
+    uint16_t *slots = get_slots(page);
+
+    for (size_t i = 0; i < cells_count; ++i)
+    {
+        node->cells_start -= cells[i].size;
+        memcpy(page + node->cells_start, cells[i].data, cells[i].size);
+        slots[i] = node->cells_start;
+    }
+
+    node->cells_count = cells_count;
+}
+
+/*
+ * Splits a node, which has no room for a cell to be inserted at index, by size.
+ * The lower half stays in the page and the upper one is moved to a new page, whose number
+ * is returned. A leaf keeps all keys, so the separator is the first key of the upper half.
+ * A branch gives the separator up: the child of the separator cell becomes
+ * the right_child of the lower half.
+ */
+static uint32_t split_node(BTree *tree,
+                           const uint32_t page_number,
+                           const size_t index,
+                           const unsigned char *cell,
+                           const size_t cell_size,
+                           unsigned char *separator,
+                           size_t *separator_size)
+{
+    unsigned char *page = write_page(tree, page_number);
+    const NodeHeader *node = (const NodeHeader *) page;
+    const PageType type = node->type;
+    const int leaf = type == LEAF_NODE;
+    const uint32_t right_child = node->right_child;
+
+    unsigned char split_page[BTREE_PAGE_SIZE];
+    memcpy(split_page, page, BTREE_PAGE_SIZE);
+
+    const size_t cells_count = node->cells_count + 1;
+    Cell cells[cells_count];
+    size_t cells_size = 0;
+
+    for (size_t i = 0, j = 0; i < cells_count; ++i)
+    {
+        if (i == index)
+            cells[i] = (Cell) {cell, cell_size};
+        else
+        {
+            cells[i].data = get_cell(split_page, j++);
+            cells[i].size = get_cell_size(cells[i].data, leaf);
+        }
+
+        cells_size += cells[i].size + sizeof(uint16_t);
+    }
+
+    size_t middle = 0;
+
+    for (size_t lower_size = 0; middle < cells_count; ++middle)
+    {
+        lower_size += cells[middle].size + sizeof(uint16_t);
+
+        if (lower_size > cells_size / 2)
+            break;
+    }
+
+    if (!middle)
+        middle = 1;
+
+    if (middle > cells_count - (leaf ? 1 : 2))
+        middle = cells_count - (leaf ? 1 : 2);
+
+    const unsigned char *separator_cell = cells[middle].data;
+
+    *separator_size = separator_cell[0];
+    memcpy(separator, separator_cell + (leaf ? LEAF_CELL_HEADER_SIZE : BRANCH_CELL_HEADER_SIZE), *separator_size);
+
+    const uint32_t upper_page_number = allocate_page(tree, type);
+    unsigned char *upper_page = write_page(tree, upper_page_number);
+
+    if (leaf)
+    {
+        fill_node(page, type, cells, middle, 0);
+        fill_node(upper_page, type, cells + middle, cells_count - middle, 0);
+    }
+    else
+    {
+        uint32_t separator_child;
+        memcpy(&separator_child, separator_cell + 1, sizeof separator_child);
+
+        fill_node(page, type, cells, middle, separator_child);
+        fill_node(upper_page, type, cells + middle + 1, cells_count - middle - 1, right_child);
+    }
+
+    return upper_page_number;
+}
+
+/*
+ * Completes a checkpoint interrupted by a crash. A checkpoint file, which wasn't
+ * written entirely, is discarded, since the B-tree file isn't touched until it is synced.
+ */
+static void apply_checkpoint(BTree *tree)
+{
+    struct stat checkpoint_stat;
+
+    if (fstat(tree->checkpoint_fd, &checkpoint_stat))
+        die("%s: %s: failed to get checkpoint file size",
+            __BASE_FILE__,
+            __func__);
+
+    CheckpointHeader header;
+
+    if ((size_t) checkpoint_stat.st_size < sizeof header)
+        goto discard;
+
+    read_all(tree->checkpoint_fd, &header, sizeof header, 0, "checkpoint file");
+
+    if (header.magic != CHECKPOINT_MAGIC ||
+        header.header_checksum != update_crc32(0, &header, offsetof(CheckpointHeader, header_checksum)) ||
+        (size_t) checkpoint_stat.st_size < sizeof header + header.pages_count * (sizeof(uint32_t) + (size_t) BTREE_PAGE_SIZE))
+        goto discard;
+
+    uint32_t *page_numbers = malloc(header.pages_count * sizeof *page_numbers);
+
+    if (!page_numbers)
+        die("%s: %s: failed to allocate memory for page_numbers",
+            __BASE_FILE__,
+            __func__);
+
+    read_all(tree->checkpoint_fd, page_numbers, header.pages_count * sizeof *page_numbers, sizeof header, "checkpoint file");
+
+    static unsigned char page[BTREE_PAGE_SIZE];
+    const off_t pages_offset = sizeof header + header.pages_count * sizeof *page_numbers;
+    uint32_t data_checksum = update_crc32(0, page_numbers, header.pages_count * sizeof *page_numbers);
+
+    for (uint32_t i = 0; i < header.pages_count; ++i)
+    {
+        read_all(tree->checkpoint_fd, page, BTREE_PAGE_SIZE, pages_offset + (off_t) i * BTREE_PAGE_SIZE, "checkpoint file");
+        data_checksum = update_crc32(data_checksum, page, BTREE_PAGE_SIZE);
+    }
+
+    if (data_checksum == header.data_checksum)
+    {
+        for (uint32_t i = 0; i < header.pages_count; ++i)
+        {
+            read_all(tree->checkpoint_fd, page, BTREE_PAGE_SIZE, pages_offset + (off_t) i * BTREE_PAGE_SIZE, "checkpoint file");
+            write_all(tree->fd, page, BTREE_PAGE_SIZE, (off_t) page_numbers[i] * BTREE_PAGE_SIZE, tree->file);
+        }
+
+        if (fsync(tree->fd))
+            die("%s: %s: failed to sync %s",
+                __BASE_FILE__,
+                __func__,
+                tree->file);
+
+        report("Interrupted checkpoint of %s completed (%" PRIu32 " pages)",
+               tree->file,
+               header.pages_count);
+    }
+
+    free(page_numbers);
+
+discard:
+    if (ftruncate(tree->checkpoint_fd, 0))
+        die("%s: %s: failed to truncate checkpoint file",
+            __BASE_FILE__,
+            __func__);
+}
+
+static void write_header_page(const BTree *tree, unsigned char *page)
+{
+    BTreeHeader header =
+    {
+        .magic = BTREE_MAGIC,
+        .version = BTREE_VERSION,
+        .page_size = BTREE_PAGE_SIZE,
+        .root = tree->root,
+        .pages_count = tree->pages_count,
+        .free_page = tree->free_page
+    };
+
+    header.checksum = update_crc32(0, &header, offsetof(BTreeHeader, checksum));
+
+    memset(page, 0, BTREE_PAGE_SIZE);
+    memcpy(page, &header, sizeof header);
+}
+
+static void read_all(const int fd, void *data, const size_t data_size, const off_t offset, const char *file)
+{
+    for (size_t read_size = 0; read_size < data_size;)
+    {
+        const ssize_t result = pread(fd, (char *) data + read_size, data_size - read_size, offset + read_size);
+
+        if (result <= 0)
+            die("%s: %s: failed to read data from %s",
+                __BASE_FILE__,
+                __func__,
+                file);
+
+        read_size += result;
+    }
+}
+
+static void write_all(const int fd, const void *data, const size_t data_size, const off_t offset, const char *file)
+{
+    for (size_t written_size = 0; written_size < data_size;)
+    {
+        const ssize_t result = pwrite(fd, (const char *) data + written_size, data_size - written_size, offset + written_size);
+
+        if (result < 0)
+            die("%s: %s: failed to write data to %s",
+                __BASE_FILE__,
+                __func__,
+                file);
+
+        written_size += result;
+    }
+}
@@ -0,0 +1,1111 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/wait.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "journal.h"
+#include "btree.h"
+#include "data.h"
+#include "storage.h"
+
+#define RECORDS_VERSION 1
+
+#define MAX_CACHED_BTREE_PAGES 4096 // 32 MiB.
+#define MAX_DIRTY_BTREE_PAGES  1024 // 8 MiB.
+
+#define USER_KEY_SIZE    9  // 'u' or 'p' and the chat id.
+#define LIST_KEY_SIZE    18 // 'l', the list index, the problem creation time and the chat id.
+#define EXPIRY_KEY_SIZE  17 // 'e', the problem time and the chat id.
+#define USER_VALUE_SIZE  27 // Followed by the username.
+
+/*
+ * The users are kept in a single B-tree under these keys:
+ * 'u' and the chat id hold the user states and the problem without its text,
+ * 'p' and the chat id hold the problem text,
+ * 'l', the problem list index (see get_problems_generation) and the problem creation
+ * time and chat id order the problems of every list,
+ * 'e', the problem time and the chat id order the problems that can expire,
+ * i.e. the approved problems of not banned users with a time limit.
+ * Numbers are stored big-endian with the sign bit flipped, so keys sort as numbers.
+ */
+typedef enum
+{
+    USER_KEY = 'u',
+    PROBLEM_TEXT_KEY = 'p',
+    LIST_KEY = 'l',
+    EXPIRY_KEY = 'e'
+}
+KeyType;
+
+typedef enum
+{
+    OPERATION_PUT = 1,
+    OPERATION_DELETE
+}
+OperationType;
+
+/*
+ * A user decoded from its 'u' value.
+ */
+typedef struct
+{
+    unsigned int states;
+    int has_problem;
+    time_t time;
+    time_t created;
+    time_t approved_at;
+    char username[MAX_USERNAME_SIZE + 1];
+}
+StoredUser;
+
+static void btree_init(void);
+static void btree_convert_users(void);
+static void btree_lock_users(void);
+static void btree_unlock_users(void);
+static int btree_get_user_record(const int_fast64_t chat_id, UserRecord *user_record);
+static void btree_begin_transaction(const int_fast64_t chat_id);
+static void btree_commit_transaction(void);
+static void btree_create_user(const int_fast64_t chat_id);
+static void btree_set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value);
+static void btree_create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit);
+static void btree_set_problem_username(const int_fast64_t chat_id, const char *username);
+static void btree_delete_problem(const int_fast64_t chat_id);
+static size_t btree_read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count);
+static void btree_scan_problems(const int pending_problems,
+                                const int banned_accounts,
+                                void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                                void *context);
+static void btree_find_problem(const int_fast64_t chat_id,
+                               const int pending_problems,
+                               const int banned_accounts,
+                               void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                               void *context);
+static cJSON *btree_get_expired_problems_chat_ids(void);
+static time_t btree_get_expiry_deadline(void);
+static void btree_export_users(FILE *users_file);
+static double btree_save_backup(const char *file, const char *tmp_file);
+static void btree_report_footprint(void);
+static void begin_mutation(void);
+static void end_mutation(void);
+static int load_user(const int_fast64_t chat_id, StoredUser *user);
+static StoredUser get_user(const int_fast64_t chat_id);
+static void store_user(const int_fast64_t chat_id, const StoredUser *user);
+static size_t load_problem_text(const int_fast64_t chat_id, char *text);
+static void unlink_problem(const int_fast64_t chat_id, const StoredUser *user);
+static void link_problem(const int_fast64_t chat_id, const StoredUser *user);
+static int get_list_index(const StoredUser *user);
+static void put_value(const unsigned char *key, const size_t key_size, const void *value, const size_t value_size);
+static void delete_value(const unsigned char *key, const size_t key_size);
+static void add_operation(const OperationType type,
+                          const unsigned char *key,
+                          const size_t key_size,
+                          const void *value,
+                          const size_t value_size);
+static void apply_record(const uint32_t records_version, const unsigned char *record, const size_t record_size);
+static void compact_journal(void);
+static void import_users_json(void);
+static void make_user_key(unsigned char *key, const KeyType type, const int_fast64_t chat_id);
+static void make_list_key(unsigned char *key, const int list_index, const time_t created, const int_fast64_t chat_id);
+static void make_expiry_key(unsigned char *key, const time_t time, const int_fast64_t chat_id);
+static void put_key_number(unsigned char *key, const int64_t number);
+static int64_t get_key_number(const unsigned char *key);
+
+/*
+ * The tree and the page cache are guarded by a single mutex, since even reads change the cache.
+ */
+static BTree users_tree;
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Changes of the tree made by a mutation or a transaction are collected as operations
+ * in the operations_record, which goes to the FILE_BTREE_JOURNAL as a single record.
+ * Every operation puts or deletes a key with an absolute value, so replaying the journal
+ * over a checkpoint that already contains some of its records gives the same result.
+ * An operation is its OperationType, the key size (uint8_t), the value size (uint16_t)
+ * for OPERATION_PUT, the key and the value.
+ */
+static _Thread_local int transaction_open;
+static _Thread_local int operations_open;
+static _Thread_local unsigned char operations_record[MAX_JOURNAL_RECORD_SIZE];
+static _Thread_local size_t operations_record_size;
+
+/*
+ * A backup child reads the pages missing from its copy of the cache from the FILE_BTREE,
+ * so the file must not change until it exits.
+ */
+static int checkpoints_paused;
+
+const StorageEngine btree_storage_engine =
+{
+    .name = "btree",
+    .file = FILE_BTREE,
+    .journal_file = FILE_BTREE_JOURNAL,
+    .init = btree_init,
+    .convert_users = btree_convert_users,
+    .flush = flush_journal,
+    .lock_users = btree_lock_users,
+    .unlock_users = btree_unlock_users,
+    .get_user_record = btree_get_user_record,
+    .begin_transaction = btree_begin_transaction,
+    .commit_transaction = btree_commit_transaction,
+    .create_user = btree_create_user,
+    .set_state = btree_set_state,
+    .create_problem = btree_create_problem,
+    .set_problem_username = btree_set_problem_username,
+    .delete_problem = btree_delete_problem,
+    .read_problems = btree_read_problems,
+    .scan_problems = btree_scan_problems,
+    .find_problem = btree_find_problem,
+    .get_expired_problems_chat_ids = btree_get_expired_problems_chat_ids,
+    .get_expiry_deadline = btree_get_expiry_deadline,
+    .export_users = btree_export_users,
+    .save_backup = btree_save_backup,
+    .report_footprint = btree_report_footprint
+};
+
+/*
+ * Users are imported from the FILE_USERS if the FILE_BTREE doesn't exist yet.
+ */
+static void btree_init(void)
+{
+    if (open_btree(&users_tree, FILE_BTREE, FILE_BTREE_CHECKPOINT, MAX_CACHED_BTREE_PAGES))
+    {
+        import_users_json();
+        checkpoint_btree(&users_tree);
+        retire_users_json();
+    }
+
+    if (open_journal(FILE_BTREE_JOURNAL, RECORDS_VERSION, apply_record, compact_journal) != RECORDS_VERSION)
+    {
+        checkpoint_btree(&users_tree);
+        reset_journal();
+    }
+}
+
+static void btree_convert_users(void)
+{
+    const char *files[] = {FILE_BTREE_JOURNAL, FILE_BTREE_CHECKPOINT, FILE_BTREE};
+
+    for (size_t i = 0; i < sizeof files / sizeof *files; ++i)
+        if (unlink(files[i]) && errno != ENOENT)
+            die("%s: %s: failed to delete %s",
+                __BASE_FILE__,
+                __func__,
+                files[i]);
+
+    open_btree(&users_tree, FILE_BTREE, FILE_BTREE_CHECKPOINT, MAX_CACHED_BTREE_PAGES);
+
+    import_users_json();
+    checkpoint_btree(&users_tree);
+    retire_users_json();
+}
+
+static void btree_lock_users(void)
+{
+    pthread_mutex_lock(&users_mutex);
+}
+
+static void btree_unlock_users(void)
+{
+    pthread_mutex_unlock(&users_mutex);
+}
+
+static int btree_get_user_record(const int_fast64_t chat_id, UserRecord *user_record)
+{
+    memset(user_record, 0, sizeof *user_record);
+    user_record->chat_id = chat_id;
+
+    StoredUser user;
+
+    pthread_mutex_lock(&users_mutex);
+    const int user_exists = load_user(chat_id, &user);
+    pthread_mutex_unlock(&users_mutex);
+
+    if (user_exists)
+    {
+        user_record->states = user.states;
+        user_record->has_problem = user.has_problem;
+    }
+
+    return user_exists;
+}
+
+static void btree_begin_transaction(const int_fast64_t chat_id)
+{
+    (void) chat_id;
+
+    begin_mutation();
+    transaction_open = 1;
+}
+
+static void btree_commit_transaction(void)
+{
+    transaction_open = 0;
+    end_mutation();
+}
+
+static void btree_create_user(const int_fast64_t chat_id)
+{
+    begin_mutation();
+
+    StoredUser user;
+
+    if (!load_user(chat_id, &user))
+    {
+        memset(&user, 0, sizeof user);
+        user.states = PROBLEM_PENDING_STATE;
+
+        store_user(chat_id, &user);
+    }
+
+    end_mutation();
+}
+
+static void btree_set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value)
+{
+    if (state != ACCOUNT_BAN_STATE && state != PROBLEM_PENDING_STATE && state != PROBLEM_DESCRIPTION_STATE)
+        die("%s: %s: unknown state %#x",
+            __BASE_FILE__,
+            __func__,
+            state);
+
+    begin_mutation();
+
+    StoredUser user = get_user(chat_id);
+
+    // A problem is approved once its pending state is cleared.
+    if (state == PROBLEM_PENDING_STATE && !state_value && user.states & PROBLEM_PENDING_STATE && user.has_problem)
+        user.approved_at = time(NULL);
+
+    unlink_problem(chat_id, &user);
+
+    if (state_value)
+        user.states |= state;
+    else
+        user.states &= ~state;
+
+    link_problem(chat_id, &user);
+    store_user(chat_id, &user);
+
+    end_mutation();
+}
+
+static void btree_create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit)
+{
+    const size_t username_size = strlen(username);
+    const size_t text_size = strlen(problem_text);
+
+    if (username_size > MAX_USERNAME_SIZE)
+        die("%s: %s: username is too big",
+            __BASE_FILE__,
+            __func__);
+
+    if (text_size > MAX_BTREE_VALUE_SIZE)
+        die("%s: %s: text is too big",
+            __BASE_FILE__,
+            __func__);
+
+    begin_mutation();
+
+    StoredUser user = get_user(chat_id);
+    unlink_problem(chat_id, &user);
+
+    user.has_problem = 1;
+    user.created = time(NULL);
+    user.time = use_time_limit ? user.created : 0;
+    user.approved_at = 0;
+    memcpy(user.username, username, username_size + 1);
+
+    unsigned char key[USER_KEY_SIZE];
+    make_user_key(key, PROBLEM_TEXT_KEY, chat_id);
+    put_value(key, sizeof key, problem_text, text_size);
+
+    link_problem(chat_id, &user);
+    store_user(chat_id, &user);
+
+    end_mutation();
+}
+
+static void btree_set_problem_username(const int_fast64_t chat_id, const char *username)
+{
+    const size_t username_size = strlen(username);
+
+    if (username_size > MAX_USERNAME_SIZE)
+        die("%s: %s: username is too big",
+            __BASE_FILE__,
+            __func__);
+
+    begin_mutation();
+
+    StoredUser user = get_user(chat_id);
+
+    if (user.has_problem)
+    {
+        memcpy(user.username, username, username_size + 1);
+        store_user(chat_id, &user);
+
+        touch_problem_list(chat_id, user.states & PROBLEM_PENDING_STATE, user.states & ACCOUNT_BAN_STATE);
+    }
+
+    end_mutation();
+}
+
+static void btree_delete_problem(const int_fast64_t chat_id)
+{
+    begin_mutation();
+
+    StoredUser user = get_user(chat_id);
+
+    if (user.has_problem)
+    {
+        char text[MAX_BTREE_VALUE_SIZE + 1];
+
+        const Problem problem =
+        {
+            .time = user.time,
+            .created = user.created,
+            .approved_at = user.approved_at,
+            .username = user.username,
+            .text = load_problem_text(chat_id, text) ? text : ""
+        };
+
+        archive_deleted_problem(chat_id, &problem);
+
+        unlink_problem(chat_id, &user);
+
+        unsigned char key[USER_KEY_SIZE];
+        make_user_key(key, PROBLEM_TEXT_KEY, chat_id);
+        delete_value(key, sizeof key);
+
+        user.has_problem = 0;
+        user.time = 0;
+        user.created = 0;
+        user.approved_at = 0;
+        *user.username = 0;
+
+        store_user(chat_id, &user);
+    }
+
+    end_mutation();
+}
+
+/*
+ * The cursor position is a list key, so the reading goes on right after the last read problem.
+ */
+static size_t btree_read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count)
+{
+    const int list_index = (cursor->pending_problems ? 1 : 0) | (cursor->banned_accounts ? 2 : 0);
+    size_t problems_count = 0;
+
+    unsigned char position_key[LIST_KEY_SIZE];
+    make_list_key(position_key, list_index, cursor->created, cursor->chat_id);
+
+    pthread_mutex_lock(&users_mutex);
+
+    BTreeCursor tree_cursor;
+    seek_btree_cursor(&users_tree, &tree_cursor, position_key, cursor->has_position ? sizeof position_key : 2);
+
+    unsigned char key[MAX_BTREE_KEY_SIZE];
+    size_t key_size;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    while (problems_count < max_problems_count &&
+           next_btree_value(&users_tree, &tree_cursor, key, &key_size, value, &value_size) &&
+           key_size == LIST_KEY_SIZE && key[0] == LIST_KEY && key[1] == list_index)
+    {
+        if (cursor->has_position && !memcmp(key, position_key, sizeof position_key))
+            continue;
+
+        const int_fast64_t chat_id = get_key_number(key + 10);
+
+        StoredUser user = get_user(chat_id);
+        char text[MAX_BTREE_VALUE_SIZE + 1];
+        load_problem_text(chat_id, text);
+
+        const Problem problem =
+        {
+            .time = user.time,
+            .created = user.created,
+            .approved_at = user.approved_at,
+            .username = user.username,
+            .text = text
+        };
+
+        ProblemView *problem_view = &problems[problems_count++];
+
+        problem_view->chat_id = chat_id;
+        snprintf(problem_view->username, sizeof problem_view->username, "%s", user.username);
+        format_problem(problem_view->problem, sizeof problem_view->problem, chat_id, &problem, cursor->include_chat_ids);
+
+        cursor->has_position = 1;
+        cursor->created = user.created;
+        cursor->chat_id = chat_id;
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+    return problems_count;
+}
+
+static void btree_scan_problems(const int pending_problems,
+                                const int banned_accounts,
+                                void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                                void *context)
+{
+    const unsigned char list_prefix[] = {LIST_KEY, (pending_problems ? 1 : 0) | (banned_accounts ? 2 : 0)};
+
+    BTreeCursor tree_cursor;
+    seek_btree_cursor(&users_tree, &tree_cursor, list_prefix, sizeof list_prefix);
+
+    unsigned char key[MAX_BTREE_KEY_SIZE];
+    size_t key_size;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    while (next_btree_value(&users_tree, &tree_cursor, key, &key_size, value, &value_size) &&
+           key_size == LIST_KEY_SIZE && !memcmp(key, list_prefix, sizeof list_prefix))
+    {
+        const int_fast64_t chat_id = get_key_number(key + 10);
+
+        StoredUser user = get_user(chat_id);
+        char text[MAX_BTREE_VALUE_SIZE + 1];
+        load_problem_text(chat_id, text);
+
+        const Problem problem =
+        {
+            .time = user.time,
+            .created = user.created,
+            .approved_at = user.approved_at,
+            .username = user.username,
+            .text = text
+        };
+
+        visit(context, chat_id, &problem);
+    }
+}
+
+static void btree_find_problem(const int_fast64_t chat_id,
+                               const int pending_problems,
+                               const int banned_accounts,
+                               void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                               void *context)
+{
+    StoredUser user;
+
+    pthread_mutex_lock(&users_mutex);
+
+    if (load_user(chat_id, &user) &&
+        user.has_problem &&
+        get_list_index(&user) == ((pending_problems ? 1 : 0) | (banned_accounts ? 2 : 0)))
+    {
+        char text[MAX_BTREE_VALUE_SIZE + 1];
+        load_problem_text(chat_id, text);
+
+        const Problem problem =
+        {
+            .time = user.time,
+            .created = user.created,
+            .approved_at = user.approved_at,
+            .username = user.username,
+            .text = text
+        };
+
+        visit(context, chat_id, &problem);
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+}
+
+static cJSON *btree_get_expired_problems_chat_ids(void)
+{
+    cJSON *expired_problems_chat_ids = cJSON_CreateArray();
+    const time_t current_time = time(NULL);
+    const unsigned char expiry_prefix = EXPIRY_KEY;
+
+    pthread_mutex_lock(&users_mutex);
+
+    BTreeCursor tree_cursor;
+    seek_btree_cursor(&users_tree, &tree_cursor, &expiry_prefix, sizeof expiry_prefix);
+
+    unsigned char key[MAX_BTREE_KEY_SIZE];
+    size_t key_size;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    // The problems are ordered by their time, so the expired ones go first.
+    while (next_btree_value(&users_tree, &tree_cursor, key, &key_size, value, &value_size) &&
+           key_size == EXPIRY_KEY_SIZE && key[0] == EXPIRY_KEY &&
+           difftime(current_time, get_key_number(key + 1)) > MAX_PROBLEM_LIFETIME)
+    {
+        char chat_id_string[MAX_CHAT_ID_SIZE + 1];
+        snprintf(chat_id_string,
+                 sizeof chat_id_string,
+                 "%" PRId64,
+                 get_key_number(key + 9));
+
+        cJSON_AddItemToArray(expired_problems_chat_ids, cJSON_CreateString(chat_id_string));
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+    return expired_problems_chat_ids;
+}
+
+static time_t btree_get_expiry_deadline(void)
+{
+    const unsigned char expiry_prefix = EXPIRY_KEY;
+    time_t deadline = 0;
+
+    pthread_mutex_lock(&users_mutex);
+
+    BTreeCursor tree_cursor;
+    seek_btree_cursor(&users_tree, &tree_cursor, &expiry_prefix, sizeof expiry_prefix);
+
+    unsigned char key[MAX_BTREE_KEY_SIZE];
+    size_t key_size;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    // A problem expires once its lifetime is exceeded, i.e. a second after its time plus the lifetime.
+    if (next_btree_value(&users_tree, &tree_cursor, key, &key_size, value, &value_size) &&
+        key_size == EXPIRY_KEY_SIZE && key[0] == EXPIRY_KEY)
+        deadline = get_key_number(key + 1) + MAX_PROBLEM_LIFETIME + 1;
+
+    pthread_mutex_unlock(&users_mutex);
+    return deadline;
+}
+
+/*
+ * Takes no lock, the users must be locked or be a copy of the process, see save_backup.
+ */
+static void btree_export_users(FILE *users_file)
+{
+    const unsigned char user_prefix = USER_KEY;
+    int first_user = 1;
+
+    BTreeCursor tree_cursor;
+    seek_btree_cursor(&users_tree, &tree_cursor, &user_prefix, sizeof user_prefix);
+
+    unsigned char key[MAX_BTREE_KEY_SIZE];
+    size_t key_size;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    fputc('{', users_file);
+
+    while (next_btree_value(&users_tree, &tree_cursor, key, &key_size, value, &value_size) &&
+           key_size == USER_KEY_SIZE && key[0] == USER_KEY)
+    {
+        const int_fast64_t chat_id = get_key_number(key + 1);
+
+        StoredUser user = get_user(chat_id);
+        char text[MAX_BTREE_VALUE_SIZE + 1];
+
+        const Problem problem =
+        {
+            .time = user.time,
+            .created = user.created,
+            .approved_at = user.approved_at,
+            .username = user.username,
+            .text = user.has_problem && load_problem_text(chat_id, text) ? text : NULL
+        };
+
+        if (!first_user)
+            fputc(',', users_file);
+
+        export_user(users_file, chat_id, user.states, &problem);
+        first_user = 0;
+    }
+
+    fputc('}', users_file);
+}
+
+/*
+ * The process forks under the users mutex and the child writes its copy-on-write view
+ * of the page cache together with the FILE_BTREE, whose checkpoints are paused meanwhile,
+ * so writers are blocked only for the time of the fork.
+ */
+static double btree_save_backup(const char *file, const char *tmp_file)
+{
+    pthread_mutex_lock(&users_mutex);
+
+    struct timespec pause_start;
+    clock_gettime(CLOCK_MONOTONIC, &pause_start);
+
+    const pid_t backup_pid = fork();
+
+    if (!backup_pid)
+        _exit(write_users(file, tmp_file, DIR_BACKUPS) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    if (backup_pid > 0)
+        checkpoints_paused = 1;
+
+    pthread_mutex_unlock(&users_mutex);
+
+    const double pause = get_elapsed_milliseconds(&pause_start);
+
+    if (backup_pid < 0)
+        return -1;
+
+    int status;
+    const int failed = waitpid(backup_pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+
+    pthread_mutex_lock(&users_mutex);
+    checkpoints_paused = 0;
+    pthread_mutex_unlock(&users_mutex);
+
+    return failed ? -1 : pause;
+}
+
+/*
+ * Reports the memory taken by the page cache and how often pages are found in it.
+ */
+static void btree_report_footprint(void)
+{
+    pthread_mutex_lock(&users_mutex);
+
+    const size_t cached_pages_count = users_tree.cached_pages_count;
+    const size_t dirty_pages_count = users_tree.dirty_pages_count;
+    const uint32_t pages_count = users_tree.pages_count;
+    const uint64_t page_hits = users_tree.page_hits;
+    const uint64_t page_reads = users_tree.page_reads;
+
+    pthread_mutex_unlock(&users_mutex);
+
+    report("Users B-tree has %" PRIu32 " pages of %d bytes, %zu of them cached (%zu dirty) "
+           "taking %zu bytes, %.1f%% of page accesses hit the cache",
+           pages_count,
+           BTREE_PAGE_SIZE,
+           cached_pages_count,
+           dirty_pages_count,
+           cached_pages_count * sizeof(BTreeFrame),
+           page_hits + page_reads ? 100.0 * page_hits / (page_hits + page_reads) : 100.0);
+}
+
+/*
+ * Takes the users mutex for a mutation, unless the current transaction holds it.
+ */
+static void begin_mutation(void)
+{
+    if (transaction_open)
+        return;
+
+    pthread_mutex_lock(&users_mutex);
+
+    operations_open = 1;
+    operations_record_size = 0;
+}
+
+/*
+ * Queues the collected operations for the FILE_BTREE_JOURNAL and releases the users mutex,
+ * unless the current transaction goes on.
+ */
+static void end_mutation(void)
+{
+    if (transaction_open)
+        return;
+
+    uint_fast64_t sequence = 0;
+
+    if (operations_record_size)
+        sequence = append_journal_record(operations_record, operations_record_size);
+
+    operations_open = 0;
+    pthread_mutex_unlock(&users_mutex);
+
+    publish_approved_problems();
+    wait_journal_record(sequence);
+}
+
+static int load_user(const int_fast64_t chat_id, StoredUser *user)
+{
+    unsigned char key[USER_KEY_SIZE];
+    make_user_key(key, USER_KEY, chat_id);
+
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    if (!get_btree_value(&users_tree, key, sizeof key, value, &value_size))
+        return 0;
+
+    if (value_size < USER_VALUE_SIZE || value_size - USER_VALUE_SIZE != value[2] || value[2] > MAX_USERNAME_SIZE)
+        die("%s: %s: user %" PRIdFAST64 " is damaged",
+            __BASE_FILE__,
+            __func__,
+            chat_id);
+
+    int64_t times[3];
+    memcpy(times, value + 3, sizeof times);
+
+    user->states = value[0];
+    user->has_problem = value[1];
+    user->time = times[0];
+    user->created = times[1];
+    user->approved_at = times[2];
+
+    memcpy(user->username, value + USER_VALUE_SIZE, value[2]);
+    user->username[value[2]] = 0;
+
+    return 1;
+}
+
+static StoredUser get_user(const int_fast64_t chat_id)
+{
+    StoredUser user;
+
+    if (!load_user(chat_id, &user))
+        die("%s: %s: user %" PRIdFAST64 " doesn't exist",
+            __BASE_FILE__,
+            __func__,
+            chat_id);
+
+    return user;
+}
+
+/*
+ * The 'u' value is the states, has_problem and the username size (uint8_t each),
+ * the problem time, creation time and approval time (int64_t each) and the username.
+ */
+static void store_user(const int_fast64_t chat_id, const StoredUser *user)
+{
+    unsigned char key[USER_KEY_SIZE];
+    make_user_key(key, USER_KEY, chat_id);
+
+    unsigned char value[USER_VALUE_SIZE + MAX_USERNAME_SIZE];
+    const size_t username_size = strlen(user->username);
+    const int64_t times[3] = {user->time, user->created, user->approved_at};
+
+    value[0] = user->states;
+    value[1] = user->has_problem;
+    value[2] = username_size;
+    memcpy(value + 3, times, sizeof times);
+    memcpy(value + USER_VALUE_SIZE, user->username, username_size);
+
+    put_value(key, sizeof key, value, USER_VALUE_SIZE + username_size);
+}
+
+/*
+ * Copies a problem text terminated into text, which must fit MAX_BTREE_VALUE_SIZE + 1 bytes.
+ * Returns 1 if the text exists, else 0.
+ */
+static size_t load_problem_text(const int_fast64_t chat_id, char *text)
+{
+    unsigned char key[USER_KEY_SIZE];
+    make_user_key(key, PROBLEM_TEXT_KEY, chat_id);
+
+    size_t text_size = 0;
+    const int text_exists = get_btree_value(&users_tree, key, sizeof key, text, &text_size);
+
+    text[text_size] = 0;
+    return text_exists;
+}
+
+/*
+ * Removes the keys of a user problem from its problem list and from the expiry order.
+ */
+static void unlink_problem(const int_fast64_t chat_id, const StoredUser *user)
+{
+    if (!user->has_problem)
+        return;
+
+    const int list_index = get_list_index(user);
+
+    unsigned char list_key[LIST_KEY_SIZE];
+    make_list_key(list_key, list_index, user->created, chat_id);
+    delete_value(list_key, sizeof list_key);
+
+    touch_problem_list(chat_id, list_index & 1, list_index & 2);
+
+    if (!list_index && user->time)
+    {
+        unsigned char expiry_key[EXPIRY_KEY_SIZE];
+        make_expiry_key(expiry_key, user->time, chat_id);
+        delete_value(expiry_key, sizeof expiry_key);
+
+        notify_expiry();
+    }
+}
+
+static void link_problem(const int_fast64_t chat_id, const StoredUser *user)
+{
+    if (!user->has_problem)
+        return;
+
+    const int list_index = get_list_index(user);
+
+    unsigned char list_key[LIST_KEY_SIZE];
+    make_list_key(list_key, list_index, user->created, chat_id);
+    put_value(list_key, sizeof list_key, NULL, 0);
+
+    touch_problem_list(chat_id, list_index & 1, list_index & 2);
+
+    if (!list_index && user->time)
+    {
+        unsigned char expiry_key[EXPIRY_KEY_SIZE];
+        make_expiry_key(expiry_key, user->time, chat_id);
+        put_value(expiry_key, sizeof expiry_key, NULL, 0);
+
+        notify_expiry();
+    }
+}
+
+static int get_list_index(const StoredUser *user)
+{
+    return (user->states & PROBLEM_PENDING_STATE ? 1 : 0) | (user->states & ACCOUNT_BAN_STATE ? 2 : 0);
+}
+
+static void put_value(const unsigned char *key, const size_t key_size, const void *value, const size_t value_size)
+{
+    put_btree_value(&users_tree, key, key_size, value, value_size);
+
+    if (operations_open)
+        add_operation(OPERATION_PUT, key, key_size, value, value_size);
+}
+
+static void delete_value(const unsigned char *key, const size_t key_size)
+{
+    delete_btree_value(&users_tree, key, key_size);
+
+    if (operations_open)
+        add_operation(OPERATION_DELETE, key, key_size, NULL, 0);
+}
+
+static void add_operation(const OperationType type,
+                          const unsigned char *key,
+                          const size_t key_size,
+                          const void *value,
+                          const size_t value_size)
+{
+    const uint16_t operation_value_size = value_size;
+    const size_t operation_size = 2 + (type == OPERATION_PUT ? sizeof operation_value_size : 0) + key_size + value_size;
+
+    if (operations_record_size + operation_size > sizeof operations_record)
+        die("%s: %s: transaction is too big",
+            __BASE_FILE__,
+            __func__);
+
+    unsigned char *operation = operations_record + operations_record_size;
+
+    *operation++ = type;
+    *operation++ = key_size;
+
+    if (type == OPERATION_PUT)
+    {
+        memcpy(operation, &operation_value_size, sizeof operation_value_size);
+        operation += sizeof operation_value_size;
+    }
+
+    memcpy(operation, key, key_size);
+
+    if (value_size)
+        memcpy(operation + key_size, value, value_size);
+
+    operations_record_size += operation_size;
+}
+
+/*
+ * Applies the operations of a record to the tree.
+ * Used only for the FILE_BTREE_JOURNAL replay.
+ */
+static void apply_record(const uint32_t records_version, const unsigned char *record, const size_t record_size)
+{
+    if (records_version != RECORDS_VERSION)
+        die("%s: %s: record has unsupported version %" PRIu32,
+            __BASE_FILE__,
+            __func__,
+            records_version);
+
+    for (size_t offset = 0; offset < record_size;)
+    {
+        if (record_size - offset < 2)
+            die("%s: %s: record is damaged",
+                __BASE_FILE__,
+                __func__);
+
+        const OperationType type = record[offset];
+        const size_t key_size = record[offset + 1];
+        uint16_t value_size = 0;
+
+        offset += 2;
+
+        if (type == OPERATION_PUT)
+        {
+            if (record_size - offset < sizeof value_size)
+                die("%s: %s: record is damaged",
+                    __BASE_FILE__,
+                    __func__);
+
+            memcpy(&value_size, record + offset, sizeof value_size);
+            offset += sizeof value_size;
+        }
+        else if (type != OPERATION_DELETE)
+            die("%s: %s: record has unknown operation",
+                __BASE_FILE__,
+                __func__);
+
+        if (!key_size || key_size > MAX_BTREE_KEY_SIZE || value_size > MAX_BTREE_VALUE_SIZE ||
+            record_size - offset < key_size + value_size)
+            die("%s: %s: record is damaged",
+                __BASE_FILE__,
+                __func__);
+
+        if (type == OPERATION_PUT)
+            put_btree_value(&users_tree, record + offset, key_size, record + offset + key_size, value_size);
+        else
+            delete_btree_value(&users_tree, record + offset, key_size);
+
+        offset += key_size + value_size;
+    }
+}
+
+/*
+ * Writes the changed pages to the FILE_BTREE once enough of them are kept in memory
+ * or the FILE_BTREE_JOURNAL grows big, then the journal is no longer needed.
+ * Called by the journal thread after every commit.
+ */
+static void compact_journal(void)
+{
+    pthread_mutex_lock(&users_mutex);
+
+    if (!checkpoints_paused &&
+        (users_tree.dirty_pages_count >= MAX_DIRTY_BTREE_PAGES || get_journal_size() >= MIN_JOURNAL_COMPACTION_SIZE))
+    {
+        checkpoint_btree(&users_tree);
+        reset_journal();
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+}
+
+/*
+ * Inserts the users of the FILE_USERS into the tree without journaling them,
+ * the caller checkpoints the tree afterwards.
+ */
+static void import_users_json(void)
+{
+    char *users_string = read_users_json();
+
+    UsersEntry *entries;
+    const size_t entries_count = find_users_entries(users_string, &entries);
+
+    for (size_t i = 0; i < entries_count; ++i)
+    {
+        const int_fast64_t chat_id = entries[i].chat_id;
+
+        if (load_user(chat_id, &(StoredUser) {0}))
+            die("%s: %s: invalid user '%s'",
+                __BASE_FILE__,
+                __func__,
+                entries[i].chat_id_string);
+
+        unsigned int states;
+        Problem problem;
+        char split_username[MAX_USERNAME_SIZE + 1];
+
+        cJSON *user_json = parse_user(&entries[i], &states, &problem, split_username);
+
+        StoredUser user = {.states = states};
+
+        if (problem.text)
+        {
+            const size_t text_size = strlen(problem.text);
+
+            if (strlen(problem.username) > MAX_USERNAME_SIZE || text_size > MAX_BTREE_VALUE_SIZE)
+                die("%s: %s: problem of user '%s' is too big",
+                    __BASE_FILE__,
+                    __func__,
+                    entries[i].chat_id_string);
+
+            user.has_problem = 1;
+            user.time = problem.time;
+            user.created = problem.created;
+            user.approved_at = problem.approved_at;
+            strcpy(user.username, problem.username);
+
+            unsigned char key[USER_KEY_SIZE];
+            make_user_key(key, PROBLEM_TEXT_KEY, chat_id);
+            put_value(key, sizeof key, problem.text, text_size);
+
+            link_problem(chat_id, &user);
+        }
+
+        store_user(chat_id, &user);
+        cJSON_Delete(user_json);
+    }
+
+    free(entries);
+    free(users_string);
+}
+
+static void make_user_key(unsigned char *key, const KeyType type, const int_fast64_t chat_id)
+{
+    key[0] = type;
+    put_key_number(key + 1, chat_id);
+}
+
+static void make_list_key(unsigned char *key, const int list_index, const time_t created, const int_fast64_t chat_id)
+{
+    key[0] = LIST_KEY;
+    key[1] = list_index;
+    put_key_number(key + 2, created);
+    put_key_number(key + 10, chat_id);
+}
+
+static void make_expiry_key(unsigned char *key, const time_t time, const int_fast64_t chat_id)
+{
+    key[0] = EXPIRY_KEY;
+    put_key_number(key + 1, time);
+    put_key_number(key + 9, chat_id);
+}
+
+static void put_key_number(unsigned char *key, const int64_t number)
+{
+    const uint64_t bits = (uint64_t) number ^ UINT64_C(0x8000000000000000);
+
+    for (int i = 0; i < 8; ++i)
+        key[i] = bits >> (56 - 8 * i);
+}
+
+static int64_t get_key_number(const unsigned char *key)
+{
+    uint64_t bits = 0;
+
+    for (int i = 0; i < 8; ++i)
+        bits = bits << 8 | key[i];
+
+    return (int64_t) (bits ^ UINT64_C(0x8000000000000000));
+}
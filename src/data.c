@@ -25,242 +25,641 @@
  *                                                                            *
  ******************************************************************************/
 
+#include <sys/stat.h>
+#include <dirent.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <inttypes.h>
 #include <time.h>
 
 #include <cjson/cJSON.h>
 
 #include "log.h"
+#include "journal.h"
+#include "storage.h"
+#include "sessions.h"
+#include "archive.h"
+#include "workers.h"
 #include "data.h"
 
-static void load_users(void);
-static void save_users(void);
+/*
+ * Sizes of the approved problems measured by the first pass of build_approved_problems,
+ * then the version filled by the second one.
+ */
+typedef struct
+{
+    size_t problems_count;
+    size_t texts_size;
+    ApprovedProblems *problems;
+    char *text;
+    char *texts_end;
+}
+ApprovedProblemsBuild;
+
+/*
+ * The current approved problem of a touched chat, formatted like a problem of a version:
+ * the problem with the chat id followed by the username.
+ */
+typedef struct
+{
+    int_fast64_t chat_id;
+    time_t created;
+    char *text;
+    size_t problem_offset; // Of the problem without the chat id.
+    size_t text_size;
+}
+ChangedProblem;
+
+typedef struct
+{
+    ChangedProblem *problems;
+    size_t problems_count;
+}
+ChangedProblems;
+
+static void start_data_module(void);
+static ApprovedProblems *build_approved_problems(void);
+static ApprovedProblems *update_approved_problems(const ApprovedProblems *problems, int_fast64_t *chat_ids, size_t chat_ids_count);
+static void measure_approved_problem(void *approved_problems_build, const int_fast64_t chat_id, const Problem *problem);
+static void add_approved_problem(void *approved_problems_build, const int_fast64_t chat_id, const Problem *problem);
+static void add_changed_problem(void *changed_problems, const int_fast64_t chat_id, const Problem *problem);
+static void allocate_approved_problems(ApprovedProblemsBuild *build);
+static void copy_approved_problem(ApprovedProblemsBuild *build,
+                                  const int_fast64_t chat_id,
+                                  const time_t created,
+                                  const char *text,
+                                  const size_t problem_offset,
+                                  const size_t text_size);
+static int compare_chat_ids(const void *chat_id, const void *other_chat_id);
+static int compare_changed_problems(const void *problem, const void *other_problem);
+static void wait_approved_problems_readers(void);
+static char *skip_json_whitespace(char *json);
+static char *skip_json_string(char *json);
+static char *skip_json_value(char *json);
+static void export_string(FILE *users_file, const char *string);
+static void *backup_users(void *_);
+static void take_backup(void);
+static void delete_old_backups(void);
+static void update_change_time(const char *file, struct timespec *change_time);
+static int is_backup_file(const struct dirent *entry);
+static unsigned char *get_chat_slot(const ChatSlots *table, const size_t slot);
+static int is_empty_chat_slot(const ChatSlots *table, const size_t slot);
+
+static const StorageEngine *storage_engines[] =
+{
+    &memory_storage_engine,
+    &btree_storage_engine
+};
+
+static const StorageEngine *storage_engine = &memory_storage_engine;
 
-static cJSON *users_cache;
-static pthread_rwlock_t users_cache_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+ * expiry_generation is increased whenever the earliest expiry changes,
+ * so wait_problems_expiry can't miss a new deadline.
+ */
+static uint_fast64_t expiry_generation;
+static pthread_mutex_t expiry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expiry_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * problem_lists_generations are increased under the user lock on every change
+ * of a problem list, the index being (pending ? 1 : 0) | (banned ? 2 : 0).
+ *
+ * The approved problems are published as an immutable ApprovedProblems, which
+ * writers swap in atomically, so readers take no lock. Once published, a version
+ * is updated with the current problems of the approved_changes, the chats touched
+ * since, without locking all users.
+ * published_approved_problems_generation is the generation of the approved problems
+ * list of the published version.
+ * approved_problems_readers count readers between loading the pointer and taking
+ * a reference, which is the only moment a reader holds no reference, each in the counter
+ * of the approved_problems_phase it started in. A writer switches the phase and waits
+ * for the counter of the old one to drop to 0, which new readers don't delay, twice,
+ * so a replaced version loses its last reference only after both counters have been 0.
+ */
+static _Atomic(ApprovedProblems *) approved_problems;
+static atomic_uint_fast64_t local_problem_lists_generations[PROBLEM_LISTS_COUNT];
+static atomic_uint_fast64_t *problem_lists_generations = local_problem_lists_generations; // Shared with the workers, if any.
+static atomic_uint_fast64_t published_approved_problems_generation;
+static atomic_size_t approved_problems_readers[2];
+static atomic_uint approved_problems_phase;
+static pthread_mutex_t approved_problems_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int_fast64_t *approved_changes;
+static size_t approved_changes_count;
+static size_t approved_changes_capacity;
+static pthread_mutex_t approved_changes_mutex = PTHREAD_MUTEX_INITIALIZER; // Taken under a user lock.
+
+static long backup_interval = DEFAULT_BACKUP_INTERVAL;
+static long backups_count = DEFAULT_BACKUPS_COUNT;
+static sem_t backup_semaphore;
+
+/*
+ * The closure of the problem being deleted by this thread, which the storage engine
+ * passes to archive_deleted_problem. 0 while the engine replays its journal.
+ */
+static _Thread_local unsigned int deletion_closure;
+
+long eviction_age = DEFAULT_EVICTION_AGE;
+
+const char *state_names[STATES_COUNT] =
+{
+    "account_ban_state",
+    "problem_pending_state",
+    "problem_description_state"
+};
+
+int set_storage_engine(const char *name)
+{
+    for (size_t i = 0; i < sizeof storage_engines / sizeof *storage_engines; ++i)
+        if (!strcmp(name, storage_engines[i]->name))
+        {
+            storage_engine = storage_engines[i];
+            return 0;
+        }
+
+    return -1;
+}
+
+const char *get_storage_file(void)
+{
+    return storage_engine->file;
+}
+
+int set_persistence_policy(const char *policy)
+{
+    return set_journal_policy(policy);
+}
+
+int set_backup_interval(const char *interval)
+{
+    char *end;
+    const long value = strtol(interval, &end, 10);
+
+    if (*end || end == interval || value < 0)
+        return -1;
+
+    backup_interval = value;
+    return 0;
+}
+
+int set_backups_count(const char *count)
+{
+    char *end;
+    const long value = strtol(count, &end, 10);
+
+    if (*end || end == count || value < 0)
+        return -1;
+
+    backups_count = value;
+    return 0;
+}
+
+int set_eviction_age(const char *age)
+{
+    char *end;
+    const long value = strtol(age, &end, 10);
+
+    if (*end || end == age || value < 0)
+        return -1;
+
+    eviction_age = value;
+    return 0;
+}
 
 void init_data_module(void)
 {
-    load_users();
+    if (get_workers_count())
+        problem_lists_generations = get_shared_problem_lists_generations();
+
+    init_archive();
+
+    storage_engine->init();
+    start_data_module();
 }
 
-int has_user(const int_fast64_t chat_id)
+int is_replicable(void)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    return storage_engine->init_replica ? 1 : 0;
+}
+
+uint32_t export_replica(FILE *users_file, void (*attach_replica)(void))
+{
+    storage_engine->lock_users();
+
+    attach_replica();
+    storage_engine->export_users(users_file);
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    const int state = cJSON_GetObjectItem(users_cache, chat_id_string) ? 1 : 0;
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    storage_engine->unlock_users();
 
-    return state;
+    return storage_engine->records_version;
 }
 
-void create_user(const int_fast64_t chat_id)
+void init_replica(char *users_string, const uint32_t records_version)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    if (records_version != storage_engine->records_version)
+        die("%s: %s: primary journals records of version %" PRIu32 ", expected %" PRIu32,
+            __BASE_FILE__,
+            __func__,
+            records_version,
+            storage_engine->records_version);
 
-    cJSON *user = cJSON_CreateObject();
+    if (get_workers_count())
+        problem_lists_generations = get_shared_problem_lists_generations();
 
-    cJSON_AddNumberToObject(user, "account_ban_state", 0);
-    cJSON_AddNumberToObject(user, "problem_pending_state", 1);
-    cJSON_AddNumberToObject(user, "problem_description_state", 0);
+    storage_engine->init_replica(users_string);
+}
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+void apply_replica_records(const void *records, const size_t records_size)
+{
+    if (apply_journal_records(records,
+                              records_size,
+                              storage_engine->records_version,
+                              storage_engine->apply_replica_record))
+        die("%s: %s: records from the primary are damaged",
+            __BASE_FILE__,
+            __func__);
+}
 
-    cJSON_AddItemToObject(users_cache, chat_id_string, user);
-    save_users();
+void drop_replica(void)
+{
+    storage_engine->drop_replica();
+}
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+void promote_replica(void)
+{
+    init_archive();
+
+    storage_engine->promote_replica();
+    start_data_module();
+}
+
+void attach_data_module(void)
+{
+    storage_engine = &worker_storage_engine;
+    problem_lists_generations = get_shared_problem_lists_generations();
 }
 
-int get_state(const int_fast64_t chat_id, const char *state_name)
+const char *find_newer_storage_engine(const int importing)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    struct timespec loaded_time = {0};
+
+    update_change_time(storage_engine->file, &loaded_time);
+    update_change_time(storage_engine->journal_file, &loaded_time);
+
+    if (importing || !loaded_time.tv_sec)
+    {
+        loaded_time = (struct timespec) {0};
+        update_change_time(FILE_USERS, &loaded_time);
+    }
+
+    for (size_t i = 0; i < sizeof storage_engines / sizeof *storage_engines; ++i)
+    {
+        if (storage_engines[i] == storage_engine && !importing)
+            continue;
+
+        struct timespec change_time = {0};
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    const cJSON *state = cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), state_name);
-    pthread_rwlock_unlock(&users_cache_rwlock);
+        update_change_time(storage_engines[i]->file, &change_time);
+        update_change_time(storage_engines[i]->journal_file, &change_time);
 
-    return state->valueint;
+        if (change_time.tv_sec > loaded_time.tv_sec ||
+            (change_time.tv_sec == loaded_time.tv_sec && change_time.tv_nsec > loaded_time.tv_nsec))
+            return storage_engines[i]->name;
+    }
+
+    return NULL;
 }
 
-void set_state(const int_fast64_t chat_id, const char *state_name, const int state_value)
+void convert_users(void)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    storage_engine->convert_users();
+}
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+int export_users_json(void)
+{
+    storage_engine->init();
 
-    cJSON_SetIntValue(cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), state_name), state_value);
-    save_users();
+    storage_engine->lock_users();
+    const long users_file_size = write_users(FILE_USERS, FILE_USERS_TMP, DIR_DATA);
+    storage_engine->unlock_users();
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    storage_engine->flush();
+    return users_file_size < 0 ? -1 : 0;
 }
 
-int has_problem(const int_fast64_t chat_id)
+void flush_data_module(void)
+{
+    storage_engine->flush();
+    flush_archive();
+}
+
+void request_backup(void)
+{
+    sem_post(&backup_semaphore);
+}
+
+/*
+ * SESSION_STATES saved by earlier versions are ignored in favour of the session.
+ */
+int get_user_record(const int_fast64_t chat_id, UserRecord *user_record)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    const int user_exists = storage_engine->get_user_record(chat_id, user_record);
+
+    user_record->states &= ~SESSION_STATES;
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    const int state = cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), "problem") ? 1 : 0;
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    if (user_exists)
+        user_record->states |= get_session_states(chat_id);
 
-    return state;
+    return user_exists;
 }
 
-void create_problem(const int_fast64_t chat_id, const char *problem_text, const int use_time_limit)
+void begin_transaction(const int_fast64_t chat_id)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    storage_engine->begin_transaction(chat_id);
+}
 
-    cJSON *problem = cJSON_CreateObject();
+void commit_transaction(void)
+{
+    storage_engine->commit_transaction();
+}
 
-    cJSON_AddNumberToObject(problem, "time", use_time_limit ? time(NULL) : 0);
-    cJSON_AddStringToObject(problem, "text", problem_text);
+void create_user(const int_fast64_t chat_id)
+{
+    storage_engine->create_user(chat_id);
+}
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+void set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value)
+{
+    if (state & SESSION_STATES)
+        set_session_state(chat_id, state, state_value);
+    else
+        storage_engine->set_state(chat_id, state, state_value);
+}
 
-    cJSON_AddItemToObject(cJSON_GetObjectItem(users_cache, chat_id_string), "problem", problem);
-    save_users();
+void create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit)
+{
+    storage_engine->create_problem(chat_id, username, problem_text, use_time_limit);
+}
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+void set_problem_username(const int_fast64_t chat_id, const char *username)
+{
+    storage_engine->set_problem_username(chat_id, username);
 }
 
-void modify_problem(const int_fast64_t chat_id, const char *problem_text)
+void delete_problem(const int_fast64_t chat_id, const unsigned int closure)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    deletion_closure = closure;
+    storage_engine->delete_problem(chat_id);
+    deletion_closure = 0;
+}
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+void open_problems_cursor(ProblemsCursor *cursor, const int include_chat_ids, const int pending_problems, const int banned_accounts)
+{
+    memset(cursor, 0, sizeof *cursor);
 
-    cJSON_SetValuestring(cJSON_GetObjectItem(cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), "problem"), "text"), problem_text);
-    save_users();
+    cursor->include_chat_ids = include_chat_ids;
+    cursor->pending_problems = pending_problems;
+    cursor->banned_accounts = banned_accounts;
+}
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+size_t read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count)
+{
+    return storage_engine->read_problems(cursor, problems, max_problems_count);
 }
 
-void delete_problem(const int_fast64_t chat_id)
+uint_fast64_t get_problems_generation(const int pending_problems, const int banned_accounts)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    return atomic_load(&problem_lists_generations[(pending_problems ? 1 : 0) | (banned_accounts ? 2 : 0)]);
+}
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+const ApprovedProblems *acquire_approved_problems(void)
+{
+    const unsigned int phase = atomic_load(&approved_problems_phase) & 1;
+    atomic_fetch_add(&approved_problems_readers[phase], 1);
 
-    cJSON_DeleteItemFromObject(cJSON_GetObjectItem(users_cache, chat_id_string), "problem");
-    save_users();
+    ApprovedProblems *problems = atomic_load(&approved_problems);
+    atomic_fetch_add(&problems->references, 1);
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    atomic_fetch_sub(&approved_problems_readers[phase], 1);
+    return problems;
 }
 
-cJSON *get_problems(const int include_chat_ids, const int pending_problems, const int banned_accounts)
+void release_approved_problems(const ApprovedProblems *problems)
 {
-    cJSON *problems = cJSON_CreateArray();
+    // The version itself is allocated as mutable, only the readers see it const.
+    if (atomic_fetch_sub(&((ApprovedProblems *) problems)->references, 1) == 1)
+        free((ApprovedProblems *) problems);
+}
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    cJSON *user = users_cache->child;
+cJSON *get_expired_problems_chat_ids(void)
+{
+    return storage_engine->get_expired_problems_chat_ids();
+}
 
-    while (user)
+void wait_problems_expiry(void)
+{
+    for (;;)
     {
-        const int problem_pending_state = cJSON_GetNumberValue(cJSON_GetObjectItem(user, "problem_pending_state"));
-        const int account_ban_state = cJSON_GetNumberValue(cJSON_GetObjectItem(user, "account_ban_state"));
+        pthread_mutex_lock(&expiry_mutex);
+        const uint_fast64_t generation = expiry_generation;
+        pthread_mutex_unlock(&expiry_mutex);
 
-        if ((!pending_problems && !banned_accounts && (problem_pending_state || account_ban_state)) || // Skipping pending problem and banned account.
-            (pending_problems && !banned_accounts && (!problem_pending_state || account_ban_state)) || // Skipping non-pending problem and banned account.
-            (!pending_problems && banned_accounts && (problem_pending_state || !account_ban_state)) || // Skipping pending problem and non-banned account.
-            (pending_problems && banned_accounts && (!problem_pending_state || !account_ban_state)))   // Skipping non-pending problem and non-banned account.
-            goto next;
+        const time_t deadline = storage_engine->get_expiry_deadline();
 
-        const cJSON *problem = cJSON_GetObjectItem(user, "problem");
+        if (deadline && time(NULL) >= deadline)
+            return;
 
-        if (problem)
-        {
-            cJSON *text = cJSON_GetObjectItem(problem, "text");
+        const struct timespec deadline_timespec = {.tv_sec = deadline};
 
-            if (!include_chat_ids)
-                cJSON_AddItemToArray(problems, cJSON_CreateString(text->valuestring));
-            else
-            {
-                char chat_id_with_problem[MAX_CHAT_ID_SIZE + MAX_USERNAME_SIZE + MAX_PROBLEM_SIZE + 7];
-                snprintf(chat_id_with_problem,
-                         sizeof chat_id_with_problem,
-                         "(%s) %s",
-                         user->string,
-                         text->valuestring);
-
-                cJSON_AddItemToArray(problems, cJSON_CreateString(chat_id_with_problem));
-            }
+        pthread_mutex_lock(&expiry_mutex);
+
+        while (expiry_generation == generation)
+        {
+            if (!deadline)
+                pthread_cond_wait(&expiry_cond, &expiry_mutex);
+            else if (pthread_cond_timedwait(&expiry_cond, &expiry_mutex, &deadline_timespec) == ETIMEDOUT)
+                break;
         }
 
-    next:
-        user = user->next;
+        pthread_mutex_unlock(&expiry_mutex);
     }
-
-    pthread_rwlock_unlock(&users_cache_rwlock);
-    return problems;
 }
 
-cJSON *get_expired_problems_chat_ids(void)
+/*
+ * Changes before the first publication are covered by the build of start_data_module,
+ * which locks all users, so they aren't collected.
+ */
+void touch_problem_list(const int_fast64_t chat_id, const int pending_problems, const int banned_accounts)
 {
-    cJSON *expired_problems_chat_ids = cJSON_CreateArray();
+    const int list_index = (pending_problems ? 1 : 0) | (banned_accounts ? 2 : 0);
+
+    if (list_index || !atomic_load(&approved_problems))
+    {
+        atomic_fetch_add(&problem_lists_generations[list_index], 1);
+        return;
+    }
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    cJSON *user = users_cache->child;
+    pthread_mutex_lock(&approved_changes_mutex);
 
-    while (user)
+    if (approved_changes_count == approved_changes_capacity)
     {
-        if (cJSON_GetNumberValue(cJSON_GetObjectItem(user, "problem_pending_state")) ||
-            cJSON_GetNumberValue(cJSON_GetObjectItem(user, "account_ban_state")))
-            goto next;
+        approved_changes_capacity = approved_changes_capacity ? approved_changes_capacity * 2 : 16;
 
-        const cJSON *problem = cJSON_GetObjectItem(user, "problem");
-        const time_t problem_time = cJSON_GetNumberValue(cJSON_GetObjectItem(problem, "time"));
+        if (!(approved_changes = realloc(approved_changes, approved_changes_capacity * sizeof *approved_changes)))
+            die("%s: %s: failed to reallocate memory for approved_changes",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    approved_changes[approved_changes_count++] = chat_id;
+
+    // The change is counted together with its chat, so a publication sees both or neither.
+    atomic_fetch_add(&problem_lists_generations[0], 1);
+
+    pthread_mutex_unlock(&approved_changes_mutex);
+}
 
-        if (problem && problem_time && difftime(time(NULL), problem_time) > MAX_PROBLEM_LIFETIME)
-            cJSON_AddItemToArray(expired_problems_chat_ids, cJSON_CreateString(user->string));
+/*
+ * The replaced version is freed by its last reader.
+ */
+void publish_approved_problems(void)
+{
+    if (atomic_load(&problem_lists_generations[0]) == atomic_load(&published_approved_problems_generation))
+        return;
 
-    next:
-        user = user->next;
+    pthread_mutex_lock(&approved_problems_mutex);
+    pthread_mutex_lock(&approved_changes_mutex);
+
+    const uint_fast64_t generation = atomic_load(&problem_lists_generations[0]);
+
+    int_fast64_t *chat_ids = approved_changes;
+    const size_t chat_ids_count = approved_changes_count;
+
+    approved_changes = NULL;
+    approved_changes_count = 0;
+    approved_changes_capacity = 0;
+
+    pthread_mutex_unlock(&approved_changes_mutex);
+
+    // Changes of a concurrent writer may have been published already.
+    if (generation == atomic_load(&published_approved_problems_generation))
+    {
+        pthread_mutex_unlock(&approved_problems_mutex);
+        free(chat_ids);
+        return;
     }
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
-    return expired_problems_chat_ids;
+    ApprovedProblems *old_problems = atomic_load(&approved_problems);
+
+    // The problems are read after the generation, so the version may be newer than it, never older.
+    ApprovedProblems *problems = update_approved_problems(old_problems, chat_ids, chat_ids_count);
+    problems->generation = generation;
+
+    free(chat_ids);
+
+    atomic_store(&approved_problems, problems);
+    atomic_store(&published_approved_problems_generation, generation);
+
+    // Grace periods don't overlap, since the phases of the readers would mix.
+    wait_approved_problems_readers();
+
+    pthread_mutex_unlock(&approved_problems_mutex);
+
+    release_approved_problems(old_problems);
 }
 
 /*
- * Loads data from the FILE_USERS to the users_cache.
+ * Called with a user lock held, and user locks are never taken under the expiry_mutex.
  */
-static void load_users(void)
+void notify_expiry(void)
+{
+    pthread_mutex_lock(&expiry_mutex);
+    ++expiry_generation;
+    pthread_cond_broadcast(&expiry_cond);
+    pthread_mutex_unlock(&expiry_mutex);
+}
+
+unsigned int get_deletion_closure(void)
+{
+    return deletion_closure;
+}
+
+void archive_deleted_problem(const int_fast64_t chat_id, const Problem *problem)
+{
+    if (!deletion_closure)
+        return;
+
+    const ArchivedProblem archived_problem =
+    {
+        .chat_id = chat_id,
+        .closure = deletion_closure,
+        .created = problem->created,
+        .approved_at = problem->approved_at,
+        .closed = time(NULL),
+        .username = problem->username,
+        .text = problem->text
+    };
+
+    archive_problem(&archived_problem);
+}
+
+int format_problem(char *buffer,
+                   const size_t buffer_size,
+                   const int_fast64_t chat_id,
+                   const Problem *problem,
+                   const int include_chat_id)
+{
+    char chat_id_prefix[MAX_CHAT_ID_SIZE + 4] = "";
+
+    if (include_chat_id)
+        snprintf(chat_id_prefix,
+                 sizeof chat_id_prefix,
+                 "(%" PRIdFAST64 ") ",
+                 chat_id);
+
+    if (!*problem->username)
+        return snprintf(buffer,
+                        buffer_size,
+                        "%s%s",
+                        chat_id_prefix,
+                        problem->text);
+
+    return snprintf(buffer,
+                    buffer_size,
+                    "%s@%s: %s",
+                    chat_id_prefix,
+                    problem->username,
+                    problem->text);
+}
+
+void split_problem_text(const char *problem_text, char *username, const char **text)
+{
+    const char *separator = problem_text[0] == '@' ? strstr(problem_text, ": ") : NULL;
+    const size_t username_size = separator ? (size_t) (separator - problem_text - 1) : 0;
+
+    if (!separator || username_size > MAX_USERNAME_SIZE)
+    {
+        *username = 0;
+        *text = problem_text;
+        return;
+    }
+
+    memcpy(username, problem_text + 1, username_size);
+    username[username_size] = 0;
+
+    *text = separator + 2;
+}
+
+char *read_users_json(void)
 {
     FILE *users_file = fopen(FILE_USERS, "r");
 
@@ -293,39 +692,837 @@ static void load_users(void)
     fclose(users_file);
 
     users_string[users_file_size] = 0;
-    cJSON *users = cJSON_Parse(users_string);
+    return users_string;
+}
+
+void retire_users_json(void)
+{
+    if (rename(FILE_USERS, FILE_USERS_IMPORTED) || sync_dir(DIR_DATA))
+        die("%s: %s: failed to rename %s to %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS,
+            FILE_USERS_IMPORTED);
+}
+
+size_t find_users_entries(char *users_string, UsersEntry **entries)
+{
+    size_t entries_count = 0;
+    size_t entries_capacity = 0;
+
+    *entries = NULL;
+
+    char *json = skip_json_whitespace(users_string);
+
+    if (*json++ != '{')
+        goto invalid;
+
+    json = skip_json_whitespace(json);
+
+    if (*json == '}')
+        ++json;
+    else
+        for (;;)
+        {
+            char *chat_id_string = json + 1;
+            char *chat_id_string_end = skip_json_string(json);
+
+            if (!chat_id_string_end)
+                goto invalid;
+
+            *chat_id_string_end = 0;
+            json = skip_json_whitespace(chat_id_string_end + 1);
+
+            if (*json++ != ':')
+                goto invalid;
+
+            char *user_string = skip_json_whitespace(json);
+            json = skip_json_value(user_string);
+
+            if (!json)
+                goto invalid;
+
+            char *end;
+            const int_fast64_t chat_id = strtoll(chat_id_string, &end, 10);
+
+            if (*end || end == chat_id_string)
+                die("%s: %s: invalid user '%s'",
+                    __BASE_FILE__,
+                    __func__,
+                    chat_id_string);
+
+            if (entries_count == entries_capacity)
+            {
+                entries_capacity = entries_capacity ? entries_capacity * 2 : 1024;
+                *entries = realloc(*entries, entries_capacity * sizeof **entries);
+
+                if (!*entries)
+                    die("%s: %s: failed to reallocate memory for entries",
+                        __BASE_FILE__,
+                        __func__);
+            }
+
+            (*entries)[entries_count++] = (UsersEntry)
+            {
+                .chat_id = chat_id,
+                .chat_id_string = chat_id_string,
+                .user_string = user_string,
+                .user_string_size = json - user_string
+            };
+
+            json = skip_json_whitespace(json);
+
+            if (*json == '}')
+            {
+                ++json;
+                break;
+            }
+
+            if (*json++ != ',')
+                goto invalid;
+
+            json = skip_json_whitespace(json);
+        }
+
+    if (!*skip_json_whitespace(json))
+        return entries_count;
+
+invalid:
+    die("%s: %s: failed to parse users_string",
+        __BASE_FILE__,
+        __func__);
+
+    return 0;
+}
+
+cJSON *parse_user(const UsersEntry *entry, unsigned int *states, Problem *problem, char *split_username)
+{
+    cJSON *user_json = cJSON_ParseWithLength(entry->user_string, entry->user_string_size);
+
+    if (!cJSON_IsObject(user_json))
+        die("%s: %s: invalid user '%s'",
+            __BASE_FILE__,
+            __func__,
+            entry->chat_id_string);
+
+    *states = 0;
+    memset(problem, 0, sizeof *problem);
+
+    for (int i = 0; i < STATES_COUNT; ++i)
+        if (cJSON_GetNumberValue(cJSON_GetObjectItem(user_json, state_names[i])))
+            *states |= 1u << i;
+
+    const cJSON *problem_json = cJSON_GetObjectItem(user_json, "problem");
+
+    if (problem_json)
+    {
+        const cJSON *created = cJSON_GetObjectItem(problem_json, "created");
+        const cJSON *approved_at = cJSON_GetObjectItem(problem_json, "approved_at");
+        const cJSON *username = cJSON_GetObjectItem(problem_json, "username");
+        const char *text = cJSON_GetStringValue(cJSON_GetObjectItem(problem_json, "text"));
+
+        if (!text || (username && !cJSON_IsString(username)))
+            die("%s: %s: invalid problem of user '%s'",
+                __BASE_FILE__,
+                __func__,
+                entry->chat_id_string);
+
+        problem->time = cJSON_GetNumberValue(cJSON_GetObjectItem(problem_json, "time"));
+        // Problems saved before the creation time was tracked are ordered by their lifetime start.
+        problem->created = created ? cJSON_GetNumberValue(created) : problem->time;
+
+        // Approval times of older problems are unknown, their creation is the closest one.
+        if (approved_at)
+            problem->approved_at = cJSON_GetNumberValue(approved_at);
+        else if (!(*states & PROBLEM_PENDING_STATE))
+            problem->approved_at = problem->created;
+
+        if (username)
+        {
+            problem->username = cJSON_GetStringValue(username);
+            problem->text = (char *) text;
+        }
+        else
+        {
+            // Problems saved before usernames were kept apart are migrated here.
+            const char *split_text;
+
+            split_problem_text(text, split_username, &split_text);
+
+            problem->username = split_username;
+            problem->text = (char *) split_text;
+        }
+    }
+
+    return user_json;
+}
+
+void export_user(FILE *users_file, const int_fast64_t chat_id, const unsigned int states, const Problem *problem)
+{
+    fprintf(users_file, "\"%" PRIdFAST64 "\":{", chat_id);
+
+    for (int i = 0; i < STATES_COUNT; ++i)
+        fprintf(users_file,
+                "%s\"%s\":%u",
+                i ? "," : "",
+                state_names[i],
+                states >> i & 1);
+
+    if (problem->text)
+    {
+        fprintf(users_file,
+                ",\"problem\":{\"time\":%jd,\"created\":%jd,\"approved_at\":%jd,\"username\":",
+                (intmax_t) problem->time,
+                (intmax_t) problem->created,
+                (intmax_t) problem->approved_at);
+
+        export_string(users_file, problem->username);
+        fputs(",\"text\":", users_file);
+        export_string(users_file, problem->text);
+
+        fputc('}', users_file);
+    }
+
+    fputc('}', users_file);
+}
+
+long write_users(const char *file, const char *tmp_file, const char *dir)
+{
+    FILE *users_file = fopen(tmp_file, "w");
+
+    if (!users_file)
+        return -1;
 
-    if (!users)
-        die("%s: %s: failed to parse users_string",
+    storage_engine->export_users(users_file);
+
+    const long users_file_size = ftell(users_file);
+
+    const int failed = ferror(users_file) ||
+                       fflush(users_file) ||
+                       fsync(fileno(users_file));
+
+    if (fclose(users_file) || failed || rename(tmp_file, file) || sync_dir(dir))
+    {
+        unlink(tmp_file);
+        return -1;
+    }
+
+    return users_file_size;
+}
+
+int sync_dir(const char *dir)
+{
+    const int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if (dir_fd < 0)
+        return -1;
+
+    const int failed = fsync(dir_fd);
+
+    close(dir_fd);
+    return failed ? -1 : 0;
+}
+
+double get_elapsed_milliseconds(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+uint64_t hash_chat_id(const int_fast64_t chat_id)
+{
+    uint64_t x = chat_id;
+
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+size_t find_empty_chat_slot(const ChatSlots *table, const int_fast64_t chat_id)
+{
+    size_t slot = hash_chat_id(chat_id) & table->slots_mask;
+
+    while (!is_empty_chat_slot(table, slot))
+        slot = (slot + 1) & table->slots_mask;
+
+    return slot;
+}
+
+void clear_chat_slot(const ChatSlots *table, size_t slot)
+{
+    for (size_t next_slot = (slot + 1) & table->slots_mask;
+         !is_empty_chat_slot(table, next_slot);
+         next_slot = (next_slot + 1) & table->slots_mask)
+    {
+        const size_t home_slot = hash_chat_id(table->get_chat_id(table->context, get_chat_slot(table, next_slot))) & table->slots_mask;
+
+        if (((next_slot - home_slot) & table->slots_mask) >= ((next_slot - slot) & table->slots_mask))
+        {
+            memcpy(get_chat_slot(table, slot), get_chat_slot(table, next_slot), table->slot_size);
+            slot = next_slot;
+        }
+    }
+
+    memset(get_chat_slot(table, slot), 0, table->slot_size);
+}
+
+/*
+ * Publishes the approved problems of the loaded users and starts the backups.
+ */
+static void start_data_module(void)
+{
+    storage_engine->lock_users();
+
+    atomic_store(&published_approved_problems_generation, atomic_load(&problem_lists_generations[0]));
+    atomic_store(&approved_problems, build_approved_problems());
+
+    storage_engine->unlock_users();
+
+    if (mkdir(DIR_BACKUPS, 0700) && errno != EEXIST)
+        die("%s: %s: failed to create %s",
+            __BASE_FILE__,
+            __func__,
+            DIR_BACKUPS);
+
+    sem_init(&backup_semaphore, 0, 0);
+
+    pthread_t backup_users_thread;
+
+    if (pthread_create(&backup_users_thread,
+                       NULL,
+                       backup_users,
+                       NULL))
+        die("%s: %s: failed to create backup_users_thread",
             __BASE_FILE__,
             __func__);
 
-    free(users_string);
-    users_cache = users;
+    pthread_detach(backup_users_thread);
 }
 
 /*
- * Saves data from the users_cache to the FILE_USERS.
+ * Copies the approved problems into a new version with a single reference.
+ * The version is a single allocation: the header, both pointers arrays and the texts,
+ * measured by a first scan of the list and filled by a second one.
+ * The users must be locked with lock_users.
  */
-static void save_users(void)
+static ApprovedProblems *build_approved_problems(void)
 {
-    char *users_string = cJSON_PrintUnformatted(users_cache);
+    ApprovedProblemsBuild build = {0};
 
-    if (!users_string)
-        die("%s: %s: failed to print users_cache",
+    storage_engine->scan_problems(0, 0, measure_approved_problem, &build);
+    allocate_approved_problems(&build);
+    storage_engine->scan_problems(0, 0, add_approved_problem, &build);
+
+    return build.problems;
+}
+
+/*
+ * Returns a copy of a version, in which the problems of the touched chat_ids are replaced
+ * with their current ones. Only one user is locked at a time, to read its problem.
+ */
+static ApprovedProblems *update_approved_problems(const ApprovedProblems *problems, int_fast64_t *chat_ids, size_t chat_ids_count)
+{
+    // A chat comes once per change, e.g. twice for a problem recreated between the publications.
+    qsort(chat_ids, chat_ids_count, sizeof *chat_ids, compare_chat_ids);
+
+    size_t unique_count = 0;
+
+    for (size_t i = 0; i < chat_ids_count; ++i)
+        if (!unique_count || chat_ids[i] != chat_ids[unique_count - 1])
+            chat_ids[unique_count++] = chat_ids[i];
+
+    chat_ids_count = unique_count;
+
+    ChangedProblems changed = { .problems = malloc(chat_ids_count * sizeof *changed.problems) };
+
+    if (!changed.problems && chat_ids_count)
+        die("%s: %s: failed to allocate memory for changed problems",
             __BASE_FILE__,
             __func__);
 
-    FILE *users_file = fopen(FILE_USERS, "w");
+    for (size_t i = 0; i < chat_ids_count; ++i)
+        storage_engine->find_problem(chat_ids[i], 0, 0, add_changed_problem, &changed);
 
-    if (!users_file)
-        die("%s: %s: failed to open %s",
+    qsort(changed.problems, changed.problems_count, sizeof *changed.problems, compare_changed_problems);
+
+    ApprovedProblemsBuild build = {0};
+
+    for (size_t i = 0; i < problems->problems_count; ++i)
+        if (!bsearch(&problems->chat_ids[i], chat_ids, chat_ids_count, sizeof *chat_ids, compare_chat_ids))
+        {
+            ++build.problems_count;
+            build.texts_size += strlen(problems->problems_with_chat_ids[i]) + strlen(problems->usernames[i]) + 2;
+        }
+
+    for (size_t i = 0; i < changed.problems_count; ++i)
+    {
+        ++build.problems_count;
+        build.texts_size += changed.problems[i].text_size;
+    }
+
+    allocate_approved_problems(&build);
+
+    // Both the kept and the changed problems are in the creation order, so they are merged.
+    size_t j = 0;
+
+    for (size_t i = 0; i < problems->problems_count; ++i)
+    {
+        if (bsearch(&problems->chat_ids[i], chat_ids, chat_ids_count, sizeof *chat_ids, compare_chat_ids))
+            continue;
+
+        for (; j < changed.problems_count; ++j)
+        {
+            const ChangedProblem *changed_problem = &changed.problems[j];
+
+            if (changed_problem->created > problems->created_times[i] ||
+                (changed_problem->created == problems->created_times[i] && changed_problem->chat_id > problems->chat_ids[i]))
+                break;
+
+            copy_approved_problem(&build,
+                                  changed_problem->chat_id,
+                                  changed_problem->created,
+                                  changed_problem->text,
+                                  changed_problem->problem_offset,
+                                  changed_problem->text_size);
+        }
+
+        const char *text = problems->problems_with_chat_ids[i];
+
+        copy_approved_problem(&build,
+                              problems->chat_ids[i],
+                              problems->created_times[i],
+                              text,
+                              problems->problems[i] - text,
+                              problems->usernames[i] + strlen(problems->usernames[i]) + 1 - text);
+    }
+
+    for (; j < changed.problems_count; ++j)
+        copy_approved_problem(&build,
+                              changed.problems[j].chat_id,
+                              changed.problems[j].created,
+                              changed.problems[j].text,
+                              changed.problems[j].problem_offset,
+                              changed.problems[j].text_size);
+
+    for (size_t i = 0; i < changed.problems_count; ++i)
+        free(changed.problems[i].text);
+
+    free(changed.problems);
+
+    return build.problems;
+}
+
+static void measure_approved_problem(void *approved_problems_build, const int_fast64_t chat_id, const Problem *problem)
+{
+    ApprovedProblemsBuild *build = approved_problems_build;
+
+    ++build->problems_count;
+    build->texts_size += format_problem(NULL, 0, chat_id, problem, 1) + strlen(problem->username) + 2;
+}
+
+static void add_approved_problem(void *approved_problems_build, const int_fast64_t chat_id, const Problem *problem)
+{
+    ApprovedProblemsBuild *build = approved_problems_build;
+    ApprovedProblems *problems = build->problems;
+    const size_t i = problems->problems_count++;
+
+    const int problem_size = format_problem(build->text, build->texts_end - build->text, chat_id, problem, 1);
+
+    problems->chat_ids[i] = chat_id;
+    problems->created_times[i] = problem->created;
+    problems->problems_with_chat_ids[i] = build->text;
+    problems->problems[i] = build->text + problem_size - format_problem(NULL, 0, chat_id, problem, 0);
+
+    build->text += problem_size + 1;
+
+    strcpy(build->text, problem->username);
+    problems->usernames[i] = build->text;
+
+    build->text += strlen(problem->username) + 1;
+}
+
+static void add_changed_problem(void *changed_problems, const int_fast64_t chat_id, const Problem *problem)
+{
+    ChangedProblems *changed = changed_problems;
+    ChangedProblem *changed_problem = &changed->problems[changed->problems_count++];
+
+    const int problem_size = format_problem(NULL, 0, chat_id, problem, 1);
+
+    changed_problem->chat_id = chat_id;
+    changed_problem->created = problem->created;
+    changed_problem->problem_offset = problem_size - format_problem(NULL, 0, chat_id, problem, 0);
+    changed_problem->text_size = problem_size + strlen(problem->username) + 2;
+
+    if (!(changed_problem->text = malloc(changed_problem->text_size)))
+        die("%s: %s: failed to allocate memory for text",
             __BASE_FILE__,
-            __func__,
-            FILE_USERS);
+            __func__);
 
-    fprintf(users_file, "%s", users_string);
+    format_problem(changed_problem->text, problem_size + 1, chat_id, problem, 1);
+    strcpy(changed_problem->text + problem_size + 1, problem->username);
+}
 
-    fclose(users_file);
-    free(users_string);
+/*
+ * Allocates a version for the measured build with a single reference.
+ * The version is a single allocation: the header, the chat ids, the creation times,
+ * the pointers arrays and the texts.
+ */
+static void allocate_approved_problems(ApprovedProblemsBuild *build)
+{
+    ApprovedProblems *problems = malloc(sizeof *problems +
+                                        build->problems_count * (sizeof(int_fast64_t) + sizeof(time_t) + 3 * sizeof(char *)) +
+                                        build->texts_size);
+
+    if (!problems)
+        die("%s: %s: failed to allocate memory for problems",
+            __BASE_FILE__,
+            __func__);
+
+    atomic_init(&problems->references, 1);
+    problems->generation = atomic_load(&problem_lists_generations[0]);
+    problems->problems_count = 0;
+    problems->chat_ids = (int_fast64_t *) (problems + 1);
+    problems->created_times = (time_t *) (problems->chat_ids + build->problems_count);
+    problems->problems = (const char **) (problems->created_times + build->problems_count);
+    problems->problems_with_chat_ids = problems->problems + build->problems_count;
+    problems->usernames = problems->problems_with_chat_ids + build->problems_count;
+
+    build->problems = problems;
+    build->text = (char *) (problems->usernames + build->problems_count);
+    build->texts_end = build->text + build->texts_size;
+}
+
+/*
+ * Appends a problem formatted like in a version, its text_size bytes including both terminators.
+ */
+static void copy_approved_problem(ApprovedProblemsBuild *build,
+                                  const int_fast64_t chat_id,
+                                  const time_t created,
+                                  const char *text,
+                                  const size_t problem_offset,
+                                  const size_t text_size)
+{
+    ApprovedProblems *problems = build->problems;
+    const size_t i = problems->problems_count++;
+
+    memcpy(build->text, text, text_size);
+
+    problems->chat_ids[i] = chat_id;
+    problems->created_times[i] = created;
+    problems->problems_with_chat_ids[i] = build->text;
+    problems->problems[i] = build->text + problem_offset;
+    problems->usernames[i] = build->text + strlen(build->text) + 1;
+
+    build->text += text_size;
+}
+
+static int compare_chat_ids(const void *chat_id, const void *other_chat_id)
+{
+    const int_fast64_t a = *(const int_fast64_t *) chat_id;
+    const int_fast64_t b = *(const int_fast64_t *) other_chat_id;
+
+    return (a > b) - (a < b);
+}
+
+/*
+ * Orders the problems like the problem lists: by the creation time, then by the chat id.
+ */
+static int compare_changed_problems(const void *problem, const void *other_problem)
+{
+    const ChangedProblem *a = problem;
+    const ChangedProblem *b = other_problem;
+
+    if (a->created != b->created)
+        return a->created < b->created ? -1 : 1;
+
+    return (a->chat_id > b->chat_id) - (a->chat_id < b->chat_id);
+}
+
+/*
+ * A reader, which has loaded the old pointer, entered its counter before the swap
+ * and takes its reference before leaving, so the old version is unused once both counters
+ * have been 0 since. The phase is switched before each wait, so new readers enter the other
+ * counter and can't keep the waited one above 0.
+ */
+static void wait_approved_problems_readers(void)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        const unsigned int phase = atomic_fetch_add(&approved_problems_phase, 1) & 1;
+
+        while (atomic_load(&approved_problems_readers[phase]))
+            sched_yield();
+    }
+}
+
+static char *skip_json_whitespace(char *json)
+{
+    while (*json == ' ' || *json == '\t' || *json == '\n' || *json == '\r')
+        ++json;
+
+    return json;
+}
+
+/*
+ * Returns the closing quote of the string starting at json or NULL if there is none.
+ */
+static char *skip_json_string(char *json)
+{
+    if (*json != '"')
+        return NULL;
+
+    for (++json; *json != '"'; ++json)
+        if (!*json || (*json == '\\' && !*++json))
+            return NULL;
+
+    return json;
+}
+
+/*
+ * Returns the end of the value starting at json or NULL if it isn't terminated.
+ * Only strings and brackets are checked, the value itself is validated by its parser.
+ */
+static char *skip_json_value(char *json)
+{
+    size_t depth = 0;
+
+    do
+    {
+        switch (*json)
+        {
+            case 0:
+                return NULL;
+
+            case '"':
+                if (!(json = skip_json_string(json)))
+                    return NULL;
+
+                break;
+
+            case '{':
+            case '[':
+                ++depth;
+                break;
+
+            case '}':
+            case ']':
+                if (!depth)
+                    return json;
+
+                --depth;
+                break;
+
+            case ',':
+                if (!depth)
+                    return json;
+
+                break;
+        }
+
+        ++json;
+    }
+    while (depth || (*json != ',' && *json != '}' && *json != ']' && *json != ' ' &&
+                     *json != '\t' && *json != '\n' && *json != '\r' && *json));
+
+    return json;
+}
+
+/*
+ * Writes a JSON string literal, escaping the same characters as cJSON does.
+ */
+static void export_string(FILE *users_file, const char *string)
+{
+    fputc('"', users_file);
+
+    for (const unsigned char *c = (const unsigned char *) string; *c; ++c)
+        switch (*c)
+        {
+            case '"':
+                fputs("\\\"", users_file);
+                break;
+
+            case '\\':
+                fputs("\\\\", users_file);
+                break;
+
+            case '\b':
+                fputs("\\b", users_file);
+                break;
+
+            case '\f':
+                fputs("\\f", users_file);
+                break;
+
+            case '\n':
+                fputs("\\n", users_file);
+                break;
+
+            case '\r':
+                fputs("\\r", users_file);
+                break;
+
+            case '\t':
+                fputs("\\t", users_file);
+                break;
+
+            default:
+                if (*c < 0x20)
+                    fprintf(users_file, "\\u%04x", *c);
+                else
+                    fputc(*c, users_file);
+        }
+
+    fputc('"', users_file);
+}
+
+/*
+ * Takes a backup every backup_interval seconds (if it isn't 0) and on every request_backup.
+ */
+static void *backup_users(void *_)
+{
+    (void) _;
+
+    for (;;)
+    {
+        if (!backup_interval)
+            sem_wait(&backup_semaphore);
+        else
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += backup_interval;
+
+            while (sem_timedwait(&backup_semaphore, &deadline) && errno == EINTR);
+        }
+
+        take_backup();
+    }
+
+    return NULL;
+}
+
+/*
+ * Saves a consistent copy of the users to the DIR_BACKUPS without stopping the daemon,
+ * see the save_backup of the storage engine.
+ */
+static void take_backup(void)
+{
+    const time_t current_time = time(NULL);
+
+    struct tm current_tm;
+    localtime_r(&current_time, &current_tm);
+
+    char backup_file[sizeof DIR_BACKUPS + 32];
+    strftime(backup_file,
+             sizeof backup_file,
+             DIR_BACKUPS "users-%Y%m%d-%H%M%S.json",
+             &current_tm);
+
+    char backup_tmp_file[sizeof backup_file + 4];
+    snprintf(backup_tmp_file,
+             sizeof backup_tmp_file,
+             "%s.tmp",
+             backup_file);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const double pause = storage_engine->save_backup(backup_file, backup_tmp_file);
+
+    if (pause < 0)
+    {
+        report("Failed to save users backup %s",
+               backup_file);
+        return;
+    }
+
+    report("Users backup %s saved in %.2f ms (writers paused for %.2f ms)",
+           backup_file,
+           get_elapsed_milliseconds(&start),
+           pause);
+
+    if (backups_count)
+        delete_old_backups();
+
+    storage_engine->report_footprint();
+}
+
+/*
+ * Deletes the backups older than the backups_count newest ones.
+ * The names of the backups sort in the order they were taken.
+ */
+static void delete_old_backups(void)
+{
+    struct dirent **entries;
+    const int entries_count = scandir(DIR_BACKUPS, &entries, is_backup_file, alphasort);
+
+    if (entries_count < 0)
+    {
+        report("Failed to list users backups in %s",
+               DIR_BACKUPS);
+        return;
+    }
+
+    for (int i = 0; i < entries_count; ++i)
+    {
+        if (i < entries_count - backups_count)
+        {
+            char backup_file[sizeof DIR_BACKUPS + 256];
+            snprintf(backup_file,
+                     sizeof backup_file,
+                     DIR_BACKUPS "%s",
+                     entries[i]->d_name);
+
+            if (unlink(backup_file) && errno != ENOENT)
+                report("Failed to delete old users backup %s",
+                       backup_file);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+}
+
+/*
+ * Moves change_time forward to the modification time of a file, if it exists.
+ */
+static void update_change_time(const char *file, struct timespec *change_time)
+{
+    struct stat file_stat;
+
+    if (stat(file, &file_stat))
+        return;
+
+    if (file_stat.st_mtim.tv_sec > change_time->tv_sec ||
+        (file_stat.st_mtim.tv_sec == change_time->tv_sec && file_stat.st_mtim.tv_nsec > change_time->tv_nsec))
+        *change_time = file_stat.st_mtim;
+}
+
+static int is_backup_file(const struct dirent *entry)
+{
+    const size_t name_size = strlen(entry->d_name);
+
+    return !strncmp(entry->d_name, "users-", 6) &&
+           name_size > 5 &&
+           !strcmp(entry->d_name + name_size - 5, ".json");
+}
+
+static unsigned char *get_chat_slot(const ChatSlots *table, const size_t slot)
+{
+    return (unsigned char *) table->slots + slot * table->slot_size;
+}
+
+static int is_empty_chat_slot(const ChatSlots *table, const size_t slot)
+{
+    const unsigned char *slot_data = get_chat_slot(table, slot);
+
+    for (size_t i = 0; i < table->slot_size; ++i)
+        if (slot_data[i])
+            return 0;
+
+    return 1;
 }
@@ -0,0 +1,699 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "log.h"
+#include "checksum.h"
+#include "uring.h"
+#include "storage.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC   0x4A4B4F48 // "HOKJ".
+#define JOURNAL_VERSION 2
+
+/*
+ * The journal file starts with a JournalHeader and continues with records,
+ * each of which is a RecordHeader followed by record_size bytes.
+ * The checksum covers the record_size field and the record bytes,
+ * so a torn length can't make replay read garbage as a record.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t records_version;
+}
+JournalHeader;
+
+typedef struct
+{
+    uint32_t record_size;
+    uint32_t checksum;
+}
+RecordHeader;
+
+typedef enum
+{
+    POLICY_INTERVAL,
+    POLICY_MUTATIONS,
+    POLICY_SYNC
+}
+Policy;
+
+/*
+ * Encoded records waiting for a commit.
+ */
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t records_count;
+}
+Batch;
+
+static size_t replay_records(const int fd,
+                             const uint32_t records_version,
+                             void (*apply_record)(const uint32_t records_version,
+                                                  const unsigned char *record,
+                                                  const size_t record_size));
+static void *persist_journal(void *_);
+static void wait_batch(void);
+static void commit_batch(void);
+static void report_journal_stats(void);
+static void get_deadline(struct timespec *deadline, const long milliseconds);
+static uint32_t get_record_checksum(const uint32_t record_size, const void *record);
+static void write_synced(const void *data, const size_t data_size);
+
+static const char *journal_file;
+static int journal_fd = -1;
+static size_t journal_size;
+static uint32_t journal_records_version;
+
+static Policy journal_policy;
+static long journal_policy_value;
+
+static void (*compact_users)(void);
+
+/*
+ * replicated_size is the size of the pending_batch, which is left out of what's passed
+ * to replicate, since it was appended before replicate_journal.
+ */
+static void (*replicate_records)(const void *records, const size_t records_size, const uint_fast64_t sequence);
+static size_t replicated_size;
+
+/*
+ * Appenders only touch the pending_batch under the journal_mutex.
+ * The journal thread swaps it with the writing_batch and writes the latter
+ * under the journal_io_mutex, which reset_journal takes as well, so a batch
+ * can never be written after the journal was reset under it.
+ * Lock order: journal_io_mutex, then journal_mutex.
+ */
+static Batch pending_batch;
+static Batch writing_batch;
+
+static uint_fast64_t appended_sequence;
+static uint_fast64_t committed_sequence;
+
+static pthread_mutex_t journal_mutex    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t journal_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appended_cond;
+static pthread_cond_t committed_cond;
+
+static size_t stats_commits_count;
+static size_t stats_records_count;
+static size_t stats_max_batch_size;
+static double stats_latency;
+static double stats_max_latency;
+static time_t stats_start_time;
+
+int set_journal_policy(const char *policy)
+{
+    if (!strcmp(policy, "sync"))
+    {
+        journal_policy = POLICY_SYNC;
+        journal_policy_value = 0;
+        return 0;
+    }
+
+    const char *value;
+
+    if (!strncmp(policy, "interval:", 9))
+    {
+        journal_policy = POLICY_INTERVAL;
+        value = policy + 9;
+    }
+    else if (!strncmp(policy, "mutations:", 10))
+    {
+        journal_policy = POLICY_MUTATIONS;
+        value = policy + 10;
+    }
+    else
+        return -1;
+
+    char *end;
+    journal_policy_value = strtol(value, &end, 10);
+
+    if (*end || end == value || journal_policy_value <= 0)
+        return -1;
+
+    return 0;
+}
+
+uint32_t open_journal(const char *file,
+                      const uint32_t records_version,
+                      void (*apply_record)(const uint32_t records_version,
+                                           const unsigned char *record,
+                                           const size_t record_size),
+                      void (*compact)(void))
+{
+    journal_file = file;
+    journal_records_version = records_version;
+    uint32_t replayed_records_version = records_version;
+
+    if (!journal_policy_value && journal_policy != POLICY_SYNC)
+        set_journal_policy(DEFAULT_JOURNAL_POLICY);
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+
+    pthread_cond_init(&appended_cond, &condattr);
+    pthread_cond_init(&committed_cond, &condattr);
+
+    pthread_condattr_destroy(&condattr);
+
+    if ((journal_fd = open(journal_file, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            journal_file);
+
+    JournalHeader journal_header;
+    const ssize_t journal_header_size = read(journal_fd, &journal_header, sizeof journal_header);
+
+    if (journal_header_size != sizeof journal_header || !apply_record)
+        // A new journal, a crash before its header was written or records saved elsewhere.
+        reset_journal();
+    else if (journal_header.magic != JOURNAL_MAGIC || journal_header.version != JOURNAL_VERSION)
+        die("%s: %s: %s has unknown format",
+            __BASE_FILE__,
+            __func__,
+            journal_file);
+    else if (journal_header.records_version > records_version)
+        die("%s: %s: %s has records of unsupported version %" PRIu32,
+            __BASE_FILE__,
+            __func__,
+            journal_file,
+            journal_header.records_version);
+    else
+    {
+        replayed_records_version = journal_header.records_version;
+
+        const size_t valid_size = sizeof journal_header + replay_records(journal_fd, replayed_records_version, apply_record);
+        const off_t file_size = lseek(journal_fd, 0, SEEK_END);
+
+        if (file_size > (off_t) valid_size)
+        {
+            if (ftruncate(journal_fd, valid_size))
+                die("%s: %s: failed to truncate %s",
+                    __BASE_FILE__,
+                    __func__,
+                    journal_file);
+
+            report("Journal tail of %zu bytes is damaged and was discarded",
+                   (size_t) file_size - valid_size);
+        }
+
+        journal_size = valid_size;
+    }
+
+    compact_users = compact;
+
+    stats_start_time = time(NULL);
+
+    pthread_t persist_journal_thread;
+
+    if (pthread_create(&persist_journal_thread,
+                       NULL,
+                       persist_journal,
+                       NULL))
+        die("%s: %s: failed to create persist_journal_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(persist_journal_thread);
+
+    return replayed_records_version;
+}
+
+uint_fast64_t append_journal_record(const void *record, const size_t record_size)
+{
+    if (record_size > MAX_JOURNAL_RECORD_SIZE)
+        die("%s: %s: record is too big",
+            __BASE_FILE__,
+            __func__);
+
+    RecordHeader record_header;
+    record_header.record_size = record_size;
+    record_header.checksum = get_record_checksum(record_size, record);
+
+    pthread_mutex_lock(&journal_mutex);
+
+    const size_t new_size = pending_batch.size + sizeof record_header + record_size;
+
+    if (new_size > pending_batch.capacity)
+    {
+        size_t new_capacity = pending_batch.capacity ? pending_batch.capacity : 4 * MAX_JOURNAL_RECORD_SIZE;
+
+        while (new_capacity < new_size)
+            new_capacity *= 2;
+
+        if (!(pending_batch.data = realloc(pending_batch.data, new_capacity)))
+            die("%s: %s: failed to reallocate memory for pending_batch.data",
+                __BASE_FILE__,
+                __func__);
+
+        pending_batch.capacity = new_capacity;
+    }
+
+    memcpy(pending_batch.data + pending_batch.size, &record_header, sizeof record_header);
+    memcpy(pending_batch.data + pending_batch.size + sizeof record_header, record, record_size);
+
+    pending_batch.size = new_size;
+    ++pending_batch.records_count;
+
+    journal_size += sizeof record_header + record_size;
+    const uint_fast64_t sequence = ++appended_sequence;
+
+    if (journal_policy == POLICY_SYNC ||
+        (journal_policy == POLICY_MUTATIONS && pending_batch.records_count >= (size_t) journal_policy_value))
+        pthread_cond_signal(&appended_cond);
+
+    pthread_mutex_unlock(&journal_mutex);
+    return sequence;
+}
+
+void wait_journal_record(const uint_fast64_t sequence)
+{
+    if (journal_policy != POLICY_SYNC)
+        return;
+
+    pthread_mutex_lock(&journal_mutex);
+
+    while (committed_sequence < sequence)
+        pthread_cond_wait(&committed_cond, &journal_mutex);
+
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void flush_journal(void)
+{
+    commit_batch();
+}
+
+size_t get_journal_size(void)
+{
+    pthread_mutex_lock(&journal_mutex);
+    const size_t size = journal_size;
+    pthread_mutex_unlock(&journal_mutex);
+
+    return size;
+}
+
+uint32_t replay_journal(const char *file,
+                        const uint32_t records_version,
+                        void (*apply_record)(const uint32_t records_version,
+                                             const unsigned char *record,
+                                             const size_t record_size))
+{
+    const int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            file);
+
+    JournalHeader journal_header;
+
+    // A crash before the header was written leaves no records.
+    if (read(fd, &journal_header, sizeof journal_header) != sizeof journal_header)
+    {
+        close(fd);
+        return records_version;
+    }
+
+    if (journal_header.magic != JOURNAL_MAGIC ||
+        journal_header.version != JOURNAL_VERSION ||
+        journal_header.records_version > records_version)
+        die("%s: %s: %s has unknown format",
+            __BASE_FILE__,
+            __func__,
+            file);
+
+    replay_records(fd, journal_header.records_version, apply_record);
+    close(fd);
+
+    return journal_header.records_version;
+}
+
+void rotate_journal(const char *old_file, const char *dir)
+{
+    pthread_mutex_lock(&journal_io_mutex);
+    pthread_mutex_lock(&journal_mutex);
+
+    if (rename(journal_file, old_file))
+        die("%s: %s: failed to rename %s",
+            __BASE_FILE__,
+            __func__,
+            journal_file);
+
+    close(journal_fd);
+
+    if ((journal_fd = open(journal_file, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            journal_file);
+
+    JournalHeader journal_header;
+    journal_header.magic = JOURNAL_MAGIC;
+    journal_header.version = JOURNAL_VERSION;
+    journal_header.records_version = journal_records_version;
+
+    write_synced(&journal_header, sizeof journal_header);
+
+    // Records are committed to the new file only once it can't disappear in a crash.
+    if (sync_dir(dir))
+        die("%s: %s: failed to sync %s",
+            __BASE_FILE__,
+            __func__,
+            dir);
+
+    // Queued records go to the new file, replaying them over what the caller saves is harmless.
+    journal_size = sizeof journal_header + pending_batch.size;
+
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_mutex_unlock(&journal_io_mutex);
+}
+
+void reset_journal(void)
+{
+    pthread_mutex_lock(&journal_io_mutex);
+    pthread_mutex_lock(&journal_mutex);
+
+    if (ftruncate(journal_fd, 0))
+        die("%s: %s: failed to truncate %s",
+            __BASE_FILE__,
+            __func__,
+            journal_file);
+
+    JournalHeader journal_header;
+    journal_header.magic = JOURNAL_MAGIC;
+    journal_header.version = JOURNAL_VERSION;
+    journal_header.records_version = journal_records_version;
+
+    write_synced(&journal_header, sizeof journal_header);
+
+    journal_size = sizeof journal_header;
+
+    if (replicate_records && pending_batch.size > replicated_size)
+        replicate_records(pending_batch.data + replicated_size, pending_batch.size - replicated_size, appended_sequence);
+
+    pending_batch.size = 0;
+    pending_batch.records_count = 0;
+    replicated_size = 0;
+
+    // Queued records are covered by whatever the caller has saved.
+    committed_sequence = appended_sequence;
+    pthread_cond_broadcast(&committed_cond);
+
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_mutex_unlock(&journal_io_mutex);
+}
+
+uint_fast64_t replicate_journal(void (*replicate)(const void *records,
+                                                  const size_t records_size,
+                                                  const uint_fast64_t sequence))
+{
+    pthread_mutex_lock(&journal_io_mutex);
+    pthread_mutex_lock(&journal_mutex);
+
+    replicate_records = replicate;
+    replicated_size = pending_batch.size;
+
+    const uint_fast64_t sequence = appended_sequence;
+
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_mutex_unlock(&journal_io_mutex);
+
+    return sequence;
+}
+
+int apply_journal_records(const void *records,
+                          const size_t records_size,
+                          const uint32_t records_version,
+                          void (*apply_record)(const uint32_t records_version,
+                                               const unsigned char *record,
+                                               const size_t record_size))
+{
+    const unsigned char *data = records;
+    size_t offset = 0;
+
+    while (offset < records_size)
+    {
+        RecordHeader record_header;
+
+        if (records_size - offset < sizeof record_header)
+            return -1;
+
+        memcpy(&record_header, data + offset, sizeof record_header);
+        offset += sizeof record_header;
+
+        if (record_header.record_size > MAX_JOURNAL_RECORD_SIZE ||
+            records_size - offset < record_header.record_size ||
+            get_record_checksum(record_header.record_size, data + offset) != record_header.checksum)
+            return -1;
+
+        apply_record(records_version, data + offset, record_header.record_size);
+        offset += record_header.record_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Passes the records of a journal file, read from its current offset, to apply_record
+ * up to the end or a torn or corrupted record. Returns the size of the passed records.
+ */
+static size_t replay_records(const int fd,
+                             const uint32_t records_version,
+                             void (*apply_record)(const uint32_t records_version,
+                                                  const unsigned char *record,
+                                                  const size_t record_size))
+{
+    size_t valid_size = 0;
+    unsigned char record[MAX_JOURNAL_RECORD_SIZE];
+
+    for (;;)
+    {
+        RecordHeader record_header;
+
+        if (read(fd, &record_header, sizeof record_header) != sizeof record_header ||
+            record_header.record_size > sizeof record ||
+            read(fd, record, record_header.record_size) != (ssize_t) record_header.record_size ||
+            get_record_checksum(record_header.record_size, record) != record_header.checksum)
+            break;
+
+        apply_record(records_version, record, record_header.record_size);
+        valid_size += sizeof record_header + record_header.record_size;
+    }
+
+    return valid_size;
+}
+
+/*
+ * Commits records according to the journal_policy, reports statistics and
+ * lets the data module compact the journal when it grows too big.
+ */
+static void *persist_journal(void *_)
+{
+    (void) _;
+
+    for (;;)
+    {
+        wait_batch();
+        commit_batch();
+
+        if (difftime(time(NULL), stats_start_time) >= MAX_JOURNAL_STATS_INTERVAL)
+            report_journal_stats();
+
+        compact_users();
+    }
+
+    return NULL;
+}
+
+/*
+ * Blocks until the pending_batch should be committed according to the journal_policy.
+ */
+static void wait_batch(void)
+{
+    if (journal_policy == POLICY_INTERVAL)
+    {
+        const struct timespec interval =
+        {
+            journal_policy_value / 1000,
+            journal_policy_value % 1000 * 1000000
+        };
+
+        nanosleep(&interval, NULL);
+        return;
+    }
+
+    pthread_mutex_lock(&journal_mutex);
+
+    if (journal_policy == POLICY_SYNC)
+        while (!pending_batch.records_count)
+            pthread_cond_wait(&appended_cond, &journal_mutex);
+    else
+    {
+        struct timespec deadline;
+        get_deadline(&deadline, MAX_JOURNAL_COMMIT_DELAY);
+
+        while (pending_batch.records_count < (size_t) journal_policy_value)
+            if (pthread_cond_timedwait(&appended_cond, &journal_mutex, &deadline) == ETIMEDOUT)
+            {
+                if (pending_batch.records_count)
+                    break;
+
+                get_deadline(&deadline, MAX_JOURNAL_COMMIT_DELAY);
+            }
+    }
+
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/*
+ * Writes all pending records with one write and one fdatasync, submitted together.
+ */
+static void commit_batch(void)
+{
+    pthread_mutex_lock(&journal_io_mutex);
+    pthread_mutex_lock(&journal_mutex);
+
+    const Batch batch = pending_batch;
+    pending_batch = writing_batch;
+    writing_batch = batch;
+
+    const uint_fast64_t sequence = appended_sequence;
+    const size_t skipped_size = replicated_size;
+
+    replicated_size = 0;
+
+    pthread_mutex_unlock(&journal_mutex);
+
+    // The records are replicated first, so a replica has every record that's on the disk.
+    if (replicate_records && writing_batch.size > skipped_size)
+        replicate_records(writing_batch.data + skipped_size, writing_batch.size - skipped_size, sequence);
+
+    if (writing_batch.records_count)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        write_synced(writing_batch.data, writing_batch.size);
+
+        const double latency = get_elapsed_milliseconds(&start);
+
+        ++stats_commits_count;
+        stats_records_count += writing_batch.records_count;
+        stats_latency += latency;
+
+        if (writing_batch.records_count > stats_max_batch_size)
+            stats_max_batch_size = writing_batch.records_count;
+
+        if (latency > stats_max_latency)
+            stats_max_latency = latency;
+
+        writing_batch.size = 0;
+        writing_batch.records_count = 0;
+    }
+
+    pthread_mutex_lock(&journal_mutex);
+
+    committed_sequence = sequence;
+    pthread_cond_broadcast(&committed_cond);
+
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_mutex_unlock(&journal_io_mutex);
+}
+
+static void report_journal_stats(void)
+{
+    pthread_mutex_lock(&journal_io_mutex);
+
+    if (stats_commits_count)
+        report("Journal made %zu commits: %.1f records per commit on average (max %zu), "
+               "%.2f ms commit latency on average (max %.2f ms)",
+               stats_commits_count,
+               (double) stats_records_count / stats_commits_count,
+               stats_max_batch_size,
+               stats_latency / stats_commits_count,
+               stats_max_latency);
+
+    stats_commits_count = 0;
+    stats_records_count = 0;
+    stats_max_batch_size = 0;
+    stats_latency = 0;
+    stats_max_latency = 0;
+    stats_start_time = time(NULL);
+
+    pthread_mutex_unlock(&journal_io_mutex);
+}
+
+static void get_deadline(struct timespec *deadline, const long milliseconds)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    deadline->tv_sec += milliseconds / 1000;
+    deadline->tv_nsec += milliseconds % 1000 * 1000000;
+
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static uint32_t get_record_checksum(const uint32_t record_size, const void *record)
+{
+    return update_crc32(update_crc32(0, &record_size, sizeof record_size), record, record_size);
+}
+
+/*
+ * Appends data to the journal file and syncs it, see write_file.
+ */
+static void write_synced(const void *data, const size_t data_size)
+{
+    if (write_file(journal_fd, data, data_size, -1, 1))
+        die("%s: %s: failed to write to %s",
+            __BASE_FILE__,
+            __func__,
+            journal_file);
+}
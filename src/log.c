@@ -26,46 +26,86 @@
  ******************************************************************************/
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include "uring.h"
 #include "log.h"
 
-static pthread_mutex_t info_log_mutex  = PTHREAD_MUTEX_INITIALIZER;
+#define MAX_REPORT_SIZE 4096
+
 static pthread_mutex_t error_log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * The line is formatted first and appended with a single write_file, which O_APPEND
+ * keeps whole, so reports of different threads don't wait for each other.
+ * The FILE_INFOLOG is opened for every report, so a rotated log is never written to.
+ */
 void report(const char *fmt, ...)
 {
-    pthread_mutex_lock(&info_log_mutex);
-
-    FILE *info_log = fopen(FILE_INFOLOG, "a");
-
-    if (!info_log)
-        die("%s: %s: failed to open %s",
-            __BASE_FILE__,
-            __func__,
-            FILE_INFOLOG);
-
     const time_t current_time = time(NULL);
 
+    struct tm current_tm;
+    localtime_r(&current_time, &current_tm);
+
     char timestamp[MAX_TIMESTAMP_SIZE + 1];
     strftime(timestamp,
              sizeof timestamp,
              "[%Y-%m-%d %H:%M:%S]",
-             localtime(&current_time));
+             &current_tm);
+
+    char line[MAX_REPORT_SIZE];
+    char *report_line = line;
+
+    const int timestamp_size = sprintf(line, "%s ", timestamp);
 
-    fprintf(info_log, "%s ", timestamp);
     va_list argp;
     va_start(argp, fmt);
-    vfprintf(info_log, fmt, argp);
+    const int message_size = vsnprintf(line + timestamp_size, sizeof line - timestamp_size, fmt, argp);
     va_end(argp);
-    fputc('\n', info_log);
 
-    fclose(info_log);
+    const size_t line_size = timestamp_size + message_size + 1; // With the newline.
+
+    // A message, which doesn't fit the line, is formatted again into a bigger one.
+    if (line_size >= sizeof line)
+    {
+        if (!(report_line = malloc(line_size + 1)))
+            die("%s: %s: failed to allocate memory for report_line",
+                __BASE_FILE__,
+                __func__);
+
+        memcpy(report_line, line, timestamp_size);
 
-    pthread_mutex_unlock(&info_log_mutex);
+        va_start(argp, fmt);
+        vsprintf(report_line + timestamp_size, fmt, argp);
+        va_end(argp);
+    }
+
+    report_line[line_size - 1] = '\n';
+
+    const int info_log_fd = open(FILE_INFOLOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+
+    if (info_log_fd < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_INFOLOG);
+
+    if (write_file(info_log_fd, report_line, line_size, -1, 0))
+        die("%s: %s: failed to write to %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_INFOLOG);
+
+    close(info_log_fd);
+
+    if (report_line != line)
+        free(report_line);
 }
 
 void die(const char *fmt, ...)
@@ -78,11 +118,14 @@ void die(const char *fmt, ...)
     {
         const time_t current_time = time(NULL);
 
+        struct tm current_tm;
+        localtime_r(&current_time, &current_tm);
+
         char timestamp[MAX_TIMESTAMP_SIZE + 1];
         strftime(timestamp,
                  sizeof timestamp,
                  "[%Y-%m-%d %H:%M:%S]",
-                 localtime(&current_time));
+                 &current_tm);
 
         fprintf(error_log, "%s ", timestamp);
         va_list argp;
@@ -27,6 +27,7 @@
 
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -41,6 +42,9 @@
 #include "log.h"
 #include "requests.h"
 #include "data.h"
+#include "archive.h"
+#include "workers.h"
+#include "replication.h"
 #include "bot.h"
 
 #define ERRORSTAMP "\e[0;31;1mError:\e[0m"
@@ -52,30 +56,72 @@ static void handle_args(int argc, char **argv);
 static void init_pw(void);
 static void check_instance(void);
 static void drop_privileges(void);
+static void check_storage(void);
+static void convert(void);
+static void export(void);
+static void query(void);
+static void follow(void);
 static void daemonize(void);
 static void init_signals(void);
 static void init_modules(void);
 static void init_info(void);
+static void *wait_signals(void *_);
 static void handle_signal(const int signal);
+static void run_worker(void);
 
 static int maintenance_mode = 0;
+static int convert_mode = 0;
+static int export_mode = 0;
+static int query_mode = 0;
+static volatile int standby_mode = 0;
+
+static ArchiveQuery archive_query;
 
 static struct passwd *pw;
 
+static int lock_fd;
+
 static pid_t pid;
 static char *mode;
 
+static sigset_t waited_signals;
+
 int main(int argc, char **argv)
 {
     handle_args(argc, argv);
 
     init_pw();
-    check_instance();
+
+    // The archive is only appended to, so it can be queried beside a working hok-daemon.
+    if (!query_mode)
+        check_instance();
+
     drop_privileges();
 
+    // The maintenance mode doesn't load users, and a standby gets them from the primary.
+    if (!query_mode && !maintenance_mode && !standby_mode)
+        check_storage();
+
+    if (convert_mode)
+        convert();
+
+    if (export_mode)
+        export();
+
+    if (query_mode)
+        query();
+
     daemonize();
 
+    // The workers are forked before any thread exists, see start_workers.
+    if (!maintenance_mode)
+        start_workers(run_worker);
+
     init_signals();
+
+    if (standby_mode)
+        follow();
+
     init_modules();
     init_info();
 
@@ -101,6 +147,16 @@ static void handle_args(int argc, char **argv)
         {"help",        no_argument, 0, 'h'},
         {"version",     no_argument, 0, 'v'},
         {"maintenance", no_argument, 0, 'm'},
+        {"convert",     no_argument, 0, 'c'},
+        {"export",      no_argument, 0, 'x'},
+        {"storage",     required_argument, 0, 's'},
+        {"persist",     required_argument, 0, 'p'},
+        {"backup",      required_argument, 0, 'b'},
+        {"keep",        required_argument, 0, 'k'},
+        {"evict",       required_argument, 0, 'e'},
+        {"archive",     required_argument, 0, 'a'},
+        {"workers",     required_argument, 0, 'w'},
+        {"replicate",   required_argument, 0, 'r'},
         {0, 0, 0, 0}
     };
 
@@ -108,22 +164,54 @@ static void handle_args(int argc, char **argv)
 
     while ((opt = getopt_long(argc,
                               argv,
-                              "+hvm",
+                              "+:hvmcxs:p:b:k:e:a:w:r:",
                               long_options,
                               NULL)) != -1)
     {
         switch (opt)
         {
             case 'h':
-                printf("Usage: hok-daemon [option]\n"
+                printf("Usage: hok-daemon [option]...\n"
                        "Daemon for controlling the 'Hands of Kindness' Telegram bot.\n\n"
                        "Options:\n"
-                       "  -h, --help           print this help and exit\n"
-                       "  -v, --version        print the hok-daemon version and exit\n"
-                       "  -m, --maintenance    run the hok-daemon in maintenance mode\n"
+                       "  -h, --help              print this help and exit\n"
+                       "  -v, --version           print the hok-daemon version and exit\n"
+                       "  -m, --maintenance       run the hok-daemon in maintenance mode\n"
+                       "  -c, --convert           replace the storage ENGINE files with " FILE_USERS " and exit\n"
+                       "  -x, --export            write the users of the storage ENGINE to " FILE_USERS " and exit\n"
+                       "  -s, --storage=ENGINE    keep users in the storage ENGINE: 'memory' (in memory,\n"
+                       "                          " FILE_SNAPSHOT ") or 'btree' (on the disk,\n"
+                       "                          " FILE_BTREE "); a new engine imports " FILE_USERS ",\n"
+                       "                          users of another ENGINE are moved with -x and -c\n"
+                       "                          (default: '" DEFAULT_STORAGE_ENGINE "')\n"
+                       "  -p, --persist=POLICY    write data changes to the disk according to the POLICY:\n"
+                       "                          'interval:<ms>', 'mutations:<count>' or 'sync'\n"
+                       "                          (default: '" DEFAULT_PERSISTENCE_POLICY "')\n"
+                       "  -b, --backup=SECONDS    take a backup of users every SECONDS seconds, 0 disables it\n"
+                       "                          (default: %d); SIGUSR1 takes a backup at any time\n"
+                       "  -k, --keep=COUNT        keep the COUNT newest backups in " DIR_BACKUPS ",\n"
+                       "                          0 keeps all of them (default: %d)\n"
+                       "  -e, --evict=SECONDS     move users without a problem, inactive for SECONDS seconds,\n"
+                       "                          from memory to " FILE_COLD_USERS ", 0 disables it\n"
+                       "                          (default: %d); only the 'memory' storage ENGINE evicts users\n"
+                       "  -a, --archive=QUERY     print the closed problems from " DIR_ARCHIVE " as JSON lines\n"
+                       "                          and exit; QUERY is 'CHAT_ID' or 'all', optionally followed by\n"
+                       "                          ':FROM[:TO]', the closing times in seconds since the Epoch\n"
+                       "  -w, --workers=COUNT     handle messages in COUNT worker processes, which are restarted\n"
+                       "                          if they crash, 0 handles them in the daemon itself\n"
+                       "                          (default: 0, maximum: %d)\n"
+                       "  -r, --replicate=ADDRESS stream data changes to a standby at the ADDRESS, a Unix socket\n"
+                       "                          path or 'HOST:PORT' of a loopback HOST; if a hok-daemon with\n"
+                       "                          the option is running already, run as its standby, which\n"
+                       "                          takes over once it stops; only the 'memory' storage ENGINE\n"
+                       "                          is replicated\n"
                        "\nTo run the hok-daemon, run it with the superuser privileges."
                        "\nhok-daemon will automatically drop privileges to the hok-daemon user."
-                       "\n\nPlease send bug reports to <odrawq.qwardo@gmail.com>\n");
+                       "\n\nPlease send bug reports to <odrawq.qwardo@gmail.com>\n",
+                       DEFAULT_BACKUP_INTERVAL,
+                       DEFAULT_BACKUPS_COUNT,
+                       DEFAULT_EVICTION_AGE,
+                       MAX_WORKERS_COUNT);
                 exit(EXIT_SUCCESS);
 
             case 'v':
@@ -137,6 +225,118 @@ static void handle_args(int argc, char **argv)
                 maintenance_mode = 1;
                 break;
 
+            case 'c':
+                convert_mode = 1;
+                break;
+
+            case 'x':
+                export_mode = 1;
+                break;
+
+            case 's':
+                if (set_storage_engine(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid storage engine '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'p':
+                if (set_persistence_policy(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid persistence policy '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'b':
+                if (set_backup_interval(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid backup interval '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'k':
+                if (set_backups_count(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid backups count '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'e':
+                if (set_eviction_age(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid eviction age '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'a':
+                if (parse_archive_query(optarg, &archive_query))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid archive query '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                query_mode = 1;
+                break;
+
+            case 'w':
+                if (set_workers_count(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid workers count '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'r':
+                if (set_replication_address(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " invalid replication address '%s'\n"
+                            "Try 'hok-daemon -h' for more information.\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case ':':
+                fprintf(stderr,
+                        ERRORSTAMP " option '%s' requires an argument\n"
+                        "Try 'hok-daemon -h' for more information.\n",
+                        argv[optind - 1]);
+                exit(EXIT_FAILURE);
+
             case '?':
                 if (optopt)
                     fprintf(stderr,
@@ -163,6 +363,14 @@ static void handle_args(int argc, char **argv)
                 "Try 'hok-daemon -h' for more information.\n");
         exit(EXIT_FAILURE);
     }
+
+    if (is_replication_enabled() && !is_replicable())
+    {
+        fprintf(stderr,
+                ERRORSTAMP " storage engine can't be replicated\n"
+                "Try 'hok-daemon -h' for more information.\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 static void init_pw(void)
@@ -177,7 +385,7 @@ static void init_pw(void)
 
 /*
  * Checks if another instance of hok-daemon is already running.
- * If so, terminates the process.
+ * If so, terminates the process, unless it can be its standby.
  */
 static void check_instance(void)
 {
@@ -229,8 +437,16 @@ static void check_instance(void)
         exit(EXIT_FAILURE);
     }
 
+    lock_fd = fd;
+
     if (flock(fd, LOCK_EX | LOCK_NB))
     {
+        if (errno == EWOULDBLOCK && is_replication_enabled() && !maintenance_mode && !convert_mode && !export_mode)
+        {
+            standby_mode = 1;
+            return;
+        }
+
         if (errno == EWOULDBLOCK)
             fprintf(stderr,
                     ERRORSTAMP " hok-daemon is already running\n");
@@ -264,6 +480,133 @@ static void drop_privileges(void)
     }
 }
 
+/*
+ * Refuses to load users older than the ones of another storage engine,
+ * which would be lost, see find_newer_storage_engine.
+ */
+static void check_storage(void)
+{
+    if (convert_mode && access(FILE_USERS, F_OK))
+    {
+        fprintf(stderr,
+                ERRORSTAMP " %s doesn't exist\n",
+                FILE_USERS);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *newer_engine = find_newer_storage_engine(convert_mode);
+
+    if (!newer_engine)
+        return;
+
+    if (convert_mode)
+        fprintf(stderr,
+                ERRORSTAMP " %s is older than the users of the '%s' storage engine\n"
+                "Export them with 'hok-daemon -s %s -x' first.\n",
+                FILE_USERS,
+                newer_engine,
+                newer_engine);
+    else
+        fprintf(stderr,
+                ERRORSTAMP " the users of the '%s' storage engine are newer\n"
+                "Export them with 'hok-daemon -s %s -x' and import them with -c.\n",
+                newer_engine,
+                newer_engine);
+
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Converts users to the format of the storage engine instead of starting the daemon.
+ */
+static void convert(void)
+{
+    convert_users();
+
+    printf("Converted %s to %s\n",
+           FILE_USERS,
+           get_storage_file());
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Writes the users of the storage engine to the FILE_USERS instead of starting the daemon.
+ */
+static void export(void)
+{
+    if (export_users_json())
+    {
+        fprintf(stderr,
+                ERRORSTAMP " failed to write %s\n",
+                FILE_USERS);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Exported %s to %s\n",
+           get_storage_file(),
+           FILE_USERS);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Prints the archived problems matching the archive_query instead of starting the daemon.
+ * The number of them goes to the stderr, so the stdout has only the problems.
+ */
+static void query(void)
+{
+    const size_t problems_count = query_archive(&archive_query);
+
+    fprintf(stderr,
+            "Found %zu archived problems\n",
+            problems_count);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Keeps a replica of the running primary until it stops, then takes over its lock.
+ * A standby, which the running primary drops, follows it again from scratch.
+ * Starts as the primary instead if it stops while there is no replica.
+ */
+static void follow(void)
+{
+    report("hok-daemon %d.%d.%d started as a standby (PID: %d)",
+           MAJOR_VERSION,
+           MINOR_VERSION,
+           PATCH_VERSION,
+           getpid());
+
+    for (;;)
+    {
+        while (follow_primary())
+        {
+            if (!flock(lock_fd, LOCK_EX | LOCK_NB))
+            {
+                standby_mode = 0;
+                return;
+            }
+
+            sleep(REPLICATION_CONNECT_INTERVAL);
+        }
+
+        wait_primary();
+
+        // The primary releases the lock as it exits, at about the time its stream ends.
+        for (int i = 0; i < MAX_REPLICATION_TAKEOVER_DELAY; ++i)
+        {
+            if (!flock(lock_fd, LOCK_EX | LOCK_NB))
+            {
+                report("Standby took over from the primary");
+                return;
+            }
+
+            sleep(1);
+        }
+
+        report("Primary is running, but has dropped the standby, which follows it again");
+        drop_replica();
+    }
+}
+
 static void daemonize(void)
 {
     if (daemon(0, 0) < 0)
@@ -274,9 +617,31 @@ static void daemonize(void)
     }
 }
 
+/*
+ * Asynchronous signals are blocked in every thread and handled by the
+ * wait_signals_thread, so their handling can safely take locks.
+ * Must be called before any other thread is created.
+ */
 static void init_signals(void)
 {
-    signal(SIGTERM, handle_signal);
+    sigemptyset(&waited_signals);
+    sigaddset(&waited_signals, SIGTERM);
+    sigaddset(&waited_signals, SIGUSR1);
+
+    pthread_sigmask(SIG_BLOCK, &waited_signals, NULL);
+
+    pthread_t wait_signals_thread;
+
+    if (pthread_create(&wait_signals_thread,
+                       NULL,
+                       wait_signals,
+                       NULL))
+        die("%s: %s: failed to create wait_signals_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(wait_signals_thread);
+
     signal(SIGSEGV, handle_signal);
 }
 
@@ -285,7 +650,19 @@ static void init_modules(void)
     init_requests_module();
 
     if (!maintenance_mode)
-        init_data_module();
+    {
+        if (standby_mode)
+            promote_replica();
+        else
+            init_data_module();
+
+        standby_mode = 0;
+
+        serve_workers();
+
+        if (is_replication_enabled())
+            start_replication();
+    }
 }
 
 static void init_info(void)
@@ -294,11 +671,29 @@ static void init_info(void)
     mode = maintenance_mode ? "Maintenance" : "Default";
 }
 
+static void *wait_signals(void *_)
+{
+    (void) _;
+
+    for (;;)
+    {
+        int signal;
+
+        if (!sigwait(&waited_signals, &signal))
+            handle_signal(signal);
+    }
+
+    return NULL;
+}
+
 static void handle_signal(const int signal)
 {
     switch (signal)
     {
         case SIGTERM:
+            if (!maintenance_mode && !standby_mode)
+                flush_data_module();
+
             report("hok-daemon %d.%d.%d terminated (PID: %d; Mode: %s)",
                    MAJOR_VERSION,
                    MINOR_VERSION,
@@ -307,7 +702,27 @@ static void handle_signal(const int signal)
                    mode);
             exit(EXIT_SUCCESS);
 
+        case SIGUSR1:
+            if (!maintenance_mode && !standby_mode)
+                request_backup();
+
+            break;
+
         case SIGSEGV:
             die("Segmentation fault");
     }
 }
+
+/*
+ * Runs in every worker process, which only handles the messages it's given,
+ * so it needs no signals other than the SIGSEGV and keeps no data of its own.
+ */
+static void run_worker(void)
+{
+    signal(SIGSEGV, handle_signal);
+
+    init_requests_module();
+    attach_data_module();
+
+    start_bot_worker();
+}
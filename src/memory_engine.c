@@ -0,0 +1,2653 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "checksum.h"
+#include "journal.h"
+#include "slab.h"
+#include "btree.h"
+#include "data.h"
+#include "storage.h"
+#include "uring.h"
+
+#define MIN_USERS_CAPACITY 1024
+
+#define RECORDS_VERSION     3
+#define MIN_RECORDS_VERSION 2 // Records of version 2 carry "@username: text" as the problem text.
+
+#define SNAPSHOT_MAGIC   0x534B4F48 // "HOKS".
+#define SNAPSHOT_VERSION 4
+#define MIN_SNAPSHOT_VERSION 2
+
+#define SNAPSHOT_BUFFER_SIZE (1024 * 1024) // 1 MiB.
+
+#define MAX_CACHED_COLD_USERS_PAGES 256  // 2 MiB.
+#define MAX_EVICTION_INTERVAL       3600 // 1 hour.
+
+typedef enum
+{
+    RECORD_CREATE_USER = 1,
+    RECORD_SET_STATE,
+    RECORD_CREATE_PROBLEM,
+    RECORD_SET_PROBLEM_USERNAME,
+    RECORD_DELETE_PROBLEM,
+    RECORD_TRANSACTION, // Followed by records, each prefixed with its uint16_t size.
+    RECORD_EVICT_USER,
+    RECORD_RESTORE_USER
+}
+RecordType;
+
+/*
+ * A journal record describing one mutation. The problem username and then
+ * the problem text, if any, follow the header without terminators.
+ * Every record assigns absolute values, so replaying the journal over a snapshot
+ * that already contains some of its records gives the same result.
+ * RECORD_EVICT_USER and RECORD_RESTORE_USER only move a user out of the users table
+ * and back, the FILE_COLD_USERS is changed apart from the journal, see evict_shard_users.
+ */
+typedef struct
+{
+    int64_t chat_id;
+    int64_t problem_time; // For RECORD_SET_STATE the time of the change, see approved_at.
+    int64_t problem_created;
+    uint8_t type;
+    uint8_t state_index;
+    uint8_t state_value;  // For RECORD_RESTORE_USER all the state flags.
+    uint8_t problem_username_size;
+}
+RecordHeader;
+
+typedef struct
+{
+    RecordHeader header;
+    char problem_data[MAX_JOURNAL_RECORD_SIZE - sizeof(RecordHeader)];
+}
+Record;
+
+/*
+ * The FILE_SNAPSHOT is a SnapshotHeader followed by users_count SnapshotUsers
+ * and then by heap_size bytes of problems, each a null-terminated username
+ * followed by a null-terminated text, which the SnapshotUsers refer to by offset. The data checksum covers everything
+ * after the header, the header checksum covers the header up to itself.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t users_count;
+    uint64_t heap_size;
+    uint32_t data_checksum;
+    uint32_t header_checksum;
+}
+SnapshotHeader;
+
+typedef struct
+{
+    int64_t chat_id;
+    int64_t problem_time;
+    int64_t problem_created;
+    int64_t problem_approved_at;
+    uint64_t problem_offset;
+    uint32_t problem_username_size;
+    uint32_t problem_text_size;
+    uint8_t states[STATES_COUNT];
+    uint8_t has_problem;
+    uint32_t last_active; // Zero in snapshots before version 4, which fit the same layout.
+}
+SnapshotUser;
+
+/*
+ * Collects the snapshot data into big chunks, which are written with
+ * write_file at the growing offset.
+ */
+typedef struct
+{
+    int fd;
+    off_t offset;
+    unsigned char *buffer;
+    size_t buffer_size;
+    int failed;
+}
+SnapshotWriter;
+
+/*
+ * A user of a snapshot of version 2, whose heap holds "@username: text" problem texts.
+ */
+typedef struct
+{
+    int64_t chat_id;
+    int64_t problem_time;
+    int64_t problem_created;
+    uint64_t problem_text_offset;
+    uint32_t problem_text_size;
+    uint8_t states[STATES_COUNT];
+    uint8_t has_problem;
+}
+SnapshotUserV2;
+
+typedef struct
+{
+    int_fast64_t chat_id;
+    unsigned int states; // ACCOUNT_BAN_STATE, PROBLEM_PENDING_STATE and PROBLEM_DESCRIPTION_STATE flags.
+    Problem problem;
+    uint32_t previous_problem_user; // Neighbours in the problem list, see problem_lists.
+    uint32_t next_problem_user;
+    uint32_t expiry_heap_position;  // Position in the expiry_heap plus one, 0 if the problem can't expire.
+    _Atomic uint32_t last_active;   // Time of the last access, also changed under the read lock.
+}
+User;
+
+/*
+ * A doubly linked list of users threaded through the users table by user ids,
+ * which are indexes into users plus one, so 0 means no user.
+ */
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    size_t size;
+}
+ProblemList;
+
+/*
+ * A user evict_shard_users has moved to the cold_users, but not yet journaled.
+ */
+typedef struct
+{
+    int64_t chat_id;
+    int restored; // Faulted in meanwhile, so its RECORD_EVICT_USER is skipped.
+}
+EvictedUser;
+
+/*
+ * Entries of the shards worker_index, worker_index + workers_count, ... for an import_users worker.
+ */
+typedef struct
+{
+    const UsersEntry *entries;
+    const size_t *shard_entries_offsets; // USERS_SHARDS_COUNT + 1 offsets into entries sorted by shard.
+    long worker_index;
+    long workers_count;
+}
+ImportTask;
+
+/*
+ * The users are partitioned by the chat_id hash into USERS_SHARDS_COUNT shards,
+ * each with its own lock and its own users table, problem lists and expiry heap,
+ * so mutations of unrelated chats don't serialize behind one lock.
+ * User ids are local to a shard.
+ */
+typedef struct
+{
+    pthread_rwlock_t rwlock;
+
+    /*
+     * Users are kept in a dense array, so full scans walk contiguous memory, and an evicted
+     * user is replaced by the last one. users_slots is a ChatSlots table of indexes
+     * into users plus one, where 0 marks an empty slot, see get_users_slots.
+     */
+    User *users;
+    size_t users_count;
+    size_t users_capacity;
+
+    uint32_t *users_slots;
+    size_t users_slots_mask;
+
+    /*
+     * Every user with a problem is linked into exactly one of the problem_lists,
+     * chosen by its pending and ban states (see get_problem_list) and ordered
+     * by the problem creation time, so listings cost O(results).
+     */
+    ProblemList problem_lists[PROBLEM_LISTS_COUNT];
+
+    /*
+     * expiry_heap is a binary min-heap of user ids ordered by the problem expiry.
+     * It holds every approved problem of a not banned user with a time limit,
+     * which are the only problems that can expire. Its capacity follows users_capacity.
+     */
+    uint32_t *expiry_heap;
+    size_t expiry_heap_size;
+
+    /*
+     * Problem texts are kept in slabs of the shard, so they are packed densely
+     * and a changed text reuses a freed chunk of its size class.
+     */
+    SlabAllocator texts;
+}
+Shard;
+
+static void memory_init(void);
+static void memory_flush(void);
+static void memory_init_replica(char *users_string);
+static void memory_drop_replica(void);
+static void memory_promote_replica(void);
+static void memory_convert_users(void);
+static int memory_get_user_record(const int_fast64_t chat_id, UserRecord *user_record);
+static void memory_begin_transaction(const int_fast64_t chat_id);
+static void memory_commit_transaction(void);
+static void memory_create_user(const int_fast64_t chat_id);
+static void memory_set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value);
+static void memory_create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit);
+static void memory_set_problem_username(const int_fast64_t chat_id, const char *username);
+static void memory_delete_problem(const int_fast64_t chat_id);
+static size_t memory_read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count);
+static void memory_scan_problems(const int pending_problems,
+                                 const int banned_accounts,
+                                 void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                                 void *context);
+static void memory_find_problem(const int_fast64_t chat_id,
+                                const int pending_problems,
+                                const int banned_accounts,
+                                void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                                void *context);
+static cJSON *memory_get_expired_problems_chat_ids(void);
+static time_t memory_get_expiry_deadline(void);
+static double memory_save_backup(const char *file, const char *tmp_file);
+static void memory_lock_users(void);
+static void memory_unlock_users(void);
+static Shard *get_shard(const int_fast64_t chat_id);
+static void lock_shards(void);
+static void unlock_shards(void);
+static void reserve_users(const size_t users_count);
+static size_t count_users(void);
+static User *find_user(Shard *shard, const int_fast64_t chat_id);
+static size_t find_user_slot(Shard *shard, const int_fast64_t chat_id);
+static User *get_user(Shard *shard, const int_fast64_t chat_id);
+static User *insert_user(Shard *shard, const int_fast64_t chat_id);
+static void remove_user(Shard *shard, User *user);
+static void touch_user(User *user);
+static void grow_users(Shard *shard, const size_t min_capacity);
+static void shrink_users(Shard *shard);
+static void resize_users(Shard *shard, const size_t new_capacity);
+static ChatSlots get_users_slots(Shard *shard);
+static int_fast64_t get_user_slot_chat_id(const void *shard, const void *slot);
+static int get_state_index(const unsigned int state);
+static void set_user_state(Shard *shard, User *user, const unsigned int state, const int state_value);
+static void set_user_problem(Shard *shard, User *user, const time_t time, const time_t created, const char *username, const char *text);
+static void set_problem_string(Shard *shard, char **string, const char *value);
+static void delete_user_problem(Shard *shard, User *user);
+static ProblemList *get_problem_list(Shard *shard, const int pending_problems, const int banned_accounts);
+static void link_problem(Shard *shard, User *user);
+static void unlink_problem(Shard *shard, User *user);
+static int compare_problems(const User *user, const User *other_user);
+static int compare_problem_users(const void *user, const void *other_user);
+static void init_problem_cursors(const User *cursors[], const int pending_problems, const int banned_accounts);
+static const User *next_problem_user(const User *cursors[]);
+static void seek_problem_cursors(const User *cursors[], const ProblemsCursor *cursor);
+static int is_next_problem_user(Shard *shard, const uint32_t user_id, const ProblemsCursor *cursor);
+static int compare_problem_position(const User *user, const ProblemsCursor *cursor);
+static void build_problem_lists(Shard *shard);
+static time_t get_problem_expiry(const User *user);
+static void push_expiry(Shard *shard, User *user);
+static void remove_expiry(Shard *shard, User *user);
+static void sift_expiry_up(Shard *shard, size_t position);
+static void sift_expiry_down(Shard *shard, size_t position);
+static void swap_expiries(Shard *shard, const size_t position, const size_t other_position);
+static void add_expired_problems(Shard *shard, cJSON *chat_ids, const size_t position, const time_t current_time);
+static size_t set_record_problem(Record *record, const char *username, const char *text);
+static void submit_record(Record *record, const size_t problem_text_size);
+static uint_fast64_t commit_record(Record *record, const size_t problem_text_size);
+static void add_transaction_record(Record *record, const size_t record_size);
+static void apply_record(const uint32_t records_version, const unsigned char *record_data, const size_t record_size);
+static void apply_transaction(const uint32_t records_version, const unsigned char *transaction_data, const size_t transaction_size);
+static void compact_journal(void);
+static int finish_snapshot(const int wait);
+static void open_cold_users(void);
+static User *fault_in_user(Shard *shard, const int_fast64_t chat_id);
+static void start_eviction(void);
+static void *evict_users(void *_);
+static size_t evict_shard_users(Shard *shard, const time_t current_time);
+static int is_inactive_user(const User *user, const time_t current_time);
+static int compare_evicted_users(const void *user, const void *other_user);
+static void *import_users(void *import_task);
+static void import_user(Shard *shard, const UsersEntry *entry);
+static void export_users(FILE *users_file);
+static void load_users(void);
+static void load_users_json(void);
+static void import_users_json(char *users_string);
+static void load_snapshot(void);
+static void save_snapshot(void);
+static long write_snapshot(const char *file, const char *tmp_file, const char *dir);
+static void write_snapshot_data(SnapshotWriter *writer, const void *data, const size_t data_size);
+static void flush_snapshot_writer(SnapshotWriter *writer);
+static void report_footprint(void);
+
+/*
+ * Shards are locked one at a time, except for whole-store views (snapshots,
+ * backups, listings), which lock all of them in the index order.
+ */
+static Shard shards[USERS_SHARDS_COUNT];
+
+/*
+ * Mutations between begin_transaction and commit_transaction are applied
+ * right away and packed into the transaction_record, which goes to the
+ * FILE_JOURNAL as a single record, so it is replayed entirely or not at all.
+ * transaction_shard is the shard the current thread holds for writing.
+ */
+static _Thread_local Shard *transaction_shard;
+static _Thread_local Record transaction_record;
+static _Thread_local size_t transaction_record_size;
+
+static size_t snapshot_size; // Of the last loaded or saved FILE_SNAPSHOT.
+
+/*
+ * The child of compact_journal, which saves the FILE_SNAPSHOT, 0 if there is none.
+ * Guarded by the snapshot_mutex, since memory_flush waits for it as well.
+ */
+static pid_t snapshot_pid;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Users without a problem, who haven't been active for eviction_age seconds, are moved
+ * from the shards to the cold_users B-tree of chat ids and states, which is guarded by
+ * the cold_users_mutex, never held while taking a shard lock. A user is never in both places
+ * outside of a crash recovery, see open_cold_users.
+ */
+static BTree cold_users;
+static pthread_mutex_t cold_users_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t cold_users_count; // 0 also if the FILE_COLD_USERS isn't open.
+
+/*
+ * The users of the checkpoint evict_shard_users writes, sorted by chat_id,
+ * guarded by the cold_users_mutex, see fault_in_user.
+ */
+static EvictedUser *unjournaled_evictions;
+static size_t unjournaled_evictions_count;
+
+/*
+ * A backup child reads the cold users pages missing from its copy of the cache
+ * from the FILE_COLD_USERS, so the file must not change until it exits.
+ */
+static int cold_checkpoints_paused;
+
+const StorageEngine memory_storage_engine =
+{
+    .name = "memory",
+    .file = FILE_SNAPSHOT,
+    .journal_file = FILE_JOURNAL,
+    .init = memory_init,
+    .convert_users = memory_convert_users,
+    .flush = memory_flush,
+    .lock_users = memory_lock_users,
+    .unlock_users = memory_unlock_users,
+    .get_user_record = memory_get_user_record,
+    .begin_transaction = memory_begin_transaction,
+    .commit_transaction = memory_commit_transaction,
+    .create_user = memory_create_user,
+    .set_state = memory_set_state,
+    .create_problem = memory_create_problem,
+    .set_problem_username = memory_set_problem_username,
+    .delete_problem = memory_delete_problem,
+    .read_problems = memory_read_problems,
+    .scan_problems = memory_scan_problems,
+    .find_problem = memory_find_problem,
+    .get_expired_problems_chat_ids = memory_get_expired_problems_chat_ids,
+    .get_expiry_deadline = memory_get_expiry_deadline,
+    .export_users = export_users,
+    .save_backup = memory_save_backup,
+    .report_footprint = report_footprint,
+    .init_replica = memory_init_replica,
+    .apply_replica_record = apply_record,
+    .drop_replica = memory_drop_replica,
+    .promote_replica = memory_promote_replica,
+    .records_version = RECORDS_VERSION
+};
+
+static void memory_init(void)
+{
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        pthread_rwlock_init(&shards[i].rwlock, NULL);
+
+    load_users();
+
+    // Records of an interrupted compact_journal precede the FILE_JOURNAL.
+    const int old_journal_exists = !access(FILE_JOURNAL_OLD, F_OK);
+    uint32_t records_version = RECORDS_VERSION;
+
+    if (old_journal_exists)
+        records_version = replay_journal(FILE_JOURNAL_OLD, RECORDS_VERSION, apply_record);
+
+    if (open_journal(FILE_JOURNAL, RECORDS_VERSION, apply_record, compact_journal) != RECORDS_VERSION ||
+        records_version != RECORDS_VERSION ||
+        old_journal_exists)
+    {
+        // Records of an older layout are folded into the snapshot, so new records don't follow them.
+        save_snapshot();
+        reset_journal();
+        unlink(FILE_JOURNAL_OLD);
+    }
+
+    open_cold_users();
+    start_eviction();
+}
+
+/*
+ * The snapshot being saved is waited for, so no file changes after the flush.
+ */
+static void memory_flush(void)
+{
+    flush_journal();
+    finish_snapshot(1);
+}
+
+/*
+ * The replica doesn't touch the files of the primary, its cold users included,
+ * which come with the FILE_USERS string and are evicted again after the promotion.
+ */
+static void memory_init_replica(char *users_string)
+{
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        pthread_rwlock_init(&shards[i].rwlock, NULL);
+
+    import_users_json(users_string);
+}
+
+/*
+ * The tables and the slabs of the shards are kept for the next load.
+ */
+static void memory_drop_replica(void)
+{
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        Shard *shard = &shards[i];
+
+        for (size_t j = 0; j < shard->users_count; ++j)
+        {
+            free_slab_string(&shard->texts, shard->users[j].problem.username);
+            free_slab_string(&shard->texts, shard->users[j].problem.text);
+        }
+
+        if (shard->users_slots)
+            memset(shard->users_slots, 0, (shard->users_slots_mask + 1) * sizeof *shard->users_slots);
+
+        shard->users_count = 0;
+        shard->expiry_heap_size = 0;
+        memset(shard->problem_lists, 0, sizeof shard->problem_lists);
+
+        pthread_rwlock_destroy(&shard->rwlock);
+    }
+}
+
+/*
+ * The replica has every record of the FILE_JOURNAL, so the journal is discarded
+ * once the users are in the FILE_SNAPSHOT.
+ */
+static void memory_promote_replica(void)
+{
+    save_snapshot();
+    open_journal(FILE_JOURNAL, RECORDS_VERSION, NULL, compact_journal);
+    unlink(FILE_JOURNAL_OLD);
+
+    open_cold_users();
+    start_eviction();
+}
+
+/*
+ * The snapshot is replaced by the rename of save_snapshot, but the journal and the cold users
+ * must go first, as they would be loaded over the new users.
+ */
+static void memory_convert_users(void)
+{
+    const char *files[] = {FILE_JOURNAL_OLD, FILE_JOURNAL, FILE_COLD_USERS_CHECKPOINT, FILE_COLD_USERS};
+
+    for (size_t i = 0; i < sizeof files / sizeof *files; ++i)
+        if (unlink(files[i]) && errno != ENOENT)
+            die("%s: %s: failed to delete %s",
+                __BASE_FILE__,
+                __func__,
+                files[i]);
+
+    load_users_json();
+    save_snapshot();
+    retire_users_json();
+}
+
+static int memory_get_user_record(const int_fast64_t chat_id, UserRecord *user_record)
+{
+    memset(user_record, 0, sizeof *user_record);
+    user_record->chat_id = chat_id;
+
+    Shard *shard = get_shard(chat_id);
+    pthread_rwlock_rdlock(&shard->rwlock);
+
+    User *user = find_user(shard, chat_id);
+
+    // A user missing in the shard may be cold, faulting it in takes the write lock.
+    if (!user && atomic_load(&cold_users_count))
+    {
+        pthread_rwlock_unlock(&shard->rwlock);
+        pthread_rwlock_wrlock(&shard->rwlock);
+
+        user = fault_in_user(shard, chat_id);
+    }
+
+    const int user_exists = user ? 1 : 0;
+
+    if (user)
+    {
+        user_record->states = user->states;
+        user_record->has_problem = user->problem.text ? 1 : 0;
+
+        touch_user(user);
+    }
+
+    pthread_rwlock_unlock(&shard->rwlock);
+    return user_exists;
+}
+
+static void memory_begin_transaction(const int_fast64_t chat_id)
+{
+    transaction_shard = get_shard(chat_id);
+    pthread_rwlock_wrlock(&transaction_shard->rwlock);
+
+    fault_in_user(transaction_shard, chat_id);
+
+    memset(&transaction_record.header, 0, sizeof transaction_record.header);
+    transaction_record.header.type = RECORD_TRANSACTION;
+    transaction_record_size = sizeof transaction_record.header;
+}
+
+static void memory_commit_transaction(void)
+{
+    uint_fast64_t sequence = 0;
+
+    if (transaction_record_size > sizeof transaction_record.header)
+        sequence = append_journal_record(&transaction_record, transaction_record_size);
+
+    pthread_rwlock_unlock(&transaction_shard->rwlock);
+    transaction_shard = NULL;
+
+    publish_approved_problems();
+    wait_journal_record(sequence);
+}
+
+static void memory_create_user(const int_fast64_t chat_id)
+{
+    Record record = {0};
+    record.header.type = RECORD_CREATE_USER;
+    record.header.chat_id = chat_id;
+
+    submit_record(&record, 0);
+}
+
+static void memory_set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value)
+{
+    Record record = {0};
+    record.header.type = RECORD_SET_STATE;
+    record.header.chat_id = chat_id;
+    record.header.problem_time = time(NULL);
+    record.header.state_index = get_state_index(state);
+    record.header.state_value = state_value;
+
+    submit_record(&record, 0);
+}
+
+static void memory_create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit)
+{
+    Record record = {0};
+    record.header.type = RECORD_CREATE_PROBLEM;
+    record.header.chat_id = chat_id;
+    record.header.problem_created = time(NULL);
+    record.header.problem_time = use_time_limit ? record.header.problem_created : 0;
+
+    const size_t problem_data_size = set_record_problem(&record, username, problem_text);
+
+    submit_record(&record, problem_data_size);
+}
+
+static void memory_set_problem_username(const int_fast64_t chat_id, const char *username)
+{
+    Record record = {0};
+    record.header.type = RECORD_SET_PROBLEM_USERNAME;
+    record.header.chat_id = chat_id;
+
+    const size_t problem_data_size = set_record_problem(&record, username, "");
+
+    submit_record(&record, problem_data_size);
+}
+
+static void memory_delete_problem(const int_fast64_t chat_id)
+{
+    Record record = {0};
+    record.header.type = RECORD_DELETE_PROBLEM;
+    record.header.chat_id = chat_id;
+
+    submit_record(&record, 0);
+}
+
+static size_t memory_read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count)
+{
+    size_t problems_count = 0;
+
+    lock_shards();
+
+    const User *cursors[USERS_SHARDS_COUNT];
+    seek_problem_cursors(cursors, cursor);
+
+    for (const User *user; problems_count < max_problems_count && (user = next_problem_user(cursors)); ++problems_count)
+    {
+        ProblemView *problem = &problems[problems_count];
+
+        problem->chat_id = user->chat_id;
+        snprintf(problem->username, sizeof problem->username, "%s", user->problem.username);
+        format_problem(problem->problem, sizeof problem->problem, user->chat_id, &user->problem, cursor->include_chat_ids);
+
+        cursor->has_position = 1;
+        cursor->created = user->problem.created;
+        cursor->chat_id = user->chat_id;
+    }
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        cursor->next_user_ids[i] = cursors[i] ? cursors[i] - shards[i].users + 1 : 0;
+
+    unlock_shards();
+    return problems_count;
+}
+
+static cJSON *memory_get_expired_problems_chat_ids(void)
+{
+    cJSON *expired_problems_chat_ids = cJSON_CreateArray();
+    const time_t current_time = time(NULL);
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        pthread_rwlock_rdlock(&shards[i].rwlock);
+        add_expired_problems(&shards[i], expired_problems_chat_ids, 0, current_time);
+        pthread_rwlock_unlock(&shards[i].rwlock);
+    }
+
+    return expired_problems_chat_ids;
+}
+
+static void memory_scan_problems(const int pending_problems,
+                                 const int banned_accounts,
+                                 void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                                 void *context)
+{
+    const User *cursors[USERS_SHARDS_COUNT];
+    init_problem_cursors(cursors, pending_problems, banned_accounts);
+
+    for (const User *user; (user = next_problem_user(cursors));)
+        visit(context, user->chat_id, &user->problem);
+}
+
+/*
+ * A cold user has no problem, so it isn't faulted in.
+ */
+static void memory_find_problem(const int_fast64_t chat_id,
+                                const int pending_problems,
+                                const int banned_accounts,
+                                void (*visit)(void *context, const int_fast64_t chat_id, const Problem *problem),
+                                void *context)
+{
+    Shard *shard = get_shard(chat_id);
+    pthread_rwlock_rdlock(&shard->rwlock);
+
+    const User *user = find_user(shard, chat_id);
+
+    if (user &&
+        user->problem.text &&
+        !(user->states & PROBLEM_PENDING_STATE) == !pending_problems &&
+        !(user->states & ACCOUNT_BAN_STATE) == !banned_accounts)
+        visit(context, chat_id, &user->problem);
+
+    pthread_rwlock_unlock(&shard->rwlock);
+}
+
+static time_t memory_get_expiry_deadline(void)
+{
+    time_t deadline = 0;
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        Shard *shard = &shards[i];
+        pthread_rwlock_rdlock(&shard->rwlock);
+
+        if (shard->expiry_heap_size)
+        {
+            // A problem expires once its lifetime is exceeded, i.e. a second after get_problem_expiry.
+            const time_t shard_deadline = get_problem_expiry(&shard->users[shard->expiry_heap[0] - 1]) + 1;
+
+            if (!deadline || shard_deadline < deadline)
+                deadline = shard_deadline;
+        }
+
+        pthread_rwlock_unlock(&shard->rwlock);
+    }
+
+    return deadline;
+}
+
+/*
+ * The process forks under the shard read locks and the child writes its copy-on-write view
+ * of the users table and the cold users, so writers are blocked only for the time of the fork.
+ */
+static double memory_save_backup(const char *file, const char *tmp_file)
+{
+    memory_lock_users();
+
+    struct timespec pause_start;
+    clock_gettime(CLOCK_MONOTONIC, &pause_start);
+
+    const pid_t backup_pid = fork();
+
+    if (!backup_pid)
+        _exit(write_users(file, tmp_file, DIR_BACKUPS) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    if (backup_pid > 0)
+        cold_checkpoints_paused = 1;
+
+    memory_unlock_users();
+
+    const double pause = get_elapsed_milliseconds(&pause_start);
+
+    if (backup_pid < 0)
+        return -1;
+
+    int status;
+    const int failed = waitpid(backup_pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+
+    pthread_mutex_lock(&cold_users_mutex);
+    cold_checkpoints_paused = 0;
+    pthread_mutex_unlock(&cold_users_mutex);
+
+    return failed ? -1 : pause;
+}
+
+/*
+ * Locks the shards and the cold users, so export_users sees all users consistent.
+ */
+static void memory_lock_users(void)
+{
+    lock_shards();
+    pthread_mutex_lock(&cold_users_mutex);
+}
+
+static void memory_unlock_users(void)
+{
+    pthread_mutex_unlock(&cold_users_mutex);
+    unlock_shards();
+}
+
+static Shard *get_shard(const int_fast64_t chat_id)
+{
+    // The top bits select the shard, the low bits select the slot inside it.
+    return &shards[hash_chat_id(chat_id) >> (sizeof(size_t) * 8 - USERS_SHARDS_BITS)];
+}
+
+/*
+ * Locks all shards for reading, in the index order.
+ */
+static void lock_shards(void)
+{
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        pthread_rwlock_rdlock(&shards[i].rwlock);
+}
+
+static void unlock_shards(void)
+{
+    for (int i = USERS_SHARDS_COUNT - 1; i >= 0; --i)
+        pthread_rwlock_unlock(&shards[i].rwlock);
+}
+
+/*
+ * Grows every shard ahead of a bulk load of users_count users,
+ * with some slack for the uneven spread of the hash.
+ */
+static void reserve_users(const size_t users_count)
+{
+    const size_t shard_users_count = users_count / USERS_SHARDS_COUNT;
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        grow_users(&shards[i], shard_users_count + shard_users_count / 4);
+}
+
+static size_t count_users(void)
+{
+    size_t users_count = 0;
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        users_count += shards[i].users_count;
+
+    return users_count;
+}
+
+/*
+ * Returns a user from the shard users table or NULL if it doesn't exist.
+ */
+static User *find_user(Shard *shard, const int_fast64_t chat_id)
+{
+    if (!shard->users_slots)
+        return NULL;
+
+    for (size_t slot = hash_chat_id(chat_id) & shard->users_slots_mask;
+         shard->users_slots[slot];
+         slot = (slot + 1) & shard->users_slots_mask)
+    {
+        User *user = &shard->users[shard->users_slots[slot] - 1];
+
+        if (user->chat_id == chat_id)
+            return user;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the slot of an existing user in the shard users_slots.
+ */
+static size_t find_user_slot(Shard *shard, const int_fast64_t chat_id)
+{
+    size_t slot = hash_chat_id(chat_id) & shard->users_slots_mask;
+
+    while (shard->users[shard->users_slots[slot] - 1].chat_id != chat_id)
+        slot = (slot + 1) & shard->users_slots_mask;
+
+    return slot;
+}
+
+/*
+ * Same as find_user, but terminates the process if a user doesn't exist.
+ */
+static User *get_user(Shard *shard, const int_fast64_t chat_id)
+{
+    User *user = find_user(shard, chat_id);
+
+    if (!user)
+        die("%s: %s: user %" PRIdFAST64 " doesn't exist",
+            __BASE_FILE__,
+            __func__,
+            chat_id);
+
+    return user;
+}
+
+/*
+ * Appends a zeroed user to the users table and returns it.
+ * A user must not already exist.
+ */
+static User *insert_user(Shard *shard, const int_fast64_t chat_id)
+{
+    if (shard->users_count == shard->users_capacity)
+        grow_users(shard, shard->users_count + 1);
+
+    User *user = &shard->users[shard->users_count++];
+
+    memset(user, 0, sizeof *user);
+    user->chat_id = chat_id;
+    touch_user(user);
+
+    const ChatSlots users_slots = get_users_slots(shard);
+
+    shard->users_slots[find_empty_chat_slot(&users_slots, chat_id)] = shard->users_count;
+    return user;
+}
+
+/*
+ * Removes a user without a problem from the users table. The last user takes its place,
+ * so its neighbours in the problem list and its expiry_heap entry get the new user id.
+ */
+static void remove_user(Shard *shard, User *user)
+{
+    const uint32_t user_id = user - shard->users + 1;
+    const uint32_t last_user_id = shard->users_count;
+
+    const ChatSlots users_slots = get_users_slots(shard);
+
+    clear_chat_slot(&users_slots, find_user_slot(shard, user->chat_id));
+
+    if (user_id != last_user_id)
+    {
+        memcpy(user, &shard->users[last_user_id - 1], sizeof *user);
+        shard->users_slots[find_user_slot(shard, user->chat_id)] = user_id;
+
+        if (user->problem.text)
+        {
+            ProblemList *list = get_problem_list(shard, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE);
+
+            if (user->previous_problem_user)
+                shard->users[user->previous_problem_user - 1].next_problem_user = user_id;
+            else
+                list->head = user_id;
+
+            if (user->next_problem_user)
+                shard->users[user->next_problem_user - 1].previous_problem_user = user_id;
+            else
+                list->tail = user_id;
+        }
+
+        if (user->expiry_heap_position)
+            shard->expiry_heap[user->expiry_heap_position - 1] = user_id;
+    }
+
+    --shard->users_count;
+}
+
+/*
+ * Marks a user as active now, see evict_users.
+ * Readers holding the shard for reading may call it at the same time.
+ */
+static void touch_user(User *user)
+{
+    const uint32_t current_time = time(NULL);
+
+    // Most accesses come within the same second, which needs no write.
+    if (atomic_load_explicit(&user->last_active, memory_order_relaxed) != current_time)
+        atomic_store_explicit(&user->last_active, current_time, memory_order_relaxed);
+}
+
+/*
+ * Doubles the users capacity until it reaches min_capacity.
+ */
+static void grow_users(Shard *shard, const size_t min_capacity)
+{
+    size_t new_capacity = shard->users_capacity ? shard->users_capacity : MIN_USERS_CAPACITY;
+
+    while (new_capacity < min_capacity && new_capacity <= UINT32_MAX / 2)
+        new_capacity *= 2;
+
+    if (new_capacity > UINT32_MAX / 2)
+        die("%s: %s: too many users",
+            __BASE_FILE__,
+            __func__);
+
+    resize_users(shard, new_capacity);
+}
+
+/*
+ * Halves the users capacity while at most a quarter of it is used,
+ * so the memory of evicted users is given back.
+ */
+static void shrink_users(Shard *shard)
+{
+    size_t new_capacity = shard->users_capacity;
+
+    while (new_capacity > MIN_USERS_CAPACITY && shard->users_count <= new_capacity / 4)
+        new_capacity /= 2;
+
+    if (new_capacity != shard->users_capacity)
+        resize_users(shard, new_capacity);
+}
+
+/*
+ * Reallocates the users table for new_capacity users, which must fit all of them,
+ * and rebuilds the users_slots, which are kept at most half full.
+ */
+static void resize_users(Shard *shard, const size_t new_capacity)
+{
+    User *new_users = realloc(shard->users, new_capacity * sizeof *shard->users);
+
+    if (!new_users)
+        die("%s: %s: failed to reallocate memory for users",
+            __BASE_FILE__,
+            __func__);
+
+    uint32_t *new_expiry_heap = realloc(shard->expiry_heap, new_capacity * sizeof *shard->expiry_heap);
+
+    if (!new_expiry_heap)
+        die("%s: %s: failed to reallocate memory for expiry_heap",
+            __BASE_FILE__,
+            __func__);
+
+    shard->expiry_heap = new_expiry_heap;
+
+    uint32_t *new_users_slots = calloc(new_capacity * 2, sizeof *shard->users_slots);
+
+    if (!new_users_slots)
+        die("%s: %s: failed to allocate memory for users_slots",
+            __BASE_FILE__,
+            __func__);
+
+    free(shard->users_slots);
+
+    shard->users = new_users;
+    shard->users_capacity = new_capacity;
+    shard->users_slots = new_users_slots;
+    shard->users_slots_mask = new_capacity * 2 - 1;
+
+    const ChatSlots users_slots = get_users_slots(shard);
+
+    for (size_t i = 0; i < shard->users_count; ++i)
+        shard->users_slots[find_empty_chat_slot(&users_slots, shard->users[i].chat_id)] = i + 1;
+}
+
+static ChatSlots get_users_slots(Shard *shard)
+{
+    return (ChatSlots) {shard->users_slots, sizeof *shard->users_slots, shard->users_slots_mask, get_user_slot_chat_id, shard};
+}
+
+static int_fast64_t get_user_slot_chat_id(const void *shard, const void *slot)
+{
+    return ((const Shard *) shard)->users[*(const uint32_t *) slot - 1].chat_id;
+}
+
+static int get_state_index(const unsigned int state)
+{
+    for (int i = 0; i < STATES_COUNT; ++i)
+        if (state == 1u << i)
+            return i;
+
+    die("%s: %s: unknown state %#x",
+        __BASE_FILE__,
+        __func__,
+        state);
+
+    return -1;
+}
+
+static void set_user_state(Shard *shard, User *user, const unsigned int state, const int state_value)
+{
+    unlink_problem(shard, user);
+
+    if (state_value)
+        user->states |= state;
+    else
+        user->states &= ~state;
+
+    link_problem(shard, user);
+}
+
+static void set_user_problem(Shard *shard, User *user, const time_t time, const time_t created, const char *username, const char *text)
+{
+    unlink_problem(shard, user);
+
+    user->problem.time = time;
+    user->problem.created = created;
+    user->problem.approved_at = 0;
+    set_problem_string(shard, &user->problem.username, username);
+    set_problem_string(shard, &user->problem.text, text);
+
+    link_problem(shard, user);
+}
+
+/*
+ * Replaces a problem username or text with a copy of value in the shard slabs.
+ */
+static void set_problem_string(Shard *shard, char **string, const char *value)
+{
+    free_slab_string(&shard->texts, *string);
+    *string = copy_slab_string(&shard->texts, value);
+}
+
+static void delete_user_problem(Shard *shard, User *user)
+{
+    unlink_problem(shard, user);
+
+    free_slab_string(&shard->texts, user->problem.username);
+    free_slab_string(&shard->texts, user->problem.text);
+    memset(&user->problem, 0, sizeof user->problem);
+}
+
+static ProblemList *get_problem_list(Shard *shard, const int pending_problems, const int banned_accounts)
+{
+    return &shard->problem_lists[(pending_problems ? 1 : 0) | (banned_accounts ? 2 : 0)];
+}
+
+/*
+ * Links a user with a problem into its problem list.
+ * The list is searched from the tail, since new problems are usually the newest.
+ */
+static void link_problem(Shard *shard, User *user)
+{
+    if (!user->problem.text)
+        return;
+
+    ProblemList *list = get_problem_list(shard, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE);
+    const uint32_t user_id = user - shard->users + 1;
+
+    uint32_t previous_user_id = list->tail;
+
+    while (previous_user_id && compare_problems(&shard->users[previous_user_id - 1], user) > 0)
+        previous_user_id = shard->users[previous_user_id - 1].previous_problem_user;
+
+    user->previous_problem_user = previous_user_id;
+    user->next_problem_user = previous_user_id ? shard->users[previous_user_id - 1].next_problem_user : list->head;
+
+    if (user->next_problem_user)
+        shard->users[user->next_problem_user - 1].previous_problem_user = user_id;
+    else
+        list->tail = user_id;
+
+    if (previous_user_id)
+        shard->users[previous_user_id - 1].next_problem_user = user_id;
+    else
+        list->head = user_id;
+
+    ++list->size;
+
+    touch_problem_list(user->chat_id, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE);
+
+    if (list == get_problem_list(shard, 0, 0) && user->problem.time)
+        push_expiry(shard, user);
+}
+
+static void unlink_problem(Shard *shard, User *user)
+{
+    if (!user->problem.text)
+        return;
+
+    ProblemList *list = get_problem_list(shard, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE);
+
+    if (user->previous_problem_user)
+        shard->users[user->previous_problem_user - 1].next_problem_user = user->next_problem_user;
+    else
+        list->head = user->next_problem_user;
+
+    if (user->next_problem_user)
+        shard->users[user->next_problem_user - 1].previous_problem_user = user->previous_problem_user;
+    else
+        list->tail = user->previous_problem_user;
+
+    user->previous_problem_user = 0;
+    user->next_problem_user = 0;
+
+    --list->size;
+
+    touch_problem_list(user->chat_id, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE);
+
+    if (user->expiry_heap_position)
+        remove_expiry(shard, user);
+}
+
+/*
+ * Orders problems by the creation time, then by the chat id.
+ */
+static int compare_problems(const User *user, const User *other_user)
+{
+    if (user->problem.created != other_user->problem.created)
+        return user->problem.created < other_user->problem.created ? -1 : 1;
+
+    if (user->chat_id != other_user->chat_id)
+        return user->chat_id < other_user->chat_id ? -1 : 1;
+
+    return 0;
+}
+
+static int compare_problem_users(const void *user, const void *other_user)
+{
+    return compare_problems(*(User * const *) user, *(User * const *) other_user);
+}
+
+/*
+ * Starts merging a problem list of all shards, see next_problem_user.
+ */
+static void init_problem_cursors(const User *cursors[], const int pending_problems, const int banned_accounts)
+{
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        const uint32_t user_id = get_problem_list(&shards[i], pending_problems, banned_accounts)->head;
+        cursors[i] = user_id ? &shards[i].users[user_id - 1] : NULL;
+    }
+}
+
+/*
+ * Returns the next user of the merged lists or NULL after the last one,
+ * so the problems stay ordered by the creation time across shards.
+ * All shards must be locked.
+ */
+static const User *next_problem_user(const User *cursors[])
+{
+    int next_shard = -1;
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        if (cursors[i] && (next_shard < 0 || compare_problems(cursors[i], cursors[next_shard]) < 0))
+            next_shard = i;
+
+    if (next_shard < 0)
+        return NULL;
+
+    const User *user = cursors[next_shard];
+    cursors[next_shard] = user->next_problem_user ? &shards[next_shard].users[user->next_problem_user - 1] : NULL;
+
+    return user;
+}
+
+/*
+ * Sets the cursors of the merged lists to the problems following the position of a ProblemsCursor.
+ * The hints of the ProblemsCursor are used while they still point right after the position,
+ * else the shard list is searched from the head.
+ * All shards must be locked.
+ */
+static void seek_problem_cursors(const User *cursors[], const ProblemsCursor *cursor)
+{
+    init_problem_cursors(cursors, cursor->pending_problems, cursor->banned_accounts);
+
+    if (!cursor->has_position)
+        return;
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        Shard *shard = &shards[i];
+        const uint32_t user_id = cursor->next_user_ids[i];
+
+        if (is_next_problem_user(shard, user_id, cursor))
+        {
+            cursors[i] = user_id ? &shard->users[user_id - 1] : NULL;
+            continue;
+        }
+
+        while (cursors[i] && compare_problem_position(cursors[i], cursor) <= 0)
+            cursors[i] = cursors[i]->next_problem_user ? &shard->users[cursors[i]->next_problem_user - 1] : NULL;
+    }
+}
+
+/*
+ * Checks if a user is the first one after the position of a ProblemsCursor in the list
+ * of a shard, where 0 stands for the end of the list.
+ */
+static int is_next_problem_user(Shard *shard, const uint32_t user_id, const ProblemsCursor *cursor)
+{
+    const ProblemList *list = get_problem_list(shard, cursor->pending_problems, cursor->banned_accounts);
+
+    if (!user_id)
+        return !list->tail || compare_problem_position(&shard->users[list->tail - 1], cursor) <= 0;
+
+    if (user_id > shard->users_count)
+        return 0;
+
+    const User *user = &shard->users[user_id - 1];
+
+    return user->problem.text &&
+           get_problem_list(shard, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE) == list &&
+           compare_problem_position(user, cursor) > 0 &&
+           (!user->previous_problem_user ||
+            compare_problem_position(&shard->users[user->previous_problem_user - 1], cursor) <= 0);
+}
+
+/*
+ * Compares a problem with the position of a ProblemsCursor in the order of compare_problems.
+ */
+static int compare_problem_position(const User *user, const ProblemsCursor *cursor)
+{
+    if (user->problem.created != cursor->created)
+        return user->problem.created < cursor->created ? -1 : 1;
+
+    if (user->chat_id != cursor->chat_id)
+        return user->chat_id < cursor->chat_id ? -1 : 1;
+
+    return 0;
+}
+
+/*
+ * Links all users with problems into the problem_lists at once after a bulk load.
+ * Sorting first makes every link an append.
+ */
+static void build_problem_lists(Shard *shard)
+{
+    size_t problems_count = 0;
+
+    for (size_t i = 0; i < shard->users_count; ++i)
+        if (shard->users[i].problem.text)
+            ++problems_count;
+
+    if (!problems_count)
+        return;
+
+    User **problem_users = malloc(problems_count * sizeof *problem_users);
+
+    if (!problem_users)
+        die("%s: %s: failed to allocate memory for problem_users",
+            __BASE_FILE__,
+            __func__);
+
+    for (size_t i = 0, j = 0; i < shard->users_count; ++i)
+        if (shard->users[i].problem.text)
+            problem_users[j++] = &shard->users[i];
+
+    qsort(problem_users, problems_count, sizeof *problem_users, compare_problem_users);
+
+    for (size_t i = 0; i < problems_count; ++i)
+        link_problem(shard, problem_users[i]);
+
+    free(problem_users);
+}
+
+static time_t get_problem_expiry(const User *user)
+{
+    return user->problem.time + MAX_PROBLEM_LIFETIME;
+}
+
+static void push_expiry(Shard *shard, User *user)
+{
+    shard->expiry_heap[shard->expiry_heap_size++] = user - shard->users + 1;
+    user->expiry_heap_position = shard->expiry_heap_size;
+
+    sift_expiry_up(shard, shard->expiry_heap_size - 1);
+}
+
+static void remove_expiry(Shard *shard, User *user)
+{
+    const size_t position = user->expiry_heap_position - 1;
+    const size_t last_position = --shard->expiry_heap_size;
+
+    user->expiry_heap_position = 0;
+
+    if (position != last_position)
+    {
+        shard->expiry_heap[position] = shard->expiry_heap[last_position];
+        shard->users[shard->expiry_heap[position] - 1].expiry_heap_position = position + 1;
+
+        sift_expiry_up(shard, position);
+        sift_expiry_down(shard, shard->users[shard->expiry_heap[position] - 1].expiry_heap_position - 1);
+    }
+    else if (!position)
+        notify_expiry();
+}
+
+static void sift_expiry_up(Shard *shard, size_t position)
+{
+    while (position)
+    {
+        const size_t parent_position = (position - 1) / 2;
+
+        if (get_problem_expiry(&shard->users[shard->expiry_heap[parent_position] - 1]) <=
+            get_problem_expiry(&shard->users[shard->expiry_heap[position] - 1]))
+            return;
+
+        swap_expiries(shard, position, parent_position);
+        position = parent_position;
+    }
+
+    notify_expiry();
+}
+
+static void sift_expiry_down(Shard *shard, size_t position)
+{
+    for (;;)
+    {
+        size_t min_position = position;
+
+        for (size_t child_position = position * 2 + 1;
+             child_position <= position * 2 + 2 && child_position < shard->expiry_heap_size;
+             ++child_position)
+            if (get_problem_expiry(&shard->users[shard->expiry_heap[child_position] - 1]) <
+                get_problem_expiry(&shard->users[shard->expiry_heap[min_position] - 1]))
+                min_position = child_position;
+
+        if (min_position == position)
+            return;
+
+        swap_expiries(shard, position, min_position);
+        position = min_position;
+    }
+}
+
+static void swap_expiries(Shard *shard, const size_t position, const size_t other_position)
+{
+    const uint32_t user_id = shard->expiry_heap[position];
+
+    shard->expiry_heap[position] = shard->expiry_heap[other_position];
+    shard->expiry_heap[other_position] = user_id;
+
+    shard->users[shard->expiry_heap[position] - 1].expiry_heap_position = position + 1;
+    shard->users[shard->expiry_heap[other_position] - 1].expiry_heap_position = other_position + 1;
+}
+
+/*
+ * Adds the chat ids of the expired problems in the expiry_heap subtree at position.
+ * Subtrees, whose root hasn't expired, are skipped, so this costs O(expired).
+ */
+static void add_expired_problems(Shard *shard, cJSON *chat_ids, const size_t position, const time_t current_time)
+{
+    if (position >= shard->expiry_heap_size)
+        return;
+
+    const User *user = &shard->users[shard->expiry_heap[position] - 1];
+
+    if (difftime(current_time, user->problem.time) <= MAX_PROBLEM_LIFETIME)
+        return;
+
+    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
+    snprintf(chat_id_string,
+             sizeof chat_id_string,
+             "%" PRIdFAST64,
+             user->chat_id);
+
+    cJSON_AddItemToArray(chat_ids, cJSON_CreateString(chat_id_string));
+
+    add_expired_problems(shard, chat_ids, position * 2 + 1, current_time);
+    add_expired_problems(shard, chat_ids, position * 2 + 2, current_time);
+}
+
+/*
+ * Copies a problem username and text to a record and returns their size.
+ */
+static size_t set_record_problem(Record *record, const char *username, const char *text)
+{
+    const size_t username_size = strlen(username);
+    const size_t text_size = strlen(text);
+
+    if (username_size > MAX_USERNAME_SIZE)
+        die("%s: %s: username is too big",
+            __BASE_FILE__,
+            __func__);
+
+    if (username_size + text_size >= sizeof record->problem_data)
+        die("%s: %s: text is too big",
+            __BASE_FILE__,
+            __func__);
+
+    record->header.problem_username_size = username_size;
+
+    memcpy(record->problem_data, username, username_size);
+    memcpy(record->problem_data + username_size, text, text_size);
+
+    return username_size + text_size;
+}
+
+/*
+ * Commits a record on its own or adds it to the current transaction.
+ */
+static void submit_record(Record *record, const size_t problem_text_size)
+{
+    if (transaction_shard)
+    {
+        add_transaction_record(record, sizeof record->header + problem_text_size);
+        return;
+    }
+
+    Shard *shard = get_shard(record->header.chat_id);
+
+    pthread_rwlock_wrlock(&shard->rwlock);
+    fault_in_user(shard, record->header.chat_id);
+    const uint_fast64_t sequence = commit_record(record, problem_text_size);
+    pthread_rwlock_unlock(&shard->rwlock);
+
+    publish_approved_problems();
+    wait_journal_record(sequence);
+}
+
+/*
+ * Applies a record to the users table, queues it for the FILE_JOURNAL and
+ * returns its journal sequence number.
+ * Must be called with the record user shard held for writing.
+ */
+static uint_fast64_t commit_record(Record *record, const size_t problem_text_size)
+{
+    const size_t record_size = sizeof record->header + problem_text_size;
+
+    apply_record(RECORDS_VERSION, (const unsigned char *) record, record_size);
+    return append_journal_record(record, record_size);
+}
+
+static void add_transaction_record(Record *record, const size_t record_size)
+{
+    const uint16_t entry_size = record_size;
+
+    if (get_shard(record->header.chat_id) != transaction_shard)
+        die("%s: %s: transaction spans several shards",
+            __BASE_FILE__,
+            __func__);
+
+    if (transaction_record_size + sizeof entry_size + record_size >= sizeof transaction_record)
+        die("%s: %s: transaction is too big",
+            __BASE_FILE__,
+            __func__);
+
+    apply_record(RECORDS_VERSION, (const unsigned char *) record, record_size);
+
+    unsigned char *transaction_data = (unsigned char *) &transaction_record;
+
+    memcpy(transaction_data + transaction_record_size, &entry_size, sizeof entry_size);
+    memcpy(transaction_data + transaction_record_size + sizeof entry_size, record, record_size);
+
+    transaction_record_size += sizeof entry_size + record_size;
+}
+
+/*
+ * Applies a record to the users table.
+ * Used both for new mutations and for the FILE_JOURNAL replay.
+ */
+static void apply_record(const uint32_t records_version, const unsigned char *record_data, const size_t record_size)
+{
+    Record record;
+
+    if (records_version < MIN_RECORDS_VERSION)
+        die("%s: %s: record has unsupported version %" PRIu32,
+            __BASE_FILE__,
+            __func__,
+            records_version);
+
+    if (record_size < sizeof record.header || record_size >= sizeof record)
+        die("%s: %s: record has invalid size",
+            __BASE_FILE__,
+            __func__);
+
+    memcpy(&record, record_data, record_size);
+
+    const size_t problem_data_size = record_size - sizeof record.header;
+    const size_t problem_username_size = records_version < 3 ? 0 : record.header.problem_username_size;
+
+    if (problem_username_size > problem_data_size || problem_username_size > MAX_USERNAME_SIZE)
+        die("%s: %s: record has invalid username",
+            __BASE_FILE__,
+            __func__);
+
+    char problem_username[MAX_USERNAME_SIZE + 1];
+    memcpy(problem_username, record.problem_data, problem_username_size);
+    problem_username[problem_username_size] = 0;
+
+    record.problem_data[problem_data_size] = 0;
+    const char *problem_text = record.problem_data + problem_username_size;
+
+    if (records_version < 3 &&
+        (record.header.type == RECORD_CREATE_PROBLEM || record.header.type == RECORD_SET_PROBLEM_USERNAME))
+        split_problem_text(record.problem_data, problem_username, &problem_text);
+
+    Shard *shard = get_shard(record.header.chat_id);
+
+    switch (record.header.type)
+    {
+        case RECORD_CREATE_USER:
+            if (!find_user(shard, record.header.chat_id))
+                insert_user(shard, record.header.chat_id)->states = PROBLEM_PENDING_STATE;
+
+            break;
+
+        case RECORD_SET_STATE:
+            if (record.header.state_index >= STATES_COUNT)
+                die("%s: %s: record has invalid state",
+                    __BASE_FILE__,
+                    __func__);
+
+        {
+            User *user = get_user(shard, record.header.chat_id);
+            const unsigned int state = 1u << record.header.state_index;
+
+            // A problem is approved once its pending state is cleared.
+            // Records before version 3 don't carry the time of the change.
+            if (state == PROBLEM_PENDING_STATE && !record.header.state_value &&
+                user->states & PROBLEM_PENDING_STATE && user->problem.text)
+                user->problem.approved_at = record.header.problem_time ? record.header.problem_time : user->problem.created;
+
+            set_user_state(shard, user, state, record.header.state_value);
+            break;
+        }
+
+        case RECORD_CREATE_PROBLEM:
+            set_user_problem(shard, get_user(shard, record.header.chat_id),
+                             record.header.problem_time,
+                             record.header.problem_created,
+                             problem_username,
+                             problem_text);
+            break;
+
+        case RECORD_SET_PROBLEM_USERNAME:
+        {
+            User *user = get_user(shard, record.header.chat_id);
+
+            if (!user->problem.text)
+                break;
+
+            set_problem_string(shard, &user->problem.username, problem_username);
+
+            // Records before version 3 replaced the whole text to change the username.
+            if (records_version < 3)
+                set_problem_string(shard, &user->problem.text, problem_text);
+
+            touch_problem_list(user->chat_id, user->states & PROBLEM_PENDING_STATE, user->states & ACCOUNT_BAN_STATE);
+
+            break;
+        }
+
+        case RECORD_DELETE_PROBLEM:
+        {
+            User *user = get_user(shard, record.header.chat_id);
+
+            if (user->problem.text)
+                archive_deleted_problem(user->chat_id, &user->problem);
+
+            delete_user_problem(shard, user);
+            break;
+        }
+
+        case RECORD_TRANSACTION:
+            apply_transaction(records_version, record_data + sizeof record.header, record_size - sizeof record.header);
+            break;
+
+        case RECORD_EVICT_USER:
+        {
+            User *user = find_user(shard, record.header.chat_id);
+
+            if (!user)
+                break;
+
+            if (user->problem.text)
+                die("%s: %s: record evicts user with problem",
+                    __BASE_FILE__,
+                    __func__);
+
+            remove_user(shard, user);
+            break;
+        }
+
+        case RECORD_RESTORE_USER:
+        {
+            User *user = find_user(shard, record.header.chat_id);
+
+            if (!user)
+                user = insert_user(shard, record.header.chat_id);
+
+            unlink_problem(shard, user);
+            user->states = record.header.state_value & ((1u << STATES_COUNT) - 1);
+            link_problem(shard, user);
+
+            break;
+        }
+
+        default:
+            die("%s: %s: record has unknown type",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    // Every mutation counts as an activity, a replayed one as of the replay.
+    if (record.header.type != RECORD_TRANSACTION && record.header.type != RECORD_EVICT_USER)
+    {
+        User *user = find_user(shard, record.header.chat_id);
+
+        if (user)
+            touch_user(user);
+    }
+}
+
+static void apply_transaction(const uint32_t records_version, const unsigned char *transaction_data, const size_t transaction_size)
+{
+    size_t offset = 0;
+
+    while (offset < transaction_size)
+    {
+        uint16_t entry_size;
+        RecordHeader entry_header;
+
+        if (transaction_size - offset < sizeof entry_size)
+            die("%s: %s: transaction is damaged",
+                __BASE_FILE__,
+                __func__);
+
+        memcpy(&entry_size, transaction_data + offset, sizeof entry_size);
+        offset += sizeof entry_size;
+
+        if (entry_size > transaction_size - offset || entry_size < sizeof entry_header)
+            die("%s: %s: transaction is damaged",
+                __BASE_FILE__,
+                __func__);
+
+        memcpy(&entry_header, transaction_data + offset, sizeof entry_header);
+
+        if (entry_header.type == RECORD_TRANSACTION)
+            die("%s: %s: transactions can't be nested",
+                __BASE_FILE__,
+                __func__);
+
+        apply_record(records_version, transaction_data + offset, entry_size);
+        offset += entry_size;
+    }
+}
+
+/*
+ * Folds the FILE_JOURNAL into the FILE_SNAPSHOT once the journal outgrows it,
+ * so a write costs the size of the change amortized.
+ * Called by the journal thread after every commit.
+ * The process forks under the locks and the child saves its copy-on-write view of the users,
+ * while the journal goes on in a new file, so writers are blocked only for the fork and
+ * the rotation. The records of the old one, the FILE_JOURNAL_OLD, are deleted once a later
+ * call finds the snapshot saved.
+ * No snapshot is taken while evicted users are yet to be checkpointed, see evict_shard_users.
+ */
+static void compact_journal(void)
+{
+    if (!finish_snapshot(0))
+        return;
+
+    memory_lock_users();
+
+    const size_t journal_size = get_journal_size();
+
+    if (!unjournaled_evictions_count && journal_size >= MIN_JOURNAL_COMPACTION_SIZE && journal_size >= snapshot_size)
+    {
+        pthread_mutex_lock(&snapshot_mutex);
+
+        if (!(snapshot_pid = fork()))
+            _exit(write_snapshot(FILE_SNAPSHOT, FILE_SNAPSHOT_TMP, DIR_DATA) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+        if (snapshot_pid > 0)
+            rotate_journal(FILE_JOURNAL_OLD, DIR_DATA);
+        else
+        {
+            // Without a child the snapshot is saved under the locks instead.
+            snapshot_pid = 0;
+
+            save_snapshot();
+            reset_journal();
+        }
+
+        pthread_mutex_unlock(&snapshot_mutex);
+    }
+
+    memory_unlock_users();
+}
+
+/*
+ * Deletes the FILE_JOURNAL_OLD once the child of compact_journal has saved the snapshot,
+ * waiting for it if wait is set, else only checking. Returns 1 if there is no child left, else 0.
+ */
+static int finish_snapshot(const int wait)
+{
+    pthread_mutex_lock(&snapshot_mutex);
+
+    if (snapshot_pid)
+    {
+        int status;
+        const pid_t pid = waitpid(snapshot_pid, &status, wait ? 0 : WNOHANG);
+
+        if (pid)
+        {
+            if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+                die("%s: %s: failed to save users to %s",
+                    __BASE_FILE__,
+                    __func__,
+                    FILE_SNAPSHOT);
+
+            struct stat snapshot_stat;
+
+            if (stat(FILE_SNAPSHOT, &snapshot_stat) || unlink(FILE_JOURNAL_OLD))
+                die("%s: %s: failed to delete %s",
+                    __BASE_FILE__,
+                    __func__,
+                    FILE_JOURNAL_OLD);
+
+            snapshot_pid = 0;
+            snapshot_size = snapshot_stat.st_size;
+        }
+    }
+
+    const int finished = !snapshot_pid;
+
+    pthread_mutex_unlock(&snapshot_mutex);
+    return finished;
+}
+
+/*
+ * Opens the FILE_COLD_USERS if users are evicted or have been evicted before.
+ * A crash between the steps of evict_shard_users or fault_in_user may leave a user
+ * in the FILE_COLD_USERS that is in the users table as well, which has its current states,
+ * so such users are deleted from the FILE_COLD_USERS here.
+ */
+static void open_cold_users(void)
+{
+    if (!eviction_age && access(FILE_COLD_USERS, F_OK))
+        return;
+
+    open_btree(&cold_users, FILE_COLD_USERS, FILE_COLD_USERS_CHECKPOINT, MAX_CACHED_COLD_USERS_PAGES);
+
+    size_t users_count = 0;
+    int64_t *stale_chat_ids = NULL;
+    size_t stale_users_count = 0;
+    size_t stale_users_capacity = 0;
+
+    BTreeCursor cursor;
+    seek_btree_cursor(&cold_users, &cursor, "", 0);
+
+    unsigned char key[MAX_BTREE_KEY_SIZE];
+    size_t key_size;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    // The stale users are collected first, since the tree must not change under the cursor.
+    while (next_btree_value(&cold_users, &cursor, key, &key_size, value, &value_size))
+    {
+        int64_t chat_id;
+
+        if (key_size != sizeof chat_id || value_size != 1)
+            die("%s: %s: %s is damaged",
+                __BASE_FILE__,
+                __func__,
+                FILE_COLD_USERS);
+
+        memcpy(&chat_id, key, sizeof chat_id);
+
+        if (!find_user(get_shard(chat_id), chat_id))
+        {
+            ++users_count;
+            continue;
+        }
+
+        if (stale_users_count == stale_users_capacity)
+        {
+            stale_users_capacity = stale_users_capacity ? stale_users_capacity * 2 : 64;
+
+            if (!(stale_chat_ids = realloc(stale_chat_ids, stale_users_capacity * sizeof *stale_chat_ids)))
+                die("%s: %s: failed to reallocate memory for stale_chat_ids",
+                    __BASE_FILE__,
+                    __func__);
+        }
+
+        stale_chat_ids[stale_users_count++] = chat_id;
+    }
+
+    for (size_t i = 0; i < stale_users_count; ++i)
+        delete_btree_value(&cold_users, &stale_chat_ids[i], sizeof *stale_chat_ids);
+
+    if (stale_users_count)
+        checkpoint_btree(&cold_users);
+
+    free(stale_chat_ids);
+    atomic_store(&cold_users_count, users_count);
+}
+
+/*
+ * Returns a user, moving it from the FILE_COLD_USERS back to the users table if it's cold,
+ * or NULL if it doesn't exist. The user goes to the FILE_JOURNAL before it's deleted
+ * from the FILE_COLD_USERS, see evict_shard_users.
+ * Must be called with the shard held for writing.
+ */
+static User *fault_in_user(Shard *shard, const int_fast64_t chat_id)
+{
+    User *user = find_user(shard, chat_id);
+
+    if (user || !atomic_load(&cold_users_count))
+        return user;
+
+    const int64_t key = chat_id;
+    unsigned char value[MAX_BTREE_VALUE_SIZE];
+    size_t value_size;
+
+    pthread_mutex_lock(&cold_users_mutex);
+
+    if (get_btree_value(&cold_users, &key, sizeof key, value, &value_size))
+    {
+        Record record = {0};
+        record.header.type = RECORD_RESTORE_USER;
+        record.header.chat_id = chat_id;
+        record.header.state_value = value[0];
+
+        commit_record(&record, 0);
+
+        delete_btree_value(&cold_users, &key, sizeof key);
+        atomic_fetch_sub(&cold_users_count, 1);
+
+        const EvictedUser evicted_key = {.chat_id = key};
+        EvictedUser *evicted_user = unjournaled_evictions_count ?
+                                    bsearch(&evicted_key,
+                                            unjournaled_evictions,
+                                            unjournaled_evictions_count,
+                                            sizeof *unjournaled_evictions,
+                                            compare_evicted_users) :
+                                    NULL;
+
+        if (evicted_user)
+            evicted_user->restored = 1;
+
+        user = find_user(shard, chat_id);
+    }
+
+    pthread_mutex_unlock(&cold_users_mutex);
+    return user;
+}
+
+static void start_eviction(void)
+{
+    if (!eviction_age)
+        return;
+
+    pthread_t evict_users_thread;
+
+    if (pthread_create(&evict_users_thread,
+                       NULL,
+                       evict_users,
+                       NULL))
+        die("%s: %s: failed to create evict_users_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(evict_users_thread);
+}
+
+/*
+ * Evicts inactive users from all shards every eviction_age seconds, but at least
+ * every MAX_EVICTION_INTERVAL, and reports how many users stay in memory.
+ */
+static void *evict_users(void *_)
+{
+    (void) _;
+
+    const unsigned int interval = eviction_age < MAX_EVICTION_INTERVAL ? eviction_age : MAX_EVICTION_INTERVAL;
+
+    for (;;)
+    {
+        sleep(interval);
+
+        const time_t current_time = time(NULL);
+        size_t evicted_users_count = 0;
+
+        for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+            evicted_users_count += evict_shard_users(&shards[i], current_time);
+
+        if (!evicted_users_count)
+            continue;
+
+        lock_shards();
+        const size_t users_count = count_users();
+        unlock_shards();
+
+        report("Evicted %zu inactive users to %s, %zu users stay in memory and %zu are evicted",
+               evicted_users_count,
+               FILE_COLD_USERS,
+               users_count,
+               atomic_load(&cold_users_count));
+    }
+
+    return NULL;
+}
+
+/*
+ * Moves the inactive users of a shard to the FILE_COLD_USERS and returns their number.
+ * The users leave the shard for the cold_users under the shard write lock and
+ * the cold_users_mutex, which are released before the slow part: the journal is flushed,
+ * so users faulted in before are in the FILE_JOURNAL before they disappear
+ * from the FILE_COLD_USERS, then the checkpoint is written, and only then
+ * the RECORD_EVICT_USERs are journaled, so a crash in between can't lose the users.
+ * The RECORD_RESTORE_USER of a user faulted in meanwhile is journaled first, so its
+ * RECORD_EVICT_USER is skipped, and no snapshot is taken meanwhile, see compact_journal.
+ * Nothing is evicted while a backup child reads the FILE_COLD_USERS.
+ */
+static size_t evict_shard_users(Shard *shard, const time_t current_time)
+{
+    pthread_rwlock_wrlock(&shard->rwlock);
+    pthread_mutex_lock(&cold_users_mutex);
+
+    if (cold_checkpoints_paused)
+    {
+        pthread_mutex_unlock(&cold_users_mutex);
+        pthread_rwlock_unlock(&shard->rwlock);
+        return 0;
+    }
+
+    EvictedUser *evicted_users = NULL;
+    size_t evicted_users_count = 0;
+    size_t evicted_users_capacity = 0;
+
+    // Users are removed from the end, so the last user, which takes a removed place, is already checked.
+    for (size_t i = shard->users_count; i-- > 0;)
+    {
+        User *user = &shard->users[i];
+
+        if (!is_inactive_user(user, current_time))
+            continue;
+
+        if (evicted_users_count == evicted_users_capacity)
+        {
+            evicted_users_capacity = evicted_users_capacity ? evicted_users_capacity * 2 : 64;
+
+            if (!(evicted_users = realloc(evicted_users, evicted_users_capacity * sizeof *evicted_users)))
+                die("%s: %s: failed to reallocate memory for evicted_users",
+                    __BASE_FILE__,
+                    __func__);
+        }
+
+        const int64_t key = user->chat_id;
+        const uint8_t states = user->states;
+
+        put_btree_value(&cold_users, &key, sizeof key, &states, sizeof states);
+        evicted_users[evicted_users_count++] = (EvictedUser) {.chat_id = key};
+
+        remove_user(shard, user);
+    }
+
+    BTreeCheckpoint checkpoint;
+
+    if (evicted_users_count)
+    {
+        shrink_users(shard);
+        atomic_fetch_add(&cold_users_count, evicted_users_count);
+
+        qsort(evicted_users, evicted_users_count, sizeof *evicted_users, compare_evicted_users);
+
+        unjournaled_evictions = evicted_users;
+        unjournaled_evictions_count = evicted_users_count;
+
+        prepare_btree_checkpoint(&cold_users, &checkpoint);
+    }
+
+    pthread_mutex_unlock(&cold_users_mutex);
+    pthread_rwlock_unlock(&shard->rwlock);
+
+    if (!evicted_users_count)
+        return 0;
+
+    flush_journal();
+    write_btree_checkpoint(&cold_users, &checkpoint);
+
+    pthread_mutex_lock(&cold_users_mutex);
+
+    finish_btree_checkpoint(&cold_users, &checkpoint);
+
+    // The users are already out of the shard, so the records are only journaled.
+    for (size_t i = 0; i < evicted_users_count; ++i)
+    {
+        if (evicted_users[i].restored)
+            continue;
+
+        Record record = {0};
+        record.header.type = RECORD_EVICT_USER;
+        record.header.chat_id = evicted_users[i].chat_id;
+
+        append_journal_record(&record, sizeof record.header);
+    }
+
+    unjournaled_evictions = NULL;
+    unjournaled_evictions_count = 0;
+
+    pthread_mutex_unlock(&cold_users_mutex);
+
+    free(evicted_users);
+    return evicted_users_count;
+}
+
+static int is_inactive_user(const User *user, const time_t current_time)
+{
+    return !user->problem.text &&
+           difftime(current_time, atomic_load_explicit(&user->last_active, memory_order_relaxed)) >= eviction_age;
+}
+
+static int compare_evicted_users(const void *user, const void *other_user)
+{
+    const int64_t chat_id = ((const EvictedUser *) user)->chat_id;
+    const int64_t other_chat_id = ((const EvictedUser *) other_user)->chat_id;
+
+    return (chat_id > other_chat_id) - (chat_id < other_chat_id);
+}
+
+/*
+ * Fills the shards of an ImportTask from the FILE_USERS entries. Every shard
+ * is filled by a single worker, so the workers take no locks.
+ * Problems must be linked with build_problem_lists afterwards.
+ */
+static void *import_users(void *import_task)
+{
+    const ImportTask *task = import_task;
+
+    for (long i = task->worker_index; i < USERS_SHARDS_COUNT; i += task->workers_count)
+        for (size_t j = task->shard_entries_offsets[i]; j < task->shard_entries_offsets[i + 1]; ++j)
+            import_user(&shards[i], &task->entries[j]);
+
+    return NULL;
+}
+
+static void import_user(Shard *shard, const UsersEntry *entry)
+{
+    unsigned int states;
+    Problem problem;
+    char split_username[MAX_USERNAME_SIZE + 1];
+
+    cJSON *user_json = parse_user(entry, &states, &problem, split_username);
+
+    if (find_user(shard, entry->chat_id))
+        die("%s: %s: invalid user '%s'",
+            __BASE_FILE__,
+            __func__,
+            entry->chat_id_string);
+
+    User *user = insert_user(shard, entry->chat_id);
+    user->states = states;
+
+    if (problem.text)
+    {
+        user->problem.time = problem.time;
+        user->problem.created = problem.created;
+        user->problem.approved_at = problem.approved_at;
+
+        set_problem_string(shard, &user->problem.username, problem.username);
+        set_problem_string(shard, &user->problem.text, problem.text);
+    }
+
+    cJSON_Delete(user_json);
+}
+
+/*
+ * Writes the FILE_USERS format from all shards and the cold users user by user,
+ * so no copy of the data is built in memory. Errors are left in the stream.
+ */
+static void export_users(FILE *users_file)
+{
+    int first_user = 1;
+
+    fputc('{', users_file);
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        for (size_t j = 0; j < shards[i].users_count; ++j)
+        {
+            if (!first_user)
+                fputc(',', users_file);
+
+            const User *user = &shards[i].users[j];
+
+            export_user(users_file, user->chat_id, user->states, &user->problem);
+            first_user = 0;
+        }
+
+    if (atomic_load(&cold_users_count))
+    {
+        BTreeCursor cursor;
+        seek_btree_cursor(&cold_users, &cursor, "", 0);
+
+        unsigned char key[MAX_BTREE_KEY_SIZE];
+        size_t key_size;
+        unsigned char value[MAX_BTREE_VALUE_SIZE];
+        size_t value_size;
+
+        // Cold users have no problems.
+        const Problem problem = {0};
+
+        while (next_btree_value(&cold_users, &cursor, key, &key_size, value, &value_size))
+        {
+            int64_t chat_id;
+            memcpy(&chat_id, key, sizeof chat_id);
+
+            if (!first_user)
+                fputc(',', users_file);
+
+            export_user(users_file, chat_id, value[0], &problem);
+            first_user = 0;
+        }
+    }
+
+    fputc('}', users_file);
+}
+
+/*
+ * Loads data to the users table from the FILE_SNAPSHOT or,
+ * if there is no snapshot yet, from the FILE_USERS, which is
+ * retired as soon as its users are saved to the first snapshot.
+ */
+static void load_users(void)
+{
+    if (!access(FILE_SNAPSHOT, F_OK))
+        load_snapshot();
+    else
+    {
+        load_users_json();
+        save_snapshot();
+        retire_users_json();
+    }
+}
+
+/*
+ * Loads data from the FILE_USERS to the users table.
+ */
+static void load_users_json(void)
+{
+    // The FILE_USERS has all users, cold ones included, so cold users of earlier runs are dropped.
+    unlink(FILE_COLD_USERS);
+    unlink(FILE_COLD_USERS_CHECKPOINT);
+
+    char *users_string = read_users_json();
+
+    import_users_json(users_string);
+    free(users_string);
+}
+
+/*
+ * Loads users from a string in the FILE_USERS format to the users table.
+ */
+static void import_users_json(char *users_string)
+{
+    UsersEntry *entries;
+    const size_t entries_count = find_users_entries(users_string, &entries);
+
+    // The entries are sorted by shard, so every worker fills its own shards in the file order.
+    size_t shard_entries_offsets[USERS_SHARDS_COUNT + 1] = { 0 };
+
+    for (size_t i = 0; i < entries_count; ++i)
+        ++shard_entries_offsets[get_shard(entries[i].chat_id) - shards + 1];
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        grow_users(&shards[i], shard_entries_offsets[i + 1]);
+        shard_entries_offsets[i + 1] += shard_entries_offsets[i];
+    }
+
+    UsersEntry *sorted_entries = malloc(entries_count * sizeof *sorted_entries);
+
+    if (!sorted_entries && entries_count)
+        die("%s: %s: failed to allocate memory for sorted_entries",
+            __BASE_FILE__,
+            __func__);
+
+    size_t shard_entries_counts[USERS_SHARDS_COUNT] = { 0 };
+
+    for (size_t i = 0; i < entries_count; ++i)
+    {
+        const size_t shard_index = get_shard(entries[i].chat_id) - shards;
+        sorted_entries[shard_entries_offsets[shard_index] + shard_entries_counts[shard_index]++] = entries[i];
+    }
+
+    free(entries);
+
+    long workers_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (workers_count < 1)
+        workers_count = 1;
+    else if (workers_count > USERS_SHARDS_COUNT)
+        workers_count = USERS_SHARDS_COUNT;
+
+    ImportTask tasks[USERS_SHARDS_COUNT];
+    pthread_t workers[USERS_SHARDS_COUNT];
+
+    for (long i = 0; i < workers_count; ++i)
+    {
+        tasks[i] = (ImportTask)
+        {
+            .entries = sorted_entries,
+            .shard_entries_offsets = shard_entries_offsets,
+            .worker_index = i,
+            .workers_count = workers_count
+        };
+
+        if (pthread_create(&workers[i],
+                           NULL,
+                           import_users,
+                           &tasks[i]))
+            die("%s: %s: failed to create import_users worker",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    for (long i = 0; i < workers_count; ++i)
+        pthread_join(workers[i], NULL);
+
+    free(sorted_entries);
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        build_problem_lists(&shards[i]);
+}
+
+/*
+ * Loads data from the FILE_SNAPSHOT to the users table.
+ * The snapshot is mapped to memory and its records are inserted in bulk.
+ */
+static void load_snapshot(void)
+{
+    const int snapshot_fd = open(FILE_SNAPSHOT, O_RDONLY);
+
+    if (snapshot_fd < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_SNAPSHOT);
+
+    struct stat snapshot_stat;
+
+    if (fstat(snapshot_fd, &snapshot_stat))
+        die("%s: %s: failed to get %s size",
+            __BASE_FILE__,
+            __func__,
+            FILE_SNAPSHOT);
+
+    const size_t size = snapshot_stat.st_size;
+
+    if (size < sizeof(SnapshotHeader))
+        die("%s: %s: %s is damaged",
+            __BASE_FILE__,
+            __func__,
+            FILE_SNAPSHOT);
+
+    const unsigned char *snapshot = mmap(NULL, size, PROT_READ, MAP_PRIVATE, snapshot_fd, 0);
+
+    if (snapshot == MAP_FAILED)
+        die("%s: %s: failed to map %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_SNAPSHOT);
+
+    close(snapshot_fd);
+    madvise((void *) snapshot, size, MADV_SEQUENTIAL);
+
+    SnapshotHeader header;
+    memcpy(&header, snapshot, sizeof header);
+
+    const size_t data_size = size - sizeof header;
+
+    // Snapshots of older versions are migrated on load and saved in the current version with the next compaction.
+    // Only version 2 has a different user layout, version 3 lacks just the last_active.
+    const int legacy = header.version < 3;
+    const size_t snapshot_user_size = legacy ? sizeof(SnapshotUserV2) : sizeof(SnapshotUser);
+
+    if (header.magic != SNAPSHOT_MAGIC ||
+        header.version < MIN_SNAPSHOT_VERSION ||
+        header.version > SNAPSHOT_VERSION ||
+        header.header_checksum != update_crc32(0, &header, offsetof(SnapshotHeader, header_checksum)) ||
+        header.users_count > data_size / snapshot_user_size ||
+        header.heap_size != data_size - header.users_count * snapshot_user_size ||
+        header.data_checksum != update_crc32(0, snapshot + sizeof header, data_size))
+        die("%s: %s: %s is damaged",
+            __BASE_FILE__,
+            __func__,
+            FILE_SNAPSHOT);
+
+    const unsigned char *snapshot_users = snapshot + sizeof header;
+    const char *heap = (const char *) (snapshot_users + header.users_count * snapshot_user_size);
+
+    reserve_users(header.users_count);
+
+    for (size_t i = 0; i < header.users_count; ++i)
+    {
+        SnapshotUser current_snapshot_user;
+        const SnapshotUser *snapshot_user = &current_snapshot_user;
+
+        if (!legacy)
+            memcpy(&current_snapshot_user, snapshot_users + i * snapshot_user_size, sizeof current_snapshot_user);
+        else
+        {
+            SnapshotUserV2 legacy_snapshot_user;
+            memcpy(&legacy_snapshot_user, snapshot_users + i * snapshot_user_size, sizeof legacy_snapshot_user);
+
+            memset(&current_snapshot_user, 0, sizeof current_snapshot_user);
+            current_snapshot_user.chat_id = legacy_snapshot_user.chat_id;
+            current_snapshot_user.problem_time = legacy_snapshot_user.problem_time;
+            current_snapshot_user.problem_created = legacy_snapshot_user.problem_created;
+            current_snapshot_user.problem_offset = legacy_snapshot_user.problem_text_offset;
+            current_snapshot_user.problem_text_size = legacy_snapshot_user.problem_text_size;
+            memcpy(current_snapshot_user.states, legacy_snapshot_user.states, sizeof current_snapshot_user.states);
+            current_snapshot_user.has_problem = legacy_snapshot_user.has_problem;
+
+            if (!current_snapshot_user.states[get_state_index(PROBLEM_PENDING_STATE)])
+                current_snapshot_user.problem_approved_at = current_snapshot_user.problem_created;
+        }
+
+        Shard *shard = get_shard(snapshot_user->chat_id);
+
+        // Legacy problems have no separate username, their text starts right at the offset.
+        const char *problem = heap + snapshot_user->problem_offset;
+        const size_t problem_text_offset = legacy ? 0 : (size_t) snapshot_user->problem_username_size + 1;
+
+        if (find_user(shard, snapshot_user->chat_id) ||
+            (snapshot_user->has_problem &&
+             (snapshot_user->problem_offset >= header.heap_size ||
+              problem_text_offset + snapshot_user->problem_text_size >= header.heap_size - snapshot_user->problem_offset ||
+              (!legacy && problem[problem_text_offset - 1]) ||
+              problem[problem_text_offset + snapshot_user->problem_text_size])))
+            die("%s: %s: %s is damaged",
+                __BASE_FILE__,
+                __func__,
+                FILE_SNAPSHOT);
+
+        User *user = insert_user(shard, snapshot_user->chat_id);
+
+        if (snapshot_user->last_active)
+            user->last_active = snapshot_user->last_active;
+
+        for (int j = 0; j < STATES_COUNT; ++j)
+            if (snapshot_user->states[j])
+                user->states |= 1u << j;
+
+        if (snapshot_user->has_problem)
+        {
+            user->problem.time = snapshot_user->problem_time;
+            user->problem.created = snapshot_user->problem_created;
+            user->problem.approved_at = snapshot_user->problem_approved_at;
+
+            if (!legacy)
+            {
+                set_problem_string(shard, &user->problem.username, problem);
+                set_problem_string(shard, &user->problem.text, problem + problem_text_offset);
+            }
+            else
+            {
+                char split_username[MAX_USERNAME_SIZE + 1];
+                const char *split_text;
+
+                split_problem_text(problem, split_username, &split_text);
+
+                set_problem_string(shard, &user->problem.username, split_username);
+                set_problem_string(shard, &user->problem.text, split_text);
+            }
+        }
+    }
+
+    munmap((void *) snapshot, size);
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+        build_problem_lists(&shards[i]);
+
+    snapshot_size = size;
+}
+
+/*
+ * Saves data from the users table to the FILE_SNAPSHOT.
+ */
+static void save_snapshot(void)
+{
+    const long size = write_snapshot(FILE_SNAPSHOT, FILE_SNAPSHOT_TMP, DIR_DATA);
+
+    if (size < 0)
+        die("%s: %s: failed to save users to %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_SNAPSHOT);
+
+    snapshot_size = size;
+}
+
+/*
+ * Writes data from the users table to a file in the FILE_SNAPSHOT format and
+ * returns its size, or -1 on failure.
+ * The data is written to a temporary file in the same dir first, then synced and renamed,
+ * so a crash can't leave the file truncated.
+ */
+static long write_snapshot(const char *file, const char *tmp_file, const char *dir)
+{
+    SnapshotWriter writer = {0};
+
+    if ((writer.fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+        return -1;
+
+    if (!(writer.buffer = malloc(SNAPSHOT_BUFFER_SIZE)))
+        die("%s: %s: failed to allocate memory for writer.buffer",
+            __BASE_FILE__,
+            __func__);
+
+    SnapshotHeader header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.users_count = count_users();
+
+    // The header is written again once the checksums are known.
+    write_snapshot_data(&writer, &header, sizeof header);
+
+    for (int i = 0; i < USERS_SHARDS_COUNT && !writer.failed; ++i)
+    {
+        const Shard *shard = &shards[i];
+
+        for (size_t j = 0; j < shard->users_count && !writer.failed; ++j)
+        {
+            const User *user = &shard->users[j];
+
+            SnapshotUser snapshot_user;
+            memset(&snapshot_user, 0, sizeof snapshot_user);
+
+            snapshot_user.chat_id = user->chat_id;
+            snapshot_user.last_active = atomic_load_explicit(&user->last_active, memory_order_relaxed);
+
+            for (int k = 0; k < STATES_COUNT; ++k)
+                snapshot_user.states[k] = user->states >> k & 1;
+
+            if (user->problem.text)
+            {
+                snapshot_user.has_problem = 1;
+                snapshot_user.problem_time = user->problem.time;
+                snapshot_user.problem_created = user->problem.created;
+                snapshot_user.problem_approved_at = user->problem.approved_at;
+                snapshot_user.problem_offset = header.heap_size;
+                snapshot_user.problem_username_size = strlen(user->problem.username);
+                snapshot_user.problem_text_size = strlen(user->problem.text);
+
+                header.heap_size += snapshot_user.problem_username_size + snapshot_user.problem_text_size + 2;
+            }
+
+            header.data_checksum = update_crc32(header.data_checksum, &snapshot_user, sizeof snapshot_user);
+            write_snapshot_data(&writer, &snapshot_user, sizeof snapshot_user);
+        }
+    }
+
+    for (int i = 0; i < USERS_SHARDS_COUNT && !writer.failed; ++i)
+    {
+        const Shard *shard = &shards[i];
+
+        for (size_t j = 0; j < shard->users_count && !writer.failed; ++j)
+        {
+            const Problem *problem = &shard->users[j].problem;
+
+            if (!problem->text)
+                continue;
+
+            const size_t problem_username_size = strlen(problem->username) + 1;
+            const size_t problem_text_size = strlen(problem->text) + 1;
+
+            header.data_checksum = update_crc32(header.data_checksum, problem->username, problem_username_size);
+            header.data_checksum = update_crc32(header.data_checksum, problem->text, problem_text_size);
+
+            write_snapshot_data(&writer, problem->username, problem_username_size);
+            write_snapshot_data(&writer, problem->text, problem_text_size);
+        }
+    }
+
+    flush_snapshot_writer(&writer);
+    free(writer.buffer);
+
+    header.header_checksum = update_crc32(0, &header, offsetof(SnapshotHeader, header_checksum));
+
+    // The final header goes together with the sync of the whole file.
+    const int failed = writer.failed || write_file(writer.fd, &header, sizeof header, 0, 1);
+
+    close(writer.fd);
+
+    if (failed || rename(tmp_file, file) || sync_dir(dir))
+    {
+        unlink(tmp_file);
+        return -1;
+    }
+
+    return sizeof header + header.users_count * sizeof(SnapshotUser) + header.heap_size;
+}
+
+static void write_snapshot_data(SnapshotWriter *writer, const void *data, const size_t data_size)
+{
+    if (writer->failed)
+        return;
+
+    if (writer->buffer_size + data_size > SNAPSHOT_BUFFER_SIZE)
+    {
+        flush_snapshot_writer(writer);
+
+        // Data, which doesn't fit the buffer at all, is written right away.
+        if (data_size > SNAPSHOT_BUFFER_SIZE)
+        {
+            writer->failed = writer->failed || write_file(writer->fd, data, data_size, writer->offset, 0);
+            writer->offset += data_size;
+            return;
+        }
+    }
+
+    memcpy(writer->buffer + writer->buffer_size, data, data_size);
+    writer->buffer_size += data_size;
+}
+
+static void flush_snapshot_writer(SnapshotWriter *writer)
+{
+    if (!writer->failed && writer->buffer_size)
+        writer->failed = write_file(writer->fd, writer->buffer, writer->buffer_size, writer->offset, 0);
+
+    writer->offset += writer->buffer_size;
+    writer->buffer_size = 0;
+}
+
+/*
+ * Reports the memory taken by the users table and by the problem texts,
+ * along with the numbers of users in memory and of evicted ones.
+ */
+static void report_footprint(void)
+{
+    size_t users_count = 0;
+    size_t problems_count = 0;
+    size_t users_size = 0;
+    size_t texts_size = 0;
+    size_t slabs_size = 0;
+
+    lock_shards();
+
+    for (int i = 0; i < USERS_SHARDS_COUNT; ++i)
+    {
+        const Shard *shard = &shards[i];
+
+        users_count += shard->users_count;
+
+        for (int j = 0; j < PROBLEM_LISTS_COUNT; ++j)
+            problems_count += shard->problem_lists[j].size;
+
+        users_size += shard->users_capacity * (sizeof *shard->users + sizeof *shard->expiry_heap);
+
+        if (shard->users_slots)
+            users_size += (shard->users_slots_mask + 1) * sizeof *shard->users_slots;
+
+        texts_size += shard->texts.blocks_size;
+        slabs_size += shard->texts.reserved_size;
+    }
+
+    unlock_shards();
+
+    report("%zu users are in memory and %zu are evicted to %s",
+           users_count,
+           atomic_load(&cold_users_count),
+           FILE_COLD_USERS);
+
+    report("Users take %zu bytes (%.1f bytes per user), problem texts take %zu bytes in slabs "
+           "for %zu bytes of text (%.1f bytes per problem)",
+           users_size,
+           users_count ? (double) users_size / users_count : 0.0,
+           slabs_size,
+           texts_size,
+           problems_count ? (double) slabs_size / problems_count : 0.0);
+}
@@ -0,0 +1,778 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#define _GNU_SOURCE // For the struct ucred.
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "log.h"
+#include "journal.h"
+#include "data.h"
+#include "storage.h"
+#include "replication.h"
+
+#define REPLICATION_MAGIC            0x524B4F48 // "HOKR".
+#define REPLICATION_PROTOCOL_VERSION 1
+
+#define MAX_REPLICATION_HOST_SIZE 255
+#define MAX_REPLICATION_PORT_SIZE 5
+
+/*
+ * Every message is a MessageHeader followed by size bytes. The primary sends a MESSAGE_HELLO
+ * with a Hello, a MESSAGE_USERS with the users written by export_replica, null-terminated,
+ * and then a MESSAGE_RECORDS with every batch of journal records, which the standby answers
+ * with a MESSAGE_ACK without a body.
+ * sequence is the sequence number of the last record, which the message includes,
+ * and time is when the message was sent in milliseconds since the Epoch. An ACK echoes both.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t size;
+    uint64_t sequence;
+    int64_t time;
+}
+MessageHeader;
+
+typedef enum
+{
+    MESSAGE_HELLO = 1,
+    MESSAGE_USERS,
+    MESSAGE_RECORDS,
+    MESSAGE_ACK
+}
+MessageType;
+
+typedef struct
+{
+    uint32_t protocol_version;
+    uint32_t records_version;
+}
+Hello;
+
+/*
+ * Messages held back while the users are sent to a standby.
+ */
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+}
+Backlog;
+
+static int open_replication_socket(const int listening);
+static int is_loopback_address(const struct sockaddr *address);
+static void *serve_standbys(void *listen_fd);
+static int is_trusted_standby(const int fd);
+static int sync_standby(const int fd);
+static void attach_standby(void);
+static void replicate_to_standby(const void *records, const size_t records_size, const uint_fast64_t sequence);
+static void add_to_backlog(const MessageHeader *header, const void *data);
+static void receive_acks(const int fd);
+static void drop_standby(const int fd);
+static void report_replication_stats(void);
+static void *apply_primary_records(void *_);
+static int send_message(const int fd, const MessageType type, const void *data, const size_t data_size, const uint_fast64_t sequence);
+static int send_data(const int fd, const void *data, const size_t data_size);
+static int receive_data(const int fd, void *data, const size_t data_size);
+static int64_t get_time_milliseconds(void);
+
+static const char *replication_address;
+
+/*
+ * The standby, which is being synced or followed, is guarded by the standby_mutex,
+ * since the journal thread replicates to it. attaching_fd is the standby, which attach_standby
+ * makes the standby_fd, and attached_sequence is the last record, which its users include.
+ * Lock order: the journal locks, then the standby_mutex.
+ */
+static int attaching_fd = -1;
+static uint_fast64_t attached_sequence;
+static int standby_fd = -1;
+static int standby_syncing;
+static int standby_failed;
+static uint_fast64_t sent_sequence;
+static Backlog backlog;
+static pthread_mutex_t standby_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t stats_acks_count;
+static double stats_lag;
+static double stats_max_lag;
+static uint_fast64_t stats_max_lag_records;
+static time_t stats_start_time;
+
+static int primary_fd = -1;
+static pthread_t apply_primary_records_thread;
+static uint_fast64_t applied_sequence;
+
+int set_replication_address(const char *address)
+{
+    if (*address == '/')
+    {
+        if (strlen(address) >= sizeof ((struct sockaddr_un *) NULL)->sun_path)
+            return -1;
+    }
+    else
+    {
+        const char *port = strrchr(address, ':');
+
+        if (!port ||
+            port == address ||
+            port - address > MAX_REPLICATION_HOST_SIZE ||
+            !port[1] ||
+            strlen(port + 1) > MAX_REPLICATION_PORT_SIZE ||
+            strspn(port + 1, "0123456789") != strlen(port + 1))
+            return -1;
+    }
+
+    replication_address = address;
+    return 0;
+}
+
+int is_replication_enabled(void)
+{
+    return replication_address ? 1 : 0;
+}
+
+void start_replication(void)
+{
+    const int listen_fd = open_replication_socket(1);
+
+    if (listen_fd < 0)
+        die("%s: %s: failed to listen at %s",
+            __BASE_FILE__,
+            __func__,
+            replication_address);
+
+    stats_start_time = time(NULL);
+
+    pthread_t serve_standbys_thread;
+
+    if (pthread_create(&serve_standbys_thread,
+                       NULL,
+                       serve_standbys,
+                       (void *) (intptr_t) listen_fd))
+        die("%s: %s: failed to create serve_standbys_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(serve_standbys_thread);
+
+    report("Replication accepts a standby at %s",
+           replication_address);
+}
+
+int follow_primary(void)
+{
+    if ((primary_fd = open_replication_socket(0)) < 0)
+        return -1;
+
+    MessageHeader header;
+    Hello hello;
+
+    if (receive_data(primary_fd, &header, sizeof header) ||
+        header.magic != REPLICATION_MAGIC ||
+        header.type != MESSAGE_HELLO ||
+        header.size != sizeof hello ||
+        receive_data(primary_fd, &hello, sizeof hello) ||
+        receive_data(primary_fd, &header, sizeof header) ||
+        header.magic != REPLICATION_MAGIC ||
+        header.type != MESSAGE_USERS ||
+        !header.size)
+    {
+        close(primary_fd);
+        return -1;
+    }
+
+    if (hello.protocol_version != REPLICATION_PROTOCOL_VERSION)
+        die("%s: %s: primary speaks replication protocol of version %" PRIu32,
+            __BASE_FILE__,
+            __func__,
+            hello.protocol_version);
+
+    char *users_string = malloc(header.size);
+
+    if (!users_string)
+        die("%s: %s: failed to allocate memory for users_string",
+            __BASE_FILE__,
+            __func__);
+
+    if (receive_data(primary_fd, users_string, header.size) || users_string[header.size - 1])
+    {
+        free(users_string);
+        close(primary_fd);
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    init_replica(users_string, hello.records_version);
+    free(users_string);
+
+    applied_sequence = header.sequence;
+
+    if (pthread_create(&apply_primary_records_thread,
+                       NULL,
+                       apply_primary_records,
+                       NULL))
+        die("%s: %s: failed to create apply_primary_records_thread",
+            __BASE_FILE__,
+            __func__);
+
+    report("Standby loaded %" PRIu64 " bytes of users from the primary at %s in %.2f ms",
+           header.size,
+           replication_address,
+           get_elapsed_milliseconds(&start));
+
+    return 0;
+}
+
+void wait_primary(void)
+{
+    pthread_join(apply_primary_records_thread, NULL);
+    close(primary_fd);
+
+    report("Stream from the primary ended after record %" PRIuFAST64,
+           applied_sequence);
+}
+
+/*
+ * Returns a socket listening at the replication address or connected to it, or -1 on failure.
+ */
+static int open_replication_socket(const int listening)
+{
+    if (*replication_address == '/')
+    {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        strcpy(address.sun_path, replication_address);
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+            return -1;
+
+        // A socket left by a primary, which has stopped, would make the bind fail.
+        if (listening)
+            unlink(replication_address);
+
+        // Only the user of the daemon may connect, see is_trusted_standby.
+        if (listening ?
+            bind(fd, (struct sockaddr *) &address, sizeof address) ||
+            chmod(replication_address, S_IRUSR | S_IWUSR) ||
+            listen(fd, 1) :
+            connect(fd, (struct sockaddr *) &address, sizeof address))
+        {
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    const char *port = strrchr(replication_address, ':');
+
+    char host[MAX_REPLICATION_HOST_SIZE + 1];
+    snprintf(host, sizeof host, "%.*s", (int) (port - replication_address), replication_address);
+
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0 };
+    struct addrinfo *addresses;
+
+    if (getaddrinfo(host, port + 1, &hints, &addresses))
+        return -1;
+
+    int fd = -1;
+
+    for (const struct addrinfo *address = addresses; address; address = address->ai_next)
+    {
+        // A standby isn't authenticated, so the users never leave the host.
+        if (!is_loopback_address(address->ai_addr))
+            continue;
+
+        if ((fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol)) < 0)
+            continue;
+
+        const int enabled = 1;
+
+        if (listening)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof enabled);
+
+        if (listening ?
+            !bind(fd, address->ai_addr, address->ai_addrlen) && !listen(fd, 1) :
+            !connect(fd, address->ai_addr, address->ai_addrlen))
+        {
+            // Batches are sent as they are committed, waiting for more would add to the lag.
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof enabled);
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+static int is_loopback_address(const struct sockaddr *address)
+{
+    if (address->sa_family == AF_INET)
+        return ntohl(((const struct sockaddr_in *) address)->sin_addr.s_addr) >> 24 == IN_LOOPBACKNET;
+
+    if (address->sa_family == AF_INET6)
+    {
+        const struct in6_addr *address6 = &((const struct sockaddr_in6 *) address)->sin6_addr;
+
+        return IN6_IS_ADDR_LOOPBACK(address6) ||
+               (IN6_IS_ADDR_V4MAPPED(address6) && address6->s6_addr[12] == IN_LOOPBACKNET);
+    }
+
+    return 0;
+}
+
+/*
+ * Syncs and then follows the acknowledgements of one standby at a time.
+ */
+static void *serve_standbys(void *listen_fd)
+{
+    for (;;)
+    {
+        const int fd = accept((intptr_t) listen_fd, NULL, NULL);
+
+        if (fd < 0)
+            continue;
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        if (!is_trusted_standby(fd))
+        {
+            close(fd);
+            continue;
+        }
+
+        const struct timeval timeout =
+        {
+            REPLICATION_SEND_TIMEOUT / 1000,
+            REPLICATION_SEND_TIMEOUT % 1000 * 1000
+        };
+
+        const int enabled = 1;
+
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof enabled);
+
+        if (!sync_standby(fd))
+            receive_acks(fd);
+
+        drop_standby(fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns 1 if a standby runs as the same user on this host, else 0.
+ * Only a Unix socket tells the user of its peer, a TCP one is trusted if it is local.
+ */
+static int is_trusted_standby(const int fd)
+{
+    struct sockaddr_storage address;
+    socklen_t address_size = sizeof address;
+
+    if (getsockname(fd, (struct sockaddr *) &address, &address_size))
+        return 0;
+
+    if (address.ss_family != AF_UNIX)
+    {
+        address_size = sizeof address;
+
+        if (getpeername(fd, (struct sockaddr *) &address, &address_size) ||
+            !is_loopback_address((struct sockaddr *) &address))
+        {
+            report("Replication refused a standby, which isn't local");
+            return 0;
+        }
+
+        return 1;
+    }
+
+    struct ucred credentials;
+    socklen_t credentials_size = sizeof credentials;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size))
+        return 0;
+
+    if (credentials.uid != geteuid())
+    {
+        report("Replication refused a standby of user %ju",
+               (uintmax_t) credentials.uid);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Sends the users to a standby, while the records journaled in the meantime are held back
+ * in the backlog, and then the backlog, after which the records go to the standby directly.
+ * Returns 0 on success or -1 if the standby is gone.
+ */
+static int sync_standby(const int fd)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *users_string;
+    size_t users_size;
+
+    FILE *users_file = open_memstream(&users_string, &users_size);
+
+    if (!users_file)
+        die("%s: %s: failed to open users_file",
+            __BASE_FILE__,
+            __func__);
+
+    attaching_fd = fd;
+
+    const uint32_t records_version = export_replica(users_file, attach_standby);
+    fputc('\0', users_file);
+
+    if (fclose(users_file))
+        die("%s: %s: failed to export users for the standby",
+            __BASE_FILE__,
+            __func__);
+
+    const Hello hello =
+    {
+        .protocol_version = REPLICATION_PROTOCOL_VERSION,
+        .records_version = records_version
+    };
+
+    int failed = send_message(fd, MESSAGE_HELLO, &hello, sizeof hello, 0) ||
+                 send_message(fd, MESSAGE_USERS, users_string, users_size, attached_sequence);
+
+    free(users_string);
+
+    pthread_mutex_lock(&standby_mutex);
+
+    if (!failed && !standby_failed)
+        failed = send_data(fd, backlog.data, backlog.size);
+
+    standby_syncing = 0;
+    standby_failed |= failed;
+    backlog.size = 0;
+
+    pthread_mutex_unlock(&standby_mutex);
+
+    if (failed)
+        return -1;
+
+    report("Standby connected and got %zu bytes of users in %.2f ms",
+           users_size,
+           get_elapsed_milliseconds(&start));
+
+    return 0;
+}
+
+/*
+ * Called by export_replica while the users can't change.
+ */
+static void attach_standby(void)
+{
+    attached_sequence = replicate_journal(replicate_to_standby);
+
+    pthread_mutex_lock(&standby_mutex);
+
+    standby_fd = attaching_fd;
+    standby_syncing = 1;
+    standby_failed = 0;
+    sent_sequence = attached_sequence;
+
+    pthread_mutex_unlock(&standby_mutex);
+}
+
+/*
+ * Called by the journal for every batch of records before it's written to the disk.
+ * A standby, which fails to receive the batch in time, is shut down, so it won't take over
+ * with the records missing.
+ */
+static void replicate_to_standby(const void *records, const size_t records_size, const uint_fast64_t sequence)
+{
+    pthread_mutex_lock(&standby_mutex);
+
+    if (standby_fd >= 0 && !standby_failed)
+    {
+        if (standby_syncing)
+        {
+            const MessageHeader header =
+            {
+                .magic = REPLICATION_MAGIC,
+                .type = MESSAGE_RECORDS,
+                .size = records_size,
+                .sequence = sequence,
+                .time = get_time_milliseconds()
+            };
+
+            add_to_backlog(&header, records);
+        }
+        else if (send_message(standby_fd, MESSAGE_RECORDS, records, records_size, sequence))
+        {
+            standby_failed = 1;
+            shutdown(standby_fd, SHUT_RDWR);
+
+            report("Standby failed to receive records in time and was dropped");
+        }
+
+        sent_sequence = sequence;
+    }
+
+    pthread_mutex_unlock(&standby_mutex);
+}
+
+/*
+ * Must be called with the standby_mutex held.
+ */
+static void add_to_backlog(const MessageHeader *header, const void *data)
+{
+    const size_t new_size = backlog.size + sizeof *header + header->size;
+
+    if (new_size > backlog.capacity)
+    {
+        size_t new_capacity = backlog.capacity ? backlog.capacity : 4 * MAX_JOURNAL_RECORD_SIZE;
+
+        while (new_capacity < new_size)
+            new_capacity *= 2;
+
+        if (!(backlog.data = realloc(backlog.data, new_capacity)))
+            die("%s: %s: failed to reallocate memory for backlog.data",
+                __BASE_FILE__,
+                __func__);
+
+        backlog.capacity = new_capacity;
+    }
+
+    memcpy(backlog.data + backlog.size, header, sizeof *header);
+    memcpy(backlog.data + backlog.size + sizeof *header, data, header->size);
+
+    backlog.size = new_size;
+}
+
+/*
+ * Counts the lag of the standby from its acknowledgements until it's gone.
+ */
+static void receive_acks(const int fd)
+{
+    MessageHeader header;
+
+    while (!receive_data(fd, &header, sizeof header) &&
+           header.magic == REPLICATION_MAGIC &&
+           header.type == MESSAGE_ACK &&
+           !header.size)
+    {
+        const double lag = get_time_milliseconds() - header.time;
+
+        pthread_mutex_lock(&standby_mutex);
+        const uint_fast64_t lag_records = sent_sequence - header.sequence;
+        pthread_mutex_unlock(&standby_mutex);
+
+        ++stats_acks_count;
+        stats_lag += lag;
+
+        if (lag > stats_max_lag)
+            stats_max_lag = lag;
+
+        if (lag_records > stats_max_lag_records)
+            stats_max_lag_records = lag_records;
+
+        if (difftime(time(NULL), stats_start_time) >= MAX_REPLICATION_STATS_INTERVAL)
+            report_replication_stats();
+    }
+}
+
+static void drop_standby(const int fd)
+{
+    pthread_mutex_lock(&standby_mutex);
+
+    standby_fd = -1;
+    standby_syncing = 0;
+    backlog.size = 0;
+
+    pthread_mutex_unlock(&standby_mutex);
+
+    close(fd);
+
+    report_replication_stats();
+    report("Standby disconnected");
+}
+
+static void report_replication_stats(void)
+{
+    if (stats_acks_count)
+        report("Standby acknowledged %zu batches of records: %.2f ms lag on average (max %.2f ms), "
+               "up to %" PRIuFAST64 " records behind",
+               stats_acks_count,
+               stats_lag / stats_acks_count,
+               stats_max_lag,
+               stats_max_lag_records);
+
+    stats_acks_count = 0;
+    stats_lag = 0;
+    stats_max_lag = 0;
+    stats_max_lag_records = 0;
+    stats_start_time = time(NULL);
+}
+
+/*
+ * Applies the records from the primary until the stream ends.
+ * A message cut off by the end was never written to the disk by the primary, so it's dropped.
+ */
+static void *apply_primary_records(void *_)
+{
+    (void) _;
+
+    unsigned char *records = NULL;
+    size_t records_capacity = 0;
+
+    MessageHeader header;
+
+    while (!receive_data(primary_fd, &header, sizeof header) &&
+           header.magic == REPLICATION_MAGIC &&
+           header.type == MESSAGE_RECORDS)
+    {
+        if (header.size > records_capacity)
+        {
+            records_capacity = header.size;
+
+            if (!(records = realloc(records, records_capacity)))
+                die("%s: %s: failed to reallocate memory for records",
+                    __BASE_FILE__,
+                    __func__);
+        }
+
+        if (receive_data(primary_fd, records, header.size))
+            break;
+
+        apply_replica_records(records, header.size);
+        applied_sequence = header.sequence;
+
+        header.type = MESSAGE_ACK;
+        header.size = 0;
+
+        // A lost acknowledgement only leaves the lag unknown.
+        send_data(primary_fd, &header, sizeof header);
+    }
+
+    free(records);
+    return NULL;
+}
+
+/*
+ * Returns 0 on success or -1 on failure.
+ */
+static int send_message(const int fd, const MessageType type, const void *data, const size_t data_size, const uint_fast64_t sequence)
+{
+    const MessageHeader header =
+    {
+        .magic = REPLICATION_MAGIC,
+        .type = type,
+        .size = data_size,
+        .sequence = sequence,
+        .time = get_time_milliseconds()
+    };
+
+    return send_data(fd, &header, sizeof header) || send_data(fd, data, data_size) ? -1 : 0;
+}
+
+/*
+ * Returns 0 on success or -1 on failure, including a timeout.
+ */
+static int send_data(const int fd, const void *data, const size_t data_size)
+{
+    size_t sent_size = 0;
+
+    while (sent_size < data_size)
+    {
+        const ssize_t size = send(fd, (const char *) data + sent_size, data_size - sent_size, MSG_NOSIGNAL);
+
+        if (size < 0 && errno == EINTR)
+            continue;
+
+        if (size <= 0)
+            return -1;
+
+        sent_size += size;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 0 on success or -1 on failure, including the end of the stream.
+ */
+static int receive_data(const int fd, void *data, const size_t data_size)
+{
+    size_t received_size = 0;
+
+    while (received_size < data_size)
+    {
+        const ssize_t size = recv(fd, (char *) data + received_size, data_size - received_size, 0);
+
+        if (size < 0 && errno == EINTR)
+            continue;
+
+        if (size <= 0)
+            return -1;
+
+        received_size += size;
+    }
+
+    return 0;
+}
+
+static int64_t get_time_milliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
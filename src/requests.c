@@ -29,6 +29,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <curl/curl.h>
 #include <cjson/cJSON.h>
@@ -43,25 +45,63 @@ typedef struct
 }
 ServerResponse;
 
+static CURL *get_curl(void);
+static CURLcode perform_request(CURL *curl);
+static void report_requests_stats(void);
+static void lock_share(CURL *_, const curl_lock_data data, const curl_lock_access __, void *___);
+static void unlock_share(CURL *_, const curl_lock_data data, void *__);
+static void cleanup_curl(void *curl);
 static size_t write_callback(void *data,
                              const size_t data_size,
                              const size_t data_count,
                              void *server_response);
 
+static CURLSH *share;
+static pthread_mutex_t share_mutexes[CURL_LOCK_DATA_LAST];
+
+static pthread_key_t curl_key;
+
+static pthread_mutex_t requests_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t requests_stats_requests;
+static size_t requests_stats_connections;
+static size_t requests_stats_handshakes;
+static double requests_stats_handshakes_time;
+static time_t requests_stats_start_time;
+
 void init_requests_module(void)
 {
     curl_global_init(CURL_GLOBAL_DEFAULT);
-}
 
-cJSON *get_updates(const int_fast32_t update_id)
-{
-    CURL *curl = curl_easy_init();
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&share_mutexes[i], NULL);
+
+    share = curl_share_init();
 
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
+    if (!share)
+        die("%s: %s: failed to initialize curl share",
             __BASE_FILE__,
             __func__);
 
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_share);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    if (curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+        report("Curl can't share connections, every thread will keep its own");
+
+    if (pthread_key_create(&curl_key, cleanup_curl))
+        die("%s: %s: failed to create curl_key",
+            __BASE_FILE__,
+            __func__);
+
+    requests_stats_start_time = time(NULL);
+}
+
+cJSON *get_updates(const int_fast32_t update_id)
+{
+    CURL *curl = get_curl();
+
     ServerResponse response;
     response.data = malloc(1);
 
@@ -84,24 +124,8 @@ cJSON *get_updates(const int_fast32_t update_id)
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
-
-    CURLcode code;
-    int retries = 0;
-
-    do
-    {
-        code = curl_easy_perform(curl);
-
-        if (code == CURLE_OK)
-            break;
-    }
-    while (++retries < MAX_REQUEST_RETRIES);
 
-    curl_easy_cleanup(curl);
-
-    if (code != CURLE_OK)
+    if (perform_request(curl) != CURLE_OK)
     {
         free(response.data);
         return NULL;
@@ -120,12 +144,7 @@ cJSON *get_updates(const int_fast32_t update_id)
 
 cJSON *get_chat(const int_fast64_t chat_id)
 {
-    CURL *curl = curl_easy_init();
-
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
-            __BASE_FILE__,
-            __func__);
+    CURL *curl = get_curl();
 
     ServerResponse response;
     response.data = malloc(1);
@@ -147,24 +166,8 @@ cJSON *get_chat(const int_fast64_t chat_id)
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
-
-    CURLcode code;
-    int retries = 0;
-
-    do
-    {
-        code = curl_easy_perform(curl);
-
-        if (code == CURLE_OK)
-            break;
-    }
-    while (++retries < MAX_REQUEST_RETRIES);
-
-    curl_easy_cleanup(curl);
 
-    if (code != CURLE_OK)
+    if (perform_request(curl) != CURLE_OK)
     {
         free(response.data);
         return NULL;
@@ -183,12 +186,7 @@ cJSON *get_chat(const int_fast64_t chat_id)
 
 void leave_chat(const int_fast64_t chat_id)
 {
-    CURL *curl = curl_easy_init();
-
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
-            __BASE_FILE__,
-            __func__);
+    CURL *curl = get_curl();
 
     char post_fields[MAX_POSTFIELDS_SIZE];
     snprintf(post_fields,
@@ -198,35 +196,43 @@ void leave_chat(const int_fast64_t chat_id)
 
     curl_easy_setopt(curl, CURLOPT_URL, BOT_API_URL "/leaveChat");
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
 
-    int retries = 0;
+    perform_request(curl);
+}
 
-    do
-        if (curl_easy_perform(curl) == CURLE_OK)
-            break;
-    while (++retries < MAX_REQUEST_RETRIES);
+void send_message_with_keyboard(const int_fast64_t chat_id, const char *message, const char *keyboard)
+{
+    char *escaped_message = escape_message(message);
 
-    curl_easy_cleanup(curl);
+    send_escaped_message_with_keyboard(chat_id, escaped_message, keyboard);
+    free(escaped_message);
 }
 
-void send_message_with_keyboard(const int_fast64_t chat_id, const char *message, const char *keyboard)
+char *escape_message(const char *message)
 {
-    CURL *curl = curl_easy_init();
+    // The handle is only used for error reporting, so the escaping needs no easy handle of its own.
+    char *curl_escaped_message = curl_easy_escape(NULL, message, 0);
 
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
+    if (!curl_escaped_message)
+        die("%s: %s: failed to escape message",
             __BASE_FILE__,
             __func__);
 
-    char *escaped_message = curl_easy_escape(curl, message, 0);
+    char *escaped_message = strdup(curl_escaped_message);
 
     if (!escaped_message)
-        die("%s: %s: failed to escape message",
+        die("%s: %s: failed to allocate memory for escaped_message",
             __BASE_FILE__,
             __func__);
 
+    curl_free(curl_escaped_message);
+    return escaped_message;
+}
+
+void send_escaped_message_with_keyboard(const int_fast64_t chat_id, const char *escaped_message, const char *keyboard)
+{
+    CURL *curl = get_curl();
+
     char post_fields[MAX_POSTFIELDS_SIZE];
     snprintf(post_fields,
              sizeof post_fields,
@@ -239,17 +245,127 @@ void send_message_with_keyboard(const int_fast64_t chat_id, const char *message,
 
     curl_easy_setopt(curl, CURLOPT_URL, BOT_API_URL "/sendMessage");
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
+
+    perform_request(curl);
+}
+
+/*
+ * Returns the handle of the calling thread with its options reset.
+ * The reset keeps the connections, so the next request can reuse them.
+ */
+static CURL *get_curl(void)
+{
+    CURL *curl = pthread_getspecific(curl_key);
+
+    if (curl)
+        curl_easy_reset(curl);
+    else
+    {
+        curl = curl_easy_init();
+
+        if (!curl)
+            die("%s: %s: failed to initialize curl",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_setspecific(curl_key, curl);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, (long) MAX_CONNECTIONS);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
 
+    return curl;
+}
+
+/*
+ * Performs a request, retrying it up to MAX_REQUEST_RETRIES times, and counts
+ * the connections and TLS handshakes every attempt has made.
+ */
+static CURLcode perform_request(CURL *curl)
+{
+    CURLcode code;
     int retries = 0;
 
     do
-        if (curl_easy_perform(curl) == CURLE_OK)
+    {
+        code = curl_easy_perform(curl);
+
+        long connections = 0;
+        curl_off_t connect_time = 0;
+        curl_off_t handshake_time = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connections);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_time);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &handshake_time);
+
+        pthread_mutex_lock(&requests_stats_mutex);
+
+        ++requests_stats_requests;
+        requests_stats_connections += connections;
+
+        // The handshake time is zero on a reused connection.
+        if (connections && handshake_time)
+        {
+            ++requests_stats_handshakes;
+            requests_stats_handshakes_time += (handshake_time - connect_time) / 1000.0;
+        }
+
+        if (difftime(time(NULL), requests_stats_start_time) >= MAX_REQUESTS_STATS_INTERVAL)
+            report_requests_stats();
+
+        pthread_mutex_unlock(&requests_stats_mutex);
+
+        if (code == CURLE_OK)
             break;
+    }
     while (++retries < MAX_REQUEST_RETRIES);
 
-    curl_free(escaped_message);
+    return code;
+}
+
+/*
+ * Must be called with the requests_stats_mutex held.
+ */
+static void report_requests_stats(void)
+{
+    if (requests_stats_requests)
+        report("Made %zu requests over %zu new connections (%.1f%% reused), "
+               "%zu TLS handshakes of %.2f ms on average",
+               requests_stats_requests,
+               requests_stats_connections,
+               requests_stats_connections < requests_stats_requests ?
+               100.0 * (requests_stats_requests - requests_stats_connections) / requests_stats_requests : 0.0,
+               requests_stats_handshakes,
+               requests_stats_handshakes ? requests_stats_handshakes_time / requests_stats_handshakes : 0.0);
+
+    requests_stats_requests = 0;
+    requests_stats_connections = 0;
+    requests_stats_handshakes = 0;
+    requests_stats_handshakes_time = 0;
+    requests_stats_start_time = time(NULL);
+}
+
+static void lock_share(CURL *_, const curl_lock_data data, const curl_lock_access __, void *___)
+{
+    (void) _;
+    (void) __;
+    (void) ___;
+
+    pthread_mutex_lock(&share_mutexes[data]);
+}
+
+static void unlock_share(CURL *_, const curl_lock_data data, void *__)
+{
+    (void) _;
+    (void) __;
+
+    pthread_mutex_unlock(&share_mutexes[data]);
+}
+
+static void cleanup_curl(void *curl)
+{
     curl_easy_cleanup(curl);
 }
 
@@ -0,0 +1,218 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "log.h"
+#include "storage.h"
+#include "sessions.h"
+
+#define MIN_SESSIONS_CAPACITY 64
+
+typedef struct
+{
+    int_fast64_t chat_id;
+    unsigned int states; // 0 marks an empty slot, a session without states is removed.
+    time_t last_access;
+}
+Session;
+
+static Session *find_session(const int_fast64_t chat_id, const time_t current_time);
+static Session *insert_session(const int_fast64_t chat_id, const time_t current_time);
+static void remove_session(Session *session);
+static void resize_sessions(const time_t current_time);
+static int is_expired_session(const Session *session, const time_t current_time);
+static int_fast64_t get_session_chat_id(const void *_, const void *session);
+
+/*
+ * Sessions are kept in a ChatSlots table, which is at most half full.
+ * Expired sessions are removed when they are found and skipped when the table is resized.
+ */
+static Session *sessions;
+static size_t sessions_count;
+static size_t sessions_mask;
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void set_session_state(const int_fast64_t chat_id, const unsigned int state, const int state_value)
+{
+    const time_t current_time = time(NULL);
+
+    pthread_mutex_lock(&sessions_mutex);
+
+    Session *session = find_session(chat_id, current_time);
+
+    if (!session && state_value)
+        session = insert_session(chat_id, current_time);
+
+    if (session)
+    {
+        if (state_value)
+            session->states |= state;
+        else
+            session->states &= ~state;
+
+        session->last_access = current_time;
+
+        if (!session->states)
+            remove_session(session);
+    }
+
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+unsigned int get_session_states(const int_fast64_t chat_id)
+{
+    const time_t current_time = time(NULL);
+    unsigned int states = 0;
+
+    pthread_mutex_lock(&sessions_mutex);
+
+    Session *session = find_session(chat_id, current_time);
+
+    if (session)
+    {
+        states = session->states;
+        session->last_access = current_time;
+    }
+
+    pthread_mutex_unlock(&sessions_mutex);
+    return states;
+}
+
+/*
+ * Returns the session of a user or NULL if it doesn't exist or has expired,
+ * in which case it's removed.
+ */
+static Session *find_session(const int_fast64_t chat_id, const time_t current_time)
+{
+    if (!sessions)
+        return NULL;
+
+    for (size_t slot = hash_chat_id(chat_id) & sessions_mask;
+         sessions[slot].states;
+         slot = (slot + 1) & sessions_mask)
+    {
+        Session *session = &sessions[slot];
+
+        if (session->chat_id != chat_id)
+            continue;
+
+        if (!is_expired_session(session, current_time))
+            return session;
+
+        remove_session(session);
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Adds a session without states, which must get some right away.
+ * The session must not already exist.
+ */
+static Session *insert_session(const int_fast64_t chat_id, const time_t current_time)
+{
+    if (!sessions || (sessions_count + 1) * 2 > sessions_mask + 1)
+        resize_sessions(current_time);
+
+    const ChatSlots sessions_slots = {sessions, sizeof *sessions, sessions_mask, get_session_chat_id, NULL};
+
+    ++sessions_count;
+
+    Session *session = &sessions[find_empty_chat_slot(&sessions_slots, chat_id)];
+
+    session->chat_id = chat_id;
+    session->states = 0;
+    session->last_access = current_time;
+
+    return session;
+}
+
+/*
+ * Removes a session, see clear_chat_slot.
+ */
+static void remove_session(Session *session)
+{
+    const ChatSlots sessions_slots = {sessions, sizeof *sessions, sessions_mask, get_session_chat_id, NULL};
+
+    clear_chat_slot(&sessions_slots, session - sessions);
+    --sessions_count;
+}
+
+/*
+ * Rebuilds the table without the expired sessions, doubling its capacity
+ * until it has room for one more session.
+ */
+static void resize_sessions(const time_t current_time)
+{
+    size_t live_sessions_count = 0;
+
+    for (size_t i = 0; sessions && i <= sessions_mask; ++i)
+        if (sessions[i].states && !is_expired_session(&sessions[i], current_time))
+            ++live_sessions_count;
+
+    size_t new_capacity = sessions ? sessions_mask + 1 : MIN_SESSIONS_CAPACITY;
+
+    while ((live_sessions_count + 1) * 2 > new_capacity)
+        new_capacity *= 2;
+
+    Session *new_sessions = calloc(new_capacity, sizeof *new_sessions);
+
+    if (!new_sessions)
+        die("%s: %s: failed to allocate memory for sessions",
+            __BASE_FILE__,
+            __func__);
+
+    const ChatSlots new_sessions_slots = {new_sessions, sizeof *new_sessions, new_capacity - 1, get_session_chat_id, NULL};
+
+    for (size_t i = 0; sessions && i <= sessions_mask; ++i)
+        if (sessions[i].states && !is_expired_session(&sessions[i], current_time))
+            new_sessions[find_empty_chat_slot(&new_sessions_slots, sessions[i].chat_id)] = sessions[i];
+
+    free(sessions);
+
+    sessions = new_sessions;
+    sessions_count = live_sessions_count;
+    sessions_mask = new_capacity - 1;
+}
+
+static int is_expired_session(const Session *session, const time_t current_time)
+{
+    return difftime(current_time, session->last_access) >= SESSION_TTL;
+}
+
+static int_fast64_t get_session_chat_id(const void *_, const void *session)
+{
+    (void) _;
+
+    return ((const Session *) session)->chat_id;
+}
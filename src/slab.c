@@ -0,0 +1,156 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "slab.h"
+
+static int get_slab_class(const size_t size);
+static void *carve_slab_chunk(SlabAllocator *allocator, const size_t chunk_size);
+
+/*
+ * Chunk sizes go in steps of 16 bytes up to 256, where most problem texts fit,
+ * and then in steps of a half of a power of 2, so a chunk wastes at most a third of itself.
+ * All of them are multiples of MIN_SLAB_CHUNK_SIZE, which keeps chunks aligned.
+ */
+static const size_t slab_chunk_sizes[SLAB_CLASSES_COUNT] =
+{
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    384, 512, 768, 1024, 1536, 2048, 3072, MAX_SLAB_CHUNK_SIZE
+};
+
+void *allocate_slab_block(SlabAllocator *allocator, const size_t size)
+{
+    allocator->blocks_size += size;
+
+    if (size > MAX_SLAB_CHUNK_SIZE)
+    {
+        void *block = malloc(size);
+
+        if (!block)
+            die("%s: %s: failed to allocate memory for block",
+                __BASE_FILE__,
+                __func__);
+
+        allocator->reserved_size += size;
+        allocator->chunks_size += size;
+        return block;
+    }
+
+    const int slab_class = get_slab_class(size);
+    const size_t chunk_size = slab_chunk_sizes[slab_class];
+
+    allocator->chunks_size += chunk_size;
+
+    void *chunk = allocator->free_chunks[slab_class];
+
+    if (!chunk)
+        return carve_slab_chunk(allocator, chunk_size);
+
+    // A free chunk keeps the pointer to the next free chunk of its class in its first bytes.
+    memcpy(&allocator->free_chunks[slab_class], chunk, sizeof(void *));
+    return chunk;
+}
+
+void free_slab_block(SlabAllocator *allocator, void *block, const size_t size)
+{
+    if (!block)
+        return;
+
+    allocator->blocks_size -= size;
+
+    if (size > MAX_SLAB_CHUNK_SIZE)
+    {
+        allocator->reserved_size -= size;
+        allocator->chunks_size -= size;
+        free(block);
+        return;
+    }
+
+    const int slab_class = get_slab_class(size);
+
+    allocator->chunks_size -= slab_chunk_sizes[slab_class];
+
+    memcpy(block, &allocator->free_chunks[slab_class], sizeof(void *));
+    allocator->free_chunks[slab_class] = block;
+}
+
+char *copy_slab_string(SlabAllocator *allocator, const char *string)
+{
+    const size_t string_size = strlen(string) + 1;
+    char *copy = allocate_slab_block(allocator, string_size);
+
+    memcpy(copy, string, string_size);
+    return copy;
+}
+
+void free_slab_string(SlabAllocator *allocator, char *string)
+{
+    if (string)
+        free_slab_block(allocator, string, strlen(string) + 1);
+}
+
+/*
+ * Returns the index of the smallest size class which fits size bytes.
+ */
+static int get_slab_class(const size_t size)
+{
+    int slab_class = 0;
+
+    while (slab_chunk_sizes[slab_class] < size)
+        ++slab_class;
+
+    return slab_class;
+}
+
+/*
+ * Cuts a new chunk from the current slab, starting a new slab when it is exhausted.
+ * Slabs are never returned to the system: freed chunks are reused by their class,
+ * and the rest of an exhausted slab is left unused.
+ */
+static void *carve_slab_chunk(SlabAllocator *allocator, const size_t chunk_size)
+{
+    if (!allocator->slab || SLAB_SIZE - allocator->slab_used_size < chunk_size)
+    {
+        allocator->slab = aligned_alloc(MIN_SLAB_CHUNK_SIZE, SLAB_SIZE);
+
+        if (!allocator->slab)
+            die("%s: %s: failed to allocate memory for slab",
+                __BASE_FILE__,
+                __func__);
+
+        allocator->slab_used_size = 0;
+        allocator->reserved_size += SLAB_SIZE;
+    }
+
+    void *chunk = allocator->slab + allocator->slab_used_size;
+    allocator->slab_used_size += chunk_size;
+
+    return chunk;
+}
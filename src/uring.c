@@ -0,0 +1,366 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "uring.h"
+
+#define MAX_URING_WRITE_SIZE 1073741824 // 1 GiB, io_uring takes 32-bit lengths.
+
+/*
+ * The queues shared with the kernel, see io_uring_setup(2).
+ * The submission queue holds indexes into the sqes.
+ */
+typedef struct
+{
+    int set_up;
+    int fd;
+
+    unsigned char *sq_ring;
+    size_t sq_ring_size;
+    unsigned char *cq_ring; // The same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP.
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+}
+Uring;
+
+static int set_up_uring(void);
+static void init_uring_module(void);
+static void close_uring(void *_);
+static void forget_uring(void);
+static ssize_t write_uring(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync, int *synced);
+static struct io_uring_sqe *get_sqe(const unsigned index);
+
+/*
+ * Every thread has its own io_uring, so writers of different files never wait for each other.
+ * A ring is set up on the first write_file of a thread and closed when the thread exits.
+ */
+static _Thread_local Uring uring;
+
+static pthread_once_t uring_module_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uring_key;
+static atomic_int uring_unavailable; // Set once the kernel has refused an io_uring.
+
+int write_file(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync)
+{
+    const unsigned char *bytes = data;
+    size_t written_size = 0;
+    int synced = 0;
+
+    if (sync && data_size <= MAX_URING_WRITE_SIZE && set_up_uring())
+    {
+        const ssize_t size = write_uring(fd, data, data_size, offset, sync, &synced);
+
+        if (size < 0)
+        {
+            errno = -size;
+            return -1;
+        }
+
+        written_size = size;
+    }
+
+    // A short write cancels the linked sync, so the rest is written the plain way.
+    while (written_size < data_size)
+    {
+        const ssize_t size = offset < 0 ?
+                             write(fd, bytes + written_size, data_size - written_size) :
+                             pwrite(fd, bytes + written_size, data_size - written_size, offset + written_size);
+
+        if (size < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        written_size += size;
+    }
+
+    if (sync && !synced && fdatasync(fd))
+        return -1;
+
+    return 0;
+}
+
+int is_uring_available(void)
+{
+    return set_up_uring();
+}
+
+/*
+ * Sets up the io_uring of the calling thread if it isn't set up yet.
+ * A kernel without io_uring, or one that can't take the current file position
+ * for a write (IORING_FEAT_RW_CUR_POS, Linux 5.6), makes all threads fall back.
+ * Returns 1 if the io_uring is ready, else 0.
+ */
+static int set_up_uring(void)
+{
+    if (uring.set_up)
+        return 1;
+
+    if (atomic_load(&uring_unavailable))
+        return 0;
+
+    pthread_once(&uring_module_once, init_uring_module);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    const int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+    if (fd < 0)
+    {
+        atomic_store(&uring_unavailable, 1);
+        return 0;
+    }
+
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(fd);
+        atomic_store(&uring_unavailable, 1);
+        return 0;
+    }
+
+    Uring new_uring = {.set_up = 1, .fd = fd};
+
+    new_uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    new_uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    new_uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP && new_uring.cq_ring_size > new_uring.sq_ring_size)
+        new_uring.sq_ring_size = new_uring.cq_ring_size;
+
+    new_uring.sq_ring = mmap(NULL,
+                             new_uring.sq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             fd,
+                             IORING_OFF_SQ_RING);
+
+    new_uring.cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ?
+                        new_uring.sq_ring :
+                        mmap(NULL,
+                             new_uring.cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             fd,
+                             IORING_OFF_CQ_RING);
+
+    new_uring.sqes = mmap(NULL,
+                          new_uring.sqes_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          fd,
+                          IORING_OFF_SQES);
+
+    if (new_uring.sq_ring == MAP_FAILED || new_uring.cq_ring == MAP_FAILED || new_uring.sqes == MAP_FAILED)
+    {
+        if (new_uring.sq_ring != MAP_FAILED)
+            munmap(new_uring.sq_ring, new_uring.sq_ring_size);
+
+        if (new_uring.cq_ring != MAP_FAILED && new_uring.cq_ring != new_uring.sq_ring)
+            munmap(new_uring.cq_ring, new_uring.cq_ring_size);
+
+        if (new_uring.sqes != MAP_FAILED)
+            munmap(new_uring.sqes, new_uring.sqes_size);
+
+        close(fd);
+        return 0;
+    }
+
+    new_uring.sq_head = (_Atomic unsigned *) (new_uring.sq_ring + params.sq_off.head);
+    new_uring.sq_tail = (_Atomic unsigned *) (new_uring.sq_ring + params.sq_off.tail);
+    new_uring.sq_mask = (unsigned *) (new_uring.sq_ring + params.sq_off.ring_mask);
+    new_uring.sq_array = (unsigned *) (new_uring.sq_ring + params.sq_off.array);
+    new_uring.cq_head = (_Atomic unsigned *) (new_uring.cq_ring + params.cq_off.head);
+    new_uring.cq_tail = (_Atomic unsigned *) (new_uring.cq_ring + params.cq_off.tail);
+    new_uring.cq_mask = (unsigned *) (new_uring.cq_ring + params.cq_off.ring_mask);
+    new_uring.cqes = (struct io_uring_cqe *) (new_uring.cq_ring + params.cq_off.cqes);
+
+    uring = new_uring;
+
+    // Any non-NULL value makes the destructor run at the thread exit.
+    pthread_setspecific(uring_key, &uring);
+    return 1;
+}
+
+static void init_uring_module(void)
+{
+    pthread_key_create(&uring_key, close_uring);
+    pthread_atfork(NULL, NULL, forget_uring);
+}
+
+static void close_uring(void *_)
+{
+    (void) _;
+
+    if (!uring.set_up)
+        return;
+
+    munmap(uring.sqes, uring.sqes_size);
+
+    if (uring.cq_ring != uring.sq_ring)
+        munmap(uring.cq_ring, uring.cq_ring_size);
+
+    munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.fd);
+
+    memset(&uring, 0, sizeof uring);
+}
+
+/*
+ * The queues of a forked child are still shared with the io_uring of the parent,
+ * so the child closes its copy and sets up its own one if it needs it.
+ */
+static void forget_uring(void)
+{
+    close_uring(NULL);
+}
+
+/*
+ * Submits a write, linked with a data sync if sync is set, and waits for their completion.
+ * synced is set if the sync has completed, which it doesn't after a short write.
+ * If the kernel doesn't take the entries, they are taken back and nothing is written,
+ * so write_file writes the plain way. If waiting for the completions fails, the io_uring
+ * is closed, so its late completions are never taken for the ones of the next call.
+ * Returns the number of written bytes or a negative errno.
+ */
+static ssize_t write_uring(const int fd, const void *data, const size_t data_size, const off_t offset, const int sync, int *synced)
+{
+    // The queues are empty between the calls, so the entries start at the current tail.
+    const unsigned tail = atomic_load_explicit(uring.sq_tail, memory_order_relaxed);
+    unsigned entries_count = sync ? 2 : 1;
+
+    struct io_uring_sqe *write_sqe = get_sqe(tail);
+    write_sqe->opcode = IORING_OP_WRITE;
+    write_sqe->fd = fd;
+    write_sqe->addr = (uintptr_t) data;
+    write_sqe->len = data_size;
+    write_sqe->off = offset < 0 ? (uint64_t) -1 : (uint64_t) offset;
+    write_sqe->user_data = IORING_OP_WRITE;
+
+    if (sync)
+    {
+        write_sqe->flags = IOSQE_IO_LINK;
+
+        struct io_uring_sqe *sync_sqe = get_sqe(tail + 1);
+        sync_sqe->opcode = IORING_OP_FSYNC;
+        sync_sqe->fd = fd;
+        sync_sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sync_sqe->user_data = IORING_OP_FSYNC;
+    }
+
+    atomic_store_explicit(uring.sq_tail, tail + entries_count, memory_order_release);
+
+    // Usually a single call submits the entries and waits for them, the loops below catch up after a signal.
+    unsigned waited_count = entries_count;
+
+    while (atomic_load_explicit(uring.sq_head, memory_order_acquire) != tail + entries_count)
+    {
+        if (syscall(__NR_io_uring_enter,
+                    uring.fd,
+                    tail + entries_count - atomic_load_explicit(uring.sq_head, memory_order_acquire),
+                    waited_count,
+                    IORING_ENTER_GETEVENTS,
+                    NULL,
+                    0) < 0 && errno != EINTR)
+        {
+            // The queue must be empty for the next call, and the entries taken so far are still waited for.
+            const unsigned head = atomic_load_explicit(uring.sq_head, memory_order_acquire);
+
+            atomic_store_explicit(uring.sq_tail, head, memory_order_release);
+            entries_count = head - tail;
+            break;
+        }
+
+        waited_count = 0;
+    }
+
+    ssize_t written_size = 0;
+    unsigned completed_count = 0;
+
+    while (completed_count < entries_count)
+    {
+        unsigned head = atomic_load_explicit(uring.cq_head, memory_order_relaxed);
+
+        if (head == atomic_load_explicit(uring.cq_tail, memory_order_acquire))
+        {
+            if (syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            {
+                const int error = errno;
+
+                close_uring(NULL);
+                return -error;
+            }
+
+            continue;
+        }
+
+        const struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+
+        if (cqe->user_data == IORING_OP_WRITE)
+            written_size = cqe->res;
+        else
+            *synced = cqe->res == 0;
+
+        atomic_store_explicit(uring.cq_head, head + 1, memory_order_release);
+        ++completed_count;
+    }
+
+    return written_size;
+}
+
+static struct io_uring_sqe *get_sqe(const unsigned index)
+{
+    const unsigned slot = index & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[slot];
+
+    memset(sqe, 0, sizeof *sqe);
+    uring.sq_array[slot] = slot;
+
+    return sqe;
+}
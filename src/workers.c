@@ -0,0 +1,869 @@
+/******************************************************************************
+ *                                                                            *
+ *   _             _                _                                         *
+ *  | |__    ___  | | __         __| |  __ _   ___  _ __ ___    ___   _ __    *
+ *  | '_ \  / _ \ | |/ / _____  / _` | / _` | / _ \| '_ ` _ \  / _ \ | '_ \   *
+ *  | | | || (_) ||   < |_____|| (_| || (_| ||  __/| | | | | || (_) || | | |  *
+ *  |_| |_| \___/ |_|\_\        \__,_| \__,_| \___||_| |_| |_| \___/ |_| |_|  *
+ *                                                                            *
+ * Copyright (C) 2024-2025 qwardo <odrawq.qwardo@gmail.com>                   *
+ *                                                                            *
+ * This file is part of hok-daemon.                                           *
+ *                                                                            *
+ * hok-daemon is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * hok-daemon is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the               *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with hok-daemon. If not, see <http://www.gnu.org/licenses/>.         *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "log.h"
+#include "data.h"
+#include "storage.h"
+#include "workers.h"
+
+typedef enum
+{
+    CALL_IDLE,
+    CALL_MADE,
+    CALL_RETURNED
+}
+CallState;
+
+typedef enum
+{
+    CALL_GET_USER_RECORD,
+    CALL_COMMIT_TRANSACTION,
+    CALL_CREATE_USER,
+    CALL_SET_STATE,
+    CALL_CREATE_PROBLEM,
+    CALL_SET_PROBLEM_USERNAME,
+    CALL_DELETE_PROBLEM,
+    CALL_READ_PROBLEMS
+}
+CallType;
+
+/*
+ * The arguments of a call, also kept for every mutation of a transaction.
+ */
+typedef struct
+{
+    CallType type;
+    int_fast64_t chat_id;
+    unsigned int user_state;
+    int user_state_value;
+    unsigned int closure;
+    int use_time_limit;
+    char username[MAX_USERNAME_SIZE + 1];
+}
+CallArguments;
+
+/*
+ * A call of a data module function made by a worker thread and carried out by a supervisor thread.
+ * The worker sets the state to CALL_MADE, the supervisor to CALL_RETURNED once the results
+ * are in place, and the worker back to CALL_IDLE after taking them. Both wait on the state
+ * as a futex, so neither holds anything the other one could wait for after a crash.
+ * The mutations of a transaction are only collected in the call by the worker, see
+ * worker_begin_transaction, and the supervisor applies them all on CALL_COMMIT_TRANSACTION.
+ */
+typedef struct
+{
+    atomic_uint state;
+    CallArguments arguments;
+    char problem_text[MAX_JOURNAL_RECORD_SIZE]; // Of the only problem a call or a transaction can create.
+    int_fast64_t transaction_chat_id;
+    size_t transaction_calls_count;
+    CallArguments transaction_calls[MAX_TRANSACTION_CALLS];
+    UserRecord user_record;
+    int user_exists;
+    ProblemsCursor cursor;
+    size_t problems_count;
+    ProblemView problems[MAX_CALL_PROBLEMS];
+}
+Call;
+
+/*
+ * Messages of a worker in a ring, which only the supervisor adds to and only the worker takes from.
+ * head and tail only grow and are futexes, which the other side waits on.
+ */
+typedef struct
+{
+    atomic_uint head;
+    atomic_uint tail;
+    char messages[WORKER_QUEUE_SIZE][MAX_WORKER_MESSAGE_SIZE];
+}
+MessageQueue;
+
+typedef struct
+{
+    atomic_int pid;
+    MessageQueue queue;
+    Call calls[WORKER_CALLERS_COUNT];
+}
+Worker;
+
+/*
+ * The shared memory of the supervisor, the keeper and the workers.
+ */
+typedef struct
+{
+    atomic_uint_fast64_t problem_lists_generations[PROBLEM_LISTS_COUNT];
+    Worker workers[];
+}
+SharedArea;
+
+/*
+ * Messages of a worker, which wait in the supervisor for room in its MessageQueue,
+ * see dispatch_message. The oldest one is at first.
+ */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t added_cond;
+    size_t first;
+    size_t count;
+    char *messages[MAX_WORKER_BACKLOG_SIZE];
+    size_t dropped_messages_count; // Since dropped_messages_reported_at.
+    time_t dropped_messages_reported_at;
+}
+Backlog;
+
+static void keep_workers(void (*run_worker)(void));
+static void start_worker(const int index, void (*run_worker)(void));
+static void *forward_messages(void *worker_index);
+static void report_dropped_messages(const int index, const size_t dropped_messages_count);
+static void *serve_calls(void *call_index);
+static void carry_out_call(Call *call);
+static void carry_out_mutation(const CallArguments *arguments, const char *problem_text);
+static Call *get_caller_call(void);
+static void release_caller_call(void *call);
+static void make_call(Call *call);
+static void make_mutation_call(Call *call);
+static int worker_get_user_record(const int_fast64_t chat_id, UserRecord *user_record);
+static void worker_begin_transaction(const int_fast64_t chat_id);
+static void worker_commit_transaction(void);
+static void worker_create_user(const int_fast64_t chat_id);
+static void worker_set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value);
+static void worker_create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit);
+static void worker_set_problem_username(const int_fast64_t chat_id, const char *username);
+static void worker_delete_problem(const int_fast64_t chat_id);
+static size_t worker_read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count);
+static void wait_futex(atomic_uint *futex, const unsigned int value, const long milliseconds);
+static void wake_futex(atomic_uint *futex);
+
+/*
+ * Only the calls of the message handlers reach the worker engine, everything else
+ * stays in the supervisor.
+ */
+const StorageEngine worker_storage_engine =
+{
+    .name = "worker",
+    .get_user_record = worker_get_user_record,
+    .begin_transaction = worker_begin_transaction,
+    .commit_transaction = worker_commit_transaction,
+    .create_user = worker_create_user,
+    .set_state = worker_set_state,
+    .create_problem = worker_create_problem,
+    .set_problem_username = worker_set_problem_username,
+    .delete_problem = worker_delete_problem,
+    .read_problems = worker_read_problems
+};
+
+static int workers_count;
+static int started_workers_count;
+
+static SharedArea *shared_area;
+static pid_t supervisor_pid;
+
+static Backlog *backlogs; // Of every worker, only in the supervisor.
+
+/*
+ * Of the current worker process, -1 in the supervisor.
+ */
+static int worker_index = -1;
+
+/*
+ * The calls of the current worker are handed out to its threads, each of which keeps
+ * its call until it exits, so the transactions of a thread stay with one supervisor thread.
+ */
+static int used_calls[WORKER_CALLERS_COUNT];
+static pthread_mutex_t calls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released_call_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t caller_call_key;
+static _Thread_local Call *caller_call;
+static _Thread_local int transaction_begun; // The mutations go to the transaction_calls of the caller_call then.
+
+int set_workers_count(const char *count)
+{
+    char *end;
+    const long value = strtol(count, &end, 10);
+
+    if (*end || end == count || value < 0 || value > MAX_WORKERS_COUNT)
+        return -1;
+
+    workers_count = value;
+    return 0;
+}
+
+void start_workers(void (*run_worker)(void))
+{
+    if (!workers_count)
+        return;
+
+    // Shared anonymous memory is inherited by the forked processes and zeroed.
+    shared_area = mmap(NULL,
+                       sizeof(SharedArea) + workers_count * sizeof(Worker),
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS,
+                       -1,
+                       0);
+
+    if (shared_area == MAP_FAILED)
+        die("%s: %s: failed to map shared memory",
+            __BASE_FILE__,
+            __func__);
+
+    supervisor_pid = getpid();
+
+    const pid_t keeper_pid = fork();
+
+    if (keeper_pid < 0)
+        die("%s: %s: failed to fork keeper process",
+            __BASE_FILE__,
+            __func__);
+
+    if (!keeper_pid)
+        keep_workers(run_worker);
+
+    if (!(backlogs = calloc(workers_count, sizeof *backlogs)))
+        die("%s: %s: failed to allocate memory for backlogs",
+            __BASE_FILE__,
+            __func__);
+
+    for (int i = 0; i < workers_count; ++i)
+    {
+        pthread_mutex_init(&backlogs[i].mutex, NULL);
+        pthread_cond_init(&backlogs[i].added_cond, NULL);
+    }
+
+    started_workers_count = workers_count;
+
+    report("Started %d worker processes (Keeper PID: %d)",
+           workers_count,
+           keeper_pid);
+}
+
+void serve_workers(void)
+{
+    for (int i = 0; i < started_workers_count; ++i)
+    {
+        pthread_t forward_messages_thread;
+
+        if (pthread_create(&forward_messages_thread,
+                           NULL,
+                           forward_messages,
+                           (void *) (intptr_t) i))
+            die("%s: %s: failed to create forward_messages_thread",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_detach(forward_messages_thread);
+    }
+
+    for (int i = 0; i < started_workers_count * WORKER_CALLERS_COUNT; ++i)
+    {
+        pthread_t serve_calls_thread;
+
+        if (pthread_create(&serve_calls_thread,
+                           NULL,
+                           serve_calls,
+                           (void *) (intptr_t) i))
+            die("%s: %s: failed to create serve_calls_thread",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_detach(serve_calls_thread);
+    }
+}
+
+int get_workers_count(void)
+{
+    return started_workers_count;
+}
+
+int is_worker_process(void)
+{
+    return worker_index >= 0;
+}
+
+atomic_uint_fast64_t *get_shared_problem_lists_generations(void)
+{
+    return shared_area->problem_lists_generations;
+}
+
+/*
+ * The message only goes to the backlog of the worker, from which forward_messages
+ * moves it to the queue, so the thread polling the updates never waits for a worker.
+ */
+void dispatch_message(const int_fast64_t chat_id, const cJSON *message)
+{
+    const int index = (uint_fast64_t) chat_id % started_workers_count;
+    Backlog *backlog = &backlogs[index];
+
+    char *message_string = cJSON_PrintUnformatted(message);
+
+    if (!message_string)
+        die("%s: %s: failed to print message",
+            __BASE_FILE__,
+            __func__);
+
+    if (strlen(message_string) + 1 > MAX_WORKER_MESSAGE_SIZE)
+    {
+        report("Message of user %" PRIdFAST64
+               " is too big for a worker and was dropped",
+               chat_id);
+
+        cJSON_free(message_string);
+        return;
+    }
+
+    pthread_mutex_lock(&backlog->mutex);
+
+    if (backlog->count == MAX_WORKER_BACKLOG_SIZE)
+    {
+        const time_t current_time = time(NULL);
+        size_t dropped_messages_count = 0;
+
+        ++backlog->dropped_messages_count;
+
+        if (difftime(current_time, backlog->dropped_messages_reported_at) >= WORKER_DROPS_REPORT_INTERVAL)
+        {
+            dropped_messages_count = backlog->dropped_messages_count;
+
+            backlog->dropped_messages_count = 0;
+            backlog->dropped_messages_reported_at = current_time;
+        }
+
+        pthread_mutex_unlock(&backlog->mutex);
+
+        if (dropped_messages_count)
+            report_dropped_messages(index, dropped_messages_count);
+
+        cJSON_free(message_string);
+        return;
+    }
+
+    backlog->messages[(backlog->first + backlog->count++) % MAX_WORKER_BACKLOG_SIZE] = message_string;
+
+    pthread_cond_signal(&backlog->added_cond);
+    pthread_mutex_unlock(&backlog->mutex);
+}
+
+/*
+ * The message is taken off the queue only after it's parsed, so a worker, which crashes
+ * in between, leaves it to the next one, but a message, which makes the worker crash
+ * while it's handled, is gone.
+ */
+cJSON *receive_message(void)
+{
+    MessageQueue *queue = &shared_area->workers[worker_index].queue;
+
+    const unsigned int tail = atomic_load(&queue->tail);
+    unsigned int head;
+
+    while ((head = atomic_load(&queue->head)) == tail)
+        wait_futex(&queue->head, head, -1);
+
+    cJSON *message = cJSON_Parse(queue->messages[tail % WORKER_QUEUE_SIZE]);
+
+    atomic_store(&queue->tail, tail + 1);
+    wake_futex(&queue->tail);
+
+    if (!message)
+        die("%s: %s: failed to parse message",
+            __BASE_FILE__,
+            __func__);
+
+    return message;
+}
+
+/*
+ * Runs in the keeper process, which is single-threaded, so it can always fork safely.
+ * Exits with the supervisor.
+ */
+static void keep_workers(void (*run_worker)(void))
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    if (getppid() != supervisor_pid)
+        exit(EXIT_FAILURE);
+
+    for (int i = 0; i < workers_count; ++i)
+        start_worker(i, run_worker);
+
+    for (;;)
+    {
+        int status;
+        const pid_t pid = wait(&status);
+
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            die("%s: %s: failed to wait for workers",
+                __BASE_FILE__,
+                __func__);
+        }
+
+        for (int i = 0; i < workers_count; ++i)
+        {
+            if (atomic_load(&shared_area->workers[i].pid) != pid)
+                continue;
+
+            if (WIFSIGNALED(status))
+                report("Worker %d (PID: %d) was killed by signal %d and will be restarted",
+                       i,
+                       pid,
+                       WTERMSIG(status));
+            else
+                report("Worker %d (PID: %d) exited with status %d and will be restarted",
+                       i,
+                       pid,
+                       WEXITSTATUS(status));
+
+            sleep(WORKER_RESTART_DELAY);
+            start_worker(i, run_worker);
+        }
+    }
+}
+
+/*
+ * The calls left by the previous process of the worker are finished by the supervisor
+ * before the new process takes them over.
+ */
+static void start_worker(const int index, void (*run_worker)(void))
+{
+    Worker *worker = &shared_area->workers[index];
+    const pid_t pid = fork();
+
+    if (pid < 0)
+        die("%s: %s: failed to fork worker process",
+            __BASE_FILE__,
+            __func__);
+
+    if (pid)
+    {
+        atomic_store(&worker->pid, pid);
+        return;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    worker_index = index;
+
+    for (int i = 0; i < WORKER_CALLERS_COUNT; ++i)
+    {
+        Call *call = &worker->calls[i];
+
+        while (atomic_load(&call->state) == CALL_MADE)
+            wait_futex(&call->state, CALL_MADE, -1);
+
+        atomic_store(&call->state, CALL_IDLE);
+    }
+
+    pthread_key_create(&caller_call_key, release_caller_call);
+
+    run_worker();
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Moves the messages of a worker from its backlog to its queue, waiting for room there,
+ * so the queue is only ever added to by this thread.
+ */
+static void *forward_messages(void *worker_index)
+{
+    const int index = (intptr_t) worker_index;
+
+    Backlog *backlog = &backlogs[index];
+    MessageQueue *queue = &shared_area->workers[index].queue;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&backlog->mutex);
+
+        while (!backlog->count)
+            pthread_cond_wait(&backlog->added_cond, &backlog->mutex);
+
+        char *message_string = backlog->messages[backlog->first];
+
+        backlog->first = (backlog->first + 1) % MAX_WORKER_BACKLOG_SIZE;
+        --backlog->count;
+
+        // The drops not reported yet are reported once the worker has caught up.
+        const size_t dropped_messages_count = backlog->count ? 0 : backlog->dropped_messages_count;
+
+        if (dropped_messages_count)
+        {
+            backlog->dropped_messages_count = 0;
+            backlog->dropped_messages_reported_at = time(NULL);
+        }
+
+        pthread_mutex_unlock(&backlog->mutex);
+
+        if (dropped_messages_count)
+            report_dropped_messages(index, dropped_messages_count);
+
+        const unsigned int head = atomic_load(&queue->head);
+        unsigned int tail;
+
+        while (head - (tail = atomic_load(&queue->tail)) == WORKER_QUEUE_SIZE)
+            wait_futex(&queue->tail, tail, -1);
+
+        memcpy(queue->messages[head % WORKER_QUEUE_SIZE], message_string, strlen(message_string) + 1);
+        cJSON_free(message_string);
+
+        atomic_store(&queue->head, head + 1);
+        wake_futex(&queue->head);
+    }
+
+    return NULL;
+}
+
+static void report_dropped_messages(const int index, const size_t dropped_messages_count)
+{
+    report("%zu messages were dropped, since worker %d is too far behind",
+           dropped_messages_count,
+           index);
+}
+
+/*
+ * Carries out the calls made through a single call of a worker, one after another.
+ * A transaction is carried out entirely within its CALL_COMMIT_TRANSACTION, so a worker,
+ * which crashes before it, leaves nothing of the transaction behind.
+ */
+static void *serve_calls(void *call_index)
+{
+    const int index = (intptr_t) call_index;
+
+    Worker *worker = &shared_area->workers[index / WORKER_CALLERS_COUNT];
+    Call *call = &worker->calls[index % WORKER_CALLERS_COUNT];
+
+    for (;;)
+    {
+        unsigned int state;
+
+        while ((state = atomic_load(&call->state)) != CALL_MADE)
+            wait_futex(&call->state, state, -1);
+
+        carry_out_call(call);
+
+        atomic_store(&call->state, CALL_RETURNED);
+        wake_futex(&call->state);
+    }
+
+    return NULL;
+}
+
+static void carry_out_call(Call *call)
+{
+    switch (call->arguments.type)
+    {
+        case CALL_GET_USER_RECORD:
+            call->user_exists = get_user_record(call->arguments.chat_id, &call->user_record);
+            break;
+
+        case CALL_COMMIT_TRANSACTION:
+            begin_transaction(call->transaction_chat_id);
+
+            for (size_t i = 0; i < call->transaction_calls_count; ++i)
+                carry_out_mutation(&call->transaction_calls[i], call->problem_text);
+
+            commit_transaction();
+            break;
+
+        case CALL_READ_PROBLEMS:
+            call->problems_count = read_problems(&call->cursor,
+                                                 call->problems,
+                                                 call->problems_count < MAX_CALL_PROBLEMS ? call->problems_count : MAX_CALL_PROBLEMS);
+            break;
+
+        default:
+            carry_out_mutation(&call->arguments, call->problem_text);
+    }
+}
+
+static void carry_out_mutation(const CallArguments *arguments, const char *problem_text)
+{
+    switch (arguments->type)
+    {
+        case CALL_CREATE_USER:
+            create_user(arguments->chat_id);
+            break;
+
+        case CALL_SET_STATE:
+            set_state(arguments->chat_id, arguments->user_state, arguments->user_state_value);
+            break;
+
+        case CALL_CREATE_PROBLEM:
+            create_problem(arguments->chat_id, arguments->username, problem_text, arguments->use_time_limit);
+            break;
+
+        case CALL_SET_PROBLEM_USERNAME:
+            set_problem_username(arguments->chat_id, arguments->username);
+            break;
+
+        case CALL_DELETE_PROBLEM:
+            delete_problem(arguments->chat_id, arguments->closure);
+            break;
+
+        default:
+            die("%s: %s: call has unknown type",
+                __BASE_FILE__,
+                __func__);
+    }
+}
+
+/*
+ * Returns the call of the current thread, waiting for one to be released if all are in use.
+ */
+static Call *get_caller_call(void)
+{
+    if (caller_call)
+        return caller_call;
+
+    pthread_mutex_lock(&calls_mutex);
+
+    int index;
+
+    for (;;)
+    {
+        for (index = 0; index < WORKER_CALLERS_COUNT && used_calls[index]; ++index);
+
+        if (index < WORKER_CALLERS_COUNT)
+            break;
+
+        pthread_cond_wait(&released_call_cond, &calls_mutex);
+    }
+
+    used_calls[index] = 1;
+
+    pthread_mutex_unlock(&calls_mutex);
+
+    caller_call = &shared_area->workers[worker_index].calls[index];
+    pthread_setspecific(caller_call_key, caller_call);
+
+    return caller_call;
+}
+
+static void release_caller_call(void *call)
+{
+    pthread_mutex_lock(&calls_mutex);
+
+    used_calls[(Call *) call - shared_area->workers[worker_index].calls] = 0;
+    pthread_cond_signal(&released_call_cond);
+
+    pthread_mutex_unlock(&calls_mutex);
+}
+
+static void make_call(Call *call)
+{
+    atomic_store(&call->state, CALL_MADE);
+    wake_futex(&call->state);
+
+    while (atomic_load(&call->state) == CALL_MADE)
+        wait_futex(&call->state, CALL_MADE, -1);
+
+    atomic_store(&call->state, CALL_IDLE);
+}
+
+/*
+ * Makes the call of a mutation or, inside a transaction, adds it to the transaction_calls.
+ */
+static void make_mutation_call(Call *call)
+{
+    if (!transaction_begun)
+    {
+        make_call(call);
+        return;
+    }
+
+    if (call->transaction_calls_count == MAX_TRANSACTION_CALLS)
+        die("%s: %s: transaction is too big",
+            __BASE_FILE__,
+            __func__);
+
+    call->transaction_calls[call->transaction_calls_count++] = call->arguments;
+}
+
+static int worker_get_user_record(const int_fast64_t chat_id, UserRecord *user_record)
+{
+    Call *call = get_caller_call();
+    call->arguments.type = CALL_GET_USER_RECORD;
+    call->arguments.chat_id = chat_id;
+
+    make_call(call);
+
+    *user_record = call->user_record;
+    return call->user_exists;
+}
+
+/*
+ * Nothing is called until worker_commit_transaction, which sends all the mutations at once.
+ */
+static void worker_begin_transaction(const int_fast64_t chat_id)
+{
+    Call *call = get_caller_call();
+    call->transaction_chat_id = chat_id;
+    call->transaction_calls_count = 0;
+
+    transaction_begun = 1;
+}
+
+static void worker_commit_transaction(void)
+{
+    Call *call = get_caller_call();
+    call->arguments.type = CALL_COMMIT_TRANSACTION;
+
+    transaction_begun = 0;
+    make_call(call);
+}
+
+static void worker_create_user(const int_fast64_t chat_id)
+{
+    Call *call = get_caller_call();
+    call->arguments.type = CALL_CREATE_USER;
+    call->arguments.chat_id = chat_id;
+
+    make_mutation_call(call);
+}
+
+static void worker_set_state(const int_fast64_t chat_id, const unsigned int state, const int state_value)
+{
+    Call *call = get_caller_call();
+    call->arguments.type = CALL_SET_STATE;
+    call->arguments.chat_id = chat_id;
+    call->arguments.user_state = state;
+    call->arguments.user_state_value = state_value;
+
+    make_mutation_call(call);
+}
+
+static void worker_create_problem(const int_fast64_t chat_id, const char *username, const char *problem_text, const int use_time_limit)
+{
+    Call *call = get_caller_call();
+
+    for (size_t i = 0; transaction_begun && i < call->transaction_calls_count; ++i)
+        if (call->transaction_calls[i].type == CALL_CREATE_PROBLEM)
+            die("%s: %s: transaction creates more than one problem",
+                __BASE_FILE__,
+                __func__);
+
+    if ((size_t) snprintf(call->arguments.username, sizeof call->arguments.username, "%s", username) >= sizeof call->arguments.username ||
+        (size_t) snprintf(call->problem_text, sizeof call->problem_text, "%s", problem_text) >= sizeof call->problem_text)
+        die("%s: %s: problem is too big",
+            __BASE_FILE__,
+            __func__);
+
+    call->arguments.type = CALL_CREATE_PROBLEM;
+    call->arguments.chat_id = chat_id;
+    call->arguments.use_time_limit = use_time_limit;
+
+    make_mutation_call(call);
+}
+
+static void worker_set_problem_username(const int_fast64_t chat_id, const char *username)
+{
+    Call *call = get_caller_call();
+
+    if ((size_t) snprintf(call->arguments.username, sizeof call->arguments.username, "%s", username) >= sizeof call->arguments.username)
+        die("%s: %s: username is too big",
+            __BASE_FILE__,
+            __func__);
+
+    call->arguments.type = CALL_SET_PROBLEM_USERNAME;
+    call->arguments.chat_id = chat_id;
+
+    make_mutation_call(call);
+}
+
+static void worker_delete_problem(const int_fast64_t chat_id)
+{
+    Call *call = get_caller_call();
+    call->arguments.type = CALL_DELETE_PROBLEM;
+    call->arguments.chat_id = chat_id;
+    call->arguments.closure = get_deletion_closure();
+
+    make_mutation_call(call);
+}
+
+static size_t worker_read_problems(ProblemsCursor *cursor, ProblemView *problems, const size_t max_problems_count)
+{
+    Call *call = get_caller_call();
+    size_t problems_count = 0;
+
+    while (problems_count < max_problems_count)
+    {
+        const size_t page_size = max_problems_count - problems_count < MAX_CALL_PROBLEMS ?
+                                 max_problems_count - problems_count :
+                                 MAX_CALL_PROBLEMS;
+
+        call->arguments.type = CALL_READ_PROBLEMS;
+        call->cursor = *cursor;
+        call->problems_count = page_size;
+
+        make_call(call);
+
+        *cursor = call->cursor;
+        memcpy(problems + problems_count, call->problems, call->problems_count * sizeof *problems);
+        problems_count += call->problems_count;
+
+        if (call->problems_count < page_size)
+            break;
+    }
+
+    return problems_count;
+}
+
+/*
+ * Waits until the futex no longer holds value, at most the milliseconds if they aren't negative.
+ * May return earlier, so the value must be checked again.
+ */
+static void wait_futex(atomic_uint *futex, const unsigned int value, const long milliseconds)
+{
+    const struct timespec timeout =
+    {
+        milliseconds / 1000,
+        milliseconds % 1000 * 1000000
+    };
+
+    syscall(SYS_futex, futex, FUTEX_WAIT, value, milliseconds < 0 ? NULL : &timeout, NULL, 0);
+}
+
+static void wake_futex(atomic_uint *futex)
+{
+    syscall(SYS_futex, futex, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}